@@ -39,8 +39,14 @@ ADD $0 $1       (number stored in register 1 is added to register 2)
 /registers      (this prints the values stored in every registe, register 0 should now hold 3 (1+2=3))
 /program        (prints the hex representation of all the instructions so far)
 /clear          (clears the registers and instructions)
+/resume         (a loop that runs out of fuel yields, this gives it another frame of fuel and continues)
 /quit           (quits out of the application)
 
+# BENCHMARKS
+
+'./vmtest bench' skips the tests and the repl, and times the test programs on each engine: switch, threaded, threaded with superinstructions, and the x86-64 JIT (prints ns per instruction of the original program, ns/run, and the speedup over switch)
+
+
 
 
 */
@@ -55,6 +61,11 @@ ADD $0 $1       (number stored in register 1 is added to register 2)
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <chrono>
+#include <atomic>
+#include <thread> //the worker pool, see VMWorkerPool
+#include <mutex>
+#include <condition_variable>
 
 #if defined(__clang__)
     #define Assert(Expression) if(!(Expression)) { abort(); }
@@ -64,11 +75,79 @@ ADD $0 $1       (number stored in register 1 is added to register 2)
     #define Assert(Expression) if(!(Expression)) { abort(); }
 #endif
 
+#if !defined(_WIN32)
+    #define __debugbreak() __builtin_trap()
+#endif
+
+//labels as values (goto *ptr) is a GCC/Clang extension, MSVC only gets the switch engine
+#if defined(__GNUC__) || defined(__clang__)
+    #define VM_COMPUTED_GOTO 1
+#else
+    #define VM_COMPUTED_GOTO 0
+#endif
+
+//template JIT for x86-64, everywhere else DISPATCH_JIT just runs the threaded engine
+#if defined(__x86_64__) || defined(_M_X64)
+    #define VM_JIT 1
+    #if defined(_WIN32)
+        #define WIN32_LEAN_AND_MEAN
+        #define NOMINMAX
+        #include <windows.h>
+    #else
+        #include <sys/mman.h>
+    #endif
+#else
+    #define VM_JIT 0
+#endif
+#include <stddef.h> //offsetof, the JIT addresses VM fields directly
+
+//AOT builds shell out to the system C compiler and dlopen the result
+#if !defined(_WIN32)
+    #define VM_AOT 1
+    #include <dlfcn.h>
+#else
+    #define VM_AOT 0
+#endif
+
+//guard page memory backend, an instance's memory sits at the bottom of a 4GB PROT_NONE reservation so every u32 address lands
+//inside it, loads/stores skip the bounds check and one outside the instance's memory faults into a VM error (vm_run_guarded)
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    #define VM_GUARD_PAGES 1
+    #include <sys/mman.h>
+    #include <unistd.h>
+    #include <signal.h>
+    #include <setjmp.h>
+#else
+    #define VM_GUARD_PAGES 0
+#endif
+
+//LIE images (lie_save/lie_load) get mapped straight from the file, elsewhere they're read into one block
+#if !defined(_WIN32)
+    #define VM_LIE_MMAP 1
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#else
+    #define VM_LIE_MMAP 0
+#endif
+
+//the assembler's lexer skips whitespace and comments 16 bytes at a time with SSE2, every x86-64 CPU has it
+#if defined(__SSE2__) || defined(_M_X64)
+    #define VM_SIMD_LEX 1
+    #include <emmintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+#else
+    #define VM_SIMD_LEX 0
+#endif
+
 #define s64 signed long long int
 #define u64 unsigned long long int
-#define s32 signed long int
-#define u32 unsigned long int
-#define b32 unsigned long int
+#define s32 int32_t
+#define u32 uint32_t
+#define b32 uint32_t
 #define s16 signed short
 #define u16 unsigned short
 #define u8 unsigned char
@@ -280,49 +359,99 @@ struct symbol_table_entry {
     label_types type;
     u32 byteOffset; //where the data is, if its a code label its in the bytecode, if its data its in the data table
     b32 defined;
+    symbol_table_entry* next; //in the last bucket, more entries with the same hash once every bucket is taken
+};
+
+//heap blocks things that have to stay put get carved out of, freed all at once
+struct VMChunk {
+    VMChunk* next;
+    u32 used;
+    u32 size;
 };
 
+//zeroed
+void* vm_chunk_push(VMChunk** chunks, u32 bytes) {
+    bytes = (bytes + 7) & ~7u;
+    VMChunk* chunk = *chunks;
+    if (!chunk || chunk->size - chunk->used < bytes) {
+        u32 size = bytes > 16384 ? bytes : 16384;
+        chunk = (VMChunk*)malloc(sizeof(VMChunk) + size);
+        if (!chunk) return NULL;
+        chunk->next = *chunks;
+        chunk->used = 0;
+        chunk->size = size;
+        *chunks = chunk;
+    }
+    void* memory = (u8*)(chunk + 1) + chunk->used;
+    chunk->used += bytes;
+    memset(memory, 0, bytes);
+    return memory;
+}
+
+void vm_chunks_free(VMChunk** chunks) {
+    while (*chunks) {
+        VMChunk* next = (*chunks)->next;
+        free(*chunks);
+        *chunks = next;
+    }
+}
+
 struct symbol_table {
     symbol_table_entry entries[MAX_ENTRIES][MAX_BUCKETS];
     u32 entry_count[MAX_ENTRIES];
     u32 total_entry_count;
-
+    VMChunk* chunks; //entries past a full hash bucket, and the names when copyNames is set
+    bool copyNames; //the source goes away once it's assembled (assemble_stream), every name gets its own copy
+    bool fixedSize; //never allocate, a full bucket is an error (assemble())
 };
 
 void flush_env(symbol_table* env) {
     memset(env, 0, sizeof(symbol_table));
 }
 
-//use linear probing eventually, fixed buckets will break in the worst case of only buckets + 1 entries
+//the entry for key if there is one, the buckets first and then whatever chains off the last one
+symbol_table_entry* findAssemblerSymbol(symbol_table* table, uint32_t hash, const char* key, u32 keyLen) {
+    for (u32 bucket = 0; bucket < MAX_BUCKETS; bucket++) {
+        symbol_table_entry* entry = table->entries[hash] + bucket;
+        if (entry->name && entry->nameLen == keyLen && handmade_len_strcmp(entry->name, key, keyLen)) return entry;
+    }
+    for (symbol_table_entry* entry = table->entries[hash][MAX_BUCKETS - 1].next; entry; entry = entry->next) {
+        if (entry->nameLen == keyLen && handmade_len_strcmp(entry->name, key, keyLen)) return entry;
+    }
+    return 0;
+}
+
+//fixed buckets, anything past them chains off the last one
 symbol_table_entry* pushAssemblerSymbolTable(symbol_table* table, char* key, u32 keyLen) {
     if (key == NULL) {
         printf("push_env() given key is NULL!\n");
         return 0;
     }
     uint32_t hash = hash_string_len(key, keyLen);
-    uint32_t bucket = 0;
-
-
-    for (bucket = 0; bucket < MAX_BUCKETS; bucket++) {
-        if (table->entries[hash][bucket].name == nullptr) {//found unoccupied bucket
-            table->entries[hash][bucket].name = key;
-            table->entry_count[hash]++;
-            table->total_entry_count++;
-            // printf("successfully added key %s at hash %u, entry count at hash: %d, total_entry_count: %d\n", key, hash, env->entry_count[hash], env->total_entry_count);
-            return table->entries[hash] + bucket;
-        }
-        else if (handmade_len_strcmp(table->entries[hash][bucket].name, key, keyLen)) {
-            // printf("KEY %s ALREADY EXISTS AT HASH %d IN SCOPE! ERROR!\n", key, hash);
-            // return 0;
-            // //allow redefinition
-            // table->entries[hash][bucket].byteOffset = var;
-            // printf("key %s ALREADY EXISTS at hash %u, entry count at hash: %d, total_entry_count: %d\n", key, hash, env->entry_count[hash], env->total_entry_count);
-            return table->entries[hash] + bucket;
-        }
+    symbol_table_entry* entry = findAssemblerSymbol(table, hash, key, keyLen);
+    if (entry) return entry;
+
+    if (table->copyNames) {
+        char* copy = (char*)vm_chunk_push(&table->chunks, keyLen + 1);
+        if (!copy) return 0;
+        memcpy(copy, key, keyLen);
+        key = copy;
+    }
+    for (uint32_t bucket = 0; bucket < MAX_BUCKETS && !entry; bucket++) {
+        if (table->entries[hash][bucket].name == nullptr) entry = table->entries[hash] + bucket; //found unoccupied bucket
+    }
+    if (!entry && !table->fixedSize) {
+        symbol_table_entry** link = &table->entries[hash][MAX_BUCKETS - 1].next;
+        while (*link) link = &(*link)->next;
+        entry = *link = (symbol_table_entry*)vm_chunk_push(&table->chunks, sizeof(symbol_table_entry));
     }
+    if (!entry) return 0; //the callers report it, assemble() doesn't print
 
-    printf("ERROR! symbol_table AT HASH %d FULL!!\n", hash);
-    return 0;
+    entry->name = key;
+    entry->nameLen = keyLen;
+    table->entry_count[hash]++;
+    table->total_entry_count++;
+    return entry;
 }
 
 
@@ -337,7 +466,7 @@ int assign_symbol(symbol_table* table, char* key, u32 keyLen, u32 byteOffset) {
     uint32_t bucket = 0;
 
     for (bucket = 0; bucket < MAX_BUCKETS; bucket++) {
-        if (table->entries[hash][bucket].name == '\0') {//found unoccupied bucket
+        if (table->entries[hash][bucket].name == nullptr) {//found unoccupied bucket
         }
         else if (handmade_strcmp(table->entries[hash][bucket].name, key)) {
             // printf("KEY %s ALREADY EXISTS AT HASH %d IN SCOPE! ERROR!\n", key, hash);
@@ -361,19 +490,8 @@ symbol_table_entry* getAssemblerSymbolTableEntry(symbol_table* table, char* key,
         return 0;
     }
     uint32_t hash = hash_string_len(key, keyLen);
-    uint32_t bucket = 0;
-
-
-    for (bucket = 0; bucket < MAX_BUCKETS; bucket++) {
-        if (table->entries[hash][bucket].name == '\0') {//found unoccupied bucket
-        }
-        else if (handmade_len_strcmp(table->entries[hash][bucket].name, key, keyLen)) {
-            // printf("KEY %s ALREADY EXISTS AT HASH %d IN SCOPE! ERROR!\n", key, hash);
-            // return 0;
-            //allow redefinition
-            return table->entries[hash] + bucket;
-        }
-    }
+    symbol_table_entry* entry = findAssemblerSymbol(table, hash, key, keyLen);
+    if (entry) return entry;
 
     char tempBuffer[32];
     handmade_len_strcpy(tempBuffer, key, keyLen);
@@ -386,12 +504,24 @@ symbol_table_entry* getAssemblerSymbolTableEntry(symbol_table* table, char* key,
 #define REGSP (MAX_REGISTERS - 1) //last register is the stack pointer
 #define REGFP (MAX_REGISTERS - 2) //penultimate register is the frame pointer
 
-#define MAX_BYTECODE 4096
+#define MAX_BYTECODE 4096 //what every Program holds inline, assemble_stream grows past it
+#define VM_MAX_CODE (1 << 24) //CALL and JMP to a label carry 24 bit targets
 #define MAX_MEM 256
-#define STACK_START (MAX_MEM - 4)//each entry on the stack is 4 bytes
-#define MAX_JUMPS 32 //no way to determine if we are in an infinite loop, no way to know when to reset jumps, so we hard limit how many jumps a program can make
+#define STACK_START (VM_STACK_TOP - 4)//each entry on the stack is 4 bytes
+#define VM_DEFAULT_FUEL 1024 //instructions an instance gets per run/frame before it yields, loops can't hang the game but can span frames
 #define MAX_REPL_BUFFER 2048
 #define MAX_VM_MEM (8 * 1024 * 1024) //8 MB MAX
+//memory above MAX_MEM is heap from ALOC, backed by pages that only get allocated when something touches them
+#define VM_PAGE_SIZE 4096
+#define VM_PAGE_ENTRIES (VM_PAGE_SIZE / sizeof(u8*)) //page pointers in one page table, a page table is a page too
+#define VM_PAGE_TABLES (MAX_VM_MEM / (VM_PAGE_SIZE * VM_PAGE_ENTRIES))
+#define VM_DEFAULT_MEM_CAP (64 * 1024) //heap an instance can ALOC unless it's given a different cap
+//the stack is its own segment above any heap address, [VM_STACK_TOP - size, VM_STACK_TOP), so it can't grow into label data
+//and every instance can have a different size. it's one page, allocated the first time the instance touches its stack
+#define VM_STACK_MAX VM_PAGE_SIZE
+#define VM_STACK_BASE MAX_VM_MEM //address of the first byte of the stack page
+#define VM_STACK_TOP (VM_STACK_BASE + VM_STACK_MAX)
+#define VM_DEFAULT_STACK_SIZE 1024
 
 enum generic_opcode {
     GEN_LOAD,
@@ -469,12 +599,29 @@ enum Opcode {
     OP_CALL,
     OP_RET,
     OP_SYSCALL,
-
-    //probably not worth it, do we ever push multiple values at once?
-    // OP_PUSH_REG_2,
-    // OP_PUSH_REG_3,
-    // OP_POP_REG_2,
-    // OP_POP_REG_3,
+    OP_FREE,
+    OP_PUSH_MASK, //PUSH $a $b ..., registers within 16 of the lowest one, one bounds check for all of them
+    OP_POP_MASK,
+    OP_ENTER, //ENTER #n, saves $30, points it at the frame and makes room for n bytes of locals
+    OP_LEAVE, //drops the frame and restores $30, RET still follows it
+    OP_YIELD, //gives the rest of the frame back, vm_resume carries on after it
+    OP_WAIT,  //WAIT #n, sleeps for n ticks, see VMScheduler
+    OP_WAIT_EVENT, //WAIT_EVENT #id, sleeps until the host publishes event id
+
+    //superinstructions, the assembler never emits these, vm_fuse rewrites common pairs/triples into them in the decoded stream
+    OP_SUPER_EQ_JMP,    //EQ  + JEQ #, or NEQ + JNE #
+    OP_SUPER_NEQ_JMP,   //NEQ + JEQ #, or EQ  + JNE #
+    OP_SUPER_GT_JMP,    //GT  + JEQ #, or LTQ + JNE #
+    OP_SUPER_LT_JMP,    //LT  + JEQ #, or GTQ + JNE #
+    OP_SUPER_GTQ_JMP,   //GTQ + JEQ #, or LT  + JNE #
+    OP_SUPER_LTQ_JMP,   //LTQ + JEQ #, or GT  + JNE #
+    OP_SUPER_LOAD_ADD,  //LOAD $r [$x + k] + ADD
+    OP_SUPER_LOAD_SUB,
+    OP_SUPER_LOAD_MUL,
+    OP_SUPER_LOAD_LOAD_ADD, //LOAD $r [$x + k] + LOAD $s [$y + j] + ADD
+    OP_SUPER_LOAD_LOAD_SUB,
+    OP_SUPER_LOAD_LOAD_MUL,
+    OP_END, //sentinel vm_decode puts right after the last instruction, a verified program halts on it instead of checking pc
 
     OP_COUNT, //just a placeholder to see how many opcodes we are at
     OP_ILGL = 255, //illegal
@@ -532,6 +679,27 @@ const char* opcodeStr(Opcode code){
         case OP_CALL:{return "OP_CALL";}break;
         case OP_RET:{return "OP_RET";}break;
         case OP_SYSCALL:{return "OP_SYSCALL";}break;
+        case OP_FREE:{return "OP_FREE";}break;
+        case OP_PUSH_MASK:{return "OP_PUSH_MASK";}break;
+        case OP_POP_MASK:{return "OP_POP_MASK";}break;
+        case OP_ENTER:{return "OP_ENTER";}break;
+        case OP_LEAVE:{return "OP_LEAVE";}break;
+        case OP_YIELD:{return "OP_YIELD";}break;
+        case OP_WAIT:{return "OP_WAIT";}break;
+        case OP_WAIT_EVENT:{return "OP_WAIT_EVENT";}break;
+        case OP_SUPER_EQ_JMP:{return "OP_SUPER_EQ_JMP";}break;
+        case OP_SUPER_NEQ_JMP:{return "OP_SUPER_NEQ_JMP";}break;
+        case OP_SUPER_GT_JMP:{return "OP_SUPER_GT_JMP";}break;
+        case OP_SUPER_LT_JMP:{return "OP_SUPER_LT_JMP";}break;
+        case OP_SUPER_GTQ_JMP:{return "OP_SUPER_GTQ_JMP";}break;
+        case OP_SUPER_LTQ_JMP:{return "OP_SUPER_LTQ_JMP";}break;
+        case OP_SUPER_LOAD_ADD:{return "OP_SUPER_LOAD_ADD";}break;
+        case OP_SUPER_LOAD_SUB:{return "OP_SUPER_LOAD_SUB";}break;
+        case OP_SUPER_LOAD_MUL:{return "OP_SUPER_LOAD_MUL";}break;
+        case OP_SUPER_LOAD_LOAD_ADD:{return "OP_SUPER_LOAD_LOAD_ADD";}break;
+        case OP_SUPER_LOAD_LOAD_SUB:{return "OP_SUPER_LOAD_LOAD_SUB";}break;
+        case OP_SUPER_LOAD_LOAD_MUL:{return "OP_SUPER_LOAD_LOAD_MUL";}break;
+        case OP_END:{return "OP_END";}break;
         case OP_COUNT:{return "OP_COUNT";}break;
         case OP_ILGL:{return "OP_ILGL";}break;
         default:{return "";}break;
@@ -555,11 +723,47 @@ enum addressing_mode {
 //ELF like header
 //labor instruction executable header
 //its a virtual machine, its not real, its a LIE ;^)
+#define LIE_MAGIC 0x414c4945
+#define LIE_VERSION 2
+
+enum lie_sections {
+    LIE_CODE,    //the bytecode, jump targets are already byte offsets into it
+    LIE_DATA,    //label data and resb buffers, Program::data
+    LIE_SYMBOLS, //LIESymbol for every defined label, then their names
+    LIE_IMPORTS, //LIEImport for every host function a SYSCALL names, then their names
+    LIE_DEBUG,   //u32 source line of every instruction
+    LIE_SECTION_COUNT,
+};
+
+struct LIESection {
+    u32 offset; //from the start of the image, 8 byte aligned
+    u32 size;
+};
+
 struct LIE {
     u32 magic;//magic number/identifier for the format, ASCII for ALIE, 0x414c4945
     u32 version;
-    u64 codeStart;
+    u64 codeStart; //sections[LIE_CODE].offset
+    u32 size; //the whole image, header included
+    u32 symbolCount;
+    u32 importCount;
+    u32 reserved;
+    LIESection sections[LIE_SECTION_COUNT];
+};
+
+struct LIESymbol {
+    u32 name; //offset in the image, names are NUL terminated
+    u16 nameLen;
+    u8 type; //label_types
+    u8 pad;
+    u32 byteOffset;
+};
 
+//SYSCALL indices are baked into the code, an image only loads where every one still names the same function
+struct LIEImport {
+    u32 name;
+    u16 nameLen;
+    u16 index;
 };
 
 struct AssemblerBackPatch {
@@ -567,30 +771,269 @@ struct AssemblerBackPatch {
     symbol_table_entry* hashEntry;
 };
 
+#define MAX_BACKPATCHES 256 //forward label references in one entry
 
-struct VM {
-    s32 registers[MAX_REGISTERS];
-    u8 bytecode[MAX_BYTECODE]; //the 'program' is stored here
+
+enum vm_dispatch_mode {
+    DISPATCH_SWITCH,    //portable, one executeInstruction call and switch per instruction
+    DISPATCH_THREADED,  //computed goto, each handler jumps directly to the next one
+    DISPATCH_JIT,       //x86-64 native code for verified programs, anything it can't compile runs threaded
+    DISPATCH_AOT,       //a spell compiled ahead of time to a shared object (vm_aot_build/vm_aot_load), threaded if none is loaded
+};
+
+#if VM_COMPUTED_GOTO
+    #define VM_DEFAULT_DISPATCH DISPATCH_THREADED
+#else
+    #define VM_DEFAULT_DISPATCH DISPATCH_SWITCH
+#endif
+
+enum vm_status {
+    VM_RUNNING,
+    VM_HALTED,  //ran off the end of the program or hit HLT
+    VM_YIELDED, //out of fuel or YIELD, pc and registers are intact, refuel and vm_resume next frame
+    VM_WAITING, //WAIT n, intact like VM_YIELDED, wakeTick holds n until a VMScheduler files it
+    VM_WAITING_EVENT, //WAIT_EVENT id, the same with the id in waitEvent
+    VM_ERROR,
+};
+
+#define VM_MAX_EVENTS 1024 //event ids WAIT_EVENT can name, the host decides what they mean (hit, damage taken, ...)
+
+//an instruction with its operands already pulled out of the bytecode, built once per instruction by vm_decode
+struct DecodedInstruction {
+    u8 op; //handler index, the Opcode
+    u8 a;  //register operands
+    u8 b;
+    u8 c;
+    s32 imm; //widened immediate, address offset, or resolved jump target
+};
+
+//native code for one program, it lives in the shared JIT arena so the VM never owns (or has to free) executable memory
+struct VMJit {
+    u8* code;       //prologue, called as u32 code(VM* vm, u8* entry)
+    u8** entries;   //native address of every instruction, +1 for the end of the program
+    u32 generation; //arena generation it was compiled in, the arena recycles everything when it fills up
+    bool valid;
+};
+
+struct Context;
+struct VMHostFunction;
+
+//what AOT compiled code gets to see of the VM, generated code declares the same struct (vm_aot_write_c)
+//pointers rather than the VM itself so the .so doesn't depend on the VM's layout
+struct VMAotContext {
+    s32* registers;
+    u8* mem;
+    u32* pc;
+    bool* equalFlag;
+    s32* fuel;
+    u32* blockStart;
+    u32* jumpCount;
+    u32* remainder;
+    u8* stack; //the stack page, address VM_STACK_BASE
+    u32 stackLimit;
+    Context* context; //what host functions get called with
+    vm_status* status;
+    VMHostFunction* host; //vmHost, looked up at run time so a .so doesn't bake in this process's function addresses
+};
+
+typedef u32 (*vm_aot_fn)(VMAotContext* ctx);
+
+struct VMAot {
+    vm_aot_fn fn;   //the spell's entry point, runs until it halts, yields or needs the interpreter (same exits as the JIT)
+    void* library;
+    u64 hash;       //of the bytecode it was built from, vm_aot_load checks it once. changing the code drops fn
+};
+
+//everything the assembler produces, read only once it's assembled, any number of Contexts run the same Program
+//the only runtime writes are the lazily built caches, decoded/jit/aot, and those are built before instances run
+struct Program {
+    u8* bytecode; //the 'program' is stored here, inlineCode until vm_code_reserve grows it
     u32 byteCount;
+    u32 byteCapacity;
+
+    DecodedInstruction* decoded; //one per instruction +1 for the OP_END sentinel, grows with bytecode
+    u32 decodedCount; //instructions decoded so far, anything past this gets decoded before the next run
+    bool fuse; //run the superinstruction pass after decoding
+    u32 dispatchesSaved; //how many dispatches the superinstructions save on a straight pass through the program
+    bool verified; //vm_verify passed, runs on the engine without the static checks
+    VMJit jit;
+    VMAot aot;
+    const char* verifyError; //why it didn't, and where
+    u32 verifyErrorByte;
+
+    u8 data[MAX_MEM]; //label data and resb buffers, every instance starts with a copy of this as its memory
+    u32 dataSize;
+    u32* sourceLines; //line every instruction was assembled from, the LIE debug section, grows with bytecode
+    LIE lie; //header of the image it was last saved as or loaded from
+    u8* image; //the mapped image when it came from lie_load, loaded symbol names point into it
+    u32 imageSize;
+
+    symbol_table table;
+
+    AssemblerBackPatch* backPatchTable;
+    u32 backPatchTableSize;//locations in the bytecode where we need to backpatch with the label we find
+    u32 backPatchCapacity;
+    bool fixedSize; //never allocates, outgrowing the inline arrays is an error (assemble())
+
+    u8 inlineCode[MAX_BYTECODE];
+    DecodedInstruction inlineDecoded[MAX_BYTECODE / 4 + 1];
+    u32 inlineLines[MAX_BYTECODE / 4];
+    AssemblerBackPatch inlineBackPatches[MAX_BACKPATCHES];
+};
 
-    u8 mem[MAX_MEM];
-    u32 memSize;
+//one running instance of a Program, everything it can write, a few hundred bytes
+struct Context {
+    union {
+        Program* program;
+        Context* nextFree; //only while it sits in a ContextPool's free list
+    };
+    s32 registers[MAX_REGISTERS];
+    u8 mem[MAX_MEM]; //label data, the stack is its own segment (see stack)
 
     u32 pc; //program counter, tracks which byte is executing
     u32 remainder;
-    LIE lie; //header for the code, should be contained in the bytecode
 
-    u32 jumpCount;
+    u32 jumpCount; //taken jumps, just a stat now that fuel bounds execution
     bool equalFlag;
+    bool trace; //run the printf heavy debug engine, off by default so spells run without any I/O
 
-    symbol_table table;
+    union {
+        struct {
+            s32 fuel; //instructions left this frame, charged a whole block at a time on taken jumps
+            u32 blockStart; //pc the current basic block was entered at
+        };
+        struct { //only while it's VM_WAITING or VM_WAITING_EVENT, vm_resume sets fuel and blockStart again before it runs
+            union {
+                u32 wakeTick; //n from WAIT n, then the tick it wakes on once a VMScheduler has it
+                u32 waitEvent; //id from WAIT_EVENT id
+            };
+            u32 nextWaiting; //id + 1 of the next instance in the same timer wheel slot or event list, 0 ends the list
+        };
+    };
+    vm_status status;
 
-    AssemblerBackPatch backPatchTable[256];
-    u32 backPatchTableSize;//locations in the bytecode where we need to backpatch with the label we find
-    u8 opLookupTable[GEN_COUNT][ADDR_MODE_COUNT][ADDR_MODE_COUNT][ADDR_MODE_COUNT];//very wasteful, but fits in a few KB, make into a hashmap
     int instructionsExecuted;
+    vm_dispatch_mode dispatch;
+
+    u32 heapTop; //bytes ALOC has handed out, heap addresses are [MAX_MEM, MAX_MEM + heapTop)
+    u32 memCap; //most heap this instance may ALOC, at most MAX_VM_MEM - MAX_MEM
+    u32 id; //the host's name for the instance, goes into its effect records. 0 unless the host or a ContextPool sets it
+    u8** pageTables[VM_PAGE_TABLES]; //two levels so an instance that never ALOCs carries 32 bytes of them
+
+    u8* memBase; //where address 0 is, mem above or the guard page mapping. the handlers and the JIT go through this
+    u8* guardMem; //the guard page mapping, NULL on the default backend
+    u32 guardCommitted; //bytes of it that are read/write, everything above faults
+    u32 stackLimit; //lowest address the stack can reach, VM_STACK_TOP - its size
+    u8* stack; //the stack page, address VM_STACK_BASE, NULL until the instance touches its stack
+};
+
+//the REPL's program and the one instance it runs it on, the assembler writes the Program half
+struct VM : Program, Context {
+};
+
+//native functions a spell can call with 'SYSCALL name'. the host registers them once at startup, the assembler turns
+//the name into an index into one dense table and the instruction is a single indirect call through it.
+//arguments are whatever the spell left in $0, $1 ..., results go back into registers. a function can stop the run by
+//setting vm.status (vmError for VM_ERROR, VM_YIELDED to pick up after the SYSCALL next frame)
+typedef void (*vm_host_fn)(Context& vm, void* user);
+
+struct VMHostFunction { //vm_aot_write_c declares the same struct for the generated code
+    const char* name;
+    vm_host_fn fn;
+    void* user;
+    bool effect; //queued as a VMEffect instead of called, see vm_register_effect
+    u8 effectArgs;
+};
+
+#define VM_MAX_HOST_FUNCTIONS 1024 //the index is 16 bits in the instruction, this is just the table size
+
+static void vm_host_syscall(Context& vm, void* user);
+static void vm_host_effect(Context& vm, void* user);
+static void vm_host_meaning_of_life(Context& vm, void* user) { printf("42 is the meaning of life\n"); }
+
+//only ever appended to, so an index the assembler handed out stays valid for every program built with it.
+//0 is a bare SYSCALL, the old numbered convention ($0 = 0, $1 = 42/13/14)
+struct VMHostRegistry {
+    VMHostFunction functions[VM_MAX_HOST_FUNCTIONS];
+    u32 count;
+};
+static VMHostRegistry vmHost = { {
+    { "syscall", vm_host_syscall, NULL },
+    { "meaning_of_life", vm_host_meaning_of_life, NULL },
+    { "cast_projectile", vm_host_effect, &vmHost.functions[2], true, 2 },
+    { "cast_area_of_effect", vm_host_effect, &vmHost.functions[3], true, 2 },
+}, 4 };
+
+//index of name, -1 if nothing by that name was registered. only the assembler calls this, never the run loop
+s32 vm_host_lookup(const char* name, u32 length) {
+    for (u32 i = 0; i < vmHost.count; i++) {
+        const char* registered = vmHost.functions[i].name;
+        if (!strncmp(registered, name, length) && !registered[length]) return (s32)i;
+    }
+    return -1;
+}
+
+//the index 'SYSCALL name' will compile to, -1 when the table is full or the name is taken
+s32 vm_register_host(const char* name, vm_host_fn fn, void* user = NULL) {
+    if (vmHost.count >= VM_MAX_HOST_FUNCTIONS || vm_host_lookup(name, handmade_strlen(name)) >= 0) return -1;
+    vmHost.functions[vmHost.count] = { name, fn, user };
+    return (s32)vmHost.count++;
+}
+
+//effects (projectiles, damage, anything touching state the spell doesn't own) aren't run from inside the interpreter,
+//a SYSCALL to one just appends one of these to the worker's queue and the game drains every queue in bulk once a frame
+#define VM_EFFECT_MAX_ARGS 4
+
+struct VMEffect {
+    u16 effect; //host table index of the effect, vmHost.functions[effect].name
+    u16 argCount;
+    u32 instance; //Context::id of the spell that cast it
+    s32 args[VM_EFFECT_MAX_ARGS]; //$1 ... $argCount, anything past argCount is whatever was in those registers
+};
+
+//a ring of records in the caller's memory, one per worker thread. written by the spells the worker runs and drained
+//between frames, never both at once, so there's nothing atomic about it
+struct VMEffectQueue {
+    VMEffect* records;
+    u32 capacity; //power of two
+    u32 head; //next record to drain, head and tail only ever count up
+    u32 tail; //next record to write
+    u32 stalls; //SYSCALLs that found it full and yielded
 };
 
+static thread_local VMEffectQueue* vmEffectQueue; //the queue the spells on this thread write to
+
+void vm_effect_queue_init(VMEffectQueue* queue, VMEffect* records, u32 capacity) {
+    Assert(capacity && !(capacity & (capacity - 1)));
+    queue->records = records;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->stalls = 0;
+}
+
+//the queue effects on this thread go to from now on, returns the one it replaces
+VMEffectQueue* vm_effect_queue_bind(VMEffectQueue* queue) {
+    VMEffectQueue* previous = vmEffectQueue;
+    vmEffectQueue = queue;
+    return previous;
+}
+
+static void vm_host_syscall(Context& vm, void* user) {
+    if (vm.registers[0] != 0) {
+        printf("unhandled syscall parameter\n");
+        return;
+    }
+    u32 index = 0;
+    switch (vm.registers[1]) {
+    case 42: index = 1; break;
+    case 13: index = 2; break;
+    case 14: index = 3; break;
+    default: return;
+    }
+    vmHost.functions[index].fn(vm, vmHost.functions[index].user);
+}
+
 
 
 
@@ -626,6 +1069,7 @@ enum TokenTypes {
     TOK_GTQ,
     TOK_LTQ,
     TOK_ALOC,
+    TOK_FREE,
     TOK_HLT,
     TOK_INC,
     TOK_DEC,
@@ -633,10 +1077,15 @@ enum TokenTypes {
     TOK_DIRECTIVE,
     TOK_RESB, //reserve bytes
     //repl commands
-    TOK_COMMAND_REGISTERS, TOK_COMMAND_QUIT, TOK_COMMAND_HISTORY, TOK_COMMAND_PROGRAM,
+    TOK_COMMAND_REGISTERS, TOK_COMMAND_QUIT, TOK_COMMAND_HISTORY, TOK_COMMAND_PROGRAM, TOK_COMMAND_CLEAR, TOK_COMMAND_RESUME,
     TOK_PRT,
     TOK_PUSH,
     TOK_POP,
+    TOK_ENTER,
+    TOK_LEAVE,
+    TOK_YIELD,
+    TOK_WAIT,
+    TOK_WAIT_EVENT,
     TOK_CALL,
     TOK_RET,
     TOK_SYSCALL,
@@ -659,19 +1108,34 @@ struct Parser {
     Token previous;
     bool hadError;
     bool panicMode;
-
+    bool quiet; //keep errors to errorMessage/errorLine instead of printing them, assemble() runs this way
+    const char* errorMessage; //the first error
+    int errorLine;
 };
 
+#define MAX_SCANNER_LINES 256
+
 struct Scanner {
     char* start;
     char* current;
     int line;
-    char* lines[256];
+    char* lines[MAX_SCANNER_LINES]; //start of each line for the REPL's echo and trace, lines past the end just don't get echoed
+    bool quiet; //no per token and per line echo
+
+    //set by scanner_batch, the parser then takes tokens vm_lex made a batch at a time instead of scanToken's one at a time
+    Token* tokens;
+    u32 tokenCapacity;
+    u32 tokenCount;
+    u32 nextToken;
+    const char* lexAt; //where vm_lex picks up for the next batch, ahead of current by the tokens left in this one
+    int lexLine;
 };
 
 void printScannerLine(Scanner* scanner, int line){
+    if (scanner->quiet || line < 0 || line >= MAX_SCANNER_LINES) return;
     char temp[256] = {};
     char* str = scanner->lines[line];
+    if (!str) return; //pc can point into an earlier REPL entry whose line we no longer have
     int count = 0;
     //skip initial whitespace between newline and first char
     while(*str != 0 && (*str == ' ' || *str == '\t')){
@@ -719,2773 +1183,7697 @@ struct REPL {
     VM vm;
     char history[MAX_REPL_BUFFER * MAX_REPL_BUFFER]; //stores each line submitted in the current session
     size_t historyLines;
+    VMEffectQueue effects; //what its spell casts, printed after every run
+    VMEffect effectRecords[64];
 };
 
 
 
-void init_opcode_lookup(VM* vm) {
-    memset(vm->opLookupTable, 255, sizeof(vm->opLookupTable));
-
-    vm->opLookupTable[GEN_LOAD][ADDR_REG][ADDR_REG][ADDR_NONE] = OP_LOAD_REG_TO_REG;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG][ADDR_IMM][ADDR_NONE] = OP_LOAD_IMM_TO_REG;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG][ADDR_LABEL][ADDR_NONE] = OP_LOAD_IMM_TO_REG;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG][ADDR_REG_INDIRECT][ADDR_NONE] = OP_LOAD_REG_ADDR_TO_REG;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG][ADDR_REG_OFFSET][ADDR_NONE] = OP_LOAD_OFFSET_REG_ADDR_TO_REG;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG_INDIRECT][ADDR_REG][ADDR_NONE] = OP_LOAD_REG_TO_REG_ADDR;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG_OFFSET][ADDR_REG][ADDR_NONE] = OP_LOAD_REG_TO_OFFSET_REG_ADDR;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG_INDIRECT][ADDR_REG_INDIRECT][ADDR_NONE] = OP_LOAD_DATA_ADDR_TO_ADDR;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG_INDIRECT][ADDR_REG_OFFSET][ADDR_NONE] = OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR;
-    vm->opLookupTable[GEN_LOAD][ADDR_REG_OFFSET][ADDR_REG_INDIRECT][ADDR_NONE] = OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR;
-    vm->opLookupTable[GEN_ADD][ADDR_REG][ADDR_REG][ADDR_REG] = OP_ADD_REG_TO_REG;
-    vm->opLookupTable[GEN_SUB][ADDR_REG][ADDR_REG][ADDR_REG] = OP_SUB_REG_TO_REG;
-    vm->opLookupTable[GEN_MUL][ADDR_REG][ADDR_REG][ADDR_REG] = OP_MUL_REG_TO_REG;
-    vm->opLookupTable[GEN_DIV][ADDR_REG][ADDR_REG][ADDR_REG] = OP_DIV_REG_TO_REG;
-    vm->opLookupTable[GEN_JEQ][ADDR_REG][ADDR_NONE][ADDR_NONE] = OP_JEQ_REG;
-    vm->opLookupTable[GEN_JEQ][ADDR_IMM][ADDR_NONE][ADDR_NONE] = OP_JEQ_CONSTANT;
-    vm->opLookupTable[GEN_JNE][ADDR_IMM][ADDR_NONE][ADDR_NONE] = OP_JNE_CONSTANT;
-    vm->opLookupTable[GEN_JEQ][ADDR_REG][ADDR_REG][ADDR_IMM] = OP_JEQ_REG_TO_REG_CONSTANT;
-    vm->opLookupTable[GEN_EQ][ADDR_REG][ADDR_REG][ADDR_NONE] = OP_EQ;
-    vm->opLookupTable[GEN_EQ][ADDR_REG_INDIRECT][ADDR_REG][ADDR_NONE] = OP_EQ_INDIRECT_REG_TO_REG;
-    vm->opLookupTable[GEN_EQ][ADDR_IMM][ADDR_REG][ADDR_NONE] = OP_EQ_CONST_TO_REG;
-    vm->opLookupTable[GEN_JMP][ADDR_REG][ADDR_NONE][ADDR_NONE] = OP_JMP;
-    vm->opLookupTable[GEN_JMP][ADDR_IMM][ADDR_NONE][ADDR_NONE] = OP_JMP_CONSTANT;
-    vm->opLookupTable[GEN_JMP][ADDR_LABEL][ADDR_NONE][ADDR_NONE] = OP_JMP_LABEL;
-}
-
-
-void reset_vm(VM* vm) {
-    memset(vm, 0, sizeof(VM));
-    init_opcode_lookup(vm);
-    vm->registers[REGSP] = STACK_START;
+//the same for every program, so it's built once instead of on every reset
+static u8 opLookupTable[GEN_COUNT][ADDR_MODE_COUNT][ADDR_MODE_COUNT][ADDR_MODE_COUNT];//very wasteful, but fits in a few KB, make into a hashmap
+static bool opLookupTableBuilt = false;
+
+void init_opcode_lookup() {
+    if (opLookupTableBuilt) return;
+    opLookupTableBuilt = true;
+    memset(opLookupTable, 255, sizeof(opLookupTable));
+
+    opLookupTable[GEN_LOAD][ADDR_REG][ADDR_REG][ADDR_NONE] = OP_LOAD_REG_TO_REG;
+    opLookupTable[GEN_LOAD][ADDR_REG][ADDR_IMM][ADDR_NONE] = OP_LOAD_IMM_TO_REG;
+    opLookupTable[GEN_LOAD][ADDR_REG][ADDR_LABEL][ADDR_NONE] = OP_LOAD_IMM_TO_REG;
+    opLookupTable[GEN_LOAD][ADDR_REG][ADDR_REG_INDIRECT][ADDR_NONE] = OP_LOAD_REG_ADDR_TO_REG;
+    opLookupTable[GEN_LOAD][ADDR_REG][ADDR_REG_OFFSET][ADDR_NONE] = OP_LOAD_OFFSET_REG_ADDR_TO_REG;
+    opLookupTable[GEN_LOAD][ADDR_REG_INDIRECT][ADDR_REG][ADDR_NONE] = OP_LOAD_REG_TO_REG_ADDR;
+    opLookupTable[GEN_LOAD][ADDR_REG_OFFSET][ADDR_REG][ADDR_NONE] = OP_LOAD_REG_TO_OFFSET_REG_ADDR;
+    opLookupTable[GEN_LOAD][ADDR_REG_INDIRECT][ADDR_REG_INDIRECT][ADDR_NONE] = OP_LOAD_DATA_ADDR_TO_ADDR;
+    opLookupTable[GEN_LOAD][ADDR_REG_INDIRECT][ADDR_REG_OFFSET][ADDR_NONE] = OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR;
+    opLookupTable[GEN_LOAD][ADDR_REG_OFFSET][ADDR_REG_INDIRECT][ADDR_NONE] = OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR;
+    opLookupTable[GEN_ADD][ADDR_REG][ADDR_REG][ADDR_REG] = OP_ADD_REG_TO_REG;
+    opLookupTable[GEN_SUB][ADDR_REG][ADDR_REG][ADDR_REG] = OP_SUB_REG_TO_REG;
+    opLookupTable[GEN_MUL][ADDR_REG][ADDR_REG][ADDR_REG] = OP_MUL_REG_TO_REG;
+    opLookupTable[GEN_DIV][ADDR_REG][ADDR_REG][ADDR_REG] = OP_DIV_REG_TO_REG;
+    opLookupTable[GEN_JEQ][ADDR_REG][ADDR_NONE][ADDR_NONE] = OP_JEQ_REG;
+    opLookupTable[GEN_JEQ][ADDR_IMM][ADDR_NONE][ADDR_NONE] = OP_JEQ_CONSTANT;
+    opLookupTable[GEN_JNE][ADDR_IMM][ADDR_NONE][ADDR_NONE] = OP_JNE_CONSTANT;
+    opLookupTable[GEN_JEQ][ADDR_REG][ADDR_REG][ADDR_IMM] = OP_JEQ_REG_TO_REG_CONSTANT;
+    opLookupTable[GEN_EQ][ADDR_REG][ADDR_REG][ADDR_NONE] = OP_EQ;
+    opLookupTable[GEN_EQ][ADDR_REG_INDIRECT][ADDR_REG][ADDR_NONE] = OP_EQ_INDIRECT_REG_TO_REG;
+    opLookupTable[GEN_EQ][ADDR_IMM][ADDR_REG][ADDR_NONE] = OP_EQ_CONST_TO_REG;
+    opLookupTable[GEN_JMP][ADDR_REG][ADDR_NONE][ADDR_NONE] = OP_JMP;
+    opLookupTable[GEN_JMP][ADDR_IMM][ADDR_NONE][ADDR_NONE] = OP_JMP_CONSTANT;
+    opLookupTable[GEN_JMP][ADDR_LABEL][ADDR_NONE][ADDR_NONE] = OP_JMP_LABEL;
 }
 
 
-Opcode decodeOpcode(VM* vm) {
-    return (Opcode)vm->bytecode[vm->pc++];
+//drops the image a Program was loaded from, its symbol names, code and source lines go with it
+void lie_unmap(Program* program) {
+    if (!program->image) return;
+    if (program->bytecode != program->inlineCode) { //lie_load pointed them into the image, back to no code at all
+        if (program->decoded != program->inlineDecoded) free(program->decoded);
+        program->bytecode = program->inlineCode;
+        program->decoded = program->inlineDecoded;
+        program->sourceLines = program->inlineLines;
+        program->byteCapacity = MAX_BYTECODE;
+        program->byteCount = 0;
+        program->decodedCount = 0;
+        program->verified = false;
+        program->fixedSize = false;
+    }
+#if VM_LIE_MMAP
+    munmap(program->image, program->imageSize);
+#else
+    free(program->image);
+#endif
+    program->image = NULL;
+    program->imageSize = 0;
 }
 
-
-inline u8 nextByte(VM& vm) {
-    u8 val = ((vm.bytecode[vm.pc]));
-    vm.pc += 1;
-    return val;
+//forgets the assembled program, only clears what the assembler filled in, the Program has to have been zeroed once.
+//anything that grew past the inline arrays is freed here, so a Program that did has to be reset before it's freed
+void program_reset(Program* program) {
+    lie_unmap(program);
+    symbol_table* table = &program->table;
+    for (u32 i = 0; i < MAX_ENTRIES; i++) {
+        if (table->entry_count[i]) memset(table->entries[i], 0, sizeof(table->entries[i]));
+    }
+    memset(table->entry_count, 0, sizeof(table->entry_count));
+    table->total_entry_count = 0;
+    vm_chunks_free(&table->chunks);
+    table->copyNames = false;
+    table->fixedSize = false;
+
+    if (program->bytecode != program->inlineCode) {
+        free(program->bytecode);
+        free(program->decoded);
+        free(program->sourceLines);
+    }
+    program->bytecode = program->inlineCode;
+    program->decoded = program->inlineDecoded;
+    program->sourceLines = program->inlineLines;
+    program->byteCapacity = MAX_BYTECODE;
+    if (program->backPatchTable != program->inlineBackPatches) free(program->backPatchTable);
+    program->backPatchTable = program->inlineBackPatches;
+    program->backPatchCapacity = MAX_BACKPATCHES;
+    program->fixedSize = false;
+
+    program->byteCount = 0;
+    program->decodedCount = 0;
+    program->fuse = true;
+    program->dispatchesSaved = 0;
+    program->verified = false;
+    program->jit = {};
+    program->aot = {};
+    program->verifyError = NULL;
+    program->verifyErrorByte = 0;
+    program->dataSize = 0;
+    program->lie = {};
+    program->backPatchTableSize = 0;
 }
 
-
-inline u16 next2Bytes(VM& vm) {
-    u16 val = ((vm.bytecode[vm.pc] << 8) | (vm.bytecode[vm.pc + 1]));
-    vm.pc += 2;
-    return val;
+//room for bytes more code, the code, decoded and line arrays grow together. false past VM_MAX_CODE, or past the
+//inline arrays for a fixedSize Program
+bool vm_code_reserve(Program* program, u32 bytes) {
+    u32 needed = program->byteCount + bytes;
+    if (needed <= program->byteCapacity) return true;
+    if (program->fixedSize || needed > VM_MAX_CODE) return false;
+
+    u32 capacity = program->byteCapacity * 2;
+    while (capacity < needed) capacity *= 2;
+    if (capacity > VM_MAX_CODE) capacity = VM_MAX_CODE;
+    u8* code = (u8*)malloc(capacity);
+    DecodedInstruction* decoded = (DecodedInstruction*)malloc((capacity / 4 + 1) * sizeof(DecodedInstruction));
+    u32* lines = (u32*)malloc(capacity / 4 * sizeof(u32));
+    if (!code || !decoded || !lines) {
+        free(code);
+        free(decoded);
+        free(lines);
+        return false;
+    }
+    memcpy(code, program->bytecode, program->byteCount);
+    memcpy(decoded, program->decoded, (program->byteCapacity / 4 + 1) * sizeof(DecodedInstruction));
+    memcpy(lines, program->sourceLines, program->byteCount / 4 * sizeof(u32));
+    if (program->bytecode != program->inlineCode) {
+        free(program->bytecode);
+        free(program->decoded);
+        free(program->sourceLines);
+    }
+    program->bytecode = code;
+    program->decoded = decoded;
+    program->sourceLines = lines;
+    program->byteCapacity = capacity;
+    return true;
 }
 
-inline u32 next3Bytes(VM& vm) {
-    u32 val = ((vm.bytecode[vm.pc] << 16) | (vm.bytecode[vm.pc + 1] << 8) | (vm.bytecode[vm.pc + 2]));
-    vm.pc += 3;
-    return val;
-}
+//pages for every instance's heap, handed out zeroed and recycled, never given back to the OS
+struct VMPagePool {
+    u8* freeList; //linked through the first bytes of each free page
+    u32 live; //pages some instance is using right now, page tables included
+    u32 total;
+    std::atomic<bool> lock; //instances on different workers can allocate at once, it's taken once per page, never per instruction
+};
+static VMPagePool vmPages;
 
-inline void vmMemError(VM& vm, const char* message, u32 instructionLocation, s32 memLocation, u32 maxMem) {
-    printf("[VM ERROR]: %s, instruction: %lu, memory address: %ld, max memory size: %lu\n", message, instructionLocation, memLocation, maxMem);
+inline void vm_pool_lock(VMPagePool& pool) {
+    while (pool.lock.exchange(true, std::memory_order_acquire)) std::this_thread::yield();
 }
 
-inline void vmError(VM& vm, const char* message, u32 instructionLocation) {
-    printf("[VM ERROR]: %s, instruction: %lu\n", message, instructionLocation);
+inline void vm_pool_unlock(VMPagePool& pool) {
+    pool.lock.store(false, std::memory_order_release);
 }
 
-inline bool executeInstruction(VM& vm) {
-    u32 currentByte = vm.pc;
-    if (vm.pc >= vm.byteCount) {
-        printf("program counter: %lu, exceeds byteCount: %lu, returning\n", vm.pc, vm.byteCount);
-        return true;
-    }
-
-    switch (vm.bytecode[vm.pc++]) {
-      
-    case OP_HLT: {
-        printf("%2lu: HLT ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        return true;
-    }break;
-    case OP_ILGL: {
-        printf("%2lu: IGL ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        return true;
-    }break;
-    case OP_LOAD_REG_TO_REG: {
-        printf("%2lu: LOAD REG2REG ENCOUNTERED at pc %lu   :    ", currentByte, vm.pc - 1);
-        u8 reg1 = vm.bytecode[vm.pc++];
-        u8 reg2 = nextByte(vm);
-        vm.pc++;
-        vm.registers[reg1] = vm.registers[reg2];
-        printf("LOAD $%u $%u\n", reg1, reg2);
-        return false;
-    }break;
-    case OP_LOAD_IMM_TO_REG: {
-        printf("%2lu: LOAD ENCOUNTERED at pc %2lu   :    ", currentByte, vm.pc - 1);
-        u8 reg = vm.bytecode[vm.pc++];
-        // u8 num1 = ((vm.bytecode[vm.pc]));
-        // u8 num2 = ((vm.bytecode[vm.pc+1]));
-        // u16 val = ((vm.bytecode[vm.pc] << 8) | (vm.bytecode[vm.pc+1]));
-        // vm.pc += 2;
-        u16 val = next2Bytes(vm);
-        vm.registers[reg] = val;
-        printf("LOAD $%u #%u\n", reg, val);
-        return false;
-    }break;
-    case OP_ADD_REG_TO_REG: {
-        printf("%2lu: ADD ENCOUNTERED at pc %2lu    :    ", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        u8 destreg = nextByte(vm);
-        printf("ADD $%u $%u $%u, \t %lu + %lu = %lu\n", reg1, reg2, destreg, vm.registers[reg1], vm.registers[reg2], vm.registers[reg1] + vm.registers[reg2]);
-        vm.registers[destreg] = vm.registers[reg1] + vm.registers[reg2];
-        return false;
-
-    }break;
-    case OP_SUB_REG_TO_REG: {
-        printf("%2lu: SUB ENCOUNTERED at pc %2lu   :    ", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        u8 destreg = nextByte(vm);
-        printf("SUB $%u $%u $%u, \t %lu - %lu = %lu\n", reg1, reg2, destreg, vm.registers[reg1], vm.registers[reg2], vm.registers[reg1] - vm.registers[reg2]);
-        vm.registers[destreg] = vm.registers[reg1] - vm.registers[reg2];
-        return false;
-
-    }break;
-    case OP_MUL_REG_TO_REG: {
-        printf("%2lu: MUL ENCOUNTERED at pc %lu  :     ", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        u8 destreg = nextByte(vm);
-        printf("MUL $%u $%u $%u, \t %lu * %lu = %lu\n", reg1, reg2, destreg, vm.registers[reg1], vm.registers[reg2], vm.registers[reg1] * vm.registers[reg2]);
-        vm.registers[destreg] = vm.registers[reg1] * vm.registers[reg2];
-        return false;
-
-    }break;
-    case OP_DIV_REG_TO_REG: {
-        printf("%2lu: DIV ENCOUNTERED at pc %lu   :    ", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        u8 destreg = nextByte(vm);
-        if (vm.registers[reg2] == 0) {
-            printf("$%ld is 0!\n", vm.registers[reg2]);
-            vmError(vm, "DIVISION BY 0!", currentByte);
-            return true;
-        }
-        vm.remainder = vm.registers[reg1] % vm.registers[reg2];
-        vm.registers[29] = vm.remainder; //just make register 29 the result of the modulow for now
-        vm.registers[destreg] = vm.registers[reg1] / vm.registers[reg2];
-        printf("DIV $%u $%u $%u, \t %lu / %lu = %lu remainder %lu\n", reg1, reg2, destreg, vm.registers[reg1], vm.registers[reg2], vm.registers[reg1] / vm.registers[reg2], vm.remainder);
-        return false;
+#define VM_PAGE_CHUNK 16 //pages per malloc when the pool runs dry
 
-    }break;
-    case OP_JMP: {
-        printf("%2lu: JMP ENCOUNTERED at pc %lu, jumpCount: %lu \n", currentByte, vm.pc - 1, vm.jumpCount + 1);
-        u8 reg = nextByte(vm);
-        vm.pc = vm.registers[reg];
-        vm.jumpCount++;
-        if (vm.pc >= vm.byteCount) {
-            printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
-            return true;
-        }
-        if (vm.jumpCount >= MAX_JUMPS) {
-            printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-            vmError(vm, "MAX JUMPS REACHED!", currentByte);
-            return true;
-        }
-        return false;
-    }break;
-    case OP_JMPF: {
-        printf("%2lu: JMPF ENCOUNTERED at pc %lu, jumpCount: %lu\n", currentByte, vm.pc - 1, vm.jumpCount + 1);
-        u8 reg = nextByte(vm);
-        vm.pc += vm.registers[reg] - 2;// - 2 to account for the first 2 instructions we've already executed
-        vm.jumpCount++;
-        printf("JMPF %lu\n", vm.registers[reg]);
-        if (vm.pc >= vm.byteCount) {
-            printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
-            return true;
-        }
-        if (vm.jumpCount >= MAX_JUMPS) {
-            printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-            vmError(vm, "MAX JUMPS REACHED!", currentByte);
-            return true;
-        }
-        return false;
-    }break;
-    case OP_JMPB: {
-        printf("%2lu: JMPB ENCOUNTERED at pc %lu, jumpCount: %lu\n", currentByte, vm.pc - 1, vm.jumpCount + 1);
-        u8 reg = nextByte(vm);
-        vm.pc -= vm.registers[reg] + 2;// - 2 to account for the first 2 instructions we've already executed
-        printf("JMPB %lu\n", vm.registers[reg]);
-        vm.jumpCount++;
-        if (vm.pc >= vm.byteCount) {
-            printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
-            return true;
+u8* vm_page_alloc(bool zeroed = true) {
+    vm_pool_lock(vmPages);
+    if (!vmPages.freeList) {
+        u8* chunk = (u8*)malloc(VM_PAGE_SIZE * VM_PAGE_CHUNK);
+        if (!chunk) {
+            vm_pool_unlock(vmPages);
+            return NULL;
         }
-        if (vm.jumpCount >= MAX_JUMPS) {
-            printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-            vmError(vm, "MAX JUMPS REACHED!", currentByte);
-            return true;
+        for (u32 i = 0; i < VM_PAGE_CHUNK; i++) {
+            u8* page = chunk + i * VM_PAGE_SIZE;
+            *(u8**)page = vmPages.freeList;
+            vmPages.freeList = page;
         }
-        return false;
-    }break;
-    case OP_EQ: {
-        printf("%2lu: EQ ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        if (vm.registers[reg1] == vm.registers[reg2])vm.equalFlag = true;
-        else vm.equalFlag = false;
-        vm.pc++;//need to pad out to the next instruction
-        return false;
-    }break;
-    case OP_NEQ: {
-        printf("%2lu: NEQ ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        if (vm.registers[reg1] != vm.registers[reg2])vm.equalFlag = true;
-        else vm.equalFlag = false;
-        vm.pc++;//need to pad out to the next instruction
-        return false;
-    }break;
+        vmPages.total += VM_PAGE_CHUNK;
+    }
+    u8* page = vmPages.freeList;
+    vmPages.freeList = *(u8**)page;
+    vmPages.live++;
+    vm_pool_unlock(vmPages);
+    if (zeroed) memset(page, 0, VM_PAGE_SIZE);
+    return page;
+}
 
-    case OP_GT: {
-        printf("%2lu: GT ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        if (vm.registers[reg1] > vm.registers[reg2])vm.equalFlag = true;
-        else vm.equalFlag = false;
-        vm.pc++;//need to pad out to the next instruction
-        return false;
-    }break;
-    case OP_LT: {
-        printf("%2lu: LT ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        printf("$%d < $%d = %d < %d\n", reg1, reg2, vm.registers[reg1], vm.registers[reg2]);
-        if (vm.registers[reg1] < vm.registers[reg2])vm.equalFlag = true;
-        else vm.equalFlag = false;
-        vm.pc++;//need to pad out to the next instruction
-        return false;
-    }break;
-    case OP_GTQ: {
-        printf("%2lu: GTQ ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        if (vm.registers[reg1] >= vm.registers[reg2])vm.equalFlag = true;
-        else vm.equalFlag = false;
-        vm.pc++;//need to pad out to the next instruction
-        return false;
-    }break;
-    case OP_LTQ: {
-        printf("%2lu: LTQ ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        if (vm.registers[reg1] <= vm.registers[reg2])vm.equalFlag = true;
-        else vm.equalFlag = false;
-        vm.pc++;//need to pad out to the next instruction
-        return false;
-    }break;
+inline void vm_page_free(u8* page) {
+    vm_pool_lock(vmPages);
+    *(u8**)page = vmPages.freeList;
+    vmPages.freeList = page;
+    vmPages.live--;
+    vm_pool_unlock(vmPages);
+}
 
-    case OP_JEQ_REG: {
-        printf("%2lu: JEQ ENCOUNTERED at pc %lu, jumpCount: %lu   :   ", currentByte, vm.pc - 1, vm.jumpCount);
-        u8 reg1 = nextByte(vm);
-        s32 target = vm.registers[reg1];
-        printf("JEQ %lu, equalFlag: %d\n", target, vm.equalFlag);
-        if (vm.equalFlag) {
-            vm.equalFlag = false;
-            vm.jumpCount++;
-            printf("equalFlag is TRUE, JUMPING!\n");
-            vm.pc = target;
-            if (vm.pc >= vm.byteCount) {
-                printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-                return true;
+//stacks that fit in VM_STACK_SMALL bytes (the default size) come out of their own free list, a whole page each would
+//cost lots of live instances 4x the memory for bytes they can't address
+#define VM_STACK_SMALL 1024
+#define VM_STACK_CHUNK 64 //small stacks per malloc
+static VMPagePool vmSmallStacks;
+
+//returns the stack pointer biased so stack + (addr - VM_STACK_BASE) works for the instance's whole range, like a page
+//would. only [stackLimit, VM_STACK_TOP) gets cleared, that's all the program can see
+u8* vm_stack_block_alloc(u32 stackLimit) {
+    u32 bytes = VM_STACK_TOP - stackLimit;
+    u8* stack = NULL;
+    if (bytes > VM_STACK_SMALL) {
+        stack = vm_page_alloc(false);
+        if (!stack) return NULL;
+    }
+    else {
+        vm_pool_lock(vmSmallStacks);
+        if (!vmSmallStacks.freeList) {
+            u8* chunk = (u8*)malloc(VM_STACK_SMALL * VM_STACK_CHUNK);
+            if (!chunk) {
+                vm_pool_unlock(vmSmallStacks);
+                return NULL;
             }
-            if (vm.jumpCount >= MAX_JUMPS) {
-                printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-                return true;
+            for (u32 i = 0; i < VM_STACK_CHUNK; i++) {
+                u8* block = chunk + i * VM_STACK_SMALL;
+                *(u8**)block = vmSmallStacks.freeList;
+                vmSmallStacks.freeList = block;
             }
+            vmSmallStacks.total += VM_STACK_CHUNK;
         }
-        else {
-            vm.equalFlag = false;
-            printf("equalFlag is FALSE, not jumping\n");
-            vm.pc += 2;//need to pad out to the next instruction
-        }
+        u8* block = vmSmallStacks.freeList;
+        vmSmallStacks.freeList = *(u8**)block;
+        vmSmallStacks.live++;
+        vm_pool_unlock(vmSmallStacks);
+        stack = block - (VM_STACK_MAX - VM_STACK_SMALL);
+    }
+    memset(stack + (stackLimit - VM_STACK_BASE), 0, bytes);
+    return stack;
+}
 
-        return false;
-    }break;
+//stackLimit has to be the one the stack was allocated with
+void vm_stack_block_free(u8* stack, u32 stackLimit) {
+    if (VM_STACK_TOP - stackLimit > VM_STACK_SMALL) {
+        vm_page_free(stack);
+        return;
+    }
+    u8* block = stack + (VM_STACK_MAX - VM_STACK_SMALL);
+    vm_pool_lock(vmSmallStacks);
+    *(u8**)block = vmSmallStacks.freeList;
+    vmSmallStacks.freeList = block;
+    vmSmallStacks.live--;
+    vm_pool_unlock(vmSmallStacks);
+}
 
-    case OP_ALOC: {
-        // printf("ALOC ENCOUNTERED at pc %u\n", vm.pc-1);
-        // u8 reg1 = nextByte(vm);
-        // s32 val = vm.registers[reg1];
-        // vm.pc+=2;//need to pad out to the next instruction
-        // if(vm.heapSize + val >= MAX_VM_MEM){
-        //     printf("CANNOT ALLOCATE MORE MEMORY! QUITTING\n");
-        //     return true;
-        // }
-        // vm.heapSize += val;
-        return false;
-    }break;
+#define VM_GUARD_RESERVE (1ull << 32) //every u32 address, so base + address never leaves the mapping
 
-    case OP_INC: {
-        u8 reg1 = nextByte(vm);
-        Assert(reg1 >= 0 && reg1 < 32);
-        vm.registers[reg1]++;
-        printf("%2lu: INC ENCOUNTERED at pc %lu, vm.registers[$%u] is now %ld\n", currentByte, currentByte, reg1, vm.registers[reg1]);
-        vm.pc += 2;//need to pad out to the next instruction
-        return false;
-    }break;
-    case OP_DEC: {
-        u8 reg1 = nextByte(vm);
-        Assert(reg1 >= 0 && reg1 < 32);
-        vm.registers[reg1]--;
-        printf("%2lu: DEC ENCOUNTERED at pc %lu, vm.registers[$%u] is now %ld\n", currentByte, currentByte, reg1, vm.registers[reg1]);
-        vm.pc += 2;//need to pad out to the next instruction
-        return false;
-    }break;
+#if VM_GUARD_PAGES
+//the guarded run in progress on this thread, the signal handler jumps back into it
+struct VMGuardTrap {
+    sigjmp_buf jump;
+    u8* base;
+    u64 fault; //address the program faulted on, relative to base
+};
+static thread_local VMGuardTrap* vmGuardTrap;
+static struct sigaction vmGuardPrevious;
+static u32 vmGuardPage; //OS page size, what mprotect works in
+
+static void vm_guard_signal(int sig, siginfo_t* info, void* context) {
+    VMGuardTrap* trap = vmGuardTrap;
+    u8* address = (u8*)info->si_addr;
+    if (trap && address >= trap->base && address < trap->base + VM_GUARD_RESERVE) {
+        trap->fault = (u64)(address - trap->base);
+        siglongjmp(trap->jump, 1);
+    }
+    //not ours, hand it to whoever had it before, or put the default back and let the access fault again
+    if (vmGuardPrevious.sa_flags & SA_SIGINFO) vmGuardPrevious.sa_sigaction(sig, info, context);
+    else if (vmGuardPrevious.sa_handler != SIG_DFL && vmGuardPrevious.sa_handler != SIG_IGN) vmGuardPrevious.sa_handler(sig);
+    else sigaction(SIGSEGV, &vmGuardPrevious, NULL);
+}
 
-    //LOAD [$0 + 4] [$1]
-    case OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR: {
-        printf("%2lu: LOAD REG ADDR TO OFFSET REG ADDR ENCOUNTERED at pc %lu :    ", currentByte, vm.pc - 1);
+//SA_NODEFER so jumping out of the handler doesn't leave SIGSEGV blocked, sigsetjmp doesn't have to save the mask then
+//a static initializer so it happens once even when threads guard instances at the same time, a second install would
+//save our own handler as the previous one and a fault that isn't ours would recurse forever
+static void vm_guard_install() {
+    static const bool installed = [] {
+        vmGuardPage = (u32)sysconf(_SC_PAGESIZE);
+        struct sigaction action = {};
+        action.sa_sigaction = vm_guard_signal;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &vmGuardPrevious);
+        return true;
+    }();
+    (void)installed;
+}
 
-        u8 reg1 = vm.bytecode[vm.pc++];
-        u8 offset = vm.bytecode[vm.pc++];
-        u8 reg2 = vm.bytecode[vm.pc++];
+//makes [0, MAX_MEM + heapTop) read/write, whole OS pages at a time
+bool vm_guard_commit(Context& vm, u32 heapTop) {
+    u32 end = (MAX_MEM + heapTop + vmGuardPage - 1) & ~(vmGuardPage - 1);
+    if (end <= vm.guardCommitted) return true;
+    if (mprotect(vm.guardMem + vm.guardCommitted, end - vm.guardCommitted, PROT_READ | PROT_WRITE)) return false;
+    vm.guardCommitted = end;
+    return true;
+}
 
-        if (vm.registers[reg1] + offset >= MAX_MEM || vm.registers[reg1] + offset < 0) {
-            printf("LOAD memory offset addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[reg1] + offset, MAX_MEM);
-            return true;
-        }
+//back to the one page low memory is in, the heap pages go back to the OS and fault again, the stack gets cleared
+void vm_guard_release(Context* ctx) {
+    memset(ctx->guardMem + MAX_MEM, 0, vmGuardPage - MAX_MEM);
+    if (ctx->guardCommitted > vmGuardPage) {
+        u8* heap = ctx->guardMem + vmGuardPage;
+        size_t bytes = ctx->guardCommitted - vmGuardPage;
+        madvise(heap, bytes, MADV_DONTNEED);
+        mprotect(heap, bytes, PROT_NONE);
+    }
+    ctx->guardCommitted = vmGuardPage;
+}
+#endif
 
-        if (vm.registers[reg2] >= MAX_MEM || vm.registers[reg2] < 0) {
-            printf("LOAD memory addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[reg2], MAX_MEM);
-            return true;
+//gives every heap page the instance touched back to the pool, its heap is empty afterwards
+void context_free_heap(Context* ctx) {
+#if VM_GUARD_PAGES
+    if (ctx->guardMem) vm_guard_release(ctx);
+#endif
+    for (u32 t = 0; t < VM_PAGE_TABLES; t++) {
+        u8** table = ctx->pageTables[t];
+        if (!table) continue;
+        for (u32 i = 0; i < VM_PAGE_ENTRIES; i++) {
+            if (table[i]) vm_page_free(table[i]);
         }
+        vm_page_free((u8*)table);
+        ctx->pageTables[t] = NULL;
+    }
+    ctx->heapTop = 0;
+}
 
+//the stack outlives vm_restart, a restarted spell only overwrites its own old frames. a new spell in the slot gets a
+//clean one, only the part below the size limit is ever addressable so that's all that needs clearing
+void context_free_stack(Context* ctx) {
+    if (!ctx->stack) return;
+    if (ctx->guardMem) {
+        memset(ctx->stack + (ctx->stackLimit - VM_STACK_BASE), 0, VM_STACK_TOP - ctx->stackLimit);
+        return;
+    }
+    vm_stack_block_free(ctx->stack, ctx->stackLimit);
+    ctx->stack = NULL;
+}
 
-        vm.mem[vm.registers[reg1] + offset] = vm.mem[vm.registers[reg2]];
-
-        printf("LOAD [$%u + %u] [$%u]\n", reg1, offset, reg2);
-        return false;
-    }break;
-
-    //LOAD $0 [$1 + 4]
-    case OP_LOAD_OFFSET_REG_ADDR_TO_REG: {
-        printf("%2lu: LOAD OFFSET REG ADDR TO REG ENCOUNTERED at pc %lu :    ", currentByte, vm.pc - 1);
-
-        u8 reg1 = vm.bytecode[vm.pc++];
-        u8 reg2 = vm.bytecode[vm.pc++];
-        u8 offset = vm.bytecode[vm.pc++];
-
-        vm.registers[reg1] = vm.mem[vm.registers[reg2] + offset];
+//everything the instance holds besides itself, before its memory goes away or to another spell
+inline void context_free_memory(Context* ctx) {
+    context_free_heap(ctx);
+    context_free_stack(ctx);
+}
 
-        if (vm.registers[reg2] + offset >= MAX_MEM || vm.registers[reg2] + offset < 0) {
-            printf("LOAD memory offset addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[reg2] + offset, MAX_MEM);
-            return true;
-        }
-        printf("LOAD $%u [$%u + %u]\n", reg1, reg2, offset);
-        return false;
-    }break;
-    //LOAD [$1 + 4] $0
-    case OP_LOAD_REG_TO_OFFSET_REG_ADDR: {
-        printf("%2lu: OP_LOAD_REG_TO_OFFSET_REG_ADDR ENCOUNTERED at pc %lu :    ", currentByte, vm.pc - 1);
-        u8 reg1 = vm.bytecode[vm.pc++];
-        u8 offset = vm.bytecode[vm.pc++];
-        u8 reg2 = vm.bytecode[vm.pc++];
-        vm.mem[vm.registers[reg1] + offset] = vm.registers[reg2];
-        if (vm.registers[reg1] + offset >= MAX_MEM || vm.registers[reg1] + offset < 0) {
-            printf("LOAD memory offset addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[reg2] + offset, MAX_MEM);
-            return true;
-        }
-        printf("LOAD [$%u + %u] $%u \n", reg1, offset, reg2);
+#if VM_GUARD_PAGES
+//moves an instance onto the guard page backend, its low memory comes along and its heap and stack start out empty
+//false when the OS won't hand out the address space, the instance stays where it was
+bool context_guard_memory(Context* ctx) {
+    if (ctx->guardMem) return true;
+    vm_guard_install();
+    void* reserve = mmap(NULL, VM_GUARD_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserve == MAP_FAILED) return false;
+    u8* mem = (u8*)reserve;
+    u32 stackBytes = (VM_STACK_MAX + vmGuardPage - 1) & ~(vmGuardPage - 1);
+    if (mprotect(mem, vmGuardPage, PROT_READ | PROT_WRITE) || mprotect(mem + VM_STACK_BASE, stackBytes, PROT_READ | PROT_WRITE)) {
+        munmap(reserve, VM_GUARD_RESERVE);
         return false;
-    }break;
-
-    case OP_LOAD_REG_TO_REG_ADDR:{
-        printf("%2lu: LOAD REG TO REG ADDR ENCOUNTERED at pc %lu :    ", currentByte, vm.pc - 1);
-        u8 reg1 = vm.bytecode[vm.pc++];
-        u8 reg2 = vm.bytecode[vm.pc++];
-        u8 offset = vm.bytecode[vm.pc++];
+    }
+    context_free_memory(ctx);
+    memcpy(mem, ctx->mem, MAX_MEM);
+    ctx->stack = mem + VM_STACK_BASE;
+    ctx->guardMem = mem;
+    ctx->guardCommitted = vmGuardPage;
+    ctx->memBase = mem;
+    return true;
+}
 
-        if (vm.registers[reg1] + offset >= MAX_MEM || vm.registers[reg1] + offset < 0) {
-            printf("LOAD memory offset addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[reg1] + offset, MAX_MEM);
-            return true;
-        }
+//back to the default backend, has to happen before the Context's memory is freed or reused by a pool
+void context_unguard_memory(Context* ctx) {
+    if (!ctx->guardMem) return;
+    context_free_heap(ctx);
+    memcpy(ctx->mem, ctx->guardMem, MAX_MEM);
+    munmap(ctx->guardMem, VM_GUARD_RESERVE);
+    ctx->stack = NULL;
+    ctx->guardMem = NULL;
+    ctx->guardCommitted = 0;
+    ctx->memBase = ctx->mem;
+}
+#else
+bool context_guard_memory(Context* ctx) { return false; }
+void context_unguard_memory(Context* ctx) {}
+#endif
 
-        if (vm.registers[reg2] >= MAX_MEM || vm.registers[reg2] < 0) {
-            printf("LOAD memory addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[reg2], MAX_MEM);
-            return true;
-        }
+//slow half of vm_addr, heap addresses, the page (and its page table) gets allocated the first time it's touched
+u8* vm_heap_addr(Context& vm, u32 addr) {
+    u32 offset = addr - MAX_MEM;
+    if (addr < MAX_MEM || offset >= vm.heapTop) return NULL;
+    if (vm.guardMem) return vm.guardMem + addr; //one contiguous mapping, nothing to allocate
+
+    u32 page = offset / VM_PAGE_SIZE;
+    u8**& table = vm.pageTables[page / VM_PAGE_ENTRIES];
+    if (!table) {
+        table = (u8**)vm_page_alloc();
+        if (!table) return NULL;
+    }
+    u8*& bytes = table[page % VM_PAGE_ENTRIES];
+    if (!bytes) {
+        bytes = vm_page_alloc();
+        if (!bytes) return NULL;
+    }
+    return bytes + offset % VM_PAGE_SIZE;
+}
 
-        vm.mem[vm.registers[reg1] + offset] = vm.registers[reg2];
-        printf("LOAD [$%u + %u] $%u \n", reg1, offset, reg2);
-        return false;
-    }break;
-    //LOAD [$0] [$1 + 4]
-    case OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR: {
-        printf("%2lu: LOAD OFFSET REG ADDR TO REG ADDR ENCOUNTERED at pc %lu :    ", currentByte, vm.pc - 1);
-        u8 reg1 = vm.bytecode[vm.pc++];
-        u8 reg2 = vm.bytecode[vm.pc++];
-        u8 offset = vm.bytecode[vm.pc++];
-
-        if (vm.registers[reg2] + offset >= MAX_MEM || vm.registers[reg2] + offset < 0) {
-            printf("LOAD memory offset addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[reg2] + offset, MAX_MEM);
-            return true;
-        }
+inline u8* vm_stack_alloc(Context& vm) {
+    vm.stack = vm_stack_block_alloc(vm.stackLimit);
+    return vm.stack;
+}
 
-        if (vm.registers[reg1] >= MAX_MEM || vm.registers[reg1] < 0) {
-            printf("LOAD memory addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[reg1], MAX_MEM);
-            return true;
-        }
+//stack segment addresses, only the instance's own stackLimit and up
+u8* vm_stack_addr(Context& vm, u32 addr) {
+    if (addr < vm.stackLimit || addr >= VM_STACK_TOP) return NULL;
+    if (!vm.stack && !vm_stack_alloc(vm)) return NULL;
+    return vm.stack + (addr - VM_STACK_BASE);
+}
 
-        vm.mem[vm.registers[reg1]] = vm.mem[vm.registers[reg2] + offset];
-        printf("LOAD [$%u] [$%u + %u]\n", reg1, reg2, offset);
-        return false;
-    }break;
+//bytes of stack the instance gets, 4 aligned and at most VM_STACK_MAX. like memCap it goes back to the default on reset
+//and it's for between runs, an allocated stack was sized for the old limit so its contents don't survive a change
+inline void context_set_stack_size(Context* ctx, u32 bytes) {
+    bytes &= ~3u;
+    if (bytes < 4) bytes = 4;
+    if (bytes > VM_STACK_MAX) bytes = VM_STACK_MAX;
+    u32 limit = VM_STACK_TOP - bytes;
+    if (ctx->stack && limit != ctx->stackLimit) {
+        if (ctx->guardMem && limit < ctx->stackLimit) memset(ctx->stack + (limit - VM_STACK_BASE), 0, ctx->stackLimit - limit);
+        else if (!ctx->guardMem) context_free_stack(ctx);
+    }
+    ctx->stackLimit = limit;
+}
 
+//address to byte, NULL when it's outside the instance's memory. the first MAX_MEM bytes (label data) are
+//in the Context itself, everything above is heap, then the stack segment
+inline u8* vm_addr(Context& vm, s32 addr) {
+    if ((u32)addr < MAX_MEM) return vm.memBase + addr;
+    if ((u32)addr >= VM_STACK_BASE) return vm_stack_addr(vm, (u32)addr);
+    return vm_heap_addr(vm, (u32)addr);
+}
 
-    case OP_LOAD_DATA_ADDR_TO_ADDR: {
-        // __debugbreak();
-        printf("%2lu: LOAD DATA ADDRESS TO ADDRESS ENCOUNTERED at pc %lu   :    ", currentByte, vm.pc - 1);
+inline u32 vm_mem_size(Context& vm) {
+    return MAX_MEM + vm.heapTop;
+}
 
-        u8 reg1 = vm.bytecode[vm.pc++];
-        u8 reg2 = vm.bytecode[vm.pc++];
-        vm.pc++;
+//ALOC/FREE allocator, everything it keeps lives in the instance's own heap so an instance that never allocates pays nothing
+//and a replay of the same program always gets the same addresses
+//blocks are 16..4096 bytes in power of two size classes, each with a free list, so the common case is a pop or a push
+//bigger blocks go on one first fit list. the 4 bytes before an address hold its block size, the low bit set while it's free
+//a free block's next link is where its data was. nothing gets split or merged
+#define VM_HEAP_CLASSES 9
+#define VM_HEAP_MIN_BLOCK 16u
+#define VM_HEAP_MAX_CLASS_BLOCK (VM_HEAP_MIN_BLOCK << (VM_HEAP_CLASSES - 1))
+#define VM_HEAP_FREE_BIT 1u
+#define VM_HEAP_HEADER_SIZE 64 //VMHeapHeader rounded up so blocks stay 16 aligned
+
+//at the bottom of the heap, the first ALOC puts it there
+struct VMHeapHeader {
+    u32 freeLists[VM_HEAP_CLASSES]; //address of the first free block of each class, 0 when empty
+    u32 largeFree;
+    u32 live; //bytes in blocks the program holds
+    u32 peak;
+    u32 free; //bytes in blocks sitting on the free lists
+};
+static_assert(sizeof(VMHeapHeader) <= VM_HEAP_HEADER_SIZE, "heap header has outgrown its slot");
+
+struct VMHeapStats {
+    u32 live;
+    u32 peak;
+    u32 free;
+    u32 reserved; //heap handed out by the bump pointer so far, header included
+    float fragmentation; //share of the blocks carved out so far that sit unused on the free lists
+};
 
+//a block's size word, NULL when the address isn't a block the allocator could have handed out
+inline u32* vm_heap_block(Context& vm, u32 block) {
+    if (block < MAX_MEM + VM_HEAP_HEADER_SIZE || ((block - MAX_MEM) & (VM_HEAP_MIN_BLOCK - 1))) return NULL;
+    return (u32*)vm_heap_addr(vm, block);
+}
 
-        s32 val1 = vm.registers[reg1];
-        s32 val2 = vm.registers[reg2];
+inline u32 vm_heap_class(u32 blockSize) {
+    u32 index = 0;
+    while ((VM_HEAP_MIN_BLOCK << index) < blockSize) index++;
+    return index;
+}
 
-        // vm.registers[reg] = val;
+//moves the bump pointer, the guard page backend has to make the new bytes read/write first
+inline bool vm_heap_grow(Context& vm, u32 heapTop) {
+#if VM_GUARD_PAGES
+    if (vm.guardMem && !vm_guard_commit(vm, heapTop)) return false;
+#endif
+    vm.heapTop = heapTop;
+    return true;
+}
 
-        if (val1 >= MAX_MEM || val1 < 0) {
-            printf("LOAD memory addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, val1, MAX_MEM);
-            return true;
+//address of size usable bytes, 0 when the instance's cap is hit (or the program scribbled over its free lists)
+u32 vm_heap_alloc(Context& vm, u32 size) {
+    u32 cap = vm.memCap < MAX_VM_MEM - MAX_MEM ? vm.memCap : MAX_VM_MEM - MAX_MEM;
+    if (vm.heapTop == 0) {
+        if (cap < VM_HEAP_HEADER_SIZE || !vm_heap_grow(vm, VM_HEAP_HEADER_SIZE)) return 0;
+    }
+    VMHeapHeader* heap = (VMHeapHeader*)vm_heap_addr(vm, MAX_MEM);
+    if (!heap || size > cap) return 0;
+
+    u32 need = size + 4;
+    u32 blockSize = 0;
+    u32 block = 0;
+    if (need <= VM_HEAP_MAX_CLASS_BLOCK) {
+        u32 index = vm_heap_class(need);
+        blockSize = VM_HEAP_MIN_BLOCK << index;
+        block = heap->freeLists[index];
+        if (block) {
+            u32* header = vm_heap_block(vm, block);
+            if (!header || *header != (blockSize | VM_HEAP_FREE_BIT)) return 0;
+            heap->freeLists[index] = header[1]; //the link is in the same 16 byte block, so the same page
         }
-
-        if (val2 >= MAX_MEM || val2 < 0) {
-            printf("LOAD memory addressing error!\n");
-            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, val2, MAX_MEM);
-            return true;
+    }
+    else {
+        blockSize = (need + VM_HEAP_MIN_BLOCK - 1) & ~(VM_HEAP_MIN_BLOCK - 1);
+        u32* link = &heap->largeFree;
+        while (*link) {
+            u32* header = vm_heap_block(vm, *link);
+            if (!header || !(*header & VM_HEAP_FREE_BIT)) return 0;
+            u32* next = header + 1;
+            if ((*header & ~VM_HEAP_FREE_BIT) >= blockSize) {
+                block = *link;
+                blockSize = *header & ~VM_HEAP_FREE_BIT;
+                *link = *next;
+                break;
+            }
+            link = next;
         }
+    }
 
-        printf("LOAD DATA ADDRESS TO ADDRESS [$%u] [$%u] | %c set with %c\n", reg1, reg2, vm.mem[val1], vm.mem[val2]);
-        vm.mem[val1] = vm.mem[val2];
-        return false;
-    }break;
-
-    case OP_JMP_CONSTANT: {
-        // __debugbreak();
-        printf("%2lu: JMP CONSTANT ENCOUNTERED at pc %lu   :    ", currentByte, vm.pc - 1);
-        u32 target = next2Bytes(vm);
-        vm.jumpCount++;
-        printf("equalFlag is TRUE, JUMPING!\n");
-        vm.pc = target;
-        if (vm.pc >= vm.byteCount) {
-            printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-            return true;
-        }
-        if (vm.jumpCount >= MAX_JUMPS) {
-            printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-            return true;
-        }
-        return false;
-    }break;
+    if (block) {
+        heap->free -= blockSize;
+    }
+    else {
+        if (vm.heapTop >= cap || blockSize > cap - vm.heapTop) return 0; //the host may have lowered memCap below heapTop
+        block = MAX_MEM + vm.heapTop;
+        if (!vm_heap_grow(vm, vm.heapTop + blockSize)) return 0;
+    }
+    *vm_heap_block(vm, block) = blockSize;
+    heap->live += blockSize;
+    if (heap->live > heap->peak) heap->peak = heap->live;
+    return block + 4;
+}
 
+//false for anything that isn't a live block, double frees included. FREE of 0 does nothing, like free(NULL)
+bool vm_heap_free(Context& vm, u32 address) {
+    if (address == 0) return true;
+    u32 block = address - 4;
+    u32* header = vm_heap_block(vm, block);
+    if (!header) return false;
+    u32 blockSize = *header;
+    if ((blockSize & VM_HEAP_FREE_BIT) || blockSize < VM_HEAP_MIN_BLOCK || blockSize > vm.heapTop - (block - MAX_MEM)) return false;
+    if (blockSize <= VM_HEAP_MAX_CLASS_BLOCK && (blockSize & (blockSize - 1))) return false;
+
+    VMHeapHeader* heap = (VMHeapHeader*)vm_heap_addr(vm, MAX_MEM);
+    u32* list = blockSize <= VM_HEAP_MAX_CLASS_BLOCK ? &heap->freeLists[vm_heap_class(blockSize)] : &heap->largeFree;
+    header[1] = *list;
+    *list = block;
+    *header = blockSize | VM_HEAP_FREE_BIT;
+    heap->live -= blockSize;
+    heap->free += blockSize;
+    return true;
+}
 
-    case OP_JMP_LABEL: {//need to differentiate from regular constant since labels get backpatched with all 4 bytes
-        // __debugbreak();
-        printf("%2lu: JMP LABEL ENCOUNTERED at pc %lu   :    ", currentByte, vm.pc - 1);
-        u32 target = next3Bytes(vm);
-        vm.jumpCount++;
-        printf("equalFlag is TRUE, JUMPING!\n");
-        vm.pc = target;
-        if (vm.pc >= vm.byteCount) {
-            printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-            return true;
-        }
-        if (vm.jumpCount >= MAX_JUMPS) {
-            printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-            return true;
-        }
-        return false;
-    }break;
+VMHeapStats vm_heap_stats(Context& vm) {
+    VMHeapStats stats = {};
+    stats.reserved = vm.heapTop;
+    if (!vm.heapTop) return stats;
+    VMHeapHeader* heap = (VMHeapHeader*)vm_heap_addr(vm, MAX_MEM);
+    stats.live = heap->live;
+    stats.peak = heap->peak;
+    stats.free = heap->free;
+    if (heap->live + heap->free) stats.fragmentation = (float)heap->free / (float)(heap->live + heap->free);
+    return stats;
+}
 
-    case OP_JEQ_CONSTANT: {
-        // __debugbreak();
-        printf("%2lu: JEQ ENCOUNTERED at pc %lu, jumpCount: %lu   :    ", currentByte, vm.pc - 1, vm.jumpCount);
-        u16 target = next2Bytes(vm);
+//puts an instance back at the start of a program, only the live state gets touched
+//memory is the program's data image with everything above it cleared, which covers the stack and anything the last run wrote
+void context_reset(Context* ctx, Program* program, vm_dispatch_mode dispatch = VM_DEFAULT_DISPATCH) {
+    ctx->program = program;
+    memset(ctx->registers, 0, sizeof(ctx->registers));
+    ctx->registers[REGSP] = STACK_START;
+    ctx->pc = 0;
+    ctx->remainder = 0;
+    ctx->jumpCount = 0;
+    ctx->equalFlag = false;
+    ctx->fuel = VM_DEFAULT_FUEL;
+    ctx->blockStart = 0;
+    ctx->status = VM_HALTED;
+    ctx->instructionsExecuted = 0;
+    ctx->trace = false;
+    ctx->dispatch = dispatch;
+    context_free_memory(ctx);
+    ctx->memCap = VM_DEFAULT_MEM_CAP;
+    context_set_stack_size(ctx, VM_DEFAULT_STACK_SIZE);
+    ctx->memBase = ctx->guardMem ? ctx->guardMem : ctx->mem;
+    memcpy(ctx->memBase, program->data, program->dataSize);
+    memset(ctx->memBase + program->dataSize, 0, MAX_MEM - program->dataSize);
+}
 
-        printf("JEQ %u, equalFlag: %d, target: %d\n", target, vm.equalFlag, target);
-        if (vm.equalFlag) {
-            vm.equalFlag = false;
-            vm.jumpCount++;
-            printf("equalFlag is TRUE, JUMPING!\n");
-            vm.pc = target;
-            if (vm.pc >= vm.byteCount) {
-                printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-                return true;
-            }
-            if (vm.jumpCount >= MAX_JUMPS) {
-                printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-                return true;
-            }
-        }
-        else {
-            vm.equalFlag = false;
-            printf("equalFlag is FALSE, not jumping\n");
-            vm.pc += 1;//need to pad out to the next instruction
-        }
+void reset_vm(VM* vm, vm_dispatch_mode dispatch = VM_DEFAULT_DISPATCH) {
+    init_opcode_lookup();
+    program_reset(vm);
+    context_reset(vm, vm, dispatch);
+}
 
-        return false;
-    }break;
+//the REPL and its VM come out of one big allocation, zeroed once here so every reset after that can be cheap
+//the history buffer is most of it and doesn't need clearing
+REPL* repl_create() {
+    REPL* repl = (REPL*)malloc(sizeof(REPL));
+    memset(&repl->vm, 0, sizeof(VM));
+    repl->scanner = {};
+    repl->parser = {};
+    repl->historyLines = 0;
+    vm_effect_queue_init(&repl->effects, repl->effectRecords, 64);
+    reset_vm(&repl->vm);
+    return repl;
+}
 
-    case OP_JNE_CONSTANT: {
-        // __debugbreak();
-        printf("%2lu: JNE ENCOUNTERED at pc %lu, jumpCount: %lu   :    ", currentByte, vm.pc - 1, vm.jumpCount);
-        u16 target = next2Bytes(vm);
-        printf("JNE %u, equalFlag: %d, target: %d\n", target, vm.equalFlag, target);
-        if (!vm.equalFlag) {
-            vm.jumpCount++;
-            printf("equalFlag is FALSE, JUMPING!\n");
-            vm.pc = target;
-            if (vm.pc >= vm.byteCount) {
-                printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-                return true;
-            }
-            if (vm.jumpCount >= MAX_JUMPS) {
-                printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-                return true;
-            }
-        }
-        else {
-            vm.equalFlag = false;
-            printf("equalFlag is FALSE, not jumping\n");
-            vm.pc += 1;//need to pad out to the next instruction
-        }
-        return false;
-    }break;
 
-    case OP_JEQ_REG_TO_REG_CONSTANT: {
-        // __debugbreak();
-        printf("%2lu: JEQ REG TO REG ENCOUNTERED at pc %lu, jumpCount: %lu   :    ", currentByte, vm.pc - 1, vm.jumpCount);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        u8 target = nextByte(vm);
-        if (vm.registers[reg1] == vm.registers[reg2]) {
-            vm.equalFlag = false;
-            vm.jumpCount++;
-            printf("$%d == $%d, JUMPING!\n", reg1, reg2);
-            vm.pc = target;
-            if (vm.pc >= vm.byteCount) {
-                printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-                return true;
-            }
-            if (vm.jumpCount >= MAX_JUMPS) {
-                printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-                return true;
-            }
-        }
-        else {
-            vm.equalFlag = false;
-            printf("$%d != $%d, not jumping!\n", reg1, reg2);
-        }
+//clears the runtime state for another run of the same program, bytecode, data and symbols stay
+void vm_restart(Context* vm) {
+    memset(vm->registers, 0, sizeof(vm->registers));
+    vm->registers[REGSP] = STACK_START;
+    vm->pc = 0;
+    vm->jumpCount = 0;
+    vm->equalFlag = false;
+    vm->remainder = 0;
+    vm->fuel = VM_DEFAULT_FUEL;
+    vm->blockStart = 0;
+    vm->status = VM_HALTED;
+    context_free_heap(vm); //the registers holding heap addresses are gone, so is the heap
+}
 
-        return false;
-    }break;
+//fuel doesn't carry over between frames, the budget is a per frame cost cap
+inline void vm_refuel(Context& vm, s32 fuel = VM_DEFAULT_FUEL) {
+    vm.fuel = fuel;
+}
 
-    case OP_EQ_CONST_TO_REG: {
-        printf("%2lu: OP_EQ_CONST_TO_REG ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u16 val = next2Bytes(vm);
-        if (vm.registers[reg1] == val)vm.equalFlag = true;
-        else vm.equalFlag = false;
-        return false;
-    }break;
+inline u64 vm_time_ns() {
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-    case OP_EQ_INDIRECT_REG_TO_REG: {
-        printf("%2lu: OP_EQ_INDIRECT_REG_TO_REG ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-        u8 reg1 = nextByte(vm);
-        u8 reg2 = nextByte(vm);
-        s32 val1 = vm.registers[reg1];
 
-        if (vm.mem[val1] == vm.registers[reg2])vm.equalFlag = true;
-        else vm.equalFlag = false;
-        vm.pc++;//need to pad out to the next instruction
-        return false;
-    }break;
+//expands one 4 byte instruction word into its decoded form, the operand layout depends on the opcode
+inline void decodeInstruction(const u8* bytes, DecodedInstruction* out) {
+    out->op = bytes[0];
+    out->a = bytes[1];
+    out->b = bytes[2];
+    out->c = bytes[3];
+    out->imm = 0;
 
-    case OP_PRT_ADDRESS: {
-        // __debugbreak();
-        printf("%2lu: PRT ADDRESS ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
+    //superinstructions and the end sentinel only exist in the decoded stream, a RAW instruction can't smuggle one in
+    if (bytes[0] >= OP_SUPER_EQ_JMP && bytes[0] < OP_COUNT) {
+        out->op = OP_ILGL;
+        return;
+    }
 
-        u8 reg1 = vm.bytecode[vm.pc++];
-        s32 val1 = vm.registers[reg1];
-        vm.pc += 2;
-        printf("PRT: %s\n", (char*)vm.mem + val1);
-        return false;
+    switch (bytes[0]) {
+    case OP_LOAD_IMM_TO_REG:
+    case OP_EQ_CONST_TO_REG: {//[op][reg][imm hi][imm lo]
+        out->imm = (bytes[2] << 8) | bytes[3];
     }break;
-    case OP_PRT_REG: {
-        // __debugbreak();
-        printf("%2lu: PRT REG ENCOUNTERED at pc %lu\n", currentByte, vm.pc - 1);
-
-        u8 reg1 = vm.bytecode[vm.pc++];
-        s32 val1 = vm.registers[reg1];
-        vm.pc += 2;
-        printf("PRT: %ld\n", val1);
-        return false;
+    case OP_JMP_CONSTANT:
+    case OP_JEQ_CONSTANT:
+    case OP_JNE_CONSTANT:
+    case OP_SYSCALL: {//[op][target (host function index for SYSCALL) hi][lo][pad]
+        out->imm = (bytes[1] << 8) | bytes[2];
     }break;
-                   //TODO: the way we manipulate the stack will not port to big endian hardware, will need to test on it if we ever need to 
-    case OP_PUSH_REG: {
-        u8 reg1 = nextByte(vm);
-
-        *((s32*)(vm.mem + vm.registers[REGSP])) = vm.registers[reg1];
+    case OP_JMP_LABEL:
+    case OP_CALL: {//[op][3 byte backpatched target]
+        out->imm = (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+    }break;
+    case OP_JEQ_REG_TO_REG_CONSTANT:
+    case OP_LOAD_OFFSET_REG_ADDR_TO_REG:
+    case OP_LOAD_REG_TO_REG_ADDR:
+    case OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR: {//[op][reg][reg][byte]
+        out->imm = bytes[3];
+    }break;
+    case OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR:
+    case OP_LOAD_REG_TO_OFFSET_REG_ADDR: {//[op][reg][offset][reg]
+        out->b = bytes[3];
+        out->imm = bytes[2];
+    }break;
+    case OP_PUSH_MASK:
+    case OP_POP_MASK: {//[op][lowest reg][mask hi][mask lo], bit i is register lowest + i, c is how many there are
+        out->imm = (bytes[2] << 8) | bytes[3];
+        out->b = 0;
+        out->c = 0;
+        for (u32 mask = out->imm; mask; mask &= mask - 1) out->c++;
+    }break;
+    case OP_ENTER: {//[op][locals hi][locals lo][pad]
+        out->imm = (bytes[1] << 8) | bytes[2];
+    }break;
+    case OP_WAIT: {//[op][3 byte ticks]
+        out->imm = (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+    }break;
+    case OP_WAIT_EVENT: {//[op][event hi][event lo][pad]
+        out->imm = (bytes[1] << 8) | bytes[2];
+    }break;
+    default: {}break;
+    }
+}
 
-        if ((vm.registers[REGSP] - 4) < 0) {//0 or wherever the labels end
-            __debugbreak();
-            vmError(vm, "POP ERROR! STACK TOO LARGE!", currentByte);
-            return true;
-        }
-        Assert(vm.registers[REGSP] >= 0);
+//how many instructions a decoded entry executes in one dispatch
+inline u32 superinstructionWidth(u8 op) {
+    if (op >= OP_SUPER_EQ_JMP && op <= OP_SUPER_LOAD_MUL) return 2;
+    if (op >= OP_SUPER_LOAD_LOAD_ADD && op <= OP_SUPER_LOAD_LOAD_MUL) return 3;
+    return 1;
+}
 
-        vm.registers[REGSP] -= 4;//move the stack in sections of 4 bytes
-        printf("%2lu: PUSH ENCOUNTERED at pc %lu, pushed %ld onto stack\n", currentByte, currentByte, vm.registers[reg1]);
+inline bool isFusableALU(u8 op) {
+    return op == OP_ADD_REG_TO_REG || op == OP_SUB_REG_TO_REG || op == OP_MUL_REG_TO_REG;
+}
 
-        vm.pc += 2;
-        return false;
-    }break;
-    case OP_POP_REG: {
+//rewrites compare+branch and frame load+ALU sequences in vm.decoded[first, end) into superinstructions
+//only the op of the first instruction changes, the rest keep their own entries (and operands), so a jump into the
+//middle of a fused sequence still lands on a normal handler and no jump target has to move
+void vm_fuse(Program& vm, u32 first, u32 end) {
+    for (u32 i = first; i + 1 < end; i++) {
+        DecodedInstruction* ins = vm.decoded + i;
+        u8 next = ins[1].op;
+
+        switch (ins->op) {
+        case OP_EQ:
+        case OP_NEQ:
+        case OP_GT:
+        case OP_LT:
+        case OP_GTQ:
+        case OP_LTQ: {
+            if (next != OP_JEQ_CONSTANT && next != OP_JNE_CONSTANT) break;
+            //JEQ jumps when the compare is true, JNE is the same jump on the inverted compare
+            //either way equalFlag always ends up false afterwards, so the fused handler never has to write it twice
+            bool invert = next == OP_JNE_CONSTANT;
+            switch (ins->op) {
+            case OP_EQ:  ins->op = invert ? OP_SUPER_NEQ_JMP : OP_SUPER_EQ_JMP; break;
+            case OP_NEQ: ins->op = invert ? OP_SUPER_EQ_JMP : OP_SUPER_NEQ_JMP; break;
+            case OP_GT:  ins->op = invert ? OP_SUPER_LTQ_JMP : OP_SUPER_GT_JMP; break;
+            case OP_LT:  ins->op = invert ? OP_SUPER_GTQ_JMP : OP_SUPER_LT_JMP; break;
+            case OP_GTQ: ins->op = invert ? OP_SUPER_LT_JMP : OP_SUPER_GTQ_JMP; break;
+            case OP_LTQ: ins->op = invert ? OP_SUPER_GT_JMP : OP_SUPER_LTQ_JMP; break;
+            }
+        }break;
 
-        u8 reg1 = nextByte(vm);
+        case OP_LOAD_OFFSET_REG_ADDR_TO_REG: {
+            u8 alu = next;
+            u8 fused = OP_SUPER_LOAD_ADD;
+            if (next == OP_LOAD_OFFSET_REG_ADDR_TO_REG && i + 2 < end && isFusableALU(ins[2].op)) {
+                alu = ins[2].op;
+                fused = OP_SUPER_LOAD_LOAD_ADD;
+            }
+            else if (!isFusableALU(next)) {
+                break;
+            }
+            ins->op = fused + (alu - OP_ADD_REG_TO_REG);//ADD, SUB, MUL are laid out in the same order in both places
+        }break;
 
-        if ((vm.registers[REGSP] + 4) > (MAX_MEM - 4)) {
-            __debugbreak();
-            vmError(vm, "POP ERROR! STACK TOO SMALL!", currentByte);
-            return true;
+        default: {}break;
         }
-        Assert(vm.registers[REGSP] <= (MAX_MEM - 4));
-
-        vm.registers[REGSP] += 4;//move the stack in sections of 4 bytes
-        vm.registers[reg1] = *((s32*)(vm.mem + vm.registers[REGSP]));
-        printf("%2lu: POP ENCOUNTERED at pc %lu, popped %ld onto $%u\n", currentByte, currentByte, vm.registers[reg1], reg1);
+    }
+}
 
+//dispatches the fused program saves on one straight pass through it
+u32 countDispatchesSaved(Program& vm) {
+    u32 saved = 0;
+    u32 i = 0;
+    while (i < vm.decodedCount) {
+        u32 width = superinstructionWidth(vm.decoded[i].op);
+        saved += width - 1;
+        i += width;
+    }
+    return saved;
+}
 
+//which of a, b, c name a register for each opcode
+#define OPERAND_A 1
+#define OPERAND_B 2
+#define OPERAND_C 4
+inline u32 registerOperands(u8 op) {
+    switch (op) {
+    case OP_ADD_REG_TO_REG:
+    case OP_SUB_REG_TO_REG:
+    case OP_MUL_REG_TO_REG:
+    case OP_DIV_REG_TO_REG: return OPERAND_A | OPERAND_B | OPERAND_C;
+
+    case OP_LOAD_REG_TO_REG:
+    case OP_EQ:
+    case OP_NEQ:
+    case OP_GT:
+    case OP_LT:
+    case OP_GTQ:
+    case OP_LTQ:
+    case OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR:
+    case OP_LOAD_OFFSET_REG_ADDR_TO_REG:
+    case OP_LOAD_REG_TO_OFFSET_REG_ADDR:
+    case OP_LOAD_REG_TO_REG_ADDR:
+    case OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR:
+    case OP_LOAD_DATA_ADDR_TO_ADDR:
+    case OP_JEQ_REG_TO_REG_CONSTANT:
+    case OP_EQ_INDIRECT_REG_TO_REG:
+    case OP_ALOC: return OPERAND_A | OPERAND_B;
+
+    case OP_LOAD_IMM_TO_REG:
+    case OP_JMP:
+    case OP_JMPF:
+    case OP_JMPB:
+    case OP_JEQ_REG:
+    case OP_FREE:
+    case OP_INC:
+    case OP_DEC:
+    case OP_EQ_CONST_TO_REG:
+    case OP_PRT_ADDRESS:
+    case OP_PRT_REG:
+    case OP_PUSH_REG:
+    case OP_POP_REG:
+    case OP_PUSH_MASK:
+    case OP_POP_MASK: return OPERAND_A;
+
+    default: return 0;
+    }
+}
 
-        vm.pc += 2;
+inline bool hasStaticJumpTarget(u8 op) {
+    return op == OP_JMP_CONSTANT || op == OP_JMP_LABEL || op == OP_JEQ_CONSTANT || op == OP_JNE_CONSTANT ||
+        op == OP_JEQ_REG_TO_REG_CONSTANT || op == OP_CALL;
+}
 
-        return false;
-    }break;
+inline bool hasMemOffset(u8 op) {
+    return op == OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR || op == OP_LOAD_OFFSET_REG_ADDR_TO_REG ||
+        op == OP_LOAD_REG_TO_OFFSET_REG_ADDR || op == OP_LOAD_REG_TO_REG_ADDR || op == OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR;
+}
 
-    case OP_CALL: {
-        printf("%2lu: CALL ENCOUNTERED at pc %lu\n", currentByte, currentByte);
+//PUSH/POP mask doesn't name a register past $31
+inline bool stackMaskInRange(const DecodedInstruction& ins) {
+    return ins.imm && (ins.a + 16 <= MAX_REGISTERS || !(ins.imm >> (MAX_REGISTERS - ins.a)));
+}
 
-        //push next instruction location to the stack and then jump
-        *((s32*)(vm.mem + vm.registers[REGSP])) = (vm.pc - 1) + 4;
+inline bool verifyFail(Program& vm, const char* message, u32 byte) {
+    vm.verifyError = message;
+    vm.verifyErrorByte = byte;
+    return false;
+}
 
-        if ((vm.registers[REGSP] - 4) < 0) {//0 or wherever the labels end
-            __debugbreak();
-            vmError(vm, "POP ERROR! STACK TOO LARGE!", currentByte);
-            return true;
+//runs once per program change, proves what the engine would otherwise recheck on every instruction:
+//every opcode is real, every register operand is in range, constant/label targets are aligned and land on an
+//instruction (or exactly on the end, which is a clean exit), and address offsets fit in memory
+//anything that depends on a register value at runtime (JMP $r, JMPF/JMPB, RET, register addresses) can't be proven here and keeps its check
+//reads the bytecode rather than vm.decoded so it doesn't care what the superinstruction pass did
+bool vm_verify(Program& vm) {
+    vm.verifyError = NULL;
+    vm.verifyErrorByte = 0;
+    if (vm.byteCount & 3) return verifyFail(vm, "program isn't a whole number of instructions", vm.byteCount);
+
+    for (u32 byte = 0; byte < vm.byteCount; byte += 4) {
+        DecodedInstruction ins;
+        decodeInstruction(vm.bytecode + byte, &ins);
+
+        u32 operands = registerOperands(ins.op);
+        bool hasHandler = operands || hasStaticJumpTarget(ins.op) || ins.op == OP_HLT || ins.op == OP_RET || ins.op == OP_SYSCALL ||
+            ins.op == OP_ENTER || ins.op == OP_LEAVE || ins.op == OP_YIELD || ins.op == OP_WAIT || ins.op == OP_WAIT_EVENT;
+        if (!hasHandler) return verifyFail(vm, "illegal opcode", byte);
+
+        if ((operands & OPERAND_A) && ins.a >= MAX_REGISTERS) return verifyFail(vm, "register operand out of range", byte);
+        if ((operands & OPERAND_B) && ins.b >= MAX_REGISTERS) return verifyFail(vm, "register operand out of range", byte);
+        if ((operands & OPERAND_C) && ins.c >= MAX_REGISTERS) return verifyFail(vm, "register operand out of range", byte);
+        if ((ins.op == OP_PUSH_MASK || ins.op == OP_POP_MASK) && !stackMaskInRange(ins)) return verifyFail(vm, "register mask out of range", byte);
+        if (ins.op == OP_SYSCALL && (u32)ins.imm >= vmHost.count) return verifyFail(vm, "unknown host function", byte);
+        if (ins.op == OP_WAIT_EVENT && ins.imm >= VM_MAX_EVENTS) return verifyFail(vm, "event id out of range", byte);
+
+        if (hasStaticJumpTarget(ins.op)) {
+            if (ins.imm & 3) return verifyFail(vm, "jump target is misaligned", byte);
+            if ((u32)ins.imm > vm.byteCount) return verifyFail(vm, "jump target is past the end of the program", byte);
         }
-        Assert(vm.registers[REGSP] >= 0);
-        vm.registers[REGSP] -= 4;//move the stack in sections of 4 bytes
 
+        if (hasMemOffset(ins.op) && (ins.imm < 0 || ins.imm >= MAX_MEM)) return verifyFail(vm, "address offset out of range", byte);
+    }
+    return true;
+}
 
-        u32 target = next3Bytes(vm);
-        vm.pc = target;
-        vm.jumpCount++;
-        if (vm.pc >= vm.byteCount) {
-            printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
-            return true;
-        }
-        if (vm.jumpCount >= MAX_JUMPS) {
-            printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-            vmError(vm, "MAX JUMPS REACHED!", currentByte);
-            return true;
-        }
+//decodes everything appended since the last decode, the engines only ever read vm.decoded
+//the last 2 already decoded instructions get redone so a new entry can fuse with the end of the previous one
+void vm_decode(Program& vm) {
+    u32 instructionCount = vm.byteCount / 4;
+    if (vm.decodedCount > instructionCount) {
+        //program got shorter, the new last instructions may have been fused with what got cut
+        vm.decodedCount = instructionCount;
+    }
+    else if (vm.decodedCount == instructionCount) {
+        return;
+    }
 
-        return false;
-    }break;
+    u32 first = vm.decodedCount > 2 ? vm.decodedCount - 2 : 0;
+    for (u32 i = first; i < instructionCount; i++) {
+        decodeInstruction(vm.bytecode + i * 4, vm.decoded + i);
+    }
+    vm.decodedCount = instructionCount;
 
-    case OP_RET: {
-        printf("%2lu: RET ENCOUNTERED at pc %lu\n", currentByte, currentByte);
+    if (vm.fuse) {
+        vm_fuse(vm, first, instructionCount);
+    }
+    vm.dispatchesSaved = countDispatchesSaved(vm);
 
-        if ((vm.registers[REGSP] + 4) > (MAX_MEM - 4)) {
-            __debugbreak();
-            vmError(vm, "POP ERROR! STACK TOO SMALL!", currentByte);
-            return true;
-        }
-        Assert(vm.registers[REGSP] <= (MAX_MEM - 4));
+    vm.decoded[instructionCount] = {};
+    vm.decoded[instructionCount].op = OP_END;
+    vm.verified = vm_verify(vm);
+    vm.jit.valid = false;
+    vm.aot.fn = NULL; //built from the code as it was, the library stays loaded until vm_aot_load or program_reset
+}
 
-        vm.registers[REGSP] += 4;//move the stack in sections of 4 bytes
+//call after anything writes to the bytecode at or after fromByte
+inline void vm_invalidate_decode(Program& vm, u32 fromByte) {
+    u32 instruction = fromByte / 4;
+    if (instruction < vm.decodedCount) vm.decodedCount = instruction;
+    if (fromByte < vm.byteCount) vm.aot.fn = NULL;
+}
 
-        u32 target = *((s32*)(vm.mem + vm.registers[REGSP]));
+//a fresh instance of an assembled program, starts at pc 0 with the program's data as its memory
+//the program gets decoded here so any number of instances can run it afterwards without touching it
+//ctx can be uninitialised memory, an instance that already ran goes through context_reset instead so its pages get freed
+void context_init(Context* ctx, Program* program, vm_dispatch_mode dispatch = VM_DEFAULT_DISPATCH) {
+    vm_decode(*program);
+    memset(ctx->pageTables, 0, sizeof(ctx->pageTables));
+    ctx->guardMem = NULL;
+    ctx->guardCommitted = 0;
+    ctx->stack = NULL;
+    ctx->id = 0;
+    context_reset(ctx, program, dispatch);
+}
 
-        //do we need to increment the jump count for returns?
-        vm.pc = target;
-        vm.jumpCount++;
-        if (vm.pc >= vm.byteCount) {
-            printf("JUMPED TO INVALID MEMORY %lu, EXITING\n", vm.pc);
-            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
-            return true;
-        }
-        if (vm.jumpCount >= MAX_JUMPS) {
-            printf("MAX JUMPS %u REACHED! EXITING EXECUTION!\n", MAX_JUMPS);
-            vmError(vm, "MAX JUMPS REACHED!", currentByte);
-            return true;
-        }
+//a fixed set of instances handed out and taken back in O(1), the slots are the caller's memory so spawning and
+//retiring spells never touches the heap. a released slot gets reset when it's handed out again, not when it comes back
+struct ContextPool {
+    Context* slots;
+    u32 capacity;
+    u32 used; //slots handed out at least once, everything past this has never been touched
+    u32 live;
+    Context* freeList; //released slots, linked through Context::nextFree
+};
 
+void context_pool_init(ContextPool* pool, Context* slots, u32 capacity) {
+    pool->slots = slots;
+    pool->capacity = capacity;
+    pool->used = 0;
+    pool->live = 0;
+    pool->freeList = NULL;
+}
 
+//NULL when every slot is live
+Context* context_acquire(ContextPool* pool, Program* program, vm_dispatch_mode dispatch = VM_DEFAULT_DISPATCH) {
+    Context* ctx = pool->freeList;
+    if (ctx) {
+        pool->freeList = ctx->nextFree;
+    }
+    else if (pool->used < pool->capacity) {
+        ctx = pool->slots + pool->used++;
+    }
+    else {
+        return NULL;
+    }
+    pool->live++;
+    context_init(ctx, program, dispatch); //the decode is a no-op once the program has been decoded
+    ctx->id = (u32)(ctx - pool->slots);
+    return ctx;
+}
 
-        return false;
-    }break;
+void context_release(ContextPool* pool, Context* ctx) {
+    Assert(ctx >= pool->slots && ctx < pool->slots + pool->used);
+    context_free_memory(ctx); //an idle slot doesn't hold on to pages
+    ctx->nextFree = pool->freeList;
+    pool->freeList = ctx;
+    pool->live--;
+}
 
-    case OP_SYSCALL: {
-        printf("%2lu: SYSCALL ENCOUNTERED at pc %lu\n", currentByte, currentByte);
+inline void vmMemError(Context& vm, const char* message, u32 instructionLocation, s32 memLocation, u32 maxMem) {
+    vm.status = VM_ERROR;
+    printf("[VM ERROR]: %s, instruction: %u, memory address: %d, max memory size: %u\n", message, instructionLocation, memLocation, maxMem);
+}
 
-        vm.pc += 3;
+inline void vmError(Context& vm, const char* message, u32 instructionLocation) {
+    vm.status = VM_ERROR;
+    printf("[VM ERROR]: %s, instruction: %u\n", message, instructionLocation);
+}
 
-        switch (vm.registers[0]) {
-        case 0: {
+//a full queue yields the spell with pc back on the SYSCALL, it casts the effect again when it's resumed after the drain
+inline void vm_effect_push(Context& vm, const VMHostFunction& host) {
+    VMEffectQueue* queue = vmEffectQueue;
+    if (!queue) {
+        vmError(vm, "EFFECT WITH NO QUEUE BOUND!", vm.pc - 4);
+        return;
+    }
+    if (queue->tail - queue->head == queue->capacity) {
+        queue->stalls++;
+        vm.pc -= 4;
+        vm.status = VM_YIELDED;
+        return;
+    }
+    VMEffect& record = queue->records[queue->tail++ & (queue->capacity - 1)];
+    record.effect = (u16)(&host - vmHost.functions);
+    record.argCount = host.effectArgs;
+    record.instance = vm.id;
+    memcpy(record.args, vm.registers + 1, sizeof(record.args)); //fixed size, cheaper than copying exactly argCount
+}
 
-            printf("arg1 (reg1): %ld\n", vm.registers[1]);
-            switch (vm.registers[1]) {
-            case 42: {
-                printf("42 is the meaning of life\n");
-            }break;
-            case 13: {
-                printf("CAST PROJECTILE\n");
-            }break;
-            case 14: {
-                printf("CAST AREA OF EFFECT\n");
-            }break;
-
-            default: {}
-
-            }
-            printf("arg2 (reg2): %ld\n", vm.registers[2]);
-        }break;
-        default: {
-            printf("unhandled syscall parameter\n");
-        }
-        }
-        return false;
-    }break;
-                   // case OP_EXAMPLE:{
-                   //     return false;
-                   // }break;
+//what the JIT and AOT code call, the interpreter pushes inline
+static void vm_host_effect(Context& vm, void* user) {
+    vm_effect_push(vm, *(VMHostFunction*)user);
+}
 
+//registers an effect, 'SYSCALL name' queues a record with $1 ... $argCount. -1 like vm_register_host
+s32 vm_register_effect(const char* name, u32 argCount) {
+    if (argCount > VM_EFFECT_MAX_ARGS) return -1;
+    s32 index = vm_register_host(name, vm_host_effect);
+    if (index < 0) return -1;
+    VMHostFunction& host = vmHost.functions[index];
+    host.user = &host;
+    host.effect = true;
+    host.effectArgs = (u8)argCount;
+    return index;
+}
 
-    default:
-        printf("UNKNOWN OPCODE! %u %s\n", vm.bytecode[vm.pc], opcodeStr((Opcode)vm.bytecode[vm.pc]));
-        Assert(!"invalid opcode!");
-        return true;
+//hands everything queued to fn in at most two runs of contiguous records (the ring wraps), oldest first. returns how many
+u32 vm_effect_drain(VMEffectQueue* queue, void (*fn)(const VMEffect* records, u32 count, void* user), void* user) {
+    u32 total = queue->tail - queue->head;
+    while (queue->head != queue->tail) {
+        u32 at = queue->head & (queue->capacity - 1);
+        u32 count = queue->tail - queue->head;
+        if (count > queue->capacity - at) count = queue->capacity - at;
+        fn(queue->records + at, count, user);
+        queue->head += count;
     }
+    return total;
 }
 
-void vm_run(VM& vm, Scanner* scanner = NULL) {
-    bool isDone = false;
-    vm.instructionsExecuted = 0;
-    while (!isDone) {
+//called by every taken jump after vm.pc holds the target, jumpByte is the jump instruction ending the block
+//the block is straight line code from blockStart, so its instruction count falls out of the two addresses and
+//straight line code never pays per instruction. every loop has a taken jump in it, so every loop is bounded
+//returns true when the instance is out of fuel and has to yield, pc already points at the next block
+inline bool vm_charge_fuel(Context& vm, u32 jumpByte) {
+    vm.fuel -= (s32)((jumpByte - vm.blockStart) >> 2) + 1;
+    vm.blockStart = vm.pc;
+    if (vm.fuel > 0) return false;
+    vm.status = VM_YIELDED;
+    return true;
+}
 
-        if(scanner){
-            printf("EXECUTION COUNT: %d || ", vm.instructionsExecuted);
-            printScannerLine(scanner, (vm.pc/4)+1);
-        }
+//trace output only exists in the debug engine, executeInstruction<false> compiles down to a switch with no I/O
+//errors, PRT and syscall effects still print in both, those are program output rather than tracing
+#define VM_TRACE(...) do { if (Trace) { printf(__VA_ARGS__); } } while (0)
+
+//the same handler bodies build both engines
+//switch: every handler returns to vm_run after a single instruction
+//threaded: every handler jumps straight to the next handler through the label table, only returning when the program is done
+//both execute from vm.decoded, the bytecode is only read by vm_decode
+#if VM_COMPUTED_GOTO
+    #define VM_CASE(op) case op: label_##op:
+    #define VM_DISPATCH()\
+        vm.instructionsExecuted++;\
+        currentByte = vm.pc;\
+        if (!Verified) {\
+            if (vm.pc >= byteCount) { return true; }\
+            if (vm.pc & 3) { vmError(vm, "JUMPED TO MISALIGNED INSTRUCTION", currentByte); return true; }\
+        }\
+        ins = code + (vm.pc >> 2);\
+        vm.pc += 4;\
+        goto *dispatchTable[ins->op];
+    #define VM_NEXT() do { if (Threaded) { VM_DISPATCH(); } return false; } while (0)
+#else
+    #define VM_CASE(op) case op:
+    #define VM_NEXT() return false
+#endif
 
-        isDone = executeInstruction(vm);
-        
-        vm.instructionsExecuted++;
+//register driven jumps can land anywhere, the dispatch doesn't check alignment for verified programs so they do it here
+#define VM_CHECK_DYNAMIC_TARGET()\
+    if (Verified && (vm.pc & 3)) {\
+        vmError(vm, "JUMPED TO MISALIGNED INSTRUCTION", currentByte);\
+        return true;\
     }
-}
-
-void vm_run_once(VM& vm) {
-    bool isDone = executeInstruction(vm);
-}
 
-void test_reset_vm() {
-    VM vm = {};
-    reset_vm(&vm);
+//everything the handler wrote so far (pc mostly) has to be in the Context before a guarded access can fault
+#if defined(__GNUC__) || defined(__clang__)
+    #define VM_GUARD_FENCE() __asm__ __volatile__("" ::: "memory")
+#else
+    #define VM_GUARD_FENCE()
+#endif
 
-    for (int i = 0; i < 32; i++)Assert(vm.registers[i] == 0);
-}
+//byte at addr, or out of the handler with a VM error. on the guard page backend it's just base + addr, an address past
+//the stack faults and vm_run_guarded raises the error instead. mprotect works in whole pages though, so the rest of the
+//last heap page and the stack segment below stackLimit are mapped too, one compare keeps them out of bounds
+#define VM_ADDRESS(ptr, addr, at, message)\
+    u8* ptr;\
+    if (Guarded) {\
+        VM_GUARD_FENCE();\
+        u32 ptr##Address = (u32)(addr);\
+        u32 ptr##HeapEnd = MAX_MEM + vm.heapTop;\
+        ptr = ptr##Address - ptr##HeapEnd < vm.stackLimit - ptr##HeapEnd ? NULL : vm.memBase + ptr##Address;\
+    }\
+    else {\
+        ptr = vm_addr(vm, (addr));\
+    }\
+    if (!ptr) {\
+        fputs(message, stdout);\
+        vmMemError(vm, "Attempting to address memory out of bounds!", (at), (addr), vm_mem_size(vm));\
+        return true;\
+    }
 
+//the stack slots from low up to high (the address of the last one) are all in the instance's stack segment, the page
+//gets allocated the first time. bails out of the handler with a VM error otherwise
+#define VM_STACK_CHECK(low, high, message)\
+    if ((low) > (high) || (low) < vm.stackLimit || (high) > STACK_START || (!vm.stack && !vm_stack_alloc(vm))) {\
+        vmError(vm, message, currentByte);\
+        return true;\
+    }
+#define VM_STACK_SLOT(addr) ((s32*)(vm.stack + ((addr) - VM_STACK_BASE)))
+
+//compare + JEQ/JNE #, the branch target lives in the JEQ/JNE entry right after this one
+//behaves exactly like the pair did, including jumpCount and the flag the branch leaves behind (always false)
+#define VM_SUPER_CMP_JMP(op, cmp, name)\
+    VM_CASE(op) {\
+        VM_TRACE("%2u: " name " + BRANCH ENCOUNTERED at pc %u   :    " name " $%u $%u, target: %d\n", currentByte, currentByte, ins->a, ins->b, ins[1].imm);\
+        vm.equalFlag = false;\
+        if (vm.registers[ins->a] cmp vm.registers[ins->b]) {\
+            vm.jumpCount++;\
+            vm.pc = ins[1].imm;\
+            if (!Verified && vm.pc >= byteCount) {\
+                printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);\
+                return true;\
+            }\
+            if (vm_charge_fuel(vm, currentByte + 4)) return true;\
+        }\
+        else {\
+            vm.pc += 4;\
+        }\
+        VM_NEXT();\
+    }break;
 
+//LOAD $r [$x + k], bails out of the handler on a bad address like the plain LOAD does
+#define VM_SUPER_FRAME_LOAD(load, at)\
+    {\
+        s32 src = vm.registers[(load)->b] + (load)->imm;\
+        VM_ADDRESS(srcByte, src, (at), "LOAD memory offset addressing error!\n");\
+        vm.registers[(load)->a] = *srcByte;\
+    }
 
+//one or two frame loads followed by ADD/SUB/MUL, the ALU entry comes right after the loads
+#define VM_SUPER_LOAD_ALU(op, loads, opr, name)\
+    VM_CASE(op) {\
+        VM_TRACE("%2u: " name " ENCOUNTERED at pc %u\n", currentByte, currentByte);\
+        VM_SUPER_FRAME_LOAD(ins, currentByte);\
+        if (loads == 2) VM_SUPER_FRAME_LOAD(ins + 1, currentByte + 4);\
+        const DecodedInstruction* alu = ins + loads;\
+        vm.registers[alu->c] = vm.registers[alu->a] opr vm.registers[alu->b];\
+        vm.pc += 4 * loads;\
+        VM_NEXT();\
+    }break;
 
-// PARSER START
+//a verified program (vm_verify) skips the pc bounds/alignment checks on every dispatch and the target checks on
+//constant/label jumps, the OP_END sentinel stops it instead. register driven jumps still check their target
+//Guarded engines run guard page instances (context_guard_memory) inside vm_run_guarded, loads/stores don't check addresses
+template<bool Trace, bool Threaded = false, bool Verified = false, bool Guarded = false>
+inline bool executeInstruction(Context& vm) {
+    const DecodedInstruction* code = vm.program->decoded;
+    const u32 byteCount = vm.program->byteCount;
+    u32 currentByte = vm.pc;
+    const DecodedInstruction* ins = NULL;
+
+#if VM_COMPUTED_GOTO
+    //filled by a static initializer so workers starting the threaded engine at once can't race on it
+    static void* dispatchTable[256];
+    static const bool dispatchTableBuilt = ({
+        for (u32 i = 0; i < 256; i++) dispatchTable[i] = &&label_default;
+        dispatchTable[OP_HLT] = &&label_OP_HLT;
+        dispatchTable[OP_ILGL] = &&label_OP_ILGL;
+        dispatchTable[OP_LOAD_REG_TO_REG] = &&label_OP_LOAD_REG_TO_REG;
+        dispatchTable[OP_LOAD_IMM_TO_REG] = &&label_OP_LOAD_IMM_TO_REG;
+        dispatchTable[OP_ADD_REG_TO_REG] = &&label_OP_ADD_REG_TO_REG;
+        dispatchTable[OP_SUB_REG_TO_REG] = &&label_OP_SUB_REG_TO_REG;
+        dispatchTable[OP_MUL_REG_TO_REG] = &&label_OP_MUL_REG_TO_REG;
+        dispatchTable[OP_DIV_REG_TO_REG] = &&label_OP_DIV_REG_TO_REG;
+        dispatchTable[OP_JMP] = &&label_OP_JMP;
+        dispatchTable[OP_JMPF] = &&label_OP_JMPF;
+        dispatchTable[OP_JMPB] = &&label_OP_JMPB;
+        dispatchTable[OP_EQ] = &&label_OP_EQ;
+        dispatchTable[OP_NEQ] = &&label_OP_NEQ;
+        dispatchTable[OP_GT] = &&label_OP_GT;
+        dispatchTable[OP_LT] = &&label_OP_LT;
+        dispatchTable[OP_GTQ] = &&label_OP_GTQ;
+        dispatchTable[OP_LTQ] = &&label_OP_LTQ;
+        dispatchTable[OP_JEQ_REG] = &&label_OP_JEQ_REG;
+        dispatchTable[OP_ALOC] = &&label_OP_ALOC;
+        dispatchTable[OP_INC] = &&label_OP_INC;
+        dispatchTable[OP_DEC] = &&label_OP_DEC;
+        dispatchTable[OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR] = &&label_OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR;
+        dispatchTable[OP_LOAD_OFFSET_REG_ADDR_TO_REG] = &&label_OP_LOAD_OFFSET_REG_ADDR_TO_REG;
+        dispatchTable[OP_LOAD_REG_TO_OFFSET_REG_ADDR] = &&label_OP_LOAD_REG_TO_OFFSET_REG_ADDR;
+        dispatchTable[OP_LOAD_REG_TO_REG_ADDR] = &&label_OP_LOAD_REG_TO_REG_ADDR;
+        dispatchTable[OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR] = &&label_OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR;
+        dispatchTable[OP_LOAD_DATA_ADDR_TO_ADDR] = &&label_OP_LOAD_DATA_ADDR_TO_ADDR;
+        dispatchTable[OP_JMP_CONSTANT] = &&label_OP_JMP_CONSTANT;
+        dispatchTable[OP_JMP_LABEL] = &&label_OP_JMP_LABEL;
+        dispatchTable[OP_JEQ_CONSTANT] = &&label_OP_JEQ_CONSTANT;
+        dispatchTable[OP_JNE_CONSTANT] = &&label_OP_JNE_CONSTANT;
+        dispatchTable[OP_JEQ_REG_TO_REG_CONSTANT] = &&label_OP_JEQ_REG_TO_REG_CONSTANT;
+        dispatchTable[OP_EQ_CONST_TO_REG] = &&label_OP_EQ_CONST_TO_REG;
+        dispatchTable[OP_EQ_INDIRECT_REG_TO_REG] = &&label_OP_EQ_INDIRECT_REG_TO_REG;
+        dispatchTable[OP_PRT_ADDRESS] = &&label_OP_PRT_ADDRESS;
+        dispatchTable[OP_PRT_REG] = &&label_OP_PRT_REG;
+        dispatchTable[OP_PUSH_REG] = &&label_OP_PUSH_REG;
+        dispatchTable[OP_POP_REG] = &&label_OP_POP_REG;
+        dispatchTable[OP_CALL] = &&label_OP_CALL;
+        dispatchTable[OP_RET] = &&label_OP_RET;
+        dispatchTable[OP_SYSCALL] = &&label_OP_SYSCALL;
+        dispatchTable[OP_FREE] = &&label_OP_FREE;
+        dispatchTable[OP_PUSH_MASK] = &&label_OP_PUSH_MASK;
+        dispatchTable[OP_POP_MASK] = &&label_OP_POP_MASK;
+        dispatchTable[OP_ENTER] = &&label_OP_ENTER;
+        dispatchTable[OP_LEAVE] = &&label_OP_LEAVE;
+        dispatchTable[OP_YIELD] = &&label_OP_YIELD;
+        dispatchTable[OP_WAIT] = &&label_OP_WAIT;
+        dispatchTable[OP_WAIT_EVENT] = &&label_OP_WAIT_EVENT;
+        dispatchTable[OP_SUPER_EQ_JMP] = &&label_OP_SUPER_EQ_JMP;
+        dispatchTable[OP_SUPER_NEQ_JMP] = &&label_OP_SUPER_NEQ_JMP;
+        dispatchTable[OP_SUPER_GT_JMP] = &&label_OP_SUPER_GT_JMP;
+        dispatchTable[OP_SUPER_LT_JMP] = &&label_OP_SUPER_LT_JMP;
+        dispatchTable[OP_SUPER_GTQ_JMP] = &&label_OP_SUPER_GTQ_JMP;
+        dispatchTable[OP_SUPER_LTQ_JMP] = &&label_OP_SUPER_LTQ_JMP;
+        dispatchTable[OP_SUPER_LOAD_ADD] = &&label_OP_SUPER_LOAD_ADD;
+        dispatchTable[OP_SUPER_LOAD_SUB] = &&label_OP_SUPER_LOAD_SUB;
+        dispatchTable[OP_SUPER_LOAD_MUL] = &&label_OP_SUPER_LOAD_MUL;
+        dispatchTable[OP_SUPER_LOAD_LOAD_ADD] = &&label_OP_SUPER_LOAD_LOAD_ADD;
+        dispatchTable[OP_SUPER_LOAD_LOAD_SUB] = &&label_OP_SUPER_LOAD_LOAD_SUB;
+        dispatchTable[OP_SUPER_LOAD_LOAD_MUL] = &&label_OP_SUPER_LOAD_LOAD_MUL;
+        dispatchTable[OP_END] = &&label_OP_END;
+        true;
+    });
+    (void)dispatchTableBuilt;
+    if (Threaded) {
+        VM_DISPATCH();
+    }
+#endif
 
+    if (!Verified) {
+        if (vm.pc >= byteCount) {
+            VM_TRACE("program counter: %u, exceeds byteCount: %u, returning\n", vm.pc, byteCount);
+            return true;
+        }
+        if (vm.pc & 3) {
+            vmError(vm, "JUMPED TO MISALIGNED INSTRUCTION", currentByte);
+            return true;
+        }
+    }
 
-const char* tok_to_str(TokenTypes type) {
-    switch (type) {
-        case TOK_LEFT_PAREN: return "TOK_LEFT_PAREN ";
-        case TOK_RIGHT_PAREN: return "TOK_RIGHT_PAREN ";
-        case TOK_LEFT_BRACE: return "TOK_LEFT_BRACE ";
-        case TOK_RIGHT_BRACE: return "TOK_RIGHT_BRACE ";
-        case TOK_LEFT_BRACKET: return "TOK_LEFT_BRACKET ";
-        case TOK_RIGHT_BRACKET: return "TOK_RIGHT_BRACKET ";
-        case TOK_COMMA: return "TOK_COMMA ";
-        case TOK_DOT: return "TOK_DOT ";
-        case TOK_MINUS: return "TOK_MINUS ";
-        case TOK_PLUS: return "TOK_PLUS ";
-        case TOK_SEMICOLON: return "TOK_SEMICOLON ";
-        case TOK_COLON: return "TOK_COLON ";
-        case TOK_SLASH: return "TOK_SLASH ";
-        case TOK_STAR: return "TOK_STAR ";
-        case TOK_BANG: return "TOK_BANG ";
-        case TOK_BANG_EQUAL: return "TOK_BANG_EQUAL ";
-        case TOK_EQUAL: return "TOK_EQUAL ";
-        case TOK_EQUAL_EQUAL: return "TOK_EQUAL_EQUAL ";
-        case TOK_GREATER: return "TOK_GREATER ";
-        case TOK_GREATER_EQUAL: return "TOK_GREATER_EQUAL ";
-        case TOK_LESS: return "TOK_LESS ";
-        case TOK_LESS_EQUAL: return "TOK_LESS_EQUAL ";
-        case TOK_IDENTIFIER: return "TOK_IDENTIFIER  ";
-        case TOK_SYSCALL: return "TOK_SYSCALL  ";
-        case TOK_STRING: return "TOK_STRING  ";
-        case TOK_NUMBER: return "TOK_NUMBER ";
-        case TOK_HEX: return "TOK_HEX ";
-        case TOK_AND: return "TOK_AND ";
-        case TOK_ELSE: return "TOK_ELSE ";
-        case TOK_FALSE: return "TOK_FALSE ";
-        case TOK_FOR: return "TOK_FOR ";
-        case TOK_FUN: return "TOK_FUN ";
-        case TOK_IF: return "TOK_IF ";
-        case TOK_NIL: return "TOK_NIL  ";
-        case TOK_OR: return "TOK_OR ";
-        case TOK_PRINT: return "TOK_PRINT ";
-        case TOK_RETURN: return "TOK_RETURN ";
-        case TOK_TRUE: return "TOK_TRUE ";
-        case TOK_VAR: return "TOK_VAR ";
-        case TOK_WHILE: return "TOK_WHILE ";
-        case TOK_STRUCT: return "TOK_STRUCT ";
-        case TOK_ERROR: return "TOK_ERROR ";
-        case TOK_INSTRUCTION: return "TOK_INSTRUCTION";
+    ins = code + (vm.pc >> 2);
+    vm.pc += 4;
 
-        case TOK_LOAD: return "TOK_LOAD";
-        case TOK_ADD: return "TOK_ADD";
-        case TOK_SUB: return "TOK_SUB";
-        case TOK_MUL: return "TOK_MUL";
-        case TOK_DIV: return "TOK_DIV";
-        case TOK_JMP: return "TOK_JMP";
-        case TOK_JMPF: return "TOK_JMPF";
-        case TOK_JMPB: return "TOK_JMPB";
-        case TOK_JEQ: return "TOK_JEQ";
-        case TOK_JNE: return "TOK_JNE";
-        case TOK_EQ: return "TOK_EQ";
-        case TOK_NEQ: return "TOK_NEQ";
-        case TOK_GT: return "TOK_GT";
-        case TOK_LT: return "TOK_LT";
-        case TOK_GTQ: return "TOK_GTQ";
-        case TOK_LTQ: return "TOK_LTQ";
-        case TOK_ALOC: return "TOK_ALOC";
-        case TOK_HLT: return "TOK_HLT";
-        case TOK_INC: return "TOK_INC";
-        case TOK_DEC: return "TOK_DEC";
-        case TOK_LABEL_USAGE: return "TOK_LABEL_USAGE";
-        case TOK_DIRECTIVE: return "TOK_DIRECTIVE";
-        case TOK_RESB: return "TOK_RESB";
+    switch (ins->op) {
+      
+    VM_CASE(OP_HLT) {
+        VM_TRACE("%2u: HLT ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        return true;
+    }break;
+    VM_CASE(OP_ILGL) {
+        VM_TRACE("%2u: IGL ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        vm.status = VM_ERROR;
+        return true;
+    }break;
+    VM_CASE(OP_LOAD_REG_TO_REG) {
+        VM_TRACE("%2u: LOAD REG2REG ENCOUNTERED at pc %u   :    ", currentByte, currentByte);
+        vm.registers[ins->a] = vm.registers[ins->b];
+        VM_TRACE("LOAD $%u $%u\n", ins->a, ins->b);
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_LOAD_IMM_TO_REG) {
+        VM_TRACE("%2u: LOAD ENCOUNTERED at pc %2u   :    ", currentByte, currentByte);
+        vm.registers[ins->a] = ins->imm;
+        VM_TRACE("LOAD $%u #%u\n", ins->a, ins->imm);
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_ADD_REG_TO_REG) {
+        VM_TRACE("%2u: ADD ENCOUNTERED at pc %2u    :    ", currentByte, currentByte);
+        VM_TRACE("ADD $%u $%u $%u, \t %u + %u = %u\n", ins->a, ins->b, ins->c, vm.registers[ins->a], vm.registers[ins->b], vm.registers[ins->a] + vm.registers[ins->b]);
+        vm.registers[ins->c] = vm.registers[ins->a] + vm.registers[ins->b];
+        VM_NEXT();
 
-        case TOK_COMMAND_REGISTERS: return "TOK_COMMAND_REGISTERS";
-        case TOK_COMMAND_QUIT: return "TOK_COMMAND_QUIT";
-        case TOK_COMMAND_HISTORY: return "TOK_COMMAND_HISTORY";
-        case TOK_COMMAND_PROGRAM: return "TOK_COMMAND_PROGRAM";
-        case TOK_PRT: return "TOK_PRT";
-        case TOK_PUSH: return "TOK_PUSH";
-        case TOK_POP: return "TOK_POP";
-        case TOK_CALL: return "TOK_CALL";
-        case TOK_RET: return "TOK_RET";
+    }break;
+    VM_CASE(OP_SUB_REG_TO_REG) {
+        VM_TRACE("%2u: SUB ENCOUNTERED at pc %2u   :    ", currentByte, currentByte);
+        VM_TRACE("SUB $%u $%u $%u, \t %u - %u = %u\n", ins->a, ins->b, ins->c, vm.registers[ins->a], vm.registers[ins->b], vm.registers[ins->a] - vm.registers[ins->b]);
+        vm.registers[ins->c] = vm.registers[ins->a] - vm.registers[ins->b];
+        VM_NEXT();
 
-        case TOK_REGISTER: return "TOK_REGISTER";
-        case TOK_INSTRUCTION_VALUE: return "TOK_INSTRUCTION_VALUE";
-        case TOK_RAW: return "TOK_RAW";
+    }break;
+    VM_CASE(OP_MUL_REG_TO_REG) {
+        VM_TRACE("%2u: MUL ENCOUNTERED at pc %u  :     ", currentByte, currentByte);
+        VM_TRACE("MUL $%u $%u $%u, \t %u * %u = %u\n", ins->a, ins->b, ins->c, vm.registers[ins->a], vm.registers[ins->b], vm.registers[ins->a] * vm.registers[ins->b]);
+        vm.registers[ins->c] = vm.registers[ins->a] * vm.registers[ins->b];
+        VM_NEXT();
 
-        case TOK_EOF: {
-            // __debugbreak();
-            return "TOK_EOF ";
+    }break;
+    VM_CASE(OP_DIV_REG_TO_REG) {
+        VM_TRACE("%2u: DIV ENCOUNTERED at pc %u   :    ", currentByte, currentByte);
+        if (vm.registers[ins->b] == 0) {
+            printf("$%d is 0!\n", vm.registers[ins->b]);
+            vmError(vm, "DIVISION BY 0!", currentByte);
+            return true;
         }
-        case TOK_NEWLINE: { return "TOK_NEWLINE "; }
-                    defult: return "NONE????";
-        default:{}break;
-    }
+        s32 dividend = vm.registers[ins->a];
+        s32 divisor = vm.registers[ins->b];
+        //INT32_MIN / -1 traps on x86, it wraps to INT32_MIN remainder 0 like ADD/SUB/MUL overflow does
+        s32 quotient = divisor == -1 ? (s32)(0u - (u32)dividend) : dividend / divisor;
+        vm.remainder = divisor == -1 ? 0 : dividend % divisor;
+        vm.registers[29] = vm.remainder; //just make register 29 the result of the modulow for now
+        vm.registers[ins->c] = quotient;
+        VM_TRACE("DIV $%u $%u $%u, \t %d / %d = %d remainder %u\n", ins->a, ins->b, ins->c, dividend, divisor, quotient, vm.remainder);
+        VM_NEXT();
 
-    return "NONE????";
+    }break;
+    VM_CASE(OP_JMP) {
+        VM_TRACE("%2u: JMP ENCOUNTERED at pc %u, jumpCount: %u \n", currentByte, currentByte, vm.jumpCount + 1);
+        vm.pc = vm.registers[ins->a];
+        vm.jumpCount++;
+        if (vm.pc >= byteCount) {
+            VM_TRACE("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
+            return true;
+        }
+        VM_CHECK_DYNAMIC_TARGET();
+        if (vm_charge_fuel(vm, currentByte)) return true;
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_JMPF) {
+        VM_TRACE("%2u: JMPF ENCOUNTERED at pc %u, jumpCount: %u\n", currentByte, currentByte, vm.jumpCount + 1);
+        vm.pc = currentByte + vm.registers[ins->a];//relative to the start of this instruction
+        vm.jumpCount++;
+        VM_TRACE("JMPF %u\n", vm.registers[ins->a]);
+        if (vm.pc >= byteCount) {
+            VM_TRACE("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
+            return true;
+        }
+        VM_CHECK_DYNAMIC_TARGET();
+        if (vm_charge_fuel(vm, currentByte)) return true;
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_JMPB) {
+        VM_TRACE("%2u: JMPB ENCOUNTERED at pc %u, jumpCount: %u\n", currentByte, currentByte, vm.jumpCount + 1);
+        vm.pc = currentByte - vm.registers[ins->a];//relative to the start of this instruction
+        VM_TRACE("JMPB %u\n", vm.registers[ins->a]);
+        vm.jumpCount++;
+        if (vm.pc >= byteCount) {
+            VM_TRACE("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
+            return true;
+        }
+        VM_CHECK_DYNAMIC_TARGET();
+        if (vm_charge_fuel(vm, currentByte)) return true;
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_EQ) {
+        VM_TRACE("%2u: EQ ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        vm.equalFlag = vm.registers[ins->a] == vm.registers[ins->b];
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_NEQ) {
+        VM_TRACE("%2u: NEQ ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        vm.equalFlag = vm.registers[ins->a] != vm.registers[ins->b];
+        VM_NEXT();
+    }break;
 
-}
+    VM_CASE(OP_GT) {
+        VM_TRACE("%2u: GT ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        vm.equalFlag = vm.registers[ins->a] > vm.registers[ins->b];
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_LT) {
+        VM_TRACE("%2u: LT ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        VM_TRACE("$%d < $%d = %d < %d\n", ins->a, ins->b, vm.registers[ins->a], vm.registers[ins->b]);
+        vm.equalFlag = vm.registers[ins->a] < vm.registers[ins->b];
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_GTQ) {
+        VM_TRACE("%2u: GTQ ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        vm.equalFlag = vm.registers[ins->a] >= vm.registers[ins->b];
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_LTQ) {
+        VM_TRACE("%2u: LTQ ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        vm.equalFlag = vm.registers[ins->a] <= vm.registers[ins->b];
+        VM_NEXT();
+    }break;
 
+    VM_CASE(OP_JEQ_REG) {
+        VM_TRACE("%2u: JEQ ENCOUNTERED at pc %u, jumpCount: %u   :   ", currentByte, currentByte, vm.jumpCount);
+        s32 target = vm.registers[ins->a];
+        VM_TRACE("JEQ %u, equalFlag: %d\n", target, vm.equalFlag);
+        if (vm.equalFlag) {
+            vm.equalFlag = false;
+            vm.jumpCount++;
+            VM_TRACE("equalFlag is TRUE, JUMPING!\n");
+            vm.pc = target;
+            if (vm.pc >= byteCount) {
+                printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+                return true;
+            }
+            VM_CHECK_DYNAMIC_TARGET();
+            if (vm_charge_fuel(vm, currentByte)) return true;
+        }
+        else {
+            vm.equalFlag = false;
+            VM_TRACE("equalFlag is FALSE, not jumping\n");
+        }
 
+        VM_NEXT();
+    }break;
 
-inline bool isAtEnd(Scanner* scanner) {
-    return (*scanner->current == '\0');
-}
+    //ALOC $size $dst, puts the address of size bytes of heap in $dst, pages only show up once they're touched
+    VM_CASE(OP_ALOC) {
+        s32 size = vm.registers[ins->a];
+        u32 address = size > 0 ? vm_heap_alloc(vm, (u32)size) : 0;
+        if (!address) {
+            printf("CANNOT ALLOCATE %d BYTES, %u OF %u IN USE\n", size, vm.heapTop, vm.memCap);
+            vmError(vm, "OUT OF MEMORY", currentByte);
+            return true;
+        }
+        vm.registers[ins->b] = address;
+        VM_TRACE("%2u: ALOC ENCOUNTERED at pc %u, %d bytes at %d\n", currentByte, currentByte, size, vm.registers[ins->b]);
+        VM_NEXT();
+    }break;
 
-inline char charPeek(Scanner* scanner) {
-    return *scanner->current;
-}
+    VM_CASE(OP_INC) {
+        if (!Verified) { Assert(ins->a >= 0 && ins->a < 32); }
+        vm.registers[ins->a]++;
+        VM_TRACE("%2u: INC ENCOUNTERED at pc %u, vm.registers[$%u] is now %d\n", currentByte, currentByte, ins->a, vm.registers[ins->a]);
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_DEC) {
+        if (!Verified) { Assert(ins->a >= 0 && ins->a < 32); }
+        vm.registers[ins->a]--;
+        VM_TRACE("%2u: DEC ENCOUNTERED at pc %u, vm.registers[$%u] is now %d\n", currentByte, currentByte, ins->a, vm.registers[ins->a]);
+        VM_NEXT();
+    }break;
 
+    //LOAD [$0 + 4] [$1]
+    VM_CASE(OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR) {
+        VM_TRACE("%2u: LOAD REG ADDR TO OFFSET REG ADDR ENCOUNTERED at pc %u :    ", currentByte, currentByte);
+        s32 dst = vm.registers[ins->a] + ins->imm;
+        s32 src = vm.registers[ins->b];
+        VM_ADDRESS(dstByte, dst, currentByte, "LOAD memory offset addressing error!\n");
+        VM_ADDRESS(srcByte, src, currentByte, "LOAD memory addressing error!\n");
+        *dstByte = *srcByte;
+
+        VM_TRACE("LOAD [$%u + %u] [$%u]\n", ins->a, ins->imm, ins->b);
+        VM_NEXT();
+    }break;
 
-static bool TOK_match(Scanner* scanner, char expected) {
-    if (isAtEnd(scanner))return false;
-    if (*scanner->current != expected) return false;
-    scanner->current++;
-    return true;
-}
+    //LOAD $0 [$1 + 4]
+    VM_CASE(OP_LOAD_OFFSET_REG_ADDR_TO_REG) {
+        VM_TRACE("%2u: LOAD OFFSET REG ADDR TO REG ENCOUNTERED at pc %u :    ", currentByte, currentByte);
+        s32 src = vm.registers[ins->b] + ins->imm;
+        VM_ADDRESS(srcByte, src, currentByte, "LOAD memory offset addressing error!\n");
+        vm.registers[ins->a] = *srcByte;
+        VM_TRACE("LOAD $%u [$%u + %u]\n", ins->a, ins->b, ins->imm);
+        VM_NEXT();
+    }break;
+    //LOAD [$1 + 4] $0
+    VM_CASE(OP_LOAD_REG_TO_OFFSET_REG_ADDR) {
+        VM_TRACE("%2u: OP_LOAD_REG_TO_OFFSET_REG_ADDR ENCOUNTERED at pc %u :    ", currentByte, currentByte);
+        s32 dst = vm.registers[ins->a] + ins->imm;
+        VM_ADDRESS(dstByte, dst, currentByte, "LOAD memory offset addressing error!\n");
+        *dstByte = vm.registers[ins->b];
+        VM_TRACE("LOAD [$%u + %u] $%u \n", ins->a, ins->imm, ins->b);
+        VM_NEXT();
+    }break;
 
-static Token makeToken(Scanner* scanner, TokenTypes type) {
-    printf("making token: %24s on line %d\n", tok_to_str(type), scanner->line);
-    Token token;
-    token.type = type;
-    token.start = scanner->start;
-    token.length = (int)(scanner->current - scanner->start);
-    token.line = scanner->line;
-    return token;
-}
+    VM_CASE(OP_LOAD_REG_TO_REG_ADDR){
+        VM_TRACE("%2u: LOAD REG TO REG ADDR ENCOUNTERED at pc %u :    ", currentByte, currentByte);
+        s32 dst = vm.registers[ins->a] + ins->imm;
+        VM_ADDRESS(dstByte, dst, currentByte, "LOAD memory offset addressing error!\n");
 
-static Token errorToken(Scanner* scanner, const char* message) {
-    Token token;
-    token.type = TOK_ERROR;
-    token.start = message;
-    token.length = (int)strlen(message);
-    token.line = scanner->line;
-    return token;
-}
+        if (!vm_addr(vm, vm.registers[ins->b])) {
+            printf("LOAD memory addressing error!\n");
+            vmMemError(vm, "Attempting to address memory out of bounds!", currentByte, vm.registers[ins->b], vm_mem_size(vm));
+            return true;
+        }
 
+        *dstByte = vm.registers[ins->b];
+        VM_TRACE("LOAD [$%u + %u] $%u \n", ins->a, ins->imm, ins->b);
+        VM_NEXT();
+    }break;
+    //LOAD [$0] [$1 + 4]
+    VM_CASE(OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR) {
+        VM_TRACE("%2u: LOAD OFFSET REG ADDR TO REG ADDR ENCOUNTERED at pc %u :    ", currentByte, currentByte);
+        s32 dst = vm.registers[ins->a];
+        s32 src = vm.registers[ins->b] + ins->imm;
+        VM_ADDRESS(srcByte, src, currentByte, "LOAD memory offset addressing error!\n");
+        VM_ADDRESS(dstByte, dst, currentByte, "LOAD memory addressing error!\n");
+        *dstByte = *srcByte;
+        VM_TRACE("LOAD [$%u] [$%u + %u]\n", ins->a, ins->b, ins->imm);
+        VM_NEXT();
+    }break;
 
 
-static TokenTypes checkKeyword(Scanner* scanner, s32 start, s32 length, const char* rest, TokenTypes type) {
-    int test = scanner->current - scanner->start;
-    if (scanner->current - scanner->start == start + length && memcmp(scanner->start + start, rest, length) == 0) {
-        return type;
-    }
-    return TOK_IDENTIFIER;
-}
+    VM_CASE(OP_LOAD_DATA_ADDR_TO_ADDR) {
+        // __debugbreak();
+        VM_TRACE("%2u: LOAD DATA ADDRESS TO ADDRESS ENCOUNTERED at pc %u   :    ", currentByte, currentByte);
 
-static bool checkReplKeyword(Scanner* scanner, s32 start, s32 length, const char* rest) {
-    if (scanner->current - scanner->start == start + length && memcmp(scanner->start + start, rest, length) == 0) {
-        return true;
-    }
-    return false;
-}
+        s32 val1 = vm.registers[ins->a];
+        s32 val2 = vm.registers[ins->b];
+        VM_ADDRESS(dstByte, val1, currentByte, "LOAD memory addressing error!\n");
+        VM_ADDRESS(srcByte, val2, currentByte, "LOAD memory addressing error!\n");
 
-char scannerAdvance(Scanner* scanner) {
-    scanner->current++;
-    return (scanner->current[-1]);
-}
+        VM_TRACE("LOAD DATA ADDRESS TO ADDRESS [$%u] [$%u] | %c set with %c\n", ins->a, ins->b, *dstByte, *srcByte);
+        *dstByte = *srcByte;
+        VM_NEXT();
+    }break;
 
-inline char charPeekNext(Scanner* scanner) {
-    if (isAtEnd(scanner)) return '\0';
-    return scanner->current[1];
-}
+    VM_CASE(OP_JMP_CONSTANT) {
+        // __debugbreak();
+        VM_TRACE("%2u: JMP CONSTANT ENCOUNTERED at pc %u   :    ", currentByte, currentByte);
+        vm.jumpCount++;
+        VM_TRACE("equalFlag is TRUE, JUMPING!\n");
+        vm.pc = ins->imm;
+        if (!Verified && vm.pc >= byteCount) {
+            printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+            return true;
+        }
+        if (vm_charge_fuel(vm, currentByte)) return true;
+        VM_NEXT();
+    }break;
 
 
-static void skipWhitespace(Scanner* scanner) {
-    for (;;) {
-        char c = charPeek(scanner);
-        switch (c) {
-        case ' ':
-        case '\r':
-        case '\t':
-            scannerAdvance(scanner);
-            break;
-            // case '\n'://handle newline as an explicit token to know when the next instruction begins
-            //     scanner->line++;
-            //     scannerAdvance(scanner);
-            //     break;
-        case ';': {
-            while (charPeek(scanner) != '\n' && !isAtEnd(scanner)) scannerAdvance(scanner);
-        }break;
-        case '/':
-            if (charPeekNext(scanner) == '/') {
-                //a comment goes until the end of the line
-                while (charPeek(scanner) != '\n' && !isAtEnd(scanner)) scannerAdvance(scanner);
-            }
-            else {
-                return;
-            }
-        default:
-            return;
+    VM_CASE(OP_JMP_LABEL) {//need to differentiate from regular constant since labels get backpatched with all 4 bytes
+        // __debugbreak();
+        VM_TRACE("%2u: JMP LABEL ENCOUNTERED at pc %u   :    ", currentByte, currentByte);
+        vm.jumpCount++;
+        VM_TRACE("equalFlag is TRUE, JUMPING!\n");
+        vm.pc = ins->imm;
+        if (!Verified && vm.pc >= byteCount) {
+            printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+            return true;
         }
-    }
-}
-
-
-
-inline bool isHexDigit(char c) {
-    return (c >= '0' && c <= '9') ||
-        (c >= 'a' && c <= 'f') ||
-        (c >= 'A' && c <= 'F');
-}
-
-uint8_t hexCharToValue(char c) {
-    if (c >= '0' && c <= '9') {
-        return c - '0';
-    }
-    if (c >= 'a' && c <= 'f') {
-        return c - 'a' + 10;
-    }
-    if (c >= 'A' && c <= 'F') {
-        return c - 'A' + 10;
-    }
-    return 0;//should never happen if isHexDigit is checked first
-}
+        if (vm_charge_fuel(vm, currentByte)) return true;
+        VM_NEXT();
+    }break;
 
-int parseHex(Scanner* scanner, VM* vm) {
-    u8 hexVals[4] = {};
-    for (u32 i = 0; i < 4; i++) {
-        skipWhitespace(scanner);
-        if (isHexDigit(*scanner->current) && isHexDigit(*(scanner->current + 1))) {
-            hexVals[i] = (hexCharToValue(*scanner->current) << 4) | hexCharToValue(*(scanner->current + 1));
-            scanner->current += 2;
+    VM_CASE(OP_JEQ_CONSTANT) {
+        // __debugbreak();
+        VM_TRACE("%2u: JEQ ENCOUNTERED at pc %u, jumpCount: %u   :    ", currentByte, currentByte, vm.jumpCount);
+        VM_TRACE("JEQ %u, equalFlag: %d, target: %d\n", ins->imm, vm.equalFlag, ins->imm);
+        if (vm.equalFlag) {
+            vm.equalFlag = false;
+            vm.jumpCount++;
+            VM_TRACE("equalFlag is TRUE, JUMPING!\n");
+            vm.pc = ins->imm;
+            if (!Verified && vm.pc >= byteCount) {
+                printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+                return true;
+            }
+            if (vm_charge_fuel(vm, currentByte)) return true;
         }
         else {
-            return -1;
+            vm.equalFlag = false;
+            VM_TRACE("equalFlag is FALSE, not jumping\n");
         }
-    }
-    memcpy(vm->bytecode + vm->byteCount, hexVals, sizeof(u8) * 4);
-    vm->byteCount += 4;
-
-    return 0;
-}
 
-static TokenTypes InstructionType(Scanner* scanner) {
-    switch (scanner->start[0]) {
+        VM_NEXT();
+    }break;
 
-    case 'A': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'L': return checkKeyword(scanner, 2, 2, "OC", TOK_ALOC);
-            case 'D': return checkKeyword(scanner, 2, 1, "D", TOK_ADD);
+    VM_CASE(OP_JNE_CONSTANT) {
+        // __debugbreak();
+        VM_TRACE("%2u: JNE ENCOUNTERED at pc %u, jumpCount: %u   :    ", currentByte, currentByte, vm.jumpCount);
+        VM_TRACE("JNE %u, equalFlag: %d, target: %d\n", ins->imm, vm.equalFlag, ins->imm);
+        if (!vm.equalFlag) {
+            vm.jumpCount++;
+            VM_TRACE("equalFlag is FALSE, JUMPING!\n");
+            vm.pc = ins->imm;
+            if (!Verified && vm.pc >= byteCount) {
+                printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+                return true;
             }
+            if (vm_charge_fuel(vm, currentByte)) return true;
+        }
+        else {
+            vm.equalFlag = false;
+            VM_TRACE("equalFlag is FALSE, not jumping\n");
         }
+        VM_NEXT();
     }break;
-    case 'a': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'l': return checkKeyword(scanner, 2, 2, "oc", TOK_ALOC);
-            case 'd': return checkKeyword(scanner, 2, 1, "d", TOK_ADD);
+
+    VM_CASE(OP_JEQ_REG_TO_REG_CONSTANT) {
+        // __debugbreak();
+        VM_TRACE("%2u: JEQ REG TO REG ENCOUNTERED at pc %u, jumpCount: %u   :    ", currentByte, currentByte, vm.jumpCount);
+        vm.equalFlag = false;
+        if (vm.registers[ins->a] == vm.registers[ins->b]) {
+            vm.jumpCount++;
+            VM_TRACE("$%d == $%d, JUMPING!\n", ins->a, ins->b);
+            vm.pc = ins->imm;
+            if (!Verified && vm.pc >= byteCount) {
+                printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+                return true;
             }
+            if (vm_charge_fuel(vm, currentByte)) return true;
+        }
+        else {
+            VM_TRACE("$%d != $%d, not jumping!\n", ins->a, ins->b);
         }
+
+        VM_NEXT();
     }break;
 
-    case 'C': return checkKeyword(scanner, 1, 3, "ALL", TOK_CALL);
-    case 'c': return checkKeyword(scanner, 1, 3, "all", TOK_CALL);
+    VM_CASE(OP_EQ_CONST_TO_REG) {
+        VM_TRACE("%2u: OP_EQ_CONST_TO_REG ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        vm.equalFlag = vm.registers[ins->a] == ins->imm;
+        VM_NEXT();
+    }break;
 
+    VM_CASE(OP_EQ_INDIRECT_REG_TO_REG) {
+        VM_TRACE("%2u: OP_EQ_INDIRECT_REG_TO_REG ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        s32 val1 = vm.registers[ins->a];
+        VM_ADDRESS(byte, val1, currentByte, "EQ memory addressing error!\n");
 
+        vm.equalFlag = *byte == vm.registers[ins->b];
+        VM_NEXT();
+    }break;
 
-    case 'D': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'I': return checkKeyword(scanner, 2, 1, "V", TOK_DIV);
-            case 'E': return checkKeyword(scanner, 2, 1, "C", TOK_DEC);
-            }
+    VM_CASE(OP_PRT_ADDRESS) {
+        // __debugbreak();
+        VM_TRACE("%2u: PRT ADDRESS ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        s32 val1 = vm.registers[ins->a];
+        //a byte at a time, a heap string can run across pages
+        printf("PRT: ");
+        for (u8* c = vm_addr(vm, val1); c && *c; c = vm_addr(vm, ++val1)) putchar(*c);
+        printf("\n");
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_PRT_REG) {
+        // __debugbreak();
+        VM_TRACE("%2u: PRT REG ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        s32 val1 = vm.registers[ins->a];
+        printf("PRT: %d\n", val1);
+        VM_NEXT();
+    }break;
+                   //TODO: the way we manipulate the stack will not port to big endian hardware, will need to test on it if we ever need to 
+    VM_CASE(OP_PUSH_REG) {
+        u32 sp = vm.registers[REGSP];
+        VM_STACK_CHECK(sp, sp, "PUSH ERROR! STACK OVERFLOW!");
+        *VM_STACK_SLOT(sp) = vm.registers[ins->a];
+        vm.registers[REGSP] = sp - 4;//move the stack in sections of 4 bytes
+        VM_TRACE("%2u: PUSH ENCOUNTERED at pc %u, pushed %d onto stack\n", currentByte, currentByte, vm.registers[ins->a]);
+
+        VM_NEXT();
+    }break;
+    VM_CASE(OP_POP_REG) {
+        u32 sp = vm.registers[REGSP];
+        VM_STACK_CHECK(sp + 4, sp + 4, "POP ERROR! STACK UNDERFLOW!");
+        vm.registers[REGSP] = sp + 4;//move the stack in sections of 4 bytes
+        vm.registers[ins->a] = *VM_STACK_SLOT(sp + 4);
+        VM_TRACE("%2u: POP ENCOUNTERED at pc %u, popped %d onto $%u\n", currentByte, currentByte, vm.registers[ins->a], ins->a);
+
+        VM_NEXT();
+    }break;
+
+    //PUSH $a $b ..., lowest register first (highest address) so a POP with the same registers restores them
+    VM_CASE(OP_PUSH_MASK) {
+        if (!Verified) { Assert(stackMaskInRange(*ins)); }
+        u32 sp = vm.registers[REGSP];
+        VM_STACK_CHECK(sp - 4 * (ins->c - 1), sp, "PUSH ERROR! STACK OVERFLOW!");
+        u32 at = sp;
+        for (u32 reg = ins->a, mask = ins->imm; mask; reg++, mask >>= 1) {
+            if (!(mask & 1)) continue;
+            *VM_STACK_SLOT(at) = vm.registers[reg];
+            at -= 4;
         }
+        vm.registers[REGSP] = at;
+        VM_TRACE("%2u: PUSH ENCOUNTERED at pc %u, pushed %u registers from $%u onto stack\n", currentByte, currentByte, ins->c, ins->a);
+        VM_NEXT();
     }break;
-    case 'd': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'i': return checkKeyword(scanner, 2, 1, "v", TOK_DIV);
-            case 'e': return checkKeyword(scanner, 2, 1, "c", TOK_DEC);
-            }
+    //the stack pointer moves first, so popping into $31 wins like it does for the single register POP
+    VM_CASE(OP_POP_MASK) {
+        if (!Verified) { Assert(stackMaskInRange(*ins)); }
+        u32 sp = vm.registers[REGSP];
+        u32 at = sp + 4 * ins->c;
+        VM_STACK_CHECK(sp + 4, at, "POP ERROR! STACK UNDERFLOW!");
+        vm.registers[REGSP] = at;
+        for (u32 reg = ins->a, mask = ins->imm; mask; reg++, mask >>= 1) {
+            if (!(mask & 1)) continue;
+            vm.registers[reg] = *VM_STACK_SLOT(at);
+            at -= 4;
         }
+        VM_TRACE("%2u: POP ENCOUNTERED at pc %u, popped %u registers from $%u\n", currentByte, currentByte, ins->c, ins->a);
+        VM_NEXT();
     }break;
 
-    case 'E': return checkKeyword(scanner, 1, 1, "Q", TOK_EQ);
-    case 'e': return checkKeyword(scanner, 1, 1, "q", TOK_EQ);
+    //ENTER #n is PUSH $30, LOAD $30 $31 and n bytes of locals below that in one dispatch, so [$30 + k] reaches the same
+    //arguments it did with the long form
+    VM_CASE(OP_ENTER) {
+        u32 sp = vm.registers[REGSP];
+        VM_STACK_CHECK(sp, sp, "PUSH ERROR! STACK OVERFLOW!");
+        *VM_STACK_SLOT(sp) = vm.registers[REGFP];
+        vm.registers[REGFP] = sp - 4;
+        vm.registers[REGSP] = sp - 4 - ins->imm;
+        VM_TRACE("%2u: ENTER ENCOUNTERED at pc %u, frame at %u with %d bytes of locals\n", currentByte, currentByte, sp - 4, ins->imm);
+        VM_NEXT();
+    }break;
+    //LOAD $31 $30 + POP $30
+    VM_CASE(OP_LEAVE) {
+        u32 fp = vm.registers[REGFP];
+        VM_STACK_CHECK(fp + 4, fp + 4, "POP ERROR! STACK UNDERFLOW!");
+        vm.registers[REGSP] = fp + 4;
+        vm.registers[REGFP] = *VM_STACK_SLOT(fp + 4);
+        VM_TRACE("%2u: LEAVE ENCOUNTERED at pc %u, frame pointer back to %d\n", currentByte, currentByte, vm.registers[REGFP]);
+        VM_NEXT();
+    }break;
 
+    VM_CASE(OP_CALL) {
+        VM_TRACE("%2u: CALL ENCOUNTERED at pc %u\n", currentByte, currentByte);
 
-    case 'f': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {}
-        }
-    }break;
+        //push next instruction location to the stack and then jump
+        u32 sp = vm.registers[REGSP];
+        VM_STACK_CHECK(sp, sp, "PUSH ERROR! STACK OVERFLOW!");
+        *VM_STACK_SLOT(sp) = currentByte + 4;
+        vm.registers[REGSP] = sp - 4;//move the stack in sections of 4 bytes
 
 
-    case 'G': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'T': {
-                if (scanner->current - scanner->start == 2) {
-                    return TOK_GT;
-                }
-                if (scanner->current - scanner->start == 3) {
-                    switch (scanner->start[2]) {
-                    case 'Q': return TOK_GTQ;
-                    }
-                }
-            }
-            }
+        vm.pc = ins->imm;
+        vm.jumpCount++;
+        if (!Verified && vm.pc >= byteCount) {
+            printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
+            return true;
         }
+        if (vm_charge_fuel(vm, currentByte)) return true;
+
+        VM_NEXT();
     }break;
 
+    VM_CASE(OP_RET) {
+        VM_TRACE("%2u: RET ENCOUNTERED at pc %u\n", currentByte, currentByte);
 
-    case 'g': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 't': {
-                if (scanner->current - scanner->start == 2) {
-                    return TOK_GT;
-                }
-                if (scanner->current - scanner->start == 3) {
-                    switch (scanner->start[2]) {
-                    case 'q': return TOK_GTQ;
-                    }
-                }
-            }
-            }
-        }
-    }break;
+        u32 sp = vm.registers[REGSP];
+        VM_STACK_CHECK(sp + 4, sp + 4, "POP ERROR! STACK UNDERFLOW!");
+        vm.registers[REGSP] = sp + 4;//move the stack in sections of 4 bytes
 
-    case 'H': return checkKeyword(scanner, 1, 2, "LT", TOK_HLT);
-    case 'h': return checkKeyword(scanner, 1, 2, "lt", TOK_HLT);
+        u32 target = *VM_STACK_SLOT(sp + 4);
 
-    case 'I': return checkKeyword(scanner, 1, 2, "NC", TOK_INC);
-    case 'i': return checkKeyword(scanner, 1, 2, "nc", TOK_INC);
+        //do we need to increment the jump count for returns?
+        vm.pc = target;
+        vm.jumpCount++;
+        if (vm.pc >= byteCount) {
+            printf("JUMPED TO INVALID MEMORY %u, EXITING\n", vm.pc);
+            vmError(vm, "JUMPED TO INVALID MEMORY", currentByte);
+            return true;
+        }
+        VM_CHECK_DYNAMIC_TARGET();
+        if (vm_charge_fuel(vm, currentByte)) return true;
 
 
 
-    case 'J': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'M': {
-                if (scanner->current - scanner->start > 2) {
-                    switch (scanner->start[2]) {
-                    case 'P': {
-                        // Base JMP instruction
-                        if (scanner->current - scanner->start == 3) {
-                            return TOK_JMP;
-                        }
-                        // Check for extensions like JMPF or JMPB
-                        if (scanner->current - scanner->start == 4) {
-                            switch (scanner->start[3]) {
-                            case 'F': return TOK_JMPF; // Jump forward
-                            case 'B': return TOK_JMPB; // Jump backward
-                            }
-                        }
-                    }
-                    }
-                }
-            }
-            case 'E': return checkKeyword(scanner, 2, 1, "Q", TOK_JEQ);
-            case 'N': return checkKeyword(scanner, 2, 1, "E", TOK_JNE);
-            }
-        }
-    } break;
-
-    case 'j': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'm': {
-                if (scanner->current - scanner->start > 2) {
-                    switch (scanner->start[2]) {
-                    case 'p': {
-                        // Base JMP instruction
-                        if (scanner->current - scanner->start == 3) {
-                            return TOK_JMP;
-                        }
-                        // Check for extensions like JMPF or JMPB
-                        if (scanner->current - scanner->start == 4) {
-                            switch (scanner->start[3]) {
-                            case 'f': return TOK_JMPF; // Jump forward
-                            case 'b': return TOK_JMPB; // Jump backward
-                            }
-                        }
-                    }
-                    }
-                }
-            }
-            case 'e': return checkKeyword(scanner, 2, 1, "q", TOK_JEQ);
-            case 'n': return checkKeyword(scanner, 2, 1, "e", TOK_JNE);
+        VM_NEXT();
+    }break;
 
-            }
+    //FREE $addr, gives back a block from ALOC
+    VM_CASE(OP_FREE) {
+        VM_TRACE("%2u: FREE ENCOUNTERED at pc %u, freeing %d\n", currentByte, currentByte, vm.registers[ins->a]);
+        if (!vm_heap_free(vm, (u32)vm.registers[ins->a])) {
+            printf("FREE of %d, which isn't a live ALOC block\n", vm.registers[ins->a]);
+            vmError(vm, "BAD FREE", currentByte);
+            return true;
         }
-    } break;
-
+        VM_NEXT();
+    }break;
 
-    case 'L': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'O': return checkKeyword(scanner, 2, 2, "AD", TOK_LOAD);
-            case 'T': {
-                if (scanner->current - scanner->start == 2) {
-                    return TOK_LT;
-                }
-                if (scanner->current - scanner->start == 3) {
-                    switch (scanner->start[2]) {
-                    case 'Q': return TOK_LTQ;
-                    }
-                }
-            }
-            }
+    VM_CASE(OP_SYSCALL) {
+        if (!Verified && (u32)ins->imm >= vmHost.count) {
+            vmError(vm, "UNKNOWN HOST FUNCTION!", currentByte);
+            return true;
         }
+        VMHostFunction& host = vmHost.functions[ins->imm];
+        VM_TRACE("%2u: SYSCALL ENCOUNTERED at pc %u, calling %s\n", currentByte, currentByte, host.name);
+        if (host.effect) vm_effect_push(vm, host); //the common case never leaves the interpreter
+        else host.fn(vm, host.user);
+        if (vm.status != VM_RUNNING) return true; //it raised an error or wants the rest of the frame back
+        VM_NEXT();
     }break;
-    case 'l': {
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'o': return checkKeyword(scanner, 2, 2, "ad", TOK_LOAD);
-            case 't': {
-                if (scanner->current - scanner->start == 2) {
-                    return TOK_LT;
-                }
-                if (scanner->current - scanner->start == 3) {
-                    switch (scanner->start[2]) {
-                    case 'q': return TOK_LTQ;
-                    }
-                }
-            }
-            }
+    //both leave pc on the next instruction, so resuming carries on as if the frame boundary wasn't there
+    VM_CASE(OP_YIELD) {
+        VM_TRACE("%2u: YIELD ENCOUNTERED at pc %u\n", currentByte, currentByte);
+        vm.status = VM_YIELDED;
+        return true;
+    }break;
+    VM_CASE(OP_WAIT) {
+        VM_TRACE("%2u: WAIT ENCOUNTERED at pc %u, sleeping %d ticks\n", currentByte, currentByte, ins->imm);
+        vm.wakeTick = (u32)ins->imm;
+        vm.status = VM_WAITING;
+        return true;
+    }break;
+    VM_CASE(OP_WAIT_EVENT) {
+        VM_TRACE("%2u: WAIT_EVENT ENCOUNTERED at pc %u, sleeping until event %d\n", currentByte, currentByte, ins->imm);
+        if (!Verified && ins->imm >= VM_MAX_EVENTS) {
+            vmError(vm, "EVENT ID OUT OF RANGE!", currentByte);
+            return true;
         }
+        vm.waitEvent = (u32)ins->imm;
+        vm.status = VM_WAITING_EVENT;
+        return true;
     }break;
+                   // case OP_EXAMPLE:{
+                   //     VM_NEXT();
+                   // }break;
 
+    VM_CASE(OP_END) {
+        VM_TRACE("%2u: END OF PROGRAM\n", currentByte);
+        vm.pc = currentByte; //leave pc on the end like running off it does, the REPL appends there and carries on
+        return true;
+    }break;
 
+    //superinstructions, see vm_fuse
+    VM_SUPER_CMP_JMP(OP_SUPER_EQ_JMP, ==, "EQ")
+    VM_SUPER_CMP_JMP(OP_SUPER_NEQ_JMP, !=, "NEQ")
+    VM_SUPER_CMP_JMP(OP_SUPER_GT_JMP, >, "GT")
+    VM_SUPER_CMP_JMP(OP_SUPER_LT_JMP, <, "LT")
+    VM_SUPER_CMP_JMP(OP_SUPER_GTQ_JMP, >=, "GTQ")
+    VM_SUPER_CMP_JMP(OP_SUPER_LTQ_JMP, <=, "LTQ")
+    VM_SUPER_LOAD_ALU(OP_SUPER_LOAD_ADD, 1, +, "LOAD + ADD")
+    VM_SUPER_LOAD_ALU(OP_SUPER_LOAD_SUB, 1, -, "LOAD + SUB")
+    VM_SUPER_LOAD_ALU(OP_SUPER_LOAD_MUL, 1, *, "LOAD + MUL")
+    VM_SUPER_LOAD_ALU(OP_SUPER_LOAD_LOAD_ADD, 2, +, "LOAD + LOAD + ADD")
+    VM_SUPER_LOAD_ALU(OP_SUPER_LOAD_LOAD_SUB, 2, -, "LOAD + LOAD + SUB")
+    VM_SUPER_LOAD_ALU(OP_SUPER_LOAD_LOAD_MUL, 2, *, "LOAD + LOAD + MUL")
 
-    case 'M': return checkKeyword(scanner, 1, 2, "UL", TOK_MUL);
-    case 'm': return checkKeyword(scanner, 1, 2, "ul", TOK_MUL);
-
-    case 'N': return checkKeyword(scanner, 1, 2, "EQ", TOK_NEQ);
-    case 'n': return checkKeyword(scanner, 1, 2, "eq", TOK_NEQ);
-
-    case 'P':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'O': return checkKeyword(scanner, 2, 1, "P", TOK_POP);
-            case 'R': return checkKeyword(scanner, 2, 1, "T", TOK_PRT);
-            case 'U': return checkKeyword(scanner, 2, 2, "SH", TOK_PUSH);
-            }
-        }break;
-    case 'p':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'o': return checkKeyword(scanner, 2, 1, "p", TOK_POP);
-            case 'r': return checkKeyword(scanner, 2, 1, "t", TOK_PRT);
-            case 'u': return checkKeyword(scanner, 2, 2, "sh", TOK_PUSH);
-            }
-        }break;
 
-    case 'R':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'A': return checkKeyword(scanner, 2, 1, "W", TOK_RAW);
-            case 'E': {
-                if (scanner->current - scanner->start > 2) {
-                    switch (scanner->start[2]) {
-                    case 'T': {
-                        if (scanner->current - scanner->start == 3) {
-                            return TOK_RET;
-                        }
-                    }break;
-
-                    case 'S': return checkKeyword(scanner, 3, 1, "B", TOK_RESB);
-                    }
-                }
-            }break;
-            }
-        }break;
-    case 'r':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'a': return checkKeyword(scanner, 2, 1, "w", TOK_RAW);
-            case 'e': {
-                if (scanner->current - scanner->start > 2) {
-                    switch (scanner->start[2]) {
-                    case 't': {
-                        if (scanner->current - scanner->start == 3) {
-                            return TOK_RET;
-                        }
-                    }break;
-
-                    case 's': return checkKeyword(scanner, 3, 1, "b", TOK_RESB);
-                    }
-                }
-            }break;
-            }
-        }break;
+    default:
+#if VM_COMPUTED_GOTO
+    label_default:
+#endif
+        printf("UNKNOWN OPCODE! %u %s\n", ins->op, opcodeStr((Opcode)ins->op));
+        Assert(!"invalid opcode!");
+        vm.status = VM_ERROR;
+        return true;
+    }
+}
 
+template<bool Trace, bool Verified, bool Guarded = false>
+void vm_run_engine(Context& vm, Scanner* scanner) {
+    bool isDone = false;
+    vm.instructionsExecuted = 0;
+    while (!isDone) {
 
-    case 'S':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'U': return checkKeyword(scanner, 2, 1, "B", TOK_SUB);
-            case 'Y': return checkKeyword(scanner, 2, 5, "SCALL", TOK_SYSCALL);
-            }
-        }
-    case 's':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'u': return checkKeyword(scanner, 2, 1, "b", TOK_SUB);
-            case 'y': return checkKeyword(scanner, 2, 5, "scall", TOK_SYSCALL);
-            }
+        if(Trace && scanner){
+            printf("EXECUTION COUNT: %d || ", vm.instructionsExecuted);
+            printScannerLine(scanner, (vm.pc/4)+1);
         }
 
-    case 't':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            }
-        }
+        isDone = executeInstruction<Trace, false, Verified, Guarded>(vm);
+        
+        vm.instructionsExecuted++;
     }
+}
+
+//the whole program runs inside a single executeInstruction call, handlers dispatch to each other
+template<bool Verified, bool Guarded = false>
+void vm_run_threaded(Context& vm) {
+#if VM_COMPUTED_GOTO
+    vm.instructionsExecuted = 0;
+    executeInstruction<false, true, Verified, Guarded>(vm);
+#else
+    vm_run_engine<false, Verified, Guarded>(vm, NULL);
+#endif
+}
 
-    return TOK_IDENTIFIER;
+#if VM_GUARD_PAGES
+//switch/threaded engines without address checks, an access outside the instance's memory lands in the PROT_NONE part of
+//the mapping and the SIGSEGV handler jumps back here. the handler that faulted had already moved pc past itself, like
+//the checked engines leave it after a memory error
+template<bool Verified>
+void vm_run_guarded(Context& vm, bool threaded) {
+    VMGuardTrap trap;
+    trap.base = vm.guardMem;
+    VMGuardTrap* outer = vmGuardTrap;
+    vmGuardTrap = &trap;
+    if (!sigsetjmp(trap.jump, 0)) {
+        if (threaded) vm_run_threaded<Verified, true>(vm);
+        else          vm_run_engine<false, Verified, true>(vm, NULL);
+    }
+    else {
+        printf("guard page fault!\n");
+        vmMemError(vm, "Attempting to address memory out of bounds!", vm.pc - 4, (s32)trap.fault, vm_mem_size(vm));
+    }
+    vmGuardTrap = outer;
 }
+#endif
 
 
+//JIT
+//x86-64 template JIT, every instruction of a verified program becomes one fixed chunk of machine code
+//rbx holds the VM (registers are at its start), r12 the instance memory, r13 the stack page (less VM_STACK_BASE so a stack
+//address indexes it directly), r14 the table of native instruction addresses
+//the generated code keeps the same pc/fuel/flag state in the VM the interpreter does, so either can pick up where the other stopped
+//anything without a template (DIV, PRT, ...) and any guard that fails exits to the host, which runs that one instruction
+//on the interpreter and jumps back in, so I/O and errors behave exactly like the interpreter's. SYSCALL calls the host
+//function directly
+#if VM_JIT
+
+enum jit_exit {
+    JIT_EXIT_HALT,      //HLT, the end of the program or a host function stopped the run, vm.pc is set
+    JIT_EXIT_YIELD,     //out of fuel, vm.pc is the block it has to resume at
+    JIT_EXIT_INTERPRET, //vm.pc is an instruction the JIT left to the interpreter
+};
 
-static TokenTypes identifierType(Scanner* scanner) {
-    switch (scanner->start[0]) {
-    case 'a': return checkKeyword(scanner, 1, 2, "nd", TOK_AND);
-    case 'e': return checkKeyword(scanner, 1, 3, "lse", TOK_ELSE);
-    case 'f':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'a': return checkKeyword(scanner, 2, 3, "lse", TOK_FALSE);
-            case 'o': return checkKeyword(scanner, 2, 1, "r", TOK_FOR);
-            case 'u': return checkKeyword(scanner, 2, 1, "n", TOK_FUN);
-            }
-        }break;
-    case 'i': return checkKeyword(scanner, 1, 1, "f", TOK_IF);
-    case 'l': return checkKeyword(scanner, 1, 3, "oad", TOK_LOAD);
-    case 'L': return checkKeyword(scanner, 1, 3, "OAD", TOK_LOAD);
-    case 'n': return checkKeyword(scanner, 1, 2, "il", TOK_NIL);
-    case 'o': return checkKeyword(scanner, 1, 1, "r", TOK_OR);
-    case 'p': return checkKeyword(scanner, 1, 4, "rint", TOK_PRINT);
-    case 'R': return checkKeyword(scanner, 1, 3, "AW", TOK_RAW);
-    case 'r':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'e': return checkKeyword(scanner, 1, 4, "turn", TOK_RETURN);
-            case 'a': return checkKeyword(scanner, 1, 2, "aw", TOK_RAW);
-            }
-        }
-    case 't':
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[1]) {
-            case 'r': return checkKeyword(scanner, 2, 2, "ue", TOK_TRUE);
-            }
-        }
-    case 'v': return checkKeyword(scanner, 1, 2, "ar", TOK_VAR);
-    case 'w': return checkKeyword(scanner, 1, 4, "hile", TOK_WHILE);
-    }
+typedef u32 (*vm_jit_fn)(Context* vm, u8* entry);
 
-    return TOK_IDENTIFIER;
-}
+#define JIT_ARENA_SIZE (8 * 1024 * 1024)
+#define JIT_PAGE 4096
+#define JIT_MAX_TEMPLATE 320 //bytes, the longest template (a 16 register PUSH) is well under this
 
-static Token identifier(Scanner* scanner) {
-    while (isAlpha(charPeek(scanner)) || isNumeric(charPeek(scanner))) scannerAdvance(scanner);
-    return makeToken(scanner, identifierType(scanner));
+struct JitArena {
+    u8* base;
+    u32 used;
+    u32 generation;
+};
+static JitArena jitArena;
+
+static bool jitProtect(u8* p, u32 size, bool executable) {
+#if defined(_WIN32)
+    DWORD old;
+    return VirtualProtect(p, size, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &old) != 0;
+#else
+    return mprotect(p, size, executable ? (PROT_READ | PROT_EXEC) : (PROT_READ | PROT_WRITE)) == 0;
+#endif
 }
 
+//hands out writable pages, every program gets its own pages so sealing one never touches another's code
+//when the arena fills up it starts over and bumps the generation, which makes every VM recompile on its next run
+static u8* jitArenaAlloc(u32 size) {
+    if (!jitArena.base) {
+#if defined(_WIN32)
+        jitArena.base = (u8*)VirtualAlloc(NULL, JIT_ARENA_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+        void* p = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        jitArena.base = p == MAP_FAILED ? NULL : (u8*)p;
+#endif
+        if (!jitArena.base) return NULL;
+        jitArena.generation = 1;
+    }
 
-static Token instruction(Scanner* scanner) {
-    while (isAlpha(charPeek(scanner)) || isNumeric(charPeek(scanner))) scannerAdvance(scanner);
-    return makeToken(scanner, InstructionType(scanner));
+    size = (size + JIT_PAGE - 1) & ~(JIT_PAGE - 1);
+    if (size > JIT_ARENA_SIZE) return NULL;
+    u32 start = (jitArena.used + JIT_PAGE - 1) & ~(JIT_PAGE - 1);
+    if (start + size > JIT_ARENA_SIZE) {
+        start = 0;
+        jitArena.generation++;
+    }
+    u8* p = jitArena.base + start;
+    if (!jitProtect(p, size, false)) return NULL;
+    jitArena.used = start + size;
+    return p;
 }
 
-static Token number(Scanner* scanner) {
-    if ((charPeek(scanner) == 'x' || charPeek(scanner) == 'X')) {
-        printf("HEX FOUND!\n");
-        scannerAdvance(scanner);
-        if (!isHexDigit(charPeek(scanner))) {
-            return errorToken(scanner, "Unexpected character in hex value.");
-        }
-        while (isHexDigit(charPeek(scanner))) scannerAdvance(scanner);
-        return makeToken(scanner, TOK_HEX);
-    }
+enum jit_reg { JIT_RAX = 0, JIT_RCX = 1, JIT_RDX = 2, JIT_RBX = 3, JIT_R12 = 12, JIT_R13 = 13, JIT_R14 = 14 };
+enum jit_cc { JIT_CC_B = 0x2, JIT_CC_AE = 0x3, JIT_CC_E = 0x4, JIT_CC_NE = 0x5, JIT_CC_BE = 0x6,
+              JIT_CC_L = 0xC, JIT_CC_GE = 0xD, JIT_CC_LE = 0xE, JIT_CC_G = 0xF };
 
-    while (isNumeric(charPeek(scanner))) scannerAdvance(scanner);
+#define JIT_REG(r) (s32)(offsetof(Context, registers) + 4 * (r))
+#define JIT_FIELD(f) (s32)offsetof(Context, f)
 
-    //look for a fractional part
-    if (charPeek(scanner) == '.' && isNumeric(charPeekNext(scanner))) {
-        //consume the "."
-        scannerAdvance(scanner);
-        while (isNumeric(charPeek(scanner))) scannerAdvance(scanner);
-    }
-    return makeToken(scanner, TOK_NUMBER);
+struct JitFixup {
+    u8* rel;         //rel32 to patch
+    u32 instruction; //instruction it jumps to
+};
+
+struct JitEmitter {
+    u8* at;
+    u8* end;
+    u8* epilogue;
+    u8* yield;
+    u8** entries;
+    JitFixup fixups[MAX_BYTECODE / 4 * 2];
+    u32 fixupCount;
+};
+
+inline void jit8(JitEmitter& e, u8 b) { *e.at++ = b; }
+inline void jit32(JitEmitter& e, u32 v) { memcpy(e.at, &v, 4); e.at += 4; }
+inline void jit64(JitEmitter& e, u64 v) { memcpy(e.at, &v, 8); e.at += 8; }
+
+//op reg, [base + disp32], 32 bit operands, op2 is for the 0F xx opcodes
+inline void jitMem(JitEmitter& e, u8 op, u8 reg, u8 base, s32 disp, bool twoByte = false) {
+    u8 rex = 0x40 | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+    if (rex != 0x40) jit8(e, rex);
+    if (twoByte) jit8(e, 0x0F);
+    jit8(e, op);
+    jit8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4) jit8(e, 0x24);
+    jit32(e, (u32)disp);
 }
 
-static Token string(Scanner* scanner) {
-    while (charPeek(scanner) != '"' && !isAtEnd(scanner)) {
-        if (charPeek(scanner) == '\n'){
-            scanner->line++;
-        } 
-        scannerAdvance(scanner);
-    }
+inline void jitLoadReg(JitEmitter& e, u8 hostReg, u8 vmReg) { jitMem(e, 0x8B, hostReg, JIT_RBX, JIT_REG(vmReg)); }
+inline void jitStoreReg(JitEmitter& e, u8 vmReg, u8 hostReg) { jitMem(e, 0x89, hostReg, JIT_RBX, JIT_REG(vmReg)); }
+inline void jitStoreImm(JitEmitter& e, s32 disp, u32 imm) { jitMem(e, 0xC7, 0, JIT_RBX, disp); jit32(e, imm); }
+inline void jitMovEaxImm(JitEmitter& e, u32 imm) { jit8(e, 0xB8); jit32(e, imm); }
+inline void jitCmpEaxImm(JitEmitter& e, u32 imm) { jit8(e, 0x3D); jit32(e, imm); }
+inline void jitCmpEcxImm(JitEmitter& e, u32 imm) { jit8(e, 0x81); jit8(e, 0xF9); jit32(e, imm); }
+inline void jitSetFlag(JitEmitter& e, u8 cc) { jitMem(e, 0x90 | cc, 0, JIT_RBX, JIT_FIELD(equalFlag), true); }
+inline void jitClearFlag(JitEmitter& e) { jitMem(e, 0xC6, 0, JIT_RBX, JIT_FIELD(equalFlag)); jit8(e, 0); }
+inline void jitTestFlag(JitEmitter& e) { jitMem(e, 0x80, 7, JIT_RBX, JIT_FIELD(equalFlag)); jit8(e, 0); }
+
+inline void jitJmpTo(JitEmitter& e, u8* target) {
+    jit8(e, 0xE9);
+    jit32(e, (u32)(target - (e.at + 4)));
+}
+inline void jitJccTo(JitEmitter& e, u8 cc, u8* target) {
+    jit8(e, 0x0F); jit8(e, 0x80 | cc);
+    jit32(e, (u32)(target - (e.at + 4)));
+}
+//forward jump inside a template, patched with jitPatchHere
+inline u8* jitJccForward(JitEmitter& e, u8 cc) {
+    jit8(e, 0x0F); jit8(e, 0x80 | cc);
+    u8* rel = e.at;
+    jit32(e, 0);
+    return rel;
+}
+inline void jitPatchHere(JitEmitter& e, u8* rel) {
+    u32 v = (u32)(e.at - (rel + 4));
+    memcpy(rel, &v, 4);
+}
+inline void jitJmpInstruction(JitEmitter& e, u32 targetByte) {
+    jit8(e, 0xE9);
+    e.fixups[e.fixupCount].rel = e.at;
+    e.fixups[e.fixupCount].instruction = targetByte / 4;
+    e.fixupCount++;
+    jit32(e, 0);
+}
 
-    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string");
+inline void jitExit(JitEmitter& e, u32 pc, u32 code) {
+    jitStoreImm(e, JIT_FIELD(pc), pc);
+    jitMovEaxImm(e, code);
+    jitJmpTo(e, e.epilogue);
+}
 
-    //the closing quote
-    scannerAdvance(scanner);
-    return makeToken(scanner, TOK_STRING);
+//falls through when the flags say ccOk, otherwise hands instruction currentByte to the interpreter
+//always placed before the instruction changes any state, so the interpreter sees it exactly as it was
+inline void jitGuard(JitEmitter& e, u8 ccOk, u32 currentByte) {
+    jit8(e, 0x70 | ccOk);
+    u8* rel = e.at;
+    jit8(e, 0);
+    jitExit(e, currentByte, JIT_EXIT_INTERPRET);
+    *rel = (u8)(e.at - (rel + 1));
 }
 
+//a taken jump, charges fuel for the block it ends exactly like vm_charge_fuel does
+inline void jitTakeJump(JitEmitter& e, u32 currentByte, u32 target) {
+    jitMem(e, 0xFF, 0, JIT_RBX, JIT_FIELD(jumpCount));        //inc jumpCount
+    jitMovEaxImm(e, currentByte + 4);
+    jitMem(e, 0x2B, JIT_RAX, JIT_RBX, JIT_FIELD(blockStart));  //sub eax, blockStart
+    jit8(e, 0xC1); jit8(e, 0xE8); jit8(e, 2);                  //shr eax, 2
+    jitMem(e, 0x29, JIT_RAX, JIT_RBX, JIT_FIELD(fuel));        //sub fuel, eax
+    jitStoreImm(e, JIT_FIELD(blockStart), target);
+    jitStoreImm(e, JIT_FIELD(pc), target);
+    jitJccTo(e, JIT_CC_LE, e.yield);
+    jitJmpInstruction(e, target);
+}
 
-Token scanToken(Scanner* scanner) {
-    skipWhitespace(scanner);
-    scanner->start = scanner->current;
-    if (isAtEnd(scanner)) {
-        return makeToken(scanner, TOK_EOF);
-    }
+//same thing for a target computed at runtime, eax holds it and has already been checked against the program
+inline void jitTakeDynamicJump(JitEmitter& e, u32 currentByte) {
+    jitMem(e, 0xFF, 0, JIT_RBX, JIT_FIELD(jumpCount));
+    jit8(e, 0xB9); jit32(e, currentByte + 4);                  //mov ecx, imm
+    jitMem(e, 0x2B, JIT_RCX, JIT_RBX, JIT_FIELD(blockStart));
+    jit8(e, 0xC1); jit8(e, 0xE9); jit8(e, 2);                  //shr ecx, 2
+    jitMem(e, 0x29, JIT_RCX, JIT_RBX, JIT_FIELD(fuel));
+    jitMem(e, 0x89, JIT_RAX, JIT_RBX, JIT_FIELD(blockStart));
+    jitMem(e, 0x89, JIT_RAX, JIT_RBX, JIT_FIELD(pc));
+    jitJccTo(e, JIT_CC_LE, e.yield);
+    jit8(e, 0x41); jit8(e, 0xFF); jit8(e, 0x24); jit8(e, 0x46); //jmp [r14 + rax*2], entries are 8 bytes per 4 byte instruction
+}
 
-    char c = scannerAdvance(scanner);
-    //TODO:
-    //could add a check here for slashes/dots/stuff to denote repl commands
+//eax is a jump target read from a register or the stack, anything the interpreter would complain about goes to the interpreter
+inline void jitCheckDynamicTarget(JitEmitter& e, u32 currentByte, u32 byteCount) {
+    jitCmpEaxImm(e, byteCount);
+    jitGuard(e, JIT_CC_B, currentByte);
+    jit8(e, 0xA8); jit8(e, 3); //test al, 3
+    jitGuard(e, JIT_CC_E, currentByte);
+}
 
-    //would probably want a different scanToken function for assembly/higher language parser
-    // if(isAlpha(c)) return identifier(scanner);
+//ecx = SP, checked like VM_STACK_CHECK so the slots a push writes (SP down to SP - 4 * (slots - 1)) are in the stack segment
+inline void jitCheckPush(JitEmitter& e, u32 currentByte, u32 slots = 1) {
+    jitLoadReg(e, JIT_RCX, REGSP);
+    jitCmpEcxImm(e, STACK_START);
+    jitGuard(e, JIT_CC_BE, currentByte);
+    jitMem(e, 0x8B, JIT_RAX, JIT_RBX, JIT_FIELD(stackLimit)); //mov eax, stackLimit
+    jit8(e, 0x05); jit32(e, 4 * (slots - 1));                 //add eax, imm
+    jit8(e, 0x39); jit8(e, 0xC1);                              //cmp ecx, eax
+    jitGuard(e, JIT_CC_AE, currentByte);
+}
 
-    if (isAlpha(c))return instruction(scanner);
-    if (isNumeric(c)) return number(scanner);
+//ecx = SP (or the frame pointer for LEAVE), checked so the slots above it are in the stack segment
+inline void jitCheckPop(JitEmitter& e, u32 currentByte, u32 slots = 1, u8 spReg = REGSP) {
+    jitLoadReg(e, JIT_RCX, spReg);
+    jitCmpEcxImm(e, STACK_START - 4 * slots);
+    jitGuard(e, JIT_CC_BE, currentByte);
+    jitMem(e, 0x8B, JIT_RAX, JIT_RBX, JIT_FIELD(stackLimit));
+    jit8(e, 0x83); jit8(e, 0xE8); jit8(e, 4);                 //sub eax, 4
+    jit8(e, 0x39); jit8(e, 0xC1);                              //cmp ecx, eax
+    jitGuard(e, JIT_CC_AE, currentByte);
+}
 
+//op reg, [r13 + rcx + disp], the stack slot disp bytes from SP
+inline void jitStackSlot(JitEmitter& e, u8 op, u8 reg, s32 disp) {
+    jit8(e, 0x41); jit8(e, op); jit8(e, 0x44 | ((reg & 7) << 3)); jit8(e, 0x0D); jit8(e, (u8)(s8)disp);
+}
 
-    switch (c) {
-    case '(': return makeToken(scanner, TOK_LEFT_PAREN);
-    case ')': return makeToken(scanner, TOK_RIGHT_PAREN);
-    case '{': return makeToken(scanner, TOK_LEFT_BRACE);
-    case '}': return makeToken(scanner, TOK_RIGHT_BRACE);
-    case '[': return makeToken(scanner, TOK_LEFT_BRACKET);
-    case ']': return makeToken(scanner, TOK_RIGHT_BRACKET);
-    case ':': return makeToken(scanner, TOK_COLON);
-    case '@': return makeToken(scanner, TOK_LABEL_USAGE);
-    case ',': return makeToken(scanner, TOK_COMMA);
-    case '.': return makeToken(scanner, TOK_DOT);
-    case '-': return makeToken(scanner, TOK_MINUS);
-    case '+': return makeToken(scanner, TOK_PLUS);
-    case '/': return makeToken(scanner, TOK_SLASH);
-    case '*': return makeToken(scanner, TOK_STAR);
-    case '\n':return makeToken(scanner, TOK_NEWLINE);
+//eax = an address, leaves rdx pointing at its byte, low memory off r12 and the stack segment off r13
+//anything else (heap, out of range) goes to the interpreter
+inline void jitAddress(JitEmitter& e, u32 currentByte) {
+    jitCmpEaxImm(e, MAX_MEM);
+    u8* stack = jitJccForward(e, JIT_CC_AE);
+    jit8(e, 0x49); jit8(e, 0x8D); jit8(e, 0x14); jit8(e, 0x04); //lea rdx, [r12 + rax]
+    jit8(e, 0xE9);
+    u8* done = e.at;
+    jit32(e, 0);
+    jitPatchHere(e, stack);
+    jitMem(e, 0x3B, JIT_RAX, JIT_RBX, JIT_FIELD(stackLimit));  //cmp eax, stackLimit
+    jitGuard(e, JIT_CC_AE, currentByte);
+    jitCmpEaxImm(e, VM_STACK_TOP);
+    jitGuard(e, JIT_CC_B, currentByte);
+    jit8(e, 0x49); jit8(e, 0x8D); jit8(e, 0x54); jit8(e, 0x05); jit8(e, 0); //lea rdx, [r13 + rax]
+    jitPatchHere(e, done);
+}
 
-    case '!':
-        return makeToken(scanner, TOK_match(scanner, '=') ? TOK_BANG_EQUAL : TOK_BANG);
-    case '=':
-        return makeToken(scanner, TOK_match(scanner, '=') ? TOK_EQUAL_EQUAL : TOK_EQUAL);
-    case '<':
-        return makeToken(scanner, TOK_match(scanner, '=') ? TOK_LESS_EQUAL : TOK_LESS);
-    case '>':
-        return makeToken(scanner, TOK_match(scanner, '=') ? TOK_GREATER_EQUAL : TOK_GREATER);
-    case '"': return string(scanner);
+void jitInstruction(JitEmitter& e, Program& vm, const DecodedInstruction& ins, u32 currentByte) {
+    switch (ins.op) {
+    case OP_HLT: {
+        jitExit(e, currentByte + 4, JIT_EXIT_HALT);
+    }break;
+    case OP_LOAD_IMM_TO_REG: {
+        jitStoreImm(e, JIT_REG(ins.a), (u32)ins.imm);
+    }break;
+    case OP_LOAD_REG_TO_REG: {
+        jitLoadReg(e, JIT_RAX, ins.b);
+        jitStoreReg(e, ins.a, JIT_RAX);
+    }break;
+    case OP_ADD_REG_TO_REG:
+    case OP_SUB_REG_TO_REG:
+    case OP_MUL_REG_TO_REG: {
+        jitLoadReg(e, JIT_RAX, ins.a);
+        if (ins.op == OP_ADD_REG_TO_REG) jitMem(e, 0x03, JIT_RAX, JIT_RBX, JIT_REG(ins.b));
+        else if (ins.op == OP_SUB_REG_TO_REG) jitMem(e, 0x2B, JIT_RAX, JIT_RBX, JIT_REG(ins.b));
+        else jitMem(e, 0xAF, JIT_RAX, JIT_RBX, JIT_REG(ins.b), true); //imul
+        jitStoreReg(e, ins.c, JIT_RAX);
+    }break;
+    case OP_EQ:
+    case OP_NEQ:
+    case OP_GT:
+    case OP_LT:
+    case OP_GTQ:
+    case OP_LTQ: {
+        u8 cc = ins.op == OP_EQ ? JIT_CC_E : ins.op == OP_NEQ ? JIT_CC_NE : ins.op == OP_GT ? JIT_CC_G :
+                ins.op == OP_LT ? JIT_CC_L : ins.op == OP_GTQ ? JIT_CC_GE : JIT_CC_LE;
+        jitLoadReg(e, JIT_RAX, ins.a);
+        jitMem(e, 0x3B, JIT_RAX, JIT_RBX, JIT_REG(ins.b)); //cmp
+        jitSetFlag(e, cc);
+    }break;
+    case OP_EQ_CONST_TO_REG: {
+        jitMem(e, 0x81, 7, JIT_RBX, JIT_REG(ins.a));
+        jit32(e, (u32)ins.imm);
+        jitSetFlag(e, JIT_CC_E);
+    }break;
+    case OP_INC: {
+        jitMem(e, 0xFF, 0, JIT_RBX, JIT_REG(ins.a));
+    }break;
+    case OP_DEC: {
+        jitMem(e, 0xFF, 1, JIT_RBX, JIT_REG(ins.a));
+    }break;
 
-    case '`': {
-        printf("MAKE REPL COMMAND HERE!\n");
-    }
-    case '$': return makeToken(scanner, TOK_REGISTER);
-    case '#': return makeToken(scanner, TOK_INSTRUCTION_VALUE);
+    //LOAD $a [$b + imm]
+    case OP_LOAD_OFFSET_REG_ADDR_TO_REG: {
+        jitLoadReg(e, JIT_RAX, ins.b);
+        jit8(e, 0x05); jit32(e, (u32)ins.imm); //add eax, imm
+        jitAddress(e, currentByte);
+        jit8(e, 0x0F); jit8(e, 0xB6); jit8(e, 0x0A); //movzx ecx, byte [rdx]
+        jitStoreReg(e, ins.a, JIT_RCX);
+    }break;
+    //LOAD [$a + imm] $b
+    case OP_LOAD_REG_TO_OFFSET_REG_ADDR: {
+        jitLoadReg(e, JIT_RAX, ins.a);
+        jit8(e, 0x05); jit32(e, (u32)ins.imm);
+        jitAddress(e, currentByte);
+        jitLoadReg(e, JIT_RCX, ins.b);
+        jit8(e, 0x88); jit8(e, 0x0A); //mov byte [rdx], cl
+    }break;
 
-    }
+    case OP_PUSH_REG: {
+        jitCheckPush(e, currentByte);
+        jitLoadReg(e, JIT_RAX, ins.a);
+        jitStackSlot(e, 0x89, JIT_RAX, 0);                          //mov [r13 + rcx], eax
+        jitMem(e, 0x83, 5, JIT_RBX, JIT_REG(REGSP)); jit8(e, 4);    //sub SP, 4
+    }break;
+    case OP_POP_REG: {
+        jitCheckPop(e, currentByte);
+        jitMem(e, 0x83, 0, JIT_RBX, JIT_REG(REGSP)); jit8(e, 4);    //add SP, 4
+        jitStackSlot(e, 0x8B, JIT_RAX, 4);                          //mov eax, [r13 + rcx + 4]
+        jitStoreReg(e, ins.a, JIT_RAX);
+    }break;
+    case OP_PUSH_MASK: {
+        jitCheckPush(e, currentByte, ins.c);
+        s32 disp = 0;
+        for (u32 reg = ins.a, mask = ins.imm; mask; reg++, mask >>= 1) {
+            if (!(mask & 1)) continue;
+            jitLoadReg(e, JIT_RAX, reg);
+            jitStackSlot(e, 0x89, JIT_RAX, disp);
+            disp -= 4;
+        }
+        jitMem(e, 0x83, 5, JIT_RBX, JIT_REG(REGSP)); jit8(e, 4 * ins.c);
+    }break;
+    case OP_POP_MASK: {
+        jitCheckPop(e, currentByte, ins.c);
+        jitMem(e, 0x83, 0, JIT_RBX, JIT_REG(REGSP)); jit8(e, 4 * ins.c);
+        s32 disp = 4 * ins.c;
+        for (u32 reg = ins.a, mask = ins.imm; mask; reg++, mask >>= 1) {
+            if (!(mask & 1)) continue;
+            jitStackSlot(e, 0x8B, JIT_RAX, disp);
+            jitStoreReg(e, reg, JIT_RAX);
+            disp -= 4;
+        }
+    }break;
+    case OP_ENTER: {
+        jitCheckPush(e, currentByte);
+        jitLoadReg(e, JIT_RAX, REGFP);
+        jitStackSlot(e, 0x89, JIT_RAX, 0);
+        jit8(e, 0x8D); jit8(e, 0x41); jit8(e, 0xFC);                //lea eax, [rcx - 4]
+        jitStoreReg(e, REGFP, JIT_RAX);
+        jit8(e, 0x2D); jit32(e, (u32)ins.imm);                      //sub eax, locals
+        jitStoreReg(e, REGSP, JIT_RAX);
+    }break;
+    case OP_LEAVE: {
+        jitCheckPop(e, currentByte, 1, REGFP);
+        jitStackSlot(e, 0x8B, JIT_RAX, 4);
+        jit8(e, 0x8D); jit8(e, 0x49); jit8(e, 0x04);                //lea ecx, [rcx + 4]
+        jitStoreReg(e, REGSP, JIT_RCX);
+        jitStoreReg(e, REGFP, JIT_RAX);
+    }break;
 
-    return errorToken(scanner, "Unexpected character.");
-}
+    case OP_JMP_CONSTANT:
+    case OP_JMP_LABEL: {
+        jitTakeJump(e, currentByte, (u32)ins.imm);
+    }break;
+    case OP_JEQ_CONSTANT:
+    case OP_JNE_CONSTANT: {
+        //either way the flag ends up false
+        jitTestFlag(e);
+        jitClearFlag(e);
+        u8* skip = jitJccForward(e, ins.op == OP_JEQ_CONSTANT ? JIT_CC_E : JIT_CC_NE);
+        jitTakeJump(e, currentByte, (u32)ins.imm);
+        jitPatchHere(e, skip);
+    }break;
+    case OP_JEQ_REG_TO_REG_CONSTANT: {
+        jitClearFlag(e);
+        jitLoadReg(e, JIT_RAX, ins.a);
+        jitMem(e, 0x3B, JIT_RAX, JIT_RBX, JIT_REG(ins.b));
+        u8* skip = jitJccForward(e, JIT_CC_NE);
+        jitTakeJump(e, currentByte, (u32)ins.imm);
+        jitPatchHere(e, skip);
+    }break;
+
+    case OP_JMP:
+    case OP_JMPF:
+    case OP_JMPB: {
+        if (ins.op == OP_JMP) {
+            jitLoadReg(e, JIT_RAX, ins.a);
+        }
+        else if (ins.op == OP_JMPF) {
+            jitLoadReg(e, JIT_RAX, ins.a);
+            jit8(e, 0x05); jit32(e, currentByte); //add eax, imm
+        }
+        else {
+            jitMovEaxImm(e, currentByte);
+            jitMem(e, 0x2B, JIT_RAX, JIT_RBX, JIT_REG(ins.a));
+        }
+        jitCheckDynamicTarget(e, currentByte, vm.byteCount);
+        jitTakeDynamicJump(e, currentByte);
+    }break;
+    case OP_JEQ_REG: {
+        jitTestFlag(e);
+        u8* skip = jitJccForward(e, JIT_CC_E);
+        jitLoadReg(e, JIT_RAX, ins.a);
+        jitCheckDynamicTarget(e, currentByte, vm.byteCount);
+        jitClearFlag(e);
+        jitTakeDynamicJump(e, currentByte);
+        jitPatchHere(e, skip);
+        jitClearFlag(e);
+    }break;
 
+    case OP_CALL: {
+        jitCheckPush(e, currentByte);
+        jitStackSlot(e, 0xC7, 0, 0); jit32(e, currentByte + 4);    //mov dword [r13 + rcx], return address
+        jitMem(e, 0x83, 5, JIT_RBX, JIT_REG(REGSP)); jit8(e, 4);
+        jitTakeJump(e, currentByte, (u32)ins.imm);
+    }break;
+    case OP_RET: {
+        jitCheckPop(e, currentByte);
+        jitStackSlot(e, 0x8B, JIT_RAX, 4);
+        jitCheckDynamicTarget(e, currentByte, vm.byteCount);
+        jitMem(e, 0x83, 0, JIT_RBX, JIT_REG(REGSP)); jit8(e, 4);
+        jitTakeDynamicJump(e, currentByte);
+    }break;
 
+    //the registry never changes an entry once it's handed out, so the function and its user pointer are baked in
+    //pc is stored first so the host function sees what it would on the interpreter
+    case OP_SYSCALL: {
+        VMHostFunction& host = vmHost.functions[ins.imm];
+        jitStoreImm(e, JIT_FIELD(pc), currentByte + 4);
+#if defined(_WIN32)
+        jit8(e, 0x48); jit8(e, 0x89); jit8(e, 0xD9); //mov rcx, rbx
+        jit8(e, 0x48); jit8(e, 0xBA); jit64(e, (u64)host.user); //mov rdx, user
+        jit8(e, 0x48); jit8(e, 0x83); jit8(e, 0xEC); jit8(e, 40); //sub rsp, 40 (shadow space, 16 byte alignment)
+#else
+        jit8(e, 0x48); jit8(e, 0x89); jit8(e, 0xDF); //mov rdi, rbx
+        jit8(e, 0x48); jit8(e, 0xBE); jit64(e, (u64)host.user); //mov rsi, user
+        jit8(e, 0x48); jit8(e, 0x83); jit8(e, 0xEC); jit8(e, 8); //sub rsp, 8 (16 byte alignment)
+#endif
+        jit8(e, 0x48); jit8(e, 0xB8); jit64(e, (u64)host.fn); //mov rax, fn
+        jit8(e, 0xFF); jit8(e, 0xD0); //call rax
+#if defined(_WIN32)
+        jit8(e, 0x48); jit8(e, 0x83); jit8(e, 0xC4); jit8(e, 40); //add rsp, 40
+#else
+        jit8(e, 0x48); jit8(e, 0x83); jit8(e, 0xC4); jit8(e, 8); //add rsp, 8
+#endif
+        jitMem(e, 0x83, 7, JIT_RBX, JIT_FIELD(status)); jit8(e, VM_RUNNING); //cmp dword [rbx + status], VM_RUNNING
+        u8* running = jitJccForward(e, JIT_CC_E);
+        jitMovEaxImm(e, JIT_EXIT_HALT); //it set the status, pc is already past the SYSCALL
+        jitJmpTo(e, e.epilogue);
+        jitPatchHere(e, running);
+    }break;
 
-static void errorAt(Parser* parser, Token* token, const char* message) {
-    if (parser->panicMode) return;
-    parser->panicMode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+    case OP_YIELD: {
+        jitStoreImm(e, JIT_FIELD(status), VM_YIELDED);
+        jitExit(e, currentByte + 4, JIT_EXIT_HALT);
+    }break;
+    case OP_WAIT: {
+        jitStoreImm(e, JIT_FIELD(wakeTick), (u32)ins.imm);
+        jitStoreImm(e, JIT_FIELD(status), VM_WAITING);
+        jitExit(e, currentByte + 4, JIT_EXIT_HALT);
+    }break;
+    case OP_WAIT_EVENT: {
+        jitStoreImm(e, JIT_FIELD(waitEvent), (u32)ins.imm);
+        jitStoreImm(e, JIT_FIELD(status), VM_WAITING_EVENT);
+        jitExit(e, currentByte + 4, JIT_EXIT_HALT);
+    }break;
 
-    if (token->type == TOK_EOF) {
-        fprintf(stderr, " at end");
+    default: {
+        //DIV (divide by zero), PRT (host I/O), ALOC and the rest of the addressing modes
+        jitExit(e, currentByte, JIT_EXIT_INTERPRET);
+    }break;
     }
-    else if (token->type == TOK_ERROR) {
-        //nothing
+}
+
+//compiles the whole program, only verified programs get here so every constant jump target has an entry
+bool vm_jit_compile(Program& vm) {
+    vm.jit.valid = false;
+    if (!vm.verified) return false;
+    if (vm.byteCount > MAX_BYTECODE) return false; //the fixups are sized for the inline code, bigger programs get interpreted
+
+    u32 count = vm.byteCount / 4;
+    u32 tableSize = (count + 1) * sizeof(u8*);
+    u32 size = tableSize + (count + 1) * JIT_MAX_TEMPLATE + 128;
+    u8* base = jitArenaAlloc(size);
+    if (!base) return false;
+
+    static JitEmitter e; //fixups make it too big for the stack
+    e.entries = (u8**)base;
+    e.at = base + tableSize;
+    e.end = base + size;
+    e.fixupCount = 0;
+
+    u8* code = e.at;
+    //prologue, u32 code(VM* vm, u8* entry)
+    jit8(e, 0x53);                          //push rbx
+    jit8(e, 0x41); jit8(e, 0x54);           //push r12
+    jit8(e, 0x41); jit8(e, 0x55);           //push r13
+    jit8(e, 0x41); jit8(e, 0x56);           //push r14
+#if defined(_WIN32)
+    jit8(e, 0x48); jit8(e, 0x89); jit8(e, 0xCB); //mov rbx, rcx
+    jit8(e, 0x4C); jit8(e, 0x8B); jit8(e, 0xA1); jit32(e, JIT_FIELD(memBase)); //mov r12, [rcx + memBase]
+    jit8(e, 0x4C); jit8(e, 0x8B); jit8(e, 0xA9); jit32(e, JIT_FIELD(stack)); //mov r13, [rcx + stack]
+#else
+    jit8(e, 0x48); jit8(e, 0x89); jit8(e, 0xFB); //mov rbx, rdi
+    jit8(e, 0x4C); jit8(e, 0x8B); jit8(e, 0xA7); jit32(e, JIT_FIELD(memBase)); //mov r12, [rdi + memBase]
+    jit8(e, 0x4C); jit8(e, 0x8B); jit8(e, 0xAF); jit32(e, JIT_FIELD(stack)); //mov r13, [rdi + stack]
+#endif
+    jit8(e, 0x49); jit8(e, 0x81); jit8(e, 0xED); jit32(e, VM_STACK_BASE); //sub r13, VM_STACK_BASE
+    jit8(e, 0x49); jit8(e, 0xBE); jit64(e, (u64)e.entries); //mov r14, entries
+#if defined(_WIN32)
+    jit8(e, 0xFF); jit8(e, 0xE2);           //jmp rdx
+#else
+    jit8(e, 0xFF); jit8(e, 0xE6);           //jmp rsi
+#endif
+
+    e.epilogue = e.at;
+    jit8(e, 0x41); jit8(e, 0x5E);           //pop r14
+    jit8(e, 0x41); jit8(e, 0x5D);           //pop r13
+    jit8(e, 0x41); jit8(e, 0x5C);           //pop r12
+    jit8(e, 0x5B);                          //pop rbx
+    jit8(e, 0xC3);                          //ret
+
+    e.yield = e.at; //pc is already stored
+    jitMovEaxImm(e, JIT_EXIT_YIELD);
+    jitJmpTo(e, e.epilogue);
+
+    for (u32 i = 0; i < count; i++) {
+        DecodedInstruction ins;
+        decodeInstruction(vm.bytecode + i * 4, &ins); //base instructions, not the superinstructions in vm.decoded
+        e.entries[i] = e.at;
+        jitInstruction(e, vm, ins, i * 4);
+        Assert(e.at + JIT_MAX_TEMPLATE <= e.end);
     }
-    else {
-        fprintf(stderr, "at '%.*s'", token->length, token->start);
+    e.entries[count] = e.at; //running off the end
+    jitExit(e, vm.byteCount, JIT_EXIT_HALT);
+
+    for (u32 i = 0; i < e.fixupCount; i++) {
+        JitFixup& fixup = e.fixups[i];
+        u32 rel = (u32)(e.entries[fixup.instruction] - (fixup.rel + 4));
+        memcpy(fixup.rel, &rel, 4);
     }
-    fprintf(stderr, ": %s\n", message);
-    parser->hadError = true;
-}
 
-static void error(Parser* parser, const char* message) {
-    errorAt(parser, &parser->previous, message);
-}
+    if (!jitProtect(base, (size + JIT_PAGE - 1) & ~(JIT_PAGE - 1), true)) return false;
 
+    vm.jit.code = code;
+    vm.jit.entries = e.entries;
+    vm.jit.generation = jitArena.generation;
+    vm.jit.valid = true;
+    return true;
+}
 
-static void errorAtCurrent(Parser* parser, const char* message) {
-    errorAt(parser, &parser->current, message);
+//whether the code it has is still in the arena, without compiling. a wrap since it compiled made it stale
+inline bool vm_jit_valid(Program& vm) {
+    return vm.jit.valid && vm.jit.generation == jitArena.generation;
 }
 
+inline bool vm_jit_ready(Program& vm) {
+    if (vm_jit_valid(vm)) return true;
+    return vm_jit_compile(vm);
+}
 
-static void parser_advance(Parser* parser, Scanner* scanner) {
-    parser->previous = parser->current;
+//runs native code until it halts or yields, instructions without a template run on the verified interpreter one at a time
+void vm_run_jit(Context& vm) {
+    if (!vm.stack && !vm_stack_alloc(vm)) { //the native code addresses the stack page directly
+        vm_run_threaded<true>(vm);
+        return;
+    }
+    vm.instructionsExecuted = 0;
+    vm_jit_fn fn = (vm_jit_fn)vm.program->jit.code;
     for (;;) {
-        parser->current = scanToken(scanner);
-        if (parser->current.type != TOK_ERROR)break;
-
-        errorAtCurrent(parser, parser->current.start);
+        u32 exit = fn(&vm, vm.program->jit.entries[vm.pc >> 2]);
+        if (exit == JIT_EXIT_HALT) return;
+        if (exit == JIT_EXIT_YIELD) {
+            vm.status = VM_YIELDED;
+            return;
+        }
 
+        bool isDone = executeInstruction<false, false, true>(vm);
+        vm.instructionsExecuted++;
+        if (isDone) return;
     }
 }
 
-static bool parser_consume(Parser* parser, Scanner* scanner, TokenTypes type, const char* message) {
-    if (parser->current.type == type) {
-        parser_advance(parser, scanner);
-        return true;
-    }
-    errorAtCurrent(parser, message);
-    return false;
-}
+#else
 
-inline void parseAdvance(Parser* parser, Scanner* scanner) {
-    parser->previous = parser->current;
-    for (;;) {
-        parser->current = scanToken(scanner);
-        if (parser->current.type != TOK_ERROR)break;
-        errorAtCurrent(parser, parser->current.start);
-    }
+inline bool vm_jit_valid(Program& vm) { return false; }
+inline bool vm_jit_ready(Program& vm) { return false; }
+void vm_run_jit(Context& vm) {}
 
-}
+#endif
 
-inline bool tokenCheck(Parser* parser, TokenTypes type) {
-    return parser->current.type == type;
-}
 
-inline bool tokenMatch(Parser* parser, Scanner* scanner, TokenTypes type) {
-    if (!tokenCheck(parser, type))return false;
-    parseAdvance(parser, scanner);
-    return true;
+//AOT
+//turns an assembled, verified program into C: one function per code label (plus one for the code before the first label),
+//gotos for jumps inside a function, and a switch at the top of each function over every instruction in it, which is where
+//register jumps, RET and resuming after a yield or an interpreter step land. jumps that leave the function go back through
+//the entry point, which picks the function that owns the new pc
+//same exits as the JIT: halt, yield with pc on the next block, or hand one instruction (PRT, anything a guard doesn't
+//like) to the interpreter and come back in
+#if VM_AOT
+
+enum aot_exit {
+    AOT_EXIT_HALT,
+    AOT_EXIT_YIELD,
+    AOT_EXIT_INTERPRET,
+    AOT_EXIT_CONTINUE, //only inside the generated code, pc left the current function
+};
+
+//FNV-1a, ties a built .so to the exact bytecode it came from
+u64 vm_program_hash(Program& vm) {
+    u64 hash = 14695981039346656037ull;
+    for (u32 i = 0; i < vm.byteCount; i++) {
+        hash ^= vm.bytecode[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
 }
 
-static void synchronize(Parser* parser, Scanner* scanner) {
-    parser->panicMode = false;
-    while (parser->current.type != TOK_EOF) {
-        if (parser->previous.type == TOK_SEMICOLON)return;
-        switch (parser->current.type) {
-        case TOK_FUN:
-        case TOK_VAR:
-        case TOK_FOR:
-        case TOK_IF:
-        case TOK_WHILE:
-        case TOK_PRINT:
-        case TOK_RETURN:
-            return;
-        default:
-            ;//do nothing
+//byte offsets where functions start, 0 and every code label, sorted
+u32 aotFunctionStarts(Program& vm, u32* starts, u32 max) {
+    u32 count = 0;
+    starts[count++] = 0;
+    for (u32 i = 0; i < MAX_ENTRIES; i++) {
+        for (u32 j = 0; j < vm.table.entry_count[i] && j < MAX_BUCKETS; j++) {
+            symbol_table_entry* entry = &vm.table.entries[i][j];
+            if (entry->type != label_types::label_code || !entry->defined) continue;
+            u32 offset = entry->byteOffset;
+            if (offset == 0 || offset >= vm.byteCount || (offset & 3) || count >= max) continue;
+            bool seen = false;
+            for (u32 k = 0; k < count; k++) seen |= starts[k] == offset;
+            if (!seen) starts[count++] = offset;
         }
-        parseAdvance(parser, scanner);
-
     }
+    //insertion sort, a spell has a handful of labels
+    for (u32 i = 1; i < count; i++) {
+        u32 v = starts[i];
+        u32 k = i;
+        while (k > 0 && starts[k - 1] > v) { starts[k] = starts[k - 1]; k--; }
+        starts[k] = v;
+    }
+    return count;
+}
 
+//fuel, jumpCount, blockStart and pc exactly like vm_charge_fuel, then on to the target
+static void aotTakeJump(FILE* out, u32 currentByte, const char* target, bool staticTarget, u32 targetByte, u32 functionStart, u32 functionEnd, u32 byteCount) {
+    fprintf(out, "        (*c->jumpCount)++;\n");
+    fprintf(out, "        *c->fuel -= (int32_t)((%uu - *c->blockStart) >> 2);\n", currentByte + 4);
+    fprintf(out, "        *c->blockStart = %s;\n", target);
+    fprintf(out, "        *c->pc = %s;\n", target);
+    fprintf(out, "        if (*c->fuel <= 0) return AOT_EXIT_YIELD;\n");
+    if (staticTarget && targetByte == byteCount) fprintf(out, "        return AOT_EXIT_HALT;\n");
+    else if (staticTarget && targetByte >= functionStart && targetByte < functionEnd) fprintf(out, "        goto L%u;\n", targetByte);
+    else fprintf(out, "        goto dispatch;\n");
 }
 
-#define EMIT_INSTRUCTION()\
-    u32 offset = vm->byteCount;\
-    vm->bytecode[offset+0] = code;\
-    vm->bytecode[offset+1] = bytes[0];\
-    vm->bytecode[offset+2] = bytes[1];\
-    vm->bytecode[offset+3] = bytes[2];\
-    vm->byteCount += 4;
+static void aotExit(FILE* out, u32 pc, const char* code) {
+    fprintf(out, "    { *c->pc = %uu; return %s; }\n", pc, code);
+}
 
-#define CheckReg(reg) if(((reg) < 0) || ((reg) >= MAX_REGISTERS)) {error(parser, "REGISTER NUMBER TOO HIGH!\n");return;}
+//VM_STACK_CHECK on the slots from t + lowOffset up to t + highOffset, t holds SP
+static void aotStackCheck(FILE* out, u32 b, s32 lowOffset, s32 highOffset) {
+    fprintf(out, "    lo = t + %uu; hi = t + %uu;\n    if (lo > hi || lo < c->stackLimit || hi > %uu)", (u32)lowOffset, (u32)highOffset, STACK_START);
+    aotExit(out, b, "AOT_EXIT_INTERPRET");
+}
 
+static void aotInstruction(FILE* out, Program& vm, const DecodedInstruction& ins, u32 b, u32 functionStart, u32 functionEnd) {
+    u32 n = vm.byteCount;
+    fprintf(out, "L%u: /* %s */\n", b, opcodeStr((Opcode)ins.op));
+    switch (ins.op) {
+    case OP_HLT: aotExit(out, b + 4, "AOT_EXIT_HALT"); break;
+    case OP_LOAD_IMM_TO_REG: fprintf(out, "    r[%u] = %d;\n", ins.a, ins.imm); break;
+    case OP_LOAD_REG_TO_REG: fprintf(out, "    r[%u] = r[%u];\n", ins.a, ins.b); break;
+    //unsigned math so overflow wraps like the interpreter does in practice instead of being UB in the generated code
+    case OP_ADD_REG_TO_REG: fprintf(out, "    r[%u] = (int32_t)((uint32_t)r[%u] + (uint32_t)r[%u]);\n", ins.c, ins.a, ins.b); break;
+    case OP_SUB_REG_TO_REG: fprintf(out, "    r[%u] = (int32_t)((uint32_t)r[%u] - (uint32_t)r[%u]);\n", ins.c, ins.a, ins.b); break;
+    case OP_MUL_REG_TO_REG: fprintf(out, "    r[%u] = (int32_t)((uint32_t)r[%u] * (uint32_t)r[%u]);\n", ins.c, ins.a, ins.b); break;
+    case OP_DIV_REG_TO_REG: {
+        fprintf(out, "    if (r[%u] == 0 || (r[%u] == INT32_MIN && r[%u] == -1))", ins.b, ins.a, ins.b);
+        aotExit(out, b, "AOT_EXIT_INTERPRET");
+        fprintf(out, "    { int32_t q = r[%u] / r[%u]; *c->remainder = (uint32_t)(r[%u] %% r[%u]); r[29] = (int32_t)*c->remainder; r[%u] = q; }\n",
+            ins.a, ins.b, ins.a, ins.b, ins.c);
+    }break;
+    case OP_EQ:  fprintf(out, "    *c->equalFlag = r[%u] == r[%u];\n", ins.a, ins.b); break;
+    case OP_NEQ: fprintf(out, "    *c->equalFlag = r[%u] != r[%u];\n", ins.a, ins.b); break;
+    case OP_GT:  fprintf(out, "    *c->equalFlag = r[%u] > r[%u];\n", ins.a, ins.b); break;
+    case OP_LT:  fprintf(out, "    *c->equalFlag = r[%u] < r[%u];\n", ins.a, ins.b); break;
+    case OP_GTQ: fprintf(out, "    *c->equalFlag = r[%u] >= r[%u];\n", ins.a, ins.b); break;
+    case OP_LTQ: fprintf(out, "    *c->equalFlag = r[%u] <= r[%u];\n", ins.a, ins.b); break;
+    case OP_EQ_CONST_TO_REG: fprintf(out, "    *c->equalFlag = r[%u] == %d;\n", ins.a, ins.imm); break;
+    case OP_INC: fprintf(out, "    r[%u] = (int32_t)((uint32_t)r[%u] + 1u);\n", ins.a, ins.a); break;
+    case OP_DEC: fprintf(out, "    r[%u] = (int32_t)((uint32_t)r[%u] - 1u);\n", ins.a, ins.a); break;
 
-#define PARSE_REGISTER(bytes)\
-    parseAdvance(parser, scanner);\
-    parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");\
-    u32 reg = string_to_int(parser->previous.start, &end);\
-    CheckReg(reg);\
-    bytes = reg;\
+    case OP_LOAD_OFFSET_REG_ADDR_TO_REG: {
+        fprintf(out, "    p = vm_aot_addr(c, (uint32_t)r[%u] + %du);\n    if (!p)", ins.b, ins.imm);
+        aotExit(out, b, "AOT_EXIT_INTERPRET");
+        fprintf(out, "    r[%u] = *p;\n", ins.a);
+    }break;
+    case OP_LOAD_REG_TO_OFFSET_REG_ADDR: {
+        fprintf(out, "    p = vm_aot_addr(c, (uint32_t)r[%u] + %du);\n    if (!p)", ins.a, ins.imm);
+        aotExit(out, b, "AOT_EXIT_INTERPRET");
+        fprintf(out, "    *p = (uint8_t)r[%u];\n", ins.b);
+    }break;
 
+    case OP_PUSH_REG: {
+        fprintf(out, "    t = (uint32_t)r[%u];\n", REGSP);
+        aotStackCheck(out, b, 0, 0);
+        fprintf(out, "    memcpy(VM_AOT_SLOT(t), &r[%u], 4); r[%u] = (int32_t)(t - 4u);\n", ins.a, REGSP);
+    }break;
+    case OP_POP_REG: {
+        fprintf(out, "    t = (uint32_t)r[%u];\n", REGSP);
+        aotStackCheck(out, b, 4, 4);
+        fprintf(out, "    r[%u] = (int32_t)(t + 4u); memcpy(&r[%u], VM_AOT_SLOT(t + 4u), 4);\n", REGSP, ins.a);
+    }break;
+    case OP_PUSH_MASK:
+    case OP_POP_MASK: {
+        bool push = ins.op == OP_PUSH_MASK;
+        fprintf(out, "    t = (uint32_t)r[%u];\n", REGSP);
+        if (push) aotStackCheck(out, b, -4 * (ins.c - 1), 0);
+        else aotStackCheck(out, b, 4, 4 * ins.c);
+        if (!push) fprintf(out, "    r[%u] = (int32_t)(t + %uu);\n", REGSP, 4 * ins.c);
+        s32 at = push ? 0 : 4 * ins.c;
+        for (u32 reg = ins.a, mask = ins.imm; mask; reg++, mask >>= 1) {
+            if (!(mask & 1)) continue;
+            if (push) fprintf(out, "    memcpy(VM_AOT_SLOT(t + %uu), &r[%u], 4);\n", (u32)at, reg);
+            else fprintf(out, "    memcpy(&r[%u], VM_AOT_SLOT(t + %uu), 4);\n", reg, (u32)at);
+            at -= 4;
+        }
+        if (push) fprintf(out, "    r[%u] = (int32_t)(t - %uu);\n", REGSP, 4 * ins.c);
+    }break;
+    case OP_ENTER: {
+        fprintf(out, "    t = (uint32_t)r[%u];\n", REGSP);
+        aotStackCheck(out, b, 0, 0);
+        fprintf(out, "    memcpy(VM_AOT_SLOT(t), &r[%u], 4); r[%u] = (int32_t)(t - 4u); r[%u] = (int32_t)(t - %uu);\n",
+            REGFP, REGFP, REGSP, 4 + (u32)ins.imm);
+    }break;
+    case OP_LEAVE: {
+        fprintf(out, "    t = (uint32_t)r[%u];\n", REGFP);
+        aotStackCheck(out, b, 4, 4);
+        fprintf(out, "    r[%u] = (int32_t)(t + 4u); memcpy(&r[%u], VM_AOT_SLOT(t + 4u), 4);\n", REGSP, REGFP);
+    }break;
 
-#define CheckByte(byte) if((byte) > 0xff) {error(parser, "Offset too large! needs to be within 1 byte!"); return;}
+    case OP_JMP_CONSTANT:
+    case OP_JMP_LABEL: {
+        fprintf(out, "    {\n");
+        aotTakeJump(out, b, "0", true, (u32)ins.imm, functionStart, functionEnd, n);
+        fprintf(out, "    }\n");
+    }break;
+    case OP_JEQ_CONSTANT:
+    case OP_JNE_CONSTANT:
+    case OP_JEQ_REG_TO_REG_CONSTANT:
+    case OP_CALL: {
+        char target[16];
+        snprintf(target, sizeof(target), "%uu", (u32)ins.imm);
+        if (ins.op == OP_JEQ_CONSTANT) fprintf(out, "    if (*c->equalFlag) {\n        *c->equalFlag = 0;\n");
+        else if (ins.op == OP_JNE_CONSTANT) fprintf(out, "    if (!*c->equalFlag) {\n");
+        else if (ins.op == OP_JEQ_REG_TO_REG_CONSTANT) fprintf(out, "    *c->equalFlag = 0;\n    if (r[%u] == r[%u]) {\n", ins.a, ins.b);
+        else {
+            fprintf(out, "    t = (uint32_t)r[%u];\n", REGSP);
+            aotStackCheck(out, b, 0, 0);
+            fprintf(out, "    {\n        uint32_t ret = %uu; memcpy(VM_AOT_SLOT(t), &ret, 4); r[%u] = (int32_t)(t - 4u);\n", b + 4, REGSP);
+        }
+        aotTakeJump(out, b, target, true, (u32)ins.imm, functionStart, functionEnd, n);
+        fprintf(out, "    }\n");
+        if (ins.op == OP_JEQ_CONSTANT || ins.op == OP_JNE_CONSTANT) fprintf(out, "    *c->equalFlag = 0;\n");
+    }break;
 
-#define PARSE_BYTE(byte)\
-parser_consume(parser, scanner, TOK_NUMBER, "Expected Number!");\
-int instructionValue = string_to_int(parser->previous.start, &end);\
-CheckByte(instructionValue);\
-byte = instructionValue & 0xff;
+    //register driven targets, anything the interpreter would reject goes to the interpreter before any state changes
+    case OP_JMP:
+    case OP_JMPF:
+    case OP_JMPB:
+    case OP_JEQ_REG:
+    case OP_RET: {
+        if (ins.op == OP_JEQ_REG) fprintf(out, "    if (*c->equalFlag) {\n");
+        else fprintf(out, "    {\n");
+        if (ins.op == OP_JMP || ins.op == OP_JEQ_REG) fprintf(out, "    t = (uint32_t)r[%u];\n", ins.a);
+        else if (ins.op == OP_JMPF) fprintf(out, "    t = %uu + (uint32_t)r[%u];\n", b, ins.a);
+        else if (ins.op == OP_JMPB) fprintf(out, "    t = %uu - (uint32_t)r[%u];\n", b, ins.a);
+        else {
+            fprintf(out, "    t = (uint32_t)r[%u];\n", REGSP);
+            aotStackCheck(out, b, 4, 4);
+            fprintf(out, "    memcpy(&t, VM_AOT_SLOT(t + 4u), 4);\n");
+        }
+        fprintf(out, "    if (t >= %uu || (t & 3))", n);
+        aotExit(out, b, "AOT_EXIT_INTERPRET");
+        if (ins.op == OP_JEQ_REG) fprintf(out, "        *c->equalFlag = 0;\n");
+        if (ins.op == OP_RET) fprintf(out, "        r[%u] += 4;\n", REGSP);
+        aotTakeJump(out, b, "t", false, 0, functionStart, functionEnd, n);
+        fprintf(out, "    }\n");
+        if (ins.op == OP_JEQ_REG) fprintf(out, "    *c->equalFlag = 0;\n");
+    }break;
 
+    case OP_SYSCALL: {
+        fprintf(out, "    *c->pc = %uu;\n    c->host[%u].fn(c->context, c->host[%u].user);\n    if (*c->status != %d) return AOT_EXIT_HALT;\n",
+            b + 4, ins.imm, ins.imm, VM_RUNNING);
+    }break;
+    case OP_YIELD: {
+        fprintf(out, "    *c->status = %d;\n", VM_YIELDED);
+        aotExit(out, b + 4, "AOT_EXIT_HALT");
+    }break;
+    //WAIT and WAIT_EVENT are left to the interpreter, it's once per sleep and VMAotContext doesn't carry wakeTick
 
-inline void parseRaw(VM* vm, Parser* parser, Scanner* scanner) {
-    TokenTypes instructionType = parser->previous.type;
-    parseAdvance(parser, scanner);
+    default: {
+        aotExit(out, b, "AOT_EXIT_INTERPRET");
+    }break;
+    }
+}
 
-    if (!tokenCheck(parser, TOK_HEX)) {
-        error(parser, "RAW instruction needs to be followed by HEXADECIMAL VALUES!\n");
-        return;
+//writes the C translation unit for the current program, spellName becomes the exported entry point
+bool vm_aot_write_c(Program& vm, const char* spellName, const char* path) {
+    vm_decode(vm);
+    if (!vm.verified) {
+        printf("AOT: program isn't verified (%s at %u), not compiling it\n", vm.verifyError ? vm.verifyError : "empty", vm.verifyErrorByte);
+        return false;
+    }
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        printf("AOT: couldn't open %s\n", path);
+        return false;
     }
 
-    int nybbles = 0; //need 8 nybbles
-    u8 hex[4] = {};
-    if (parser->current.length == 10) {//0x + 8 chars 
-        hex[0] = (hexCharToValue(*(parser->current.start + 2)) << 4);
-        hex[0] |= (hexCharToValue(*(parser->current.start + 3)));
+    u32 starts[MAX_ENTRIES + 1];
+    u32 functionCount = aotFunctionStarts(vm, starts, MAX_ENTRIES);
+
+    fprintf(out, "/* generated by vm_aot_write_c, %u instructions, do not edit */\n", vm.byteCount / 4);
+    fprintf(out, "#include <stdint.h>\n#include <string.h>\n\n");
+    fprintf(out, "#ifdef _WIN32\n#define VM_AOT_EXPORT __declspec(dllexport)\n#else\n#define VM_AOT_EXPORT __attribute__((visibility(\"default\")))\n#endif\n\n");
+    fprintf(out, "enum { AOT_EXIT_HALT, AOT_EXIT_YIELD, AOT_EXIT_INTERPRET, AOT_EXIT_CONTINUE };\n\n");
+    //has to match VMHostFunction, the generated code indexes the host's table
+    fprintf(out, "struct VMAotHost {\n    const char* name;\n    void (*fn)(void* context, void* user);\n    void* user;\n"
+                 "    _Bool effect;\n    uint8_t effectArgs;\n};\n\n");
+    fprintf(out, "struct VMAotContext {\n    int32_t* registers;\n    uint8_t* mem;\n    uint32_t* pc;\n    _Bool* equalFlag;\n"
+                 "    int32_t* fuel;\n    uint32_t* blockStart;\n    uint32_t* jumpCount;\n    uint32_t* remainder;\n"
+                 "    uint8_t* stack;\n    uint32_t stackLimit;\n    void* context;\n    int* status;\n    struct VMAotHost* host;\n};\n\n");
+    //vm_addr for the two segments the generated code handles itself, the heap goes to the interpreter
+    fprintf(out, "#define VM_AOT_SLOT(a) (c->stack + ((a) - %uu))\n\n", VM_STACK_BASE);
+    fprintf(out, "static inline uint8_t* vm_aot_addr(struct VMAotContext* c, uint32_t t) {\n    if (t < %uu) return c->mem + t;\n"
+                 "    if (t >= c->stackLimit && t < %uu) return VM_AOT_SLOT(t);\n    return 0;\n}\n\n", MAX_MEM, VM_STACK_TOP);
+    fprintf(out, "VM_AOT_EXPORT const uint64_t %s_hash = %lluull;\n\n", spellName, vm_program_hash(vm));
+
+    for (u32 f = 0; f < functionCount; f++) {
+        u32 functionStart = starts[f];
+        u32 functionEnd = f + 1 < functionCount ? starts[f + 1] : vm.byteCount;
+        fprintf(out, "static uint32_t %s_L%u(struct VMAotContext* c) {\n", spellName, functionStart);
+        fprintf(out, "    int32_t* r = c->registers;\n    uint8_t* p;\n    uint32_t t, lo, hi;\n    (void)r; (void)p; (void)t; (void)lo; (void)hi;\n");
+        fprintf(out, "dispatch:\n    switch (*c->pc) {\n");
+        for (u32 b = functionStart; b < functionEnd; b += 4) fprintf(out, "    case %u: goto L%u;\n", b, b);
+        fprintf(out, "    default: return AOT_EXIT_CONTINUE;\n    }\n");
+        for (u32 b = functionStart; b < functionEnd; b += 4) {
+            DecodedInstruction ins;
+            decodeInstruction(vm.bytecode + b, &ins);
+            aotInstruction(out, vm, ins, b, functionStart, functionEnd);
+        }
+        aotExit(out, functionEnd, functionEnd == vm.byteCount ? "AOT_EXIT_HALT" : "AOT_EXIT_CONTINUE");
+        fprintf(out, "}\n\n");
+    }
 
-        hex[1] = (hexCharToValue(*(parser->current.start + 4)) << 4);
-        hex[1] |= (hexCharToValue(*(parser->current.start + 5)));
+    fprintf(out, "VM_AOT_EXPORT uint32_t %s(struct VMAotContext* c) {\n    for (;;) {\n        uint32_t pc = *c->pc;\n        uint32_t exit;\n", spellName);
+    for (u32 f = functionCount; f-- > 0;) {
+        fprintf(out, "        %sif (pc >= %uu) exit = %s_L%u(c);\n", f + 1 == functionCount ? "" : "else ", starts[f], spellName, starts[f]);
+    }
+    fprintf(out, "        else return AOT_EXIT_HALT;\n");
+    fprintf(out, "        if (exit != AOT_EXIT_CONTINUE) return exit;\n    }\n}\n");
+    fclose(out);
+    return true;
+}
 
-        hex[2] = (hexCharToValue(*(parser->current.start + 6)) << 4);
-        hex[2] |= (hexCharToValue(*(parser->current.start + 7)));
+//build time: writes <soPath>.c and compiles it with $CC (or cc)
+bool vm_aot_build(Program& vm, const char* spellName, const char* soPath) {
+    char cPath[512];
+    snprintf(cPath, sizeof(cPath), "%s.c", soPath);
+    if (!vm_aot_write_c(vm, spellName, cPath)) return false;
+
+    const char* cc = getenv("CC");
+    char command[1400];
+    snprintf(command, sizeof(command), "%s -O2 -shared -fPIC -fvisibility=hidden -o '%s' '%s'", cc ? cc : "cc", soPath, cPath);
+    if (system(command) != 0) {
+        printf("AOT: '%s' failed\n", command);
+        return false;
+    }
+    return true;
+}
 
-        hex[3] = (hexCharToValue(*(parser->current.start + 8)) << 4);
-        hex[3] |= (hexCharToValue(*(parser->current.start + 9)));
-        nybbles = 8;
+//load time: the .so has to have been built from exactly the program the VM holds
+bool vm_aot_load(Program& vm, const char* soPath, const char* spellName) {
+    vm_decode(vm);
+    vm.aot = {};
+    if (!vm.verified) return false;
+
+    void* library = dlopen(soPath, RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        printf("AOT: %s\n", dlerror());
+        return false;
+    }
+    char hashName[256];
+    snprintf(hashName, sizeof(hashName), "%s_hash", spellName);
+    const u64* hash = (const u64*)dlsym(library, hashName);
+    vm_aot_fn fn = (vm_aot_fn)dlsym(library, spellName);
+    if (!hash || !fn || *hash != vm_program_hash(vm)) {
+        printf("AOT: %s doesn't contain %s for this program\n", soPath, spellName);
+        dlclose(library);
+        return false;
+    }
+
+    vm.aot.fn = fn;
+    vm.aot.library = library;
+    vm.aot.hash = *hash;
+    return true;
+}
+
+//the hash was checked on load and anything that touches the code since cleared fn, no hashing per run
+inline bool vm_aot_ready(Program& vm) {
+    return vm.aot.fn != NULL;
+}
+
+void vm_run_aot(Context& vm) {
+    if (!vm.stack && !vm_stack_alloc(vm)) {
+        vm_run_threaded<true>(vm);
+        return;
+    }
+    vm.instructionsExecuted = 0;
+    VMAotContext ctx = { vm.registers, vm.memBase, &vm.pc, &vm.equalFlag, &vm.fuel, &vm.blockStart, &vm.jumpCount, &vm.remainder,
+        vm.stack, vm.stackLimit, &vm, &vm.status, vmHost.functions };
+    for (;;) {
+        u32 exit = vm.program->aot.fn(&ctx);
+        if (exit == AOT_EXIT_HALT) return;
+        if (exit == AOT_EXIT_YIELD) {
+            vm.status = VM_YIELDED;
+            return;
+        }
+
+        bool isDone = executeInstruction<false, false, true>(vm);
+        vm.instructionsExecuted++;
+        if (isDone) return;
+    }
+}
+
+#else
+
+bool vm_aot_build(Program& vm, const char* spellName, const char* soPath) { printf("AOT builds need cc and dlopen\n"); return false; }
+bool vm_aot_load(Program& vm, const char* soPath, const char* spellName) { return false; }
+inline bool vm_aot_ready(Program& vm) { return false; }
+void vm_run_aot(Context& vm) {}
+
+#endif
+
+//set while a pool worker runs its round. the JIT emitter and arena aren't thread safe, so a worker never compiles and
+//runs code the frame didn't get compiled on the threaded engine instead
+static thread_local bool vmOnWorker;
+
+//the REPL and tests pass their scanner to get the per line trace, everything else runs the trace free engine unless vm.trace is set
+//the program has to be decoded already (vm_decode), vm_run does that for the REPL's VM
+void context_run(Context& vm, Scanner* scanner = NULL) {
+    Program& program = *vm.program;
+    vm.status = VM_RUNNING;
+    vm.blockStart = vm.pc;
+
+    //the verifier only proved things about where the program can jump, a pc left over from an error can be anywhere
+    bool verified = program.verified && vm.pc <= program.byteCount && !(vm.pc & 3);
+    if (vm.trace || scanner) {
+        if (program.dispatchesSaved) printf("superinstructions save %u dispatches per pass\n", program.dispatchesSaved);
+        if (!program.verified && program.verifyError) printf("not verified, running with checks: %s at %u\n", program.verifyError, program.verifyErrorByte);
+        if (verified) vm_run_engine<true, true>(vm, scanner);
+        else          vm_run_engine<true, false>(vm, scanner);
+    }
+    else if (vm.dispatch == DISPATCH_JIT && verified && (vmOnWorker ? vm_jit_valid(program) : vm_jit_ready(program))) {
+        vm_run_jit(vm);
+    }
+    else if (vm.dispatch == DISPATCH_AOT && verified && vm_aot_ready(program)) {
+        vm_run_aot(vm);
+    }
+#if VM_GUARD_PAGES
+    else if (vm.guardMem && (vm.dispatch == DISPATCH_SWITCH || vm.dispatch == DISPATCH_THREADED)) {
+        if (verified) vm_run_guarded<true>(vm, vm.dispatch == DISPATCH_THREADED);
+        else          vm_run_guarded<false>(vm, vm.dispatch == DISPATCH_THREADED);
+    }
+#endif
+    else if (vm.dispatch != DISPATCH_SWITCH) {
+        if (verified) vm_run_threaded<true>(vm);
+        else          vm_run_threaded<false>(vm);
     }
     else {
-        int arrayEntry = 0; //need 8 nybbles
-        int i = 0;
-        for (u32 bytes = 0; bytes < 4; bytes++) {
-            if (nybbles >= 8)break;
-            int c = 0;
-            if (bytes > 0) {
-                parser_consume(parser, scanner, TOK_HEX, "Expected HEX as operand");
-                if (!tokenCheck(parser, TOK_HEX)) {
-                    error(parser, "RAW instruction needs to be followed by HEXADECIMAL VALUES!\n");
-                    return;
-                }
-                if ((parser->current.length - 2 & 1)) {
-                    error(parser, "HEX VALUE MUST HAVE EVEN NUMBER OF CHARACTERS!\n");
-                    return;
-                }
-                if ((parser->current.length - 2 > (8 - nybbles))) {
-                    error(parser, "CUMULATIVE HEX INSTRUCTION TOO LARGE!\n");
-                    return;
-                }
+        if (verified) vm_run_engine<false, true>(vm, NULL);
+        else          vm_run_engine<false, false>(vm, NULL);
+    }
+    if (vm.status == VM_RUNNING) vm.status = VM_HALTED;
+}
 
-            }
+void vm_run(VM& vm, Scanner* scanner = NULL) {
+    vm_decode(vm);
+    context_run(vm, scanner);
+}
 
-            while (c < parser->current.length - 2 && nybbles < 8) {
-                if (c & 1) {
-                    hex[arrayEntry] = (hex[arrayEntry] << 4) | (hexCharToValue(*(parser->current.start + 2 + c)));
+inline u32 lieAlign(u32 offset) {
+    return (offset + 7) & ~7u;
+}
 
-                }
-                else {
-                    hex[arrayEntry] = (hexCharToValue(*(parser->current.start + 2 + c)));
-                }
-                nybbles++;
-                c++;
-                arrayEntry += i++;
-                i = i & 1;
-            }
+inline bool lieExported(const symbol_table_entry& entry) {
+    return entry.name && entry.defined && (entry.type == label_code || entry.type == label_data);
+}
 
+//writes the program as a LIE image: header, code, read only data, exported labels, the host functions it calls and
+//a source line per instruction. everything is an offset from the start of the image, so lie_load uses it where it's mapped
+bool lie_save(Program& vm, const char* path) {
+    LIE lie = {};
+    lie.magic = LIE_MAGIC;
+    lie.version = LIE_VERSION;
+
+    u32 symbolNames = 0;
+    for (u32 i = 0; i < MAX_ENTRIES; i++) {
+        for (u32 bucket = 0; bucket < MAX_BUCKETS; bucket++) {
+            for (const symbol_table_entry* entry = vm.table.entries[i] + bucket; entry; entry = entry->next) { //only the last bucket chains
+                if (!lieExported(*entry)) continue;
+                lie.symbolCount++;
+                symbolNames += entry->nameLen + 1;
+            }
         }
+    }
 
+    bool imported[VM_MAX_HOST_FUNCTIONS] = {};
+    u32 importNames = 0;
+    for (u32 b = 0; b + 4 <= vm.byteCount; b += 4) {
+        if (vm.bytecode[b] != OP_SYSCALL) continue;
+        u32 index = (vm.bytecode[b + 1] << 8) | vm.bytecode[b + 2];
+        if (index >= vmHost.count) {
+            printf("LIE: SYSCALL at %u names host function %u, nothing is registered there\n", b, index);
+            return false;
+        }
+        if (imported[index]) continue;
+        imported[index] = true;
+        lie.importCount++;
+        importNames += handmade_strlen(vmHost.functions[index].name) + 1;
     }
 
-    if (nybbles != 8) {
-        error(parser, "RAW instruction MUST be followed by 4 bytes of HEX!");
-        return;
+    u32 sizes[LIE_SECTION_COUNT] = {};
+    sizes[LIE_CODE] = vm.byteCount;
+    sizes[LIE_DATA] = vm.dataSize;
+    sizes[LIE_SYMBOLS] = lie.symbolCount * sizeof(LIESymbol) + symbolNames;
+    sizes[LIE_IMPORTS] = lie.importCount * sizeof(LIEImport) + importNames;
+    sizes[LIE_DEBUG] = vm.byteCount / 4 * sizeof(u32);
+    u32 offset = lieAlign(sizeof(LIE));
+    for (u32 i = 0; i < LIE_SECTION_COUNT; i++) {
+        lie.sections[i] = { offset, sizes[i] };
+        offset = lieAlign(offset + sizes[i]);
     }
-    if (hex[0] == 1 && hex[1] >= MAX_REGISTERS) {
-        error(parser, "[raw] LOAD instruction register must be within 0 - 31!");
-        return;
+    lie.size = offset;
+    lie.codeStart = lie.sections[LIE_CODE].offset;
+
+    u8* image = (u8*)calloc(1, lie.size);
+    if (!image) return false;
+    memcpy(image, &lie, sizeof(LIE));
+    memcpy(image + lie.sections[LIE_CODE].offset, vm.bytecode, vm.byteCount);
+    memcpy(image + lie.sections[LIE_DATA].offset, vm.data, vm.dataSize);
+    memcpy(image + lie.sections[LIE_DEBUG].offset, vm.sourceLines, sizes[LIE_DEBUG]);
+
+    LIESymbol* symbols = (LIESymbol*)(image + lie.sections[LIE_SYMBOLS].offset);
+    u32 name = lie.sections[LIE_SYMBOLS].offset + lie.symbolCount * sizeof(LIESymbol);
+    for (u32 i = 0; i < MAX_ENTRIES; i++) {
+        for (u32 bucket = 0; bucket < MAX_BUCKETS; bucket++) {
+            for (const symbol_table_entry* entry = vm.table.entries[i] + bucket; entry; entry = entry->next) {
+                if (!lieExported(*entry)) continue;
+                *symbols++ = { name, (u16)entry->nameLen, (u8)entry->type, 0, entry->byteOffset };
+                memcpy(image + name, entry->name, entry->nameLen);
+                name += entry->nameLen + 1;
+            }
+        }
     }
 
-    // // printf("%x %x\n", hex1, hex2);
-    u32 offset = vm->byteCount;
-    vm->bytecode[offset + 0] = hex[0];
-    vm->bytecode[offset + 1] = hex[1];
-    vm->bytecode[offset + 2] = hex[2];
-    vm->bytecode[offset + 3] = hex[3];
-    vm->byteCount += 4;
+    LIEImport* imports = (LIEImport*)(image + lie.sections[LIE_IMPORTS].offset);
+    name = lie.sections[LIE_IMPORTS].offset + lie.importCount * sizeof(LIEImport);
+    for (u32 i = 0; i < vmHost.count; i++) {
+        if (!imported[i]) continue;
+        u32 nameLen = handmade_strlen(vmHost.functions[i].name);
+        *imports++ = { name, (u16)nameLen, (u16)i };
+        memcpy(image + name, vmHost.functions[i].name, nameLen);
+        name += nameLen + 1;
+    }
 
+    FILE* out = fopen(path, "wb");
+    bool written = out && fwrite(image, 1, lie.size, out) == lie.size;
+    if (out && fclose(out) != 0) written = false;
+    free(image);
+    if (!written) {
+        printf("LIE: couldn't write %s\n", path);
+        return false;
+    }
+    vm.lie = lie;
+    return true;
+}
 
+//what's wrong with an image, NULL if lie_load can take it as is. nothing gets fixed up, so everything gets checked
+const char* lieCheck(const u8* image, u32 size) {
+    if (size < sizeof(LIE)) return "too small for a header";
+    const LIE* lie = (const LIE*)image;
+    if (lie->magic != LIE_MAGIC) return "not a LIE image";
+    if (lie->version != LIE_VERSION) return "built for another version";
+    if (lie->size != size) return "truncated";
+    for (u32 i = 0; i < LIE_SECTION_COUNT; i++) {
+        const LIESection& section = lie->sections[i];
+        if ((section.offset & 7) || section.offset < sizeof(LIE) || section.offset > size || section.size > size - section.offset) {
+            return "section out of bounds";
+        }
+    }
+    u32 codeSize = lie->sections[LIE_CODE].size;
+    if (codeSize > VM_MAX_CODE || (codeSize & 3) || lie->codeStart != lie->sections[LIE_CODE].offset) return "bad code section";
+    if (lie->sections[LIE_DATA].size > MAX_MEM) return "data doesn't fit in an instance's memory";
+    if (lie->sections[LIE_DEBUG].size != codeSize / 4 * sizeof(u32)) return "debug lines don't match the code";
+    if (lie->symbolCount > lie->sections[LIE_SYMBOLS].size / sizeof(LIESymbol)) return "bad symbol section";
+    if (lie->importCount > lie->sections[LIE_IMPORTS].size / sizeof(LIEImport)) return "bad import section";
+
+    const LIESymbol* symbols = (const LIESymbol*)(image + lie->sections[LIE_SYMBOLS].offset);
+    for (u32 i = 0; i < lie->symbolCount; i++) {
+        if (symbols[i].name >= size || symbols[i].nameLen >= size - symbols[i].name) return "symbol name out of bounds";
+        if (symbols[i].type != label_code && symbols[i].type != label_data) return "bad symbol type";
+    }
+    const LIEImport* imports = (const LIEImport*)(image + lie->sections[LIE_IMPORTS].offset);
+    for (u32 i = 0; i < lie->importCount; i++) {
+        if (imports[i].name >= size || imports[i].nameLen >= size - imports[i].name) return "import name out of bounds";
+    }
+    return NULL;
 }
 
-int parseRegister(VM* vm, Parser* parser, Scanner* scanner, int* regs) {
+//maps a LIE image with one mmap and runs it as is: the code, source lines and symbol names are used where they sit in
+//the mapping, which stays until the Program is reset. only the data gets copied, into the Program's fixed data array.
+//the mapping is private, a host patching the code gets its own copy of the page and the file never changes. every SYSCALL has to still name the host
+//function it was built against, the registry is append only so that holds for anything registered in the same order.
+//the Program has to have been zeroed once, like for program_reset
+bool lie_load(Program* program, const char* path) {
+    program_reset(program);
+
+    u8* image = NULL;
+    u32 size = 0;
+#if VM_LIE_MMAP
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size <= 0 || info.st_size > UINT32_MAX) {
+        if (fd >= 0) close(fd);
+        printf("LIE: couldn't open %s\n", path);
+        return false;
+    }
+    size = (u32)info.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        printf("LIE: couldn't map %s\n", path);
+        return false;
+    }
+    image = (u8*)mapping;
+#else
+    FILE* in = fopen(path, "rb");
+    if (in && fseek(in, 0, SEEK_END) == 0) {
+        long length = ftell(in);
+        if (length > 0 && fseek(in, 0, SEEK_SET) == 0) {
+            image = (u8*)malloc(length);
+            if (image && fread(image, 1, length, in) == (size_t)length) size = (u32)length;
+        }
+    }
+    if (in) fclose(in);
+    if (!size) {
+        free(image);
+        printf("LIE: couldn't read %s\n", path);
+        return false;
+    }
+#endif
+    program->image = image;
+    program->imageSize = size;
+
+    const char* problem = lieCheck(image, size);
+    const LIE* lie = (const LIE*)image;
+    const LIEImport* imports = problem ? NULL : (const LIEImport*)(image + lie->sections[LIE_IMPORTS].offset);
+    for (u32 i = 0; !problem && i < lie->importCount; i++) {
+        if (vm_host_lookup((const char*)image + imports[i].name, imports[i].nameLen) != imports[i].index) {
+            problem = "calls a host function that isn't registered at the index it was built against";
+        }
+    }
+    if (problem) {
+        printf("LIE: %s %s\n", path, problem);
+        lie_unmap(program);
+        return false;
+    }
 
-    const char* end = NULL;
-    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand"))return -1;
-    int reg1 = string_to_int(parser->current.start, &end);
-    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return -1;
+    const LIESymbol* symbols = (const LIESymbol*)(image + lie->sections[LIE_SYMBOLS].offset);
+    for (u32 i = 0; i < lie->symbolCount; i++) {
+        symbol_table_entry* entry = pushAssemblerSymbolTable(&program->table, (char*)image + symbols[i].name, symbols[i].nameLen);
+        if (!entry) {
+            printf("LIE: %s has more symbols than the table holds\n", path);
+            program_reset(program);
+            return false;
+        }
+        entry->nameLen = symbols[i].nameLen;
+        entry->type = (label_types)symbols[i].type;
+        entry->byteOffset = symbols[i].byteOffset;
+        entry->defined = true;
+    }
 
-    if (reg1 < 0 || reg1 >= MAX_REGISTERS) {
-        error(parser, "REGISTER 1 TOO HIGH!\n");
-        return -1;
+    //the decoded instructions are the only thing the image doesn't have, they fit inline unless the code doesn't
+    u32 codeSize = lie->sections[LIE_CODE].size;
+    if (codeSize > MAX_BYTECODE) {
+        program->decoded = (DecodedInstruction*)malloc((codeSize / 4 + 1) * sizeof(DecodedInstruction));
+        if (!program->decoded) {
+            printf("LIE: no memory for %s's code\n", path);
+            program->decoded = program->inlineDecoded;
+            program_reset(program);
+            return false;
+        }
     }
+    program->bytecode = image + lie->sections[LIE_CODE].offset;
+    program->sourceLines = (u32*)(image + lie->sections[LIE_DEBUG].offset);
+    program->byteCount = codeSize;
+    program->byteCapacity = codeSize;
+    program->fixedSize = true; //nothing more fits, and nothing to free
+    memcpy(program->data, image + lie->sections[LIE_DATA].offset, lie->sections[LIE_DATA].size);
+    program->dataSize = lie->sections[LIE_DATA].size;
+    program->lie = *lie;
+    return true;
+}
 
-    regs[0] = reg1;
+//picks a yielded instance back up at the block it ran out of fuel on, with a fresh frame budget
+void vm_resume(Context& vm, s32 fuel = VM_DEFAULT_FUEL) {
+    vm_refuel(vm, fuel);
+    context_run(vm);
+}
 
-    return 0;
+void vm_run_once(Context& vm) {
+    vm_decode(*vm.program);
+    vm.status = VM_RUNNING;
+    bool isDone = vm.trace ? executeInstruction<true>(vm) : executeInstruction<false>(vm);
+    if (isDone && vm.status == VM_RUNNING) vm.status = VM_HALTED;
 }
 
-int parse2Registers(VM* vm, Parser* parser, Scanner* scanner, int* regs) {
+//WAIT n parks an instance here instead of the host checking it every frame. a hierarchical timer wheel, four levels
+//of 64 slots, level l slot i holding everything due in the i'th 64^l tick stretch of the level's current lap. the slots are
+//lists linked through the sleeping Contexts themselves, so sleeping costs no memory, and a tick only looks at the one
+//level 0 slot that's due, plus every 64 ticks one slot of the level above, whose instances move down a level
+//instances are linked by Context::id, so they have to come from the ContextPool it was made with and keep the ids it gave them
+#define VM_WHEEL_BITS 6
+#define VM_WHEEL_SLOTS (1 << VM_WHEEL_BITS)
+#define VM_WHEEL_LEVELS 4
+#define VM_MAX_WAIT ((1u << (VM_WHEEL_BITS * VM_WHEEL_LEVELS)) - 1) //WAIT's 24 bit operand, all the wheel can reach
+
+//WAIT_EVENT parks an instance on the list for its event, linked the same way, in the order they started waiting.
+//publishing an event splices its whole list onto the ready list, one step however many are waiting on it, and nothing
+//runs until the host calls vm_scheduler_run_ready
+struct VMWaitList {
+    u32 head; //id + 1, 0 when it's empty
+    u32 tail;
+    u32 count;
+};
 
-    const char* end = NULL;
-    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand"))return -1;
-    int reg1 = string_to_int(parser->current.start, &end);
-    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return -1;
+struct VMScheduler {
+    ContextPool* pool;
+    u32 now; //ticks so far
+    u32 sleeping;
+    u32 wheel[VM_WHEEL_LEVELS][VM_WHEEL_SLOTS]; //id + 1 of the first instance in each slot, 0 when it's empty
+    u32 subscribed; //waiting on an event
+    VMWaitList events[VM_MAX_EVENTS];
+    VMWaitList ready; //woken by an event, waiting for vm_scheduler_run_ready
+};
 
-    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as second operand"))return -1;
-    int reg2 = string_to_int(parser->current.start, &end);
-    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after second register symbol"))return -1;
+void vm_scheduler_init(VMScheduler* scheduler, ContextPool* pool) {
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->pool = pool;
+}
 
-    if (reg1 < 0 || reg1 >= MAX_REGISTERS) {
-        error(parser, "REGISTER 1 TOO HIGH!\n");
-        return -1;
-    }
-    if (reg2 < 0 || reg2 >= MAX_REGISTERS) {
-        error(parser, "REGISTER 2 TOO HIGH!\n");
-        return -1;
-    }
+//puts an instance that's due at wakeTick in the slot of the lowest level that reaches that far
+inline void vm_scheduler_file(VMScheduler* scheduler, Context* ctx) {
+    u32 delta = ctx->wakeTick - scheduler->now;
+    u32 level = 0;
+    while (level + 1 < VM_WHEEL_LEVELS && delta >= (1u << (VM_WHEEL_BITS * (level + 1)))) level++;
+    u32& slot = scheduler->wheel[level][(ctx->wakeTick >> (VM_WHEEL_BITS * level)) & (VM_WHEEL_SLOTS - 1)];
+    ctx->nextWaiting = slot;
+    slot = ctx->id + 1;
+}
 
-    regs[0] = reg1;
-    regs[1] = reg2;
+//takes a VM_WAITING instance, it wakes wakeTick (its WAIT n) ticks from now. WAIT 0 is the next tick
+void vm_scheduler_sleep(VMScheduler* scheduler, Context* ctx) {
+    Assert(ctx->status == VM_WAITING && ctx == scheduler->pool->slots + ctx->id);
+    u32 ticks = ctx->wakeTick ? ctx->wakeTick : 1;
+    if (ticks > VM_MAX_WAIT) ticks = VM_MAX_WAIT;
+    ctx->wakeTick = scheduler->now + ticks;
+    vm_scheduler_file(scheduler, ctx);
+    scheduler->sleeping++;
+}
 
-    return 0;
+inline void vm_wait_list_append(VMScheduler* scheduler, VMWaitList& list, Context* ctx) {
+    ctx->nextWaiting = 0;
+    if (list.tail) scheduler->pool->slots[list.tail - 1].nextWaiting = ctx->id + 1;
+    else list.head = ctx->id + 1;
+    list.tail = ctx->id + 1;
+    list.count++;
 }
 
-int parse3Registers(VM* vm, Parser* parser, Scanner* scanner, int* regs) {
+//moves everything on from to the end of to, from ends up empty
+inline void vm_wait_list_splice(VMScheduler* scheduler, VMWaitList& to, VMWaitList& from) {
+    if (!from.head) return;
+    if (to.tail) scheduler->pool->slots[to.tail - 1].nextWaiting = from.head;
+    else to.head = from.head;
+    to.tail = from.tail;
+    to.count += from.count;
+    from = {};
+}
 
-    const char* end = NULL;
-    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand"))return -1;
-    int reg1 = string_to_int(parser->current.start, &end);
-    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return -1;
+//takes a VM_WAITING_EVENT instance, it goes on the ready list the next time its event is published
+void vm_scheduler_subscribe(VMScheduler* scheduler, Context* ctx) {
+    Assert(ctx->status == VM_WAITING_EVENT && ctx == scheduler->pool->slots + ctx->id && ctx->waitEvent < VM_MAX_EVENTS);
+    vm_wait_list_append(scheduler, scheduler->events[ctx->waitEvent], ctx);
+    scheduler->subscribed++;
+}
 
-    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as second operand"))return -1;
-    int reg2 = string_to_int(parser->current.start, &end);
-    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after second register symbol"))return -1;
+//files an instance that stopped on WAIT or WAIT_EVENT, false for anything else (halted, yielded, error)
+inline bool vm_scheduler_park(VMScheduler* scheduler, Context* ctx) {
+    if (ctx->status == VM_WAITING) vm_scheduler_sleep(scheduler, ctx);
+    else if (ctx->status == VM_WAITING_EVENT) vm_scheduler_subscribe(scheduler, ctx);
+    else return false;
+    return true;
+}
 
-    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as third operand"))return -1;
-    int reg3 = string_to_int(parser->current.start, &end);
-    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after third register symbol"))return -1;
+//a frame's worth of events in one go, every instance waiting on one of them moves to the ready list (an id that's
+//in the batch twice only wakes its waiters once). returns how many instances it woke
+u32 vm_scheduler_publish(VMScheduler* scheduler, const u32* events, u32 count) {
+    u32 woken = 0;
+    for (u32 i = 0; i < count; i++) {
+        Assert(events[i] < VM_MAX_EVENTS);
+        VMWaitList& list = scheduler->events[events[i]];
+        woken += list.count;
+        vm_wait_list_splice(scheduler, scheduler->ready, list);
+    }
+    scheduler->subscribed -= woken;
+    return woken;
+}
 
-    if (reg1 < 0 || reg1 >= MAX_REGISTERS) {
-        error(parser, "REGISTER 1 TOO HIGH!\n");
-        return -1;
+//resumes everything events have woken, oldest first, with a fresh frame of fuel each. the ones that WAIT or WAIT_EVENT
+//again get parked again, the rest go to stopped like vm_scheduler_tick's. anything woken by an event published while
+//this runs (a host function can publish) waits for the next call. returns how many instances it resumed
+u32 vm_scheduler_run_ready(VMScheduler* scheduler, s32 fuel = VM_DEFAULT_FUEL, void (*stopped)(Context* ctx, void* user) = NULL, void* user = NULL) {
+    u32 link = scheduler->ready.head;
+    u32 ran = scheduler->ready.count;
+    scheduler->ready = {};
+    while (link) {
+        Context* ctx = scheduler->pool->slots + link - 1;
+        link = ctx->nextWaiting;
+        vm_resume(*ctx, fuel);
+        if (!vm_scheduler_park(scheduler, ctx) && stopped) stopped(ctx, user);
     }
-    if (reg2 < 0 || reg2 >= MAX_REGISTERS) {
-        error(parser, "REGISTER 2 TOO HIGH!\n");
-        return -1;
+    return ran;
+}
+
+//empties one slot above level 0, everything in it is due within the next 64^level ticks so it all lands lower down
+inline void vm_scheduler_cascade(VMScheduler* scheduler, u32 level) {
+    u32& slot = scheduler->wheel[level][(scheduler->now >> (VM_WHEEL_BITS * level)) & (VM_WHEEL_SLOTS - 1)];
+    u32 link = slot;
+    slot = 0;
+    while (link) {
+        Context* ctx = scheduler->pool->slots + link - 1;
+        link = ctx->nextWaiting;
+        vm_scheduler_file(scheduler, ctx);
     }
-    if (reg3 < 0 || reg3 >= MAX_REGISTERS) {
-        error(parser, "REGISTER 3 TOO HIGH!\n");
-        return -1;
+}
+
+//advances one tick and resumes everything due on it with a fresh frame of fuel. whatever WAITs again goes straight
+//back on the wheel (or an event list), anything that halts, yields or errors is the host's again and goes to stopped
+//(when there is one)
+//returns how many instances it resumed
+u32 vm_scheduler_tick(VMScheduler* scheduler, s32 fuel = VM_DEFAULT_FUEL, void (*stopped)(Context* ctx, void* user) = NULL, void* user = NULL) {
+    scheduler->now++;
+    for (u32 level = 1; level < VM_WHEEL_LEVELS; level++) {
+        if (scheduler->now & ((1u << (VM_WHEEL_BITS * level)) - 1)) break; //only when the level below wraps around
+        vm_scheduler_cascade(scheduler, level);
     }
 
+    u32& slot = scheduler->wheel[0][scheduler->now & (VM_WHEEL_SLOTS - 1)];
+    u32 link = slot;
+    slot = 0; //anything that WAITs 64 ticks lands back in this slot, after the list was taken off it
+    u32 woken = 0;
+    while (link) {
+        Context* ctx = scheduler->pool->slots + link - 1;
+        link = ctx->nextWaiting;
+        scheduler->sleeping--;
+        woken++;
+        vm_resume(*ctx, fuel);
+        if (!vm_scheduler_park(scheduler, ctx) && stopped) stopped(ctx, user);
+    }
+    return woken;
+}
 
-    regs[0] = reg1;
-    regs[1] = reg2;
-    regs[2] = reg3;
+//runs a frame's worth of instances across a fixed set of threads. every worker has a queue of the instances it was
+//handed and takes from its head, and one that runs dry steals from the heads of the others until they're all empty.
+//nothing gets pushed while workers run, so a queue is a fixed ring and taking one is a single CAS on its head, the
+//same CAS for the owner and a thief (the owner taking oldest first is what keeps the order round robin). each worker
+//has its own effect queue bound while it runs, the deque heads are the only thing workers write to that another one
+//reads while they run
+//a frame is rounds of quanta: every round each queued instance runs at most quantum instructions, and the ones with
+//frame budget left (and the deadline not passed) go back in the queues behind the ones still waiting for this round.
+//the clock is read once per quantum, so one instance can't hold a worker past the deadline by more than a quantum, and
+//whatever the deadline cut off stays queued ahead of anything newer for the next frame
+//the thread calling vm_workers_run_frame is worker 0, vm_workers_create starts the others
+#define VM_MAX_WORKERS 64
+#define VM_DEFAULT_QUANTUM 256 //instructions between clock checks
+
+struct VMTask {
+    Context* ctx;
+    s32 budget; //instructions left this frame, it's out of the frame at 0
+};
 
-    return 0;
+struct VMWorker {
+    std::atomic<u64> head; //next instance to take, by the owner or a thief
+    u64 tail; //one past the last pushed, only written between rounds
+    VMTask* tasks;
+    u32 capacity; //power of two
+    VMTask* carry; //instances this worker ran this round that have budget left, requeued after the round
+    u32 carryCount;
+    VMEffectQueue effects;
+    u32 ran; //instances started this frame, the rest of these count the same way
+    u32 stolen; //quanta run on an instance taken off someone else's queue
+    u32 quanta;
+    u64 fuelCharged;
+    std::thread thread;
+};
+
+//what vm_workers_run_frame did
+struct VMFrameStats {
+    u32 ran; //instances that got at least one quantum
+    u32 deferred; //still queued when the frame ended, the deadline came first. they go first next frame
+    u32 quanta;
+    u32 rounds;
+    u64 fuelCharged; //charged a block at a time on taken jumps, not an instruction count: the block a HLT, YIELD or error
+                     //ends doesn't get charged, and neither does a quantum that ends in WAIT (it reuses the fuel field)
+    u64 elapsed; //ns
+};
+
+struct VMWorkerPool {
+    VMWorker workers[VM_MAX_WORKERS];
+    u32 count;
+    u32 next; //round robin for vm_workers_submit
+    std::mutex lock; //round, running and quit
+    std::condition_variable start;
+    std::condition_variable done;
+    u32 round;
+    u32 running; //workers other than 0 still in the round
+    bool quit;
+    u64 deadline; //vm_time_ns past which no worker starts another quantum
+    s32 fuel; //budget per instance per frame
+    s32 quantum;
+};
+
+//one instance off the head of worker's queue, false once it's empty. a CAS that loses to someone else just tries again
+inline bool vm_worker_take(VMWorker& worker, VMTask* task) {
+    u64 head = worker.head.load(std::memory_order_relaxed);
+    while (head < worker.tail) {
+        *task = worker.tasks[head & (worker.capacity - 1)];
+        if (worker.head.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel, std::memory_order_relaxed)) return true;
+    }
+    return false;
 }
 
-int parseRegisterAndValue(VM* vm, Parser* parser, Scanner* scanner, int* vals) {
-    parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand");
-    // int registerNumber = (int)strtol(parser->current.start, NULL, 10);
-    const char* end = NULL;
-    parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
+//the first instance any other worker still has, starting with the one after self so thieves spread out
+inline bool vm_worker_steal(VMWorkerPool* pool, u32 self, VMTask* task) {
+    for (u32 i = 1; i < pool->count; i++) {
+        if (vm_worker_take(pool->workers[(self + i) % pool->count], task)) return true;
+    }
+    return false;
+}
 
-    u32 registerNumber = string_to_int(parser->previous.start, &end);
+//one quantum of one instance. out of fuel with budget left means it still wants to run this frame, anything else
+//(halted, error, WAIT, YIELD, a full effect queue) is done with the frame
+inline void vm_worker_quantum(VMWorkerPool* pool, VMWorker& worker, VMTask task) {
+    s32 slice = task.budget < pool->quantum ? task.budget : pool->quantum;
+    if (task.budget == pool->fuel) worker.ran++;
+    vm_resume(*task.ctx, slice);
+    s32 used = slice - task.ctx->fuel; //charged a block at a time, so it can run a few past the slice
+    worker.quanta++;
+    if (task.ctx->status == VM_YIELDED && task.ctx->fuel <= 0) {
+        worker.fuelCharged += (u64)used;
+        task.budget -= used;
+        if (task.budget > 0) worker.carry[worker.carryCount++] = task;
+    }
+    else if (task.ctx->status != VM_WAITING && task.ctx->status != VM_WAITING_EVENT) { //their fuel field holds the tick or event now
+        worker.fuelCharged += (u64)(used > 0 ? used : 0);
+    }
+}
 
-    if (registerNumber < 0 || registerNumber >= MAX_REGISTERS) {
-        error(parser, "REGISTER NUMBER TOO HIGH!\n");
-        return -1;
+static void vm_worker_round(VMWorkerPool* pool, u32 index) {
+    VMWorker& worker = pool->workers[index];
+    VMEffectQueue* outer = vm_effect_queue_bind(&worker.effects);
+    vmOnWorker = true;
+    VMTask task;
+    while (vm_time_ns() < pool->deadline) {
+        if (!vm_worker_take(worker, &task)) {
+            if (!vm_worker_steal(pool, index, &task)) break;
+            worker.stolen++;
+        }
+        vm_worker_quantum(pool, worker, task);
     }
+    vmOnWorker = false;
+    vm_effect_queue_bind(outer);
+}
 
-    vals[0] = registerNumber;
+static void vm_worker_main(VMWorkerPool* pool, u32 index) {
+    u32 seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> hold(pool->lock);
+            pool->start.wait(hold, [&] { return pool->quit || pool->round != seen; });
+            if (pool->quit) return;
+            seen = pool->round;
+        }
+        vm_worker_round(pool, index);
+        std::lock_guard<std::mutex> hold(pool->lock);
+        if (--pool->running == 0) pool->done.notify_one();
+    }
+}
 
-    parser_consume(parser, scanner, TOK_INSTRUCTION_VALUE, "Expected number as second operand");
-    //this will mask off negative numbers, need to handle it better later
-    parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
+//count workers (the caller plus count - 1 threads), each queue holds up to capacity instances and each effect queue
+//effectCapacity records, both powers of two
+VMWorkerPool* vm_workers_create(u32 count, u32 capacity, u32 effectCapacity) {
+    Assert(count && count <= VM_MAX_WORKERS);
+    Assert(capacity && !(capacity & (capacity - 1)));
+    VMWorkerPool* pool = new VMWorkerPool();
+    pool->count = count;
+    for (u32 i = 0; i < count; i++) {
+        VMWorker& worker = pool->workers[i];
+        worker.tasks = (VMTask*)malloc(sizeof(VMTask) * capacity);
+        worker.capacity = capacity;
+        worker.carry = (VMTask*)malloc(sizeof(VMTask) * capacity * count); //it could steal every queue's worth in a round
+        vm_effect_queue_init(&worker.effects, (VMEffect*)malloc(sizeof(VMEffect) * effectCapacity), effectCapacity);
+    }
+    for (u32 i = 1; i < count; i++) pool->workers[i].thread = std::thread(vm_worker_main, pool, i);
+    return pool;
+}
 
-    int instructionValue = string_to_int(parser->previous.start, &end) & 0x0000FFFF;
+void vm_workers_destroy(VMWorkerPool* pool) {
+    {
+        std::lock_guard<std::mutex> hold(pool->lock);
+        pool->quit = true;
+    }
+    pool->start.notify_all();
+    for (u32 i = 0; i < pool->count; i++) {
+        VMWorker& worker = pool->workers[i];
+        if (worker.thread.joinable()) worker.thread.join();
+        free(worker.tasks);
+        free(worker.carry);
+        free(worker.effects.records);
+    }
+    delete pool;
+}
 
-    // int instructionValue =((int)strtol(parser->current.start, NULL, 10)) & 0x0000FFFF;//can only use 16 bytes for the value
+inline bool vm_worker_push_task(VMWorker& worker, VMTask task) {
+    if (worker.tail - worker.head.load(std::memory_order_relaxed) == worker.capacity) return false;
+    worker.tasks[worker.tail++ & (worker.capacity - 1)] = task;
+    return true;
+}
 
-    vals[1] = (instructionValue) >> 8;
+//queues an instance on one worker for the next frame, false when that worker's queue is full. between frames only
+//the decode gets built here rather than on whichever worker runs it first, the JIT code when the frame starts
+bool vm_workers_push(VMWorkerPool* pool, u32 index, Context* ctx) {
+    vm_decode(*ctx->program);
+    return vm_worker_push_task(pool->workers[index], { ctx, 0 }); //the frame it runs in sets the budget
+}
 
-    vals[2] = instructionValue & 0xff;
+//spreads instances round robin, a full queue passes it on to the next worker
+bool vm_workers_submit(VMWorkerPool* pool, Context* ctx) {
+    for (u32 i = 0; i < pool->count; i++) {
+        u32 index = pool->next;
+        pool->next = (pool->next + 1) % pool->count;
+        if (vm_workers_push(pool, index, ctx)) return true;
+    }
+    return false;
+}
 
-    return 0;
+//instances submitted but not run yet
+u32 vm_workers_pending(VMWorkerPool* pool) {
+    u32 pending = 0;
+    for (u32 i = 0; i < pool->count; i++) pending += (u32)(pool->workers[i].tail - pool->workers[i].head.load(std::memory_order_relaxed));
+    return pending;
 }
 
+//runs every queued instance for up to fuel instructions, quantum at a time round robin, spread over the workers, and
+//returns once they're all out of the frame or the clock passes deadline (vm_time_ns). the caller checks their status
+//and drains the effects (vm_workers_drain_effects), anything deferred is still queued for the next frame
+VMFrameStats vm_workers_run_frame(VMWorkerPool* pool, u64 deadline, s32 fuel = VM_DEFAULT_FUEL, s32 quantum = VM_DEFAULT_QUANTUM) {
+    Assert(fuel > 0 && quantum > 0);
+    u64 start = vm_time_ns();
+    pool->deadline = deadline;
+    pool->fuel = fuel;
+    pool->quantum = quantum;
+    for (u32 i = 0; i < pool->count; i++) {
+        VMWorker& worker = pool->workers[i];
+        for (u64 at = worker.head.load(std::memory_order_relaxed); at < worker.tail; at++) {
+            VMTask& task = worker.tasks[at & (worker.capacity - 1)];
+            task.budget = fuel;
+            //a push after this one's may have wrapped the arena, so it's checked here where compiling is safe. if the
+            //queued programs don't all fit the ones a later compile wrapped over run threaded (vmOnWorker)
+            if (task.ctx->dispatch == DISPATCH_JIT && task.ctx->program->verified) vm_jit_ready(*task.ctx->program);
+        }
+        worker.ran = worker.stolen = worker.quanta = 0;
+        worker.fuelCharged = 0;
+    }
 
-struct operand {
-    addressing_mode mode;
+    VMFrameStats stats = {};
+    while (vm_workers_pending(pool) && vm_time_ns() < deadline) {
+        {
+            std::lock_guard<std::mutex> hold(pool->lock);
+            pool->running = pool->count - 1;
+            pool->round++;
+        }
+        pool->start.notify_all();
+        vm_worker_round(pool, 0);
+        {
+            std::unique_lock<std::mutex> hold(pool->lock);
+            pool->done.wait(hold, [&] { return pool->running == 0; });
+        }
+        stats.rounds++;
+
+        //behind anything the deadline kept from running this round, on the worker that ran it when there's room
+        for (u32 i = 0; i < pool->count; i++) {
+            VMWorker& worker = pool->workers[i];
+            for (u32 t = 0; t < worker.carryCount; t++) {
+                bool queued = vm_worker_push_task(worker, worker.carry[t]);
+                for (u32 other = 1; !queued && other < pool->count; other++) {
+                    queued = vm_worker_push_task(pool->workers[(i + other) % pool->count], worker.carry[t]);
+                }
+                Assert(queued); //there's a slot for everything that was taken this round
+            }
+            worker.carryCount = 0;
+        }
+    }
+
+    for (u32 i = 0; i < pool->count; i++) {
+        VMWorker& worker = pool->workers[i];
+        stats.ran += worker.ran;
+        stats.quanta += worker.quanta;
+        stats.fuelCharged += worker.fuelCharged;
+    }
+    stats.deferred = vm_workers_pending(pool);
+    stats.elapsed = vm_time_ns() - start;
+    return stats;
+}
+
+//every worker's effects from the frames so far, a worker at a time
+u32 vm_workers_drain_effects(VMWorkerPool* pool, void (*fn)(const VMEffect* records, u32 count, void* user), void* user) {
+    u32 total = 0;
+    for (u32 i = 0; i < pool->count; i++) total += vm_effect_drain(&pool->workers[i].effects, fn, user);
+    return total;
+}
+
+void test_reset_vm() {
+    VM vm = {};
+    reset_vm(&vm);
+
+    for (int i = 0; i < 32; i++)Assert(vm.registers[i] == 0);
+}
+
+
+
+
+// PARSER START
+
+
+const char* tok_to_str(TokenTypes type) {
+    switch (type) {
+        case TOK_LEFT_PAREN: return "TOK_LEFT_PAREN ";
+        case TOK_RIGHT_PAREN: return "TOK_RIGHT_PAREN ";
+        case TOK_LEFT_BRACE: return "TOK_LEFT_BRACE ";
+        case TOK_RIGHT_BRACE: return "TOK_RIGHT_BRACE ";
+        case TOK_LEFT_BRACKET: return "TOK_LEFT_BRACKET ";
+        case TOK_RIGHT_BRACKET: return "TOK_RIGHT_BRACKET ";
+        case TOK_COMMA: return "TOK_COMMA ";
+        case TOK_DOT: return "TOK_DOT ";
+        case TOK_MINUS: return "TOK_MINUS ";
+        case TOK_PLUS: return "TOK_PLUS ";
+        case TOK_SEMICOLON: return "TOK_SEMICOLON ";
+        case TOK_COLON: return "TOK_COLON ";
+        case TOK_SLASH: return "TOK_SLASH ";
+        case TOK_STAR: return "TOK_STAR ";
+        case TOK_BANG: return "TOK_BANG ";
+        case TOK_BANG_EQUAL: return "TOK_BANG_EQUAL ";
+        case TOK_EQUAL: return "TOK_EQUAL ";
+        case TOK_EQUAL_EQUAL: return "TOK_EQUAL_EQUAL ";
+        case TOK_GREATER: return "TOK_GREATER ";
+        case TOK_GREATER_EQUAL: return "TOK_GREATER_EQUAL ";
+        case TOK_LESS: return "TOK_LESS ";
+        case TOK_LESS_EQUAL: return "TOK_LESS_EQUAL ";
+        case TOK_IDENTIFIER: return "TOK_IDENTIFIER  ";
+        case TOK_SYSCALL: return "TOK_SYSCALL  ";
+        case TOK_STRING: return "TOK_STRING  ";
+        case TOK_NUMBER: return "TOK_NUMBER ";
+        case TOK_HEX: return "TOK_HEX ";
+        case TOK_AND: return "TOK_AND ";
+        case TOK_ELSE: return "TOK_ELSE ";
+        case TOK_FALSE: return "TOK_FALSE ";
+        case TOK_FOR: return "TOK_FOR ";
+        case TOK_FUN: return "TOK_FUN ";
+        case TOK_IF: return "TOK_IF ";
+        case TOK_NIL: return "TOK_NIL  ";
+        case TOK_OR: return "TOK_OR ";
+        case TOK_PRINT: return "TOK_PRINT ";
+        case TOK_RETURN: return "TOK_RETURN ";
+        case TOK_TRUE: return "TOK_TRUE ";
+        case TOK_VAR: return "TOK_VAR ";
+        case TOK_WHILE: return "TOK_WHILE ";
+        case TOK_STRUCT: return "TOK_STRUCT ";
+        case TOK_ERROR: return "TOK_ERROR ";
+        case TOK_INSTRUCTION: return "TOK_INSTRUCTION";
+
+        case TOK_LOAD: return "TOK_LOAD";
+        case TOK_ADD: return "TOK_ADD";
+        case TOK_SUB: return "TOK_SUB";
+        case TOK_MUL: return "TOK_MUL";
+        case TOK_DIV: return "TOK_DIV";
+        case TOK_JMP: return "TOK_JMP";
+        case TOK_JMPF: return "TOK_JMPF";
+        case TOK_JMPB: return "TOK_JMPB";
+        case TOK_JEQ: return "TOK_JEQ";
+        case TOK_JNE: return "TOK_JNE";
+        case TOK_EQ: return "TOK_EQ";
+        case TOK_NEQ: return "TOK_NEQ";
+        case TOK_GT: return "TOK_GT";
+        case TOK_LT: return "TOK_LT";
+        case TOK_GTQ: return "TOK_GTQ";
+        case TOK_LTQ: return "TOK_LTQ";
+        case TOK_ALOC: return "TOK_ALOC";
+        case TOK_FREE: return "TOK_FREE";
+        case TOK_HLT: return "TOK_HLT";
+        case TOK_INC: return "TOK_INC";
+        case TOK_DEC: return "TOK_DEC";
+        case TOK_LABEL_USAGE: return "TOK_LABEL_USAGE";
+        case TOK_DIRECTIVE: return "TOK_DIRECTIVE";
+        case TOK_RESB: return "TOK_RESB";
+
+        case TOK_COMMAND_REGISTERS: return "TOK_COMMAND_REGISTERS";
+        case TOK_COMMAND_QUIT: return "TOK_COMMAND_QUIT";
+        case TOK_COMMAND_HISTORY: return "TOK_COMMAND_HISTORY";
+        case TOK_COMMAND_PROGRAM: return "TOK_COMMAND_PROGRAM";
+        case TOK_COMMAND_CLEAR: return "TOK_COMMAND_CLEAR";
+        case TOK_COMMAND_RESUME: return "TOK_COMMAND_RESUME";
+        case TOK_PRT: return "TOK_PRT";
+        case TOK_PUSH: return "TOK_PUSH";
+        case TOK_POP: return "TOK_POP";
+        case TOK_ENTER: return "TOK_ENTER";
+        case TOK_LEAVE: return "TOK_LEAVE";
+        case TOK_YIELD: return "TOK_YIELD";
+        case TOK_WAIT: return "TOK_WAIT";
+        case TOK_WAIT_EVENT: return "TOK_WAIT_EVENT";
+        case TOK_CALL: return "TOK_CALL";
+        case TOK_RET: return "TOK_RET";
+
+        case TOK_REGISTER: return "TOK_REGISTER";
+        case TOK_INSTRUCTION_VALUE: return "TOK_INSTRUCTION_VALUE";
+        case TOK_RAW: return "TOK_RAW";
+
+        case TOK_EOF: {
+            // __debugbreak();
+            return "TOK_EOF ";
+        }
+        case TOK_NEWLINE: { return "TOK_NEWLINE "; }
+                    defult: return "NONE????";
+        default:{}break;
+    }
+
+    return "NONE????";
+
+}
+
+
+
+inline bool isAtEnd(Scanner* scanner) {
+    return (*scanner->current == '\0');
+}
+
+inline char charPeek(Scanner* scanner) {
+    return *scanner->current;
+}
+
+
+static bool TOK_match(Scanner* scanner, char expected) {
+    if (isAtEnd(scanner))return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
+    return true;
+}
+
+static Token makeToken(Scanner* scanner, TokenTypes type) {
+    if (!scanner->quiet) printf("making token: %24s on line %d\n", tok_to_str(type), scanner->line);
+    Token token;
+    token.type = type;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
+    return token;
+}
+
+static Token errorToken(Scanner* scanner, const char* message) {
+    Token token;
+    token.type = TOK_ERROR;
+    token.start = message;
+    token.length = (int)strlen(message);
+    token.line = scanner->line;
+    return token;
+}
+
+
+
+char scannerAdvance(Scanner* scanner) {
+    scanner->current++;
+    return (scanner->current[-1]);
+}
+
+inline char charPeekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
+}
+
+
+static void skipWhitespace(Scanner* scanner) {
+    for (;;) {
+        char c = charPeek(scanner);
+        switch (c) {
+        case ' ':
+        case '\r':
+        case '\t':
+            scannerAdvance(scanner);
+            break;
+            // case '\n'://handle newline as an explicit token to know when the next instruction begins
+            //     scanner->line++;
+            //     scannerAdvance(scanner);
+            //     break;
+        case ';': {
+            while (charPeek(scanner) != '\n' && !isAtEnd(scanner)) scannerAdvance(scanner);
+        }break;
+        case '/':
+            if (charPeekNext(scanner) == '/') {
+                //a comment goes until the end of the line
+                while (charPeek(scanner) != '\n' && !isAtEnd(scanner)) scannerAdvance(scanner);
+            }
+            else {
+                return;
+            }
+        default:
+            return;
+        }
+    }
+}
+
+
+
+inline bool isHexDigit(char c) {
+    return (c >= '0' && c <= '9') ||
+        (c >= 'a' && c <= 'f') ||
+        (c >= 'A' && c <= 'F');
+}
+
+uint8_t hexCharToValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return 0;//should never happen if isHexDigit is checked first
+}
+
+int parseHex(Scanner* scanner, VM* vm) {
+    u8 hexVals[4] = {};
+    for (u32 i = 0; i < 4; i++) {
+        skipWhitespace(scanner);
+        if (isHexDigit(*scanner->current) && isHexDigit(*(scanner->current + 1))) {
+            hexVals[i] = (hexCharToValue(*scanner->current) << 4) | hexCharToValue(*(scanner->current + 1));
+            scanner->current += 2;
+        }
+        else {
+            return -1;
+        }
+    }
+    memcpy(vm->bytecode + vm->byteCount, hexVals, sizeof(u8) * 4);
+    vm->byteCount += 4;
+
+    return 0;
+}
+
+//keywords are looked up with a perfect hash the compiler finds: vmKeywordTableBuild tries seeds until every keyword in
+//the list gets a slot to itself, so a lookup is one hash, one slot and one compare. case doesn't matter (load, LOAD, Load)
+struct VMKeyword {
+    const char* name; //lower case
+    TokenTypes type;
+};
+
+static constexpr VMKeyword vmMnemonics[] = {
+    { "load", TOK_LOAD }, { "add", TOK_ADD }, { "sub", TOK_SUB }, { "mul", TOK_MUL }, { "div", TOK_DIV },
+    { "jmp", TOK_JMP }, { "jmpf", TOK_JMPF }, { "jmpb", TOK_JMPB }, { "jeq", TOK_JEQ }, { "jne", TOK_JNE },
+    { "eq", TOK_EQ }, { "neq", TOK_NEQ }, { "gt", TOK_GT }, { "lt", TOK_LT }, { "gtq", TOK_GTQ }, { "ltq", TOK_LTQ },
+    { "aloc", TOK_ALOC }, { "free", TOK_FREE }, { "hlt", TOK_HLT }, { "inc", TOK_INC }, { "dec", TOK_DEC },
+    { "resb", TOK_RESB }, { "prt", TOK_PRT }, { "push", TOK_PUSH }, { "pop", TOK_POP }, { "enter", TOK_ENTER },
+    { "leave", TOK_LEAVE }, { "yield", TOK_YIELD }, { "wait", TOK_WAIT }, { "wait_event", TOK_WAIT_EVENT },
+    { "call", TOK_CALL }, { "ret", TOK_RET }, { "syscall", TOK_SYSCALL }, { "raw", TOK_RAW },
+};
+
+static constexpr VMKeyword vmReplCommands[] = {
+    { "clear", TOK_COMMAND_CLEAR }, { "quit", TOK_COMMAND_QUIT }, { "history", TOK_COMMAND_HISTORY },
+    { "program", TOK_COMMAND_PROGRAM }, { "registers", TOK_COMMAND_REGISTERS }, { "resume", TOK_COMMAND_RESUME },
+};
+
+//the higher level language's, nothing scans for it yet
+static constexpr VMKeyword vmLanguageKeywords[] = {
+    { "and", TOK_AND }, { "else", TOK_ELSE }, { "false", TOK_FALSE }, { "for", TOK_FOR }, { "fun", TOK_FUN },
+    { "if", TOK_IF }, { "nil", TOK_NIL }, { "or", TOK_OR }, { "print", TOK_PRINT }, { "return", TOK_RETURN },
+    { "struct", TOK_STRUCT }, { "true", TOK_TRUE }, { "var", TOK_VAR }, { "while", TOK_WHILE },
+};
+
+#define VM_KEYWORD_SLOTS 256
+#define VM_KEYWORD_MAX_LENGTH 10 //wait_event, anything longer is an identifier without hashing it
+
+constexpr char vmFoldCase(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+}
+
+constexpr u32 vmKeywordHash(const char* name, u32 length, u32 seed) {
+    u32 hash = seed ^ length;
+    for (u32 i = 0; i < length; i++) hash = (hash ^ (u8)vmFoldCase(name[i])) * 16777619u;
+    return (hash ^ (hash >> 16)) & (VM_KEYWORD_SLOTS - 1);
+}
+
+constexpr u32 vmKeywordLength(const char* name) {
+    u32 length = 0;
+    while (name[length]) length++;
+    return length;
+}
+
+struct VMKeywordTable {
+    u32 seed; //0 when no seed worked
+    u8 slots[VM_KEYWORD_SLOTS]; //index + 1 of the keyword that hashes there, 0 for none
+};
+
+template <u32 N>
+constexpr VMKeywordTable vmKeywordTableBuild(const VMKeyword (&keywords)[N]) {
+    for (u32 seed = 1; seed < 4096; seed++) {
+        VMKeywordTable table = { seed, {} };
+        bool collided = false;
+        for (u32 i = 0; i < N && !collided; i++) {
+            u32 slot = vmKeywordHash(keywords[i].name, vmKeywordLength(keywords[i].name), seed);
+            collided = table.slots[slot] != 0;
+            table.slots[slot] = (u8)(i + 1);
+        }
+        if (!collided) return table;
+    }
+    return { 0, {} };
+}
+
+static constexpr VMKeywordTable vmMnemonicTable = vmKeywordTableBuild(vmMnemonics);
+static constexpr VMKeywordTable vmReplCommandTable = vmKeywordTableBuild(vmReplCommands);
+static constexpr VMKeywordTable vmLanguageKeywordTable = vmKeywordTableBuild(vmLanguageKeywords);
+static_assert(vmMnemonicTable.seed && vmReplCommandTable.seed && vmLanguageKeywordTable.seed, "no perfect hash seed, raise VM_KEYWORD_SLOTS");
+
+//the keyword name is, otherwise when it isn't one
+inline TokenTypes vmKeywordLookup(const VMKeywordTable& table, const VMKeyword* keywords, const char* name, u32 length, TokenTypes otherwise) {
+    if (length > VM_KEYWORD_MAX_LENGTH) return otherwise;
+    u8 index = table.slots[vmKeywordHash(name, length, table.seed)];
+    if (!index) return otherwise;
+    const char* keyword = keywords[index - 1].name;
+    for (u32 i = 0; i < length; i++) {
+        if (vmFoldCase(name[i]) != keyword[i]) return otherwise; //a shorter keyword ends in 0, which no name char folds to
+    }
+    return keyword[length] ? otherwise : keywords[index - 1].type;
+}
+
+static TokenTypes InstructionType(Scanner* scanner) {
+    return vmKeywordLookup(vmMnemonicTable, vmMnemonics, scanner->start, (u32)(scanner->current - scanner->start), TOK_IDENTIFIER);
+}
+
+static TokenTypes identifierType(Scanner* scanner) {
+    return vmKeywordLookup(vmLanguageKeywordTable, vmLanguageKeywords, scanner->start, (u32)(scanner->current - scanner->start), TOK_IDENTIFIER);
+}
+
+//names can have underscores after the first letter (cast_projectile)
+inline bool isIdentifierChar(char c) {
+    return isAlpha(c) || isNumeric(c) || c == '_';
+}
+
+static Token identifier(Scanner* scanner) {
+    while (isIdentifierChar(charPeek(scanner))) scannerAdvance(scanner);
+    return makeToken(scanner, identifierType(scanner));
+}
+
+
+static Token instruction(Scanner* scanner) {
+    while (isIdentifierChar(charPeek(scanner))) scannerAdvance(scanner);
+    return makeToken(scanner, InstructionType(scanner));
+}
+
+static Token number(Scanner* scanner) {
+    if ((charPeek(scanner) == 'x' || charPeek(scanner) == 'X')) {
+        if (!scanner->quiet) printf("HEX FOUND!\n");
+        scannerAdvance(scanner);
+        if (!isHexDigit(charPeek(scanner))) {
+            return errorToken(scanner, "Unexpected character in hex value.");
+        }
+        while (isHexDigit(charPeek(scanner))) scannerAdvance(scanner);
+        return makeToken(scanner, TOK_HEX);
+    }
+
+    while (isNumeric(charPeek(scanner))) scannerAdvance(scanner);
+
+    //look for a fractional part
+    if (charPeek(scanner) == '.' && isNumeric(charPeekNext(scanner))) {
+        //consume the "."
+        scannerAdvance(scanner);
+        while (isNumeric(charPeek(scanner))) scannerAdvance(scanner);
+    }
+    return makeToken(scanner, TOK_NUMBER);
+}
+
+static Token string(Scanner* scanner) {
+    while (charPeek(scanner) != '"' && !isAtEnd(scanner)) {
+        if (charPeek(scanner) == '\n'){
+            scanner->line++;
+        } 
+        scannerAdvance(scanner);
+    }
+
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string");
+
+    //the closing quote
+    scannerAdvance(scanner);
+    return makeToken(scanner, TOK_STRING);
+}
+
+
+Token scanToken(Scanner* scanner) {
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
+    if (isAtEnd(scanner)) {
+        return makeToken(scanner, TOK_EOF);
+    }
+
+    char c = scannerAdvance(scanner);
+    //TODO:
+    //could add a check here for slashes/dots/stuff to denote repl commands
+
+    //would probably want a different scanToken function for assembly/higher language parser
+    // if(isAlpha(c)) return identifier(scanner);
+
+    if (isAlpha(c))return instruction(scanner);
+    if (isNumeric(c)) return number(scanner);
+
+
+    switch (c) {
+    case '(': return makeToken(scanner, TOK_LEFT_PAREN);
+    case ')': return makeToken(scanner, TOK_RIGHT_PAREN);
+    case '{': return makeToken(scanner, TOK_LEFT_BRACE);
+    case '}': return makeToken(scanner, TOK_RIGHT_BRACE);
+    case '[': return makeToken(scanner, TOK_LEFT_BRACKET);
+    case ']': return makeToken(scanner, TOK_RIGHT_BRACKET);
+    case ':': return makeToken(scanner, TOK_COLON);
+    case '@': return makeToken(scanner, TOK_LABEL_USAGE);
+    case ',': return makeToken(scanner, TOK_COMMA);
+    case '.': return makeToken(scanner, TOK_DOT);
+    case '-': return makeToken(scanner, TOK_MINUS);
+    case '+': return makeToken(scanner, TOK_PLUS);
+    case '/': return makeToken(scanner, TOK_SLASH);
+    case '*': return makeToken(scanner, TOK_STAR);
+    case '\n':return makeToken(scanner, TOK_NEWLINE);
+
+    case '!':
+        return makeToken(scanner, TOK_match(scanner, '=') ? TOK_BANG_EQUAL : TOK_BANG);
+    case '=':
+        return makeToken(scanner, TOK_match(scanner, '=') ? TOK_EQUAL_EQUAL : TOK_EQUAL);
+    case '<':
+        return makeToken(scanner, TOK_match(scanner, '=') ? TOK_LESS_EQUAL : TOK_LESS);
+    case '>':
+        return makeToken(scanner, TOK_match(scanner, '=') ? TOK_GREATER_EQUAL : TOK_GREATER);
+    case '"': return string(scanner);
+
+    case '`': {
+        if (!scanner->quiet) printf("MAKE REPL COMMAND HERE!\n");
+    }
+    case '$': return makeToken(scanner, TOK_REGISTER);
+    case '#': return makeToken(scanner, TOK_INSTRUCTION_VALUE);
+
+    }
+
+    return errorToken(scanner, "Unexpected character.");
+}
+
+//what vm_lex does with each byte, built once by the compiler
+enum lex_kinds : u8 {
+    LEX_OTHER, //not in the language, an "Unexpected character." error
+    LEX_END,   //the terminating 0
+    LEX_BLANK, //' ', '\t', '\r', the newline is a token
+    LEX_ALPHA,
+    LEX_DIGIT,
+    LEX_QUOTE,
+    LEX_SINGLE, //a token by itself, or before a '=' (!=, ==, <=, >=)
+};
+
+struct VMLexTable {
+    u8 kind[256];
+    u8 type[256]; //the token a LEX_SINGLE byte makes
+    bool identifier[256]; //letters, digits and '_' after the first letter
+};
+
+constexpr VMLexTable vmLexTableBuild() {
+    VMLexTable table = {};
+    table.kind[0] = LEX_END;
+    table.kind[(u8)' '] = table.kind[(u8)'\t'] = table.kind[(u8)'\r'] = LEX_BLANK;
+    for (u32 c = 0; c < 256; c++) {
+        bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        bool digit = c >= '0' && c <= '9';
+        if (alpha) table.kind[c] = LEX_ALPHA;
+        if (digit) table.kind[c] = LEX_DIGIT;
+        table.identifier[c] = alpha || digit || c == '_';
+    }
+    table.kind[(u8)'"'] = LEX_QUOTE;
+    const char singles[] = "(){}[]:@,.-+/*\n!=<>`$#";
+    const TokenTypes types[] = {
+        TOK_LEFT_PAREN, TOK_RIGHT_PAREN, TOK_LEFT_BRACE, TOK_RIGHT_BRACE, TOK_LEFT_BRACKET, TOK_RIGHT_BRACKET,
+        TOK_COLON, TOK_LABEL_USAGE, TOK_COMMA, TOK_DOT, TOK_MINUS, TOK_PLUS, TOK_SLASH, TOK_STAR, TOK_NEWLINE,
+        TOK_BANG, TOK_EQUAL, TOK_LESS, TOK_GREATER, TOK_REGISTER, TOK_REGISTER, TOK_INSTRUCTION_VALUE,
+    };
+    for (u32 i = 0; singles[i]; i++) {
+        table.kind[(u8)singles[i]] = LEX_SINGLE;
+        table.type[(u8)singles[i]] = (u8)types[i];
+    }
+    return table;
+}
+
+static constexpr VMLexTable vmLex = vmLexTableBuild();
+static_assert(TOK_NEWLINE < 256, "token types are stored in a byte");
+
+#if VM_SIMD_LEX
+//GCC and Clang builtins, MSVC intrinsics
+inline u32 vmLowestBit(u32 mask) {
+#if defined(_MSC_VER)
+    unsigned long bit;
+    _BitScanForward(&bit, mask);
+    return bit;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+//the loads are 16 byte aligned so they never touch a page the text isn't on, but they do read past the terminator
+#if defined(__GNUC__) || defined(__clang__)
+    #define VM_LEX_NO_ASAN __attribute__((no_sanitize_address))
+#else
+    #define VM_LEX_NO_ASAN
+#endif
+
+//first byte at or after at that isn't ' ', '\t' or '\r', the terminator stops it
+VM_LEX_NO_ASAN inline const char* lexSkipBlanks(const char* at) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    u32 offset = (u32)((uintptr_t)at & 15);
+    const __m128i* block = (const __m128i*)(at - offset);
+    for (u32 skip = 0xFFFFu >> (16 - offset);; skip = 0, block++) { //skip the bytes before at in the first block
+        __m128i bytes = _mm_load_si128(block);
+        __m128i blank = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, space), _mm_cmpeq_epi8(bytes, tab)), _mm_cmpeq_epi8(bytes, cr));
+        u32 other = ~((u32)_mm_movemask_epi8(blank) | skip) & 0xFFFF;
+        if (other) return (const char*)block + vmLowestBit(other);
+    }
+}
+
+//the '\n' that ends the line at is on, or the terminator
+VM_LEX_NO_ASAN inline const char* lexSkipLine(const char* at) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    u32 offset = (u32)((uintptr_t)at & 15);
+    const __m128i* block = (const __m128i*)(at - offset);
+    for (u32 skip = 0xFFFFu >> (16 - offset);; skip = 0, block++) {
+        __m128i bytes = _mm_load_si128(block);
+        u32 end = (u32)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, newline), _mm_cmpeq_epi8(bytes, zero))) & ~skip;
+        if (end) return (const char*)block + vmLowestBit(end);
+    }
+}
+#else
+inline const char* lexSkipBlanks(const char* at) {
+    while (vmLex.kind[(u8)*at] == LEX_BLANK) at++;
+    return at;
+}
+
+inline const char* lexSkipLine(const char* at) {
+    while (*at != '\n' && *at) at++;
+    return at;
+}
+#endif
+
+//the assembler's lexer: the tokens scanToken would hand out one at a time, made in one pass over the text into
+//tokens[0, capacity), with a table lookup per byte, a perfect hash per mnemonic and whitespace and comments skipped 16
+//bytes at a time. stops when tokens is full or after the TOK_EOF token. at and line are where the next call picks up,
+//line goes up after every newline token and inside strings, the same count the parser keeps. it never prints
+u32 vm_lex(const char** text, int* line, Token* tokens, u32 capacity) {
+    const char* at = *text;
+    int lineAt = *line;
+    u32 count = 0;
+    while (count < capacity) {
+        for (;;) {
+            if (vmLex.kind[(u8)*at] == LEX_BLANK) { //mostly one space between operands, the blocks are for indentation
+                at++;
+                if (vmLex.kind[(u8)*at] == LEX_BLANK) at = lexSkipBlanks(at + 1);
+            }
+            if (*at == ';' || (*at == '/' && at[1] == '/')) at = lexSkipLine(at + 1);
+            else break;
+        }
+
+        Token& token = tokens[count++];
+        token.start = at;
+        token.line = lineAt;
+        u8 c = (u8)*at++;
+        switch (vmLex.kind[c]) {
+        case LEX_END: {
+            token.type = TOK_EOF;
+            token.length = 0;
+            *text = at - 1;
+            *line = lineAt;
+            return count;
+        }break;
+        case LEX_ALPHA: {
+            while (vmLex.identifier[(u8)*at]) at++;
+            token.type = vmKeywordLookup(vmMnemonicTable, vmMnemonics, token.start, (u32)(at - token.start), TOK_IDENTIFIER);
+        }break;
+        case LEX_DIGIT: {
+            token.type = TOK_NUMBER;
+            if (*at == 'x' || *at == 'X') {
+                at++;
+                if (!isHexDigit(*at)) {
+                    token.type = TOK_ERROR;
+                    token.start = "Unexpected character in hex value.";
+                    break;
+                }
+                while (isHexDigit(*at)) at++;
+                token.type = TOK_HEX;
+                break;
+            }
+            while (vmLex.kind[(u8)*at] == LEX_DIGIT) at++;
+            if (*at == '.' && vmLex.kind[(u8)at[1]] == LEX_DIGIT) { //a fractional part
+                at++;
+                while (vmLex.kind[(u8)*at] == LEX_DIGIT) at++;
+            }
+        }break;
+        case LEX_QUOTE: {
+            while (*at != '"' && *at) {
+                if (*at == '\n') lineAt++;
+                at++;
+            }
+            token.line = lineAt;
+            if (!*at) {
+                token.type = TOK_ERROR;
+                token.start = "Unterminated string";
+                break;
+            }
+            at++;
+            token.type = TOK_STRING;
+        }break;
+        case LEX_SINGLE: {
+            token.type = (TokenTypes)vmLex.type[c];
+            if (*at == '=') {
+                switch (c) {
+                case '!': token.type = TOK_BANG_EQUAL; at++; break;
+                case '=': token.type = TOK_EQUAL_EQUAL; at++; break;
+                case '<': token.type = TOK_LESS_EQUAL; at++; break;
+                case '>': token.type = TOK_GREATER_EQUAL; at++; break;
+                }
+            }
+            if (c == '\n') lineAt++;
+        }break;
+        default: {
+            token.type = TOK_ERROR;
+            token.start = "Unexpected character.";
+        }break;
+        }
+        token.length = token.type == TOK_ERROR ? (int)strlen(token.start) : (int)(at - token.start);
+    }
+    *text = at;
+    *line = lineAt;
+    return count;
+}
+
+#define VM_LEX_BATCH 256 //tokens vm_lex makes at a time for the parser, on the stack
+
+//hands the parser tokens from vm_lex, capacity at a time, instead of scanning them one at a time. starts at
+//scanner->current on scanner->line. only for quiet scanners, vm_lex doesn't echo tokens
+void scanner_batch(Scanner* scanner, Token* tokens, u32 capacity) {
+    scanner->tokens = tokens;
+    scanner->tokenCapacity = capacity;
+    scanner->tokenCount = 0;
+    scanner->nextToken = 0;
+    scanner->lexAt = scanner->current;
+    scanner->lexLine = scanner->line;
+}
+
+//the parser's next token. start, current and line end up where scanToken would have left them, the label parsers
+//read names from there
+inline Token scanNext(Scanner* scanner) {
+    if (!scanner->tokens) return scanToken(scanner);
+    if (scanner->nextToken == scanner->tokenCount) {
+        scanner->tokenCount = vm_lex(&scanner->lexAt, &scanner->lexLine, scanner->tokens, scanner->tokenCapacity);
+        scanner->nextToken = 0;
+    }
+    Token token = scanner->tokens[scanner->nextToken];
+    if (token.type != TOK_EOF) scanner->nextToken++; //EOF stays the next token from then on
+    scanner->start = (char*)token.start;
+    scanner->current = (char*)token.start + token.length;
+    scanner->line = token.line;
+    return token;
+}
+
+
+
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode) return;
+    parser->panicMode = true;
+    parser->hadError = true;
+    if (!parser->errorMessage) {
+        parser->errorMessage = message;
+        parser->errorLine = token->line;
+    }
+    if (parser->quiet) return;
+    fprintf(stderr, "[line %d] Error", token->line);
+
+    if (token->type == TOK_EOF) {
+        fprintf(stderr, " at end");
+    }
+    else if (token->type == TOK_ERROR) {
+        //nothing
+    }
+    else {
+        fprintf(stderr, "at '%.*s'", token->length, token->start);
+    }
+    fprintf(stderr, ": %s\n", message);
+    parser->hadError = true;
+}
+
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
+}
+
+
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
+}
+
+
+static void parser_advance(Parser* parser, Scanner* scanner) {
+    parser->previous = parser->current;
+    for (;;) {
+        parser->current = scanNext(scanner);
+        if (parser->current.type != TOK_ERROR)break;
+
+        errorAtCurrent(parser, parser->current.start);
+
+    }
+}
+
+static bool parser_consume(Parser* parser, Scanner* scanner, TokenTypes type, const char* message) {
+    if (parser->current.type == type) {
+        parser_advance(parser, scanner);
+        return true;
+    }
+    errorAtCurrent(parser, message);
+    return false;
+}
+
+inline void parseAdvance(Parser* parser, Scanner* scanner) {
+    parser->previous = parser->current;
+    for (;;) {
+        parser->current = scanNext(scanner);
+        if (parser->current.type != TOK_ERROR)break;
+        errorAtCurrent(parser, parser->current.start);
+    }
+
+}
+
+inline bool tokenCheck(Parser* parser, TokenTypes type) {
+    return parser->current.type == type;
+}
+
+inline bool tokenMatch(Parser* parser, Scanner* scanner, TokenTypes type) {
+    if (!tokenCheck(parser, type))return false;
+    parseAdvance(parser, scanner);
+    return true;
+}
+
+static void synchronize(Parser* parser, Scanner* scanner) {
+    parser->panicMode = false;
+    while (parser->current.type != TOK_EOF) {
+        if (parser->previous.type == TOK_SEMICOLON)return;
+        switch (parser->current.type) {
+        case TOK_FUN:
+        case TOK_VAR:
+        case TOK_FOR:
+        case TOK_IF:
+        case TOK_WHILE:
+        case TOK_PRINT:
+        case TOK_RETURN:
+            return;
+        default:
+            ;//do nothing
+        }
+        parseAdvance(parser, scanner);
+
+    }
+
+}
+
+#define EMIT_INSTRUCTION()\
+    u32 offset = vm->byteCount;\
+    vm->bytecode[offset+0] = code;\
+    vm->bytecode[offset+1] = bytes[0];\
+    vm->bytecode[offset+2] = bytes[1];\
+    vm->bytecode[offset+3] = bytes[2];\
+    vm->byteCount += 4;
+
+#define CheckReg(reg) if(((reg) < 0) || ((reg) >= MAX_REGISTERS)) {error(parser, "REGISTER NUMBER TOO HIGH!\n");return;}
+
+
+#define PARSE_REGISTER(bytes)\
+    parseAdvance(parser, scanner);\
+    parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");\
+    u32 reg = string_to_int(parser->previous.start, &end);\
+    CheckReg(reg);\
+    bytes = reg;\
+
+
+#define CheckByte(byte) if((byte) > 0xff) {error(parser, "Offset too large! needs to be within 1 byte!"); return;}
+
+#define PARSE_BYTE(byte)\
+parser_consume(parser, scanner, TOK_NUMBER, "Expected Number!");\
+int instructionValue = string_to_int(parser->previous.start, &end);\
+CheckByte(instructionValue);\
+byte = instructionValue & 0xff;
+
+
+//a use of a label that isn't defined yet, patched once the whole entry is parsed
+inline bool pushBackPatch(Program* vm, Parser* parser, symbol_table_entry* entry) {
+    if (vm->backPatchTableSize >= vm->backPatchCapacity) {
+        AssemblerBackPatch* table = NULL;
+        u32 capacity = vm->backPatchCapacity * 2;
+        if (!vm->fixedSize) table = (AssemblerBackPatch*)malloc(capacity * sizeof(AssemblerBackPatch));
+        if (!table) {
+            error(parser, "Too many forward label references!");
+            return false;
+        }
+        memcpy(table, vm->backPatchTable, vm->backPatchTableSize * sizeof(AssemblerBackPatch));
+        if (vm->backPatchTable != vm->inlineBackPatches) free(vm->backPatchTable);
+        vm->backPatchTable = table;
+        vm->backPatchCapacity = capacity;
+    }
+    AssemblerBackPatch patch = {};
+    patch.hashEntry = entry;
+    patch.byteCodeLocation = vm->byteCount + 1;//JMP location + vm->byteCount
+    vm->backPatchTable[vm->backPatchTableSize++] = patch;
+    return true;
+}
+
+inline void parseRaw(Program* vm, Parser* parser, Scanner* scanner) {
+    TokenTypes instructionType = parser->previous.type;
+    parseAdvance(parser, scanner);
+
+    if (!tokenCheck(parser, TOK_HEX)) {
+        error(parser, "RAW instruction needs to be followed by HEXADECIMAL VALUES!\n");
+        return;
+    }
+
+    int nybbles = 0; //need 8 nybbles
+    u8 hex[4] = {};
+    if (parser->current.length == 10) {//0x + 8 chars 
+        hex[0] = (hexCharToValue(*(parser->current.start + 2)) << 4);
+        hex[0] |= (hexCharToValue(*(parser->current.start + 3)));
+
+        hex[1] = (hexCharToValue(*(parser->current.start + 4)) << 4);
+        hex[1] |= (hexCharToValue(*(parser->current.start + 5)));
+
+        hex[2] = (hexCharToValue(*(parser->current.start + 6)) << 4);
+        hex[2] |= (hexCharToValue(*(parser->current.start + 7)));
+
+        hex[3] = (hexCharToValue(*(parser->current.start + 8)) << 4);
+        hex[3] |= (hexCharToValue(*(parser->current.start + 9)));
+        nybbles = 8;
+    }
+    else {
+        int arrayEntry = 0; //need 8 nybbles
+        int i = 0;
+        for (u32 bytes = 0; bytes < 4; bytes++) {
+            if (nybbles >= 8)break;
+            int c = 0;
+            if (bytes > 0) {
+                parser_consume(parser, scanner, TOK_HEX, "Expected HEX as operand");
+                if (!tokenCheck(parser, TOK_HEX)) {
+                    error(parser, "RAW instruction needs to be followed by HEXADECIMAL VALUES!\n");
+                    return;
+                }
+                if ((parser->current.length - 2 & 1)) {
+                    error(parser, "HEX VALUE MUST HAVE EVEN NUMBER OF CHARACTERS!\n");
+                    return;
+                }
+                if ((parser->current.length - 2 > (8 - nybbles))) {
+                    error(parser, "CUMULATIVE HEX INSTRUCTION TOO LARGE!\n");
+                    return;
+                }
+
+            }
+
+            while (c < parser->current.length - 2 && nybbles < 8) {
+                if (c & 1) {
+                    hex[arrayEntry] = (hex[arrayEntry] << 4) | (hexCharToValue(*(parser->current.start + 2 + c)));
+
+                }
+                else {
+                    hex[arrayEntry] = (hexCharToValue(*(parser->current.start + 2 + c)));
+                }
+                nybbles++;
+                c++;
+                arrayEntry += i++;
+                i = i & 1;
+            }
+
+        }
+
+    }
+
+    if (nybbles != 8) {
+        error(parser, "RAW instruction MUST be followed by 4 bytes of HEX!");
+        return;
+    }
+    if (hex[0] == 1 && hex[1] >= MAX_REGISTERS) {
+        error(parser, "[raw] LOAD instruction register must be within 0 - 31!");
+        return;
+    }
+
+    // // printf("%x %x\n", hex1, hex2);
+    u32 offset = vm->byteCount;
+    vm->bytecode[offset + 0] = hex[0];
+    vm->bytecode[offset + 1] = hex[1];
+    vm->bytecode[offset + 2] = hex[2];
+    vm->bytecode[offset + 3] = hex[3];
+    vm->byteCount += 4;
+
+
+}
+
+int parseRegister(Program* vm, Parser* parser, Scanner* scanner, int* regs) {
+
+    const char* end = NULL;
+    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand"))return -1;
+    int reg1 = string_to_int(parser->current.start, &end);
+    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return -1;
+
+    if (reg1 < 0 || reg1 >= MAX_REGISTERS) {
+        error(parser, "REGISTER 1 TOO HIGH!\n");
+        return -1;
+    }
+
+    regs[0] = reg1;
+
+    return 0;
+}
+
+int parse2Registers(Program* vm, Parser* parser, Scanner* scanner, int* regs) {
+
+    const char* end = NULL;
+    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand"))return -1;
+    int reg1 = string_to_int(parser->current.start, &end);
+    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return -1;
+
+    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as second operand"))return -1;
+    int reg2 = string_to_int(parser->current.start, &end);
+    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after second register symbol"))return -1;
+
+    if (reg1 < 0 || reg1 >= MAX_REGISTERS) {
+        error(parser, "REGISTER 1 TOO HIGH!\n");
+        return -1;
+    }
+    if (reg2 < 0 || reg2 >= MAX_REGISTERS) {
+        error(parser, "REGISTER 2 TOO HIGH!\n");
+        return -1;
+    }
+
+    regs[0] = reg1;
+    regs[1] = reg2;
+
+    return 0;
+}
+
+int parse3Registers(Program* vm, Parser* parser, Scanner* scanner, int* regs) {
+
+    const char* end = NULL;
+    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand"))return -1;
+    int reg1 = string_to_int(parser->current.start, &end);
+    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return -1;
+
+    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as second operand"))return -1;
+    int reg2 = string_to_int(parser->current.start, &end);
+    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after second register symbol"))return -1;
+
+    if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as third operand"))return -1;
+    int reg3 = string_to_int(parser->current.start, &end);
+    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after third register symbol"))return -1;
+
+    if (reg1 < 0 || reg1 >= MAX_REGISTERS) {
+        error(parser, "REGISTER 1 TOO HIGH!\n");
+        return -1;
+    }
+    if (reg2 < 0 || reg2 >= MAX_REGISTERS) {
+        error(parser, "REGISTER 2 TOO HIGH!\n");
+        return -1;
+    }
+    if (reg3 < 0 || reg3 >= MAX_REGISTERS) {
+        error(parser, "REGISTER 3 TOO HIGH!\n");
+        return -1;
+    }
+
+
+    regs[0] = reg1;
+    regs[1] = reg2;
+    regs[2] = reg3;
+
+    return 0;
+}
+
+int parseRegisterAndValue(Program* vm, Parser* parser, Scanner* scanner, int* vals) {
+    parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand");
+    // int registerNumber = (int)strtol(parser->current.start, NULL, 10);
+    const char* end = NULL;
+    parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
+
+    u32 registerNumber = string_to_int(parser->previous.start, &end);
+
+    if (registerNumber < 0 || registerNumber >= MAX_REGISTERS) {
+        error(parser, "REGISTER NUMBER TOO HIGH!\n");
+        return -1;
+    }
+
+    vals[0] = registerNumber;
+
+    parser_consume(parser, scanner, TOK_INSTRUCTION_VALUE, "Expected number as second operand");
+    //this will mask off negative numbers, need to handle it better later
+    parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
+
+    int instructionValue = string_to_int(parser->previous.start, &end) & 0x0000FFFF;
+
+    // int instructionValue =((int)strtol(parser->current.start, NULL, 10)) & 0x0000FFFF;//can only use 16 bytes for the value
+
+    vals[1] = (instructionValue) >> 8;
+
+    vals[2] = instructionValue & 0xff;
+
+    return 0;
+}
+
+
+struct operand {
+    addressing_mode mode;
     union {
         uint8_t reg; //for registers
         uint16_t immediate;
-        struct label { //for labels/backpatching
+        struct { //for labels/backpatching
             symbol_table_entry* entry;
             uint16_t value;
         }label;
 
-        struct indirect {
-            uint8_t reg;
-            uint8_t offset;
-        }indirect;
-    };
-};
+        struct {
+            uint8_t reg;
+            uint8_t offset;
+        }indirect;
+    };
+};
+
+
+struct vm_instruction {
+    uint8_t operation;
+    operand src;
+    operand dst;
+    operand res;
+    uint8_t final_opcode; //gets determined based on addressing modes
+};
+
+//opcode lookup table, maps (operation, srcMode, dstMode) -> opcode
+struct opcode_mapping {
+    uint8_t operation;
+    addressing_mode srcMode;
+    addressing_mode dstMode;
+    uint8_t opcode;
+};
+
+//will this make hot reloading painful if its in the game layer?
+// static opcode_mapping opcode_table[] = {
+//     {OP_LOAD, ADDR_REG,             ADDR_REG,           OP_LOAD_REG_TO_REG                  },
+//     {OP_LOAD, ADDR_IMM,             ADDR_REG,           OP_LOAD_IMM_TO_REG                  },
+//     {OP_LOAD, ADDR_LABEL,           ADDR_REG,           OP_LOAD_IMM_TO_REG/*OP_LOAD_LABEL_TO_REG*/                },
+//     {OP_LOAD, ADDR_REG_INDIRECT,    ADDR_REG,           OP_LOAD_REG_ADDR_TO_REG             },
+//     {OP_LOAD, ADDR_REG_OFFSET,      ADDR_REG,           OP_LOAD_OFFSET_REG_ADDR_TO_REG      },
+//     {OP_LOAD, ADDR_REG,             ADDR_REG_INDIRECT,  OP_LOAD_REG_TO_REG_ADDR             },
+//     {OP_LOAD, ADDR_REG,             ADDR_REG_OFFSET,    OP_LOAD_REG_TO_OFFSET_REG_ADDR      },
+//     {OP_LOAD, ADDR_REG_INDIRECT,    ADDR_REG_INDIRECT,  OP_LOAD_DATA_ADDR_TO_ADDR     },
+//     {OP_LOAD, ADDR_REG_OFFSET,      ADDR_REG_INDIRECT,  OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR },
+//     {OP_LOAD, ADDR_REG_INDIRECT,    ADDR_REG_OFFSET,    OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR },
+
+// };
+
+void emit_instruction_bytes(Program* vm, vm_instruction* inst) {
+
+    int byteCount = vm->byteCount;
+    vm->byteCount += 4;
+
+    vm->bytecode[byteCount++] = inst->final_opcode;
+    switch (inst->dst.mode) {
+    case ADDR_REG: {
+        vm->bytecode[byteCount++] = inst->dst.reg;
+    }break;
+    case ADDR_IMM: {
+        vm->bytecode[byteCount++] = (inst->dst.immediate >> 8) & 0xFF;
+        vm->bytecode[byteCount++] = inst->dst.immediate & 0XFF;
+    }break;
+    case ADDR_REG_INDIRECT: {
+        vm->bytecode[byteCount++] = inst->dst.indirect.reg;
+    }break;
+    case ADDR_REG_OFFSET: {
+        vm->bytecode[byteCount++] = inst->dst.indirect.reg;
+        vm->bytecode[byteCount++] = inst->dst.indirect.offset;
+    }break;
+    default: {}break;
+    }
+    switch (inst->src.mode) {
+    case ADDR_REG: {
+        vm->bytecode[byteCount++] = inst->src.reg;
+    }break;
+    case ADDR_IMM: {
+        vm->bytecode[byteCount++] = (inst->src.immediate >> 8) & 0xFF;
+        vm->bytecode[byteCount++] = inst->src.immediate & 0XFF;
+
+    }break;
+    case ADDR_LABEL: {
+        vm->bytecode[byteCount++] = (inst->src.label.value >> 8) & 0xFF;
+        vm->bytecode[byteCount++] = inst->src.label.value & 0XFF;
+    }break;
+    case ADDR_REG_INDIRECT: {
+        vm->bytecode[byteCount++] = inst->src.indirect.reg;
+    }break;
+    case ADDR_REG_OFFSET: {
+        vm->bytecode[byteCount++] = inst->src.indirect.reg;
+        vm->bytecode[byteCount++] = inst->src.indirect.offset;
+    }break;
+    default: {}break;
+    }
+    switch (inst->res.mode) {
+    case ADDR_REG: {
+        vm->bytecode[byteCount++] = inst->res.reg;
+    }break;
+    case ADDR_REG_INDIRECT: {
+        vm->bytecode[byteCount++] = inst->res.indirect.reg;
+    }break;
+    case ADDR_IMM: {
+        vm->bytecode[byteCount++] = inst->res.immediate;
+    }break;
+    default: {}break;
+    }
+
+}
+
+operand parse_operand(Parser* parser, Scanner* scanner, Program* vm) {
+    operand operand = {};
+    const char* end = NULL;
+
+    s32 bytes[3] = {};
+
+    switch (parser->current.type) {
+    case TOK_REGISTER: {
+        operand.mode = ADDR_REG;
+        parseAdvance(parser, scanner);
+        parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
+        u32 reg = string_to_int(parser->previous.start, &end);
+        if (((reg) < 0) || ((reg) >= MAX_REGISTERS)) { error(parser, "REGISTER NUMBER TOO HIGH!\n");return operand; }
+        operand.reg = reg;
+    }break;
+
+
+
+    case TOK_LEFT_BRACKET: {
+        parseAdvance(parser, scanner);
+
+        switch (parser->current.type) {
+
+        case TOK_REGISTER: {
+
+            parseAdvance(parser, scanner);
+            parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
+            u32 reg = string_to_int(parser->previous.start, &end);
+            if (((reg) < 0) || ((reg) >= MAX_REGISTERS)) { error(parser, "REGISTER NUMBER TOO HIGH!\n");return operand; }
+            operand.reg = reg;
+
+
+            if (parser->current.type == TOK_PLUS) {
+                operand.mode = ADDR_REG_OFFSET;
+                parseAdvance(parser, scanner);
+                switch (parser->current.type) {
+                case TOK_INSTRUCTION_VALUE:
+                    parseAdvance(parser, scanner);//fall through
+                case TOK_NUMBER: {
+                    parser_consume(parser, scanner, TOK_NUMBER, "Expected Number!");
+                    s32 instructionValue = string_to_int(parser->previous.start, &end);
+                    if ((instructionValue) > 0xff) { error(parser, "Offset too large! needs to be within 1 byte!"); return operand; }
+                    operand.indirect.offset = instructionValue & 0xff;
+                }break;
+                default:
+                    error(parser, "EXPECTED NUMBER AFTER + FOR ADDRESS OFFSET!");
+                    return operand;
+                }
+            }
+            else {
+                operand.mode = ADDR_REG_INDIRECT;
+            }
+
+
+            if (!parser_consume(parser, scanner, TOK_RIGHT_BRACKET, "Expected right bracket register symbol")) { return operand; }
+
+        }break;
+
+        default: {
+            errorAtCurrent(parser, "Expected register inside brackets");
+            return operand;
+        }break;
+
+        }
+        int fuckTheDebugger = 0;
+    }break;//end brackets/indirect addressing
+
+    case TOK_IDENTIFIER: {
+
+        operand.mode = ADDR_LABEL;
+        char* labelStart = scanner->start;
+        char* labelEnd = scanner->current;
+        u32 len = labelEnd - labelStart;
+
+        parser_consume(parser, scanner, TOK_IDENTIFIER, "Expected label as second operand");
+        //dont worry about backpatching yet
+        //TODO: HANDLE BACKPATCHING HERE!!
+
+        u32 val = 0;
+        symbol_table_entry* entry = pushAssemblerSymbolTable(&vm->table, labelStart, len);
+        if (entry) {
+
+            if (entry->defined) {
+                operand.label.value = entry->byteOffset;
+            }
+            else {
+                if (!scanner->quiet) printf("label is not yet defined\n");
+                if (!pushBackPatch(vm, parser, entry)) return operand;
+                operand.label.value = 0;
+            }
+        }
+        else {
+            error(parser, "Too many labels share a hash bucket!");
+            return operand;
+        }
+
+    }break;
+
+    case TOK_INSTRUCTION_VALUE: {
+        parser_consume(parser, scanner, TOK_INSTRUCTION_VALUE, "Expected number following immediate symbol");
+        parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
+
+    }//drop into number parsing
+    case TOK_NUMBER: {
+        operand.mode = ADDR_IMM;
+
+        s32 instructionValue = string_to_int(parser->previous.start, &end) & 0x0000FFFF;
+        operand.immediate = instructionValue;
+    }break;
+
+
+    default: {
+        error(parser, "unhandled argument!");
+        return operand;
+    }break;
+    }
+
+    return operand;
+}
+
+
+u8 lookup_opcode(Program* vm, u8 operation, addressing_mode arg1, addressing_mode arg2, addressing_mode arg3) {
+#if 0
+    //arg1 is src, arg2 is dst, so LOAD would look like LOAD arg2(dst) arg1(src), needed to change it for the 4d table 
+    for (int i = 0; opcode_table[i].operation != 0; i++) {
+        if (opcode_table[i].operation == operation &&
+            opcode_table[i].srcMode == arg1 &&
+            opcode_table[i].dstMode == arg2) {
+            return opcode_table[i].opcode;
+        }
+    }
+    return 255;
+#else //this is in a function in case we later want to use a hash map instead of a stupid large 4D table
+    return opLookupTable[operation][arg1][arg2][arg3];
+#endif
+}
+
+
+
+
+// };
+
+inline void parseLOAD(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
+    Token instructionToken = parser->current;
+    parseAdvance(parser, scanner);
+
+    vm_instruction inst = { 0 };
+    inst.operation = GEN_LOAD;
+    // Parse destination operand
+    inst.dst = parse_operand(parser, scanner, vm);
+    if (parser->hadError) return;
+
+    // Parse source operand  
+    inst.src = parse_operand(parser, scanner, vm);
+    if (parser->hadError) return;
+
+    inst.final_opcode = lookup_opcode(vm, inst.operation, inst.dst.mode, inst.src.mode, ADDR_NONE);
+
+    //if we want to reorder operands to reduce symmetric instructions from taking up the instruction count
+#if 0
+    if (inst.final_opcode == OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR) {
+        //swap dst and src
+        operand temp = inst.dst;
+        inst.dst = inst.src;
+        inst.src = temp;
+    }
+#endif
+
+    if (inst.final_opcode == 255) {
+        errorAt(parser, &instructionToken, "PARSE LOAD invalid addressing mode combination");
+        return;
+    }
+    emit_instruction_bytes(vm, &inst);
+    return;
+}
+
+
+inline void parseMATH(Program* vm, Parser* parser, Scanner* scanner, generic_opcode code) {
+    Token instructionToken = parser->current;
+    parseAdvance(parser, scanner);
+
+    vm_instruction inst = { 0 };
+    inst.operation = code;
+    // Parse destination operand
+    inst.dst = parse_operand(parser, scanner, vm);
+    if (parser->hadError) return;
+
+    // Parse source operand  
+    inst.src = parse_operand(parser, scanner, vm);
+    if (parser->hadError) return;
+
+
+    switch (parser->current.type) {
+    case TOK_REGISTER:
+    case TOK_LEFT_BRACKET://fall through, so that we can omit the result operand in certain cases
+        inst.res = parse_operand(parser, scanner, vm);
+        if (parser->hadError) return;
+        break;
+    default: {
+        inst.res = inst.dst;
+    }
+    }
+
+    //LOAD doesnt have a third operand, just use the  ADDR_REG as a null value 
+    inst.final_opcode = lookup_opcode(vm, inst.operation, inst.dst.mode, inst.src.mode, inst.res.mode);
+    if (inst.final_opcode == 255) {
+        errorAt(parser, &instructionToken, "PARSE MATH invalid addressing mode combination");
+        return;
+    }
+    emit_instruction_bytes(vm, &inst);
+    return;
+}
+
+//can either accept a single operand, or 3
+inline void parseGEN(Program* vm, Parser* parser, Scanner* scanner, generic_opcode code) {
+    Token instructionToken = parser->current;
+    parseAdvance(parser, scanner);
+
+    vm_instruction inst = { 0 };
+    inst.operation = code;
+    // Parse destination operand
+    inst.dst = parse_operand(parser, scanner, vm);
+    if (parser->hadError) return;
+
+    switch (parser->current.type) {
+    case TOK_REGISTER:
+    case TOK_INSTRUCTION_VALUE:
+    case TOK_NUMBER:
+    case TOK_LEFT_BRACKET://fall through, so that we can omit the result operand in certain cases
+        inst.src = parse_operand(parser, scanner, vm);
+        if (parser->hadError) return;
+        break;
+    default: {
+        inst.src.mode = ADDR_NONE;
+    }
+    }
+    switch (parser->current.type) {
+    case TOK_REGISTER:
+    case TOK_INSTRUCTION_VALUE://fall through, so that we can omit the result operand in certain cases
+    case TOK_NUMBER:
+    case TOK_LEFT_BRACKET:
+        inst.res = parse_operand(parser, scanner, vm);
+        if (parser->hadError) return;
+        break;
+    default: {
+        inst.res.mode = ADDR_NONE;
+    }
+    }
+
+    inst.final_opcode = lookup_opcode(vm, inst.operation, inst.dst.mode, inst.src.mode, inst.res.mode);
+    if (inst.final_opcode == 255) {
+        errorAt(parser, &instructionToken, "PARSE GEN invalid addressing mode combination");
+        return;
+    }
+    emit_instruction_bytes(vm, &inst);
+    return;
+}
+
+inline void parseRegAndVal(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
+    parseAdvance(parser, scanner);
+
+    int bytes[3] = {};
+    int result = parseRegisterAndValue(vm, parser, scanner, bytes);
+
+    if (result < 0)return;
+
+    EMIT_INSTRUCTION();
+}
+
+inline void parse3Regs(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
+    parseAdvance(parser, scanner);
+
+    int bytes[3] = {};
+    int result = parse3Registers(vm, parser, scanner, bytes);
+
+    if (result < 0)return;
+    EMIT_INSTRUCTION();
+}
+
+inline void parse2Regs(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
+    parseAdvance(parser, scanner);
+
+    int regs[2] = {};
+    int result = parse2Registers(vm, parser, scanner, regs);
+
+    if (result < 0)return;
+
+    // printf("%x %x\n", hex1, hex2);
+    u32 offset = vm->byteCount;
+    vm->bytecode[offset + 0] = code;
+    vm->bytecode[offset + 1] = regs[0];
+    vm->bytecode[offset + 2] = regs[1];
+    vm->byteCount += 4;
+}
+
+
+//PUSH $a [$b ...] / POP $a [$b ...], one register keeps the old single register encoding, more than one becomes a
+//mask relative to the lowest register so any 16 neighbouring registers fit in one instruction
+inline void parseRegisterList(Program* vm, Parser* parser, Scanner* scanner, Opcode single, Opcode masked) {
+    parseAdvance(parser, scanner);
+    int bytes[3] = {};
+    const char* end = NULL;
+    u32 regs = 0;
+    u32 count = 0;
+
+    while (parser->current.type == TOK_REGISTER) {
+        parseAdvance(parser, scanner);
+        int reg = string_to_int(parser->current.start, &end);
+        if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol"))return;
+        CheckReg(reg);
+        if (regs & (1u << reg)) {
+            error(parser, "register listed twice!");
+            return;
+        }
+        regs |= 1u << reg;
+        count++;
+    }
+    if (!count) {
+        error(parser, "Expected a register list!");
+        return;
+    }
+
+    u32 lowest = 0;
+    while (!(regs & (1u << lowest))) lowest++;
+    Opcode code = single;
+    bytes[0] = lowest;
+    if (count > 1) {
+        u32 mask = regs >> lowest;
+        if (mask >> 16) {
+            error(parser, "registers in one PUSH/POP have to be within 16 of each other!");
+            return;
+        }
+        code = masked;
+        bytes[1] = mask >> 8;
+        bytes[2] = mask & 0xFF;
+    }
+
+    EMIT_INSTRUCTION();
+}
+
+//ENTER [#locals], the # is optional
+inline void parseENTER(Program* vm, Parser* parser, Scanner* scanner) {
+    parseAdvance(parser, scanner);
+    int bytes[3] = {};
+    const char* end = NULL;
+    Opcode code = OP_ENTER;
+
+    if (parser->current.type == TOK_INSTRUCTION_VALUE || parser->current.type == TOK_NUMBER) {
+        if (parser->current.type == TOK_INSTRUCTION_VALUE) parser_consume(parser, scanner, TOK_INSTRUCTION_VALUE, "Expected number following immediate symbol");
+        if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number of bytes for locals"))return;
+        s32 locals = string_to_int(parser->previous.start, &end);
+        if (locals < 0 || locals > 0xFFFF) {
+            error(parser, "ENTER locals don't fit in 16 bits!");
+            return;
+        }
+        bytes[0] = locals >> 8;
+        bytes[1] = locals & 0xFF;
+    }
+
+    EMIT_INSTRUCTION();
+}
+
+//WAIT #ticks, the # is optional. 24 bits, as far ahead as the scheduler's timer wheel reaches
+inline void parseWAIT(Program* vm, Parser* parser, Scanner* scanner) {
+    parseAdvance(parser, scanner);
+    int bytes[3] = {};
+    const char* end = NULL;
+    Opcode code = OP_WAIT;
+
+    if (parser->current.type == TOK_INSTRUCTION_VALUE) parser_consume(parser, scanner, TOK_INSTRUCTION_VALUE, "Expected number following immediate symbol");
+    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number of ticks to wait"))return;
+    s32 ticks = string_to_int(parser->previous.start, &end);
+    if (ticks < 0 || ticks > 0xFFFFFF) {
+        error(parser, "WAIT ticks don't fit in 24 bits!");
+        return;
+    }
+    bytes[0] = ticks >> 16;
+    bytes[1] = (ticks >> 8) & 0xFF;
+    bytes[2] = ticks & 0xFF;
+
+    EMIT_INSTRUCTION();
+}
+
+//WAIT_EVENT #id, the # is optional
+inline void parseWAIT_EVENT(Program* vm, Parser* parser, Scanner* scanner) {
+    parseAdvance(parser, scanner);
+    int bytes[3] = {};
+    const char* end = NULL;
+    Opcode code = OP_WAIT_EVENT;
+
+    if (parser->current.type == TOK_INSTRUCTION_VALUE) parser_consume(parser, scanner, TOK_INSTRUCTION_VALUE, "Expected number following immediate symbol");
+    if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected an event id"))return;
+    s32 event = string_to_int(parser->previous.start, &end);
+    if (event < 0 || event >= VM_MAX_EVENTS) {
+        error(parser, "event id out of range!");
+        return;
+    }
+    bytes[0] = event >> 8;
+    bytes[1] = event & 0xFF;
+
+    EMIT_INSTRUCTION();
+}
+
+//SYSCALL [name], the name has to be registered (vm_register_host) before the program is assembled
+inline void parseSYSCALL(Program* vm, Parser* parser, Scanner* scanner) {
+    parseAdvance(parser, scanner);
+    int bytes[3] = {};
+    Opcode code = OP_SYSCALL;
+
+    if (parser->current.type == TOK_IDENTIFIER) {
+        s32 index = vm_host_lookup(parser->current.start, parser->current.length);
+        if (index < 0) {
+            error(parser, "unknown host function!");
+            return;
+        }
+        parseAdvance(parser, scanner);
+        bytes[0] = index >> 8;
+        bytes[1] = index & 0xFF;
+    }
+
+    EMIT_INSTRUCTION();
+}
+
+inline void parseCALL(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
+    parseAdvance(parser, scanner);
+    int bytes[3] = {};
+    const char* end = NULL;
+
+    switch (parser->current.type) {
+
+    case TOK_IDENTIFIER: {
+        char* labelStart = scanner->start;
+        char* labelEnd = scanner->current;
+        u32 len = labelEnd - labelStart;
+
+        parseAdvance(parser, scanner);
+
+        u32 val = 0;
+        symbol_table_entry* entry = pushAssemblerSymbolTable(&vm->table, labelStart, len);
+        if (entry) {
+            if (entry->defined) {
+                val = entry->byteOffset;
+            }
+            else {
+                if (!scanner->quiet) printf("label is not yet defined\n");
+                if (!pushBackPatch(vm, parser, entry)) return;
+            }
+        }
+        else {
+            error(parser, "Too many labels share a hash bucket!");
+            return;
+        }
+
+        bytes[0] = (val) >> 16;
+        bytes[1] = (val) >> 8;
+        bytes[2] = val & 0xff;
 
+    }break;
 
-struct vm_instruction {
-    uint8_t operation;
-    operand src;
-    operand dst;
-    operand res;
-    uint8_t final_opcode; //gets determined based on addressing modes
-};
+    default:
+        error(parser, "unhandled OP_CALL CASE! Expected label name!");
+        return;
+    }
 
-//opcode lookup table, maps (operation, srcMode, dstMode) -> opcode
-struct opcode_mapping {
-    uint8_t operation;
-    addressing_mode srcMode;
-    addressing_mode dstMode;
-    uint8_t opcode;
-};
+    EMIT_INSTRUCTION();
+}
 
-//will this make hot reloading painful if its in the game layer?
-// static opcode_mapping opcode_table[] = {
-//     {OP_LOAD, ADDR_REG,             ADDR_REG,           OP_LOAD_REG_TO_REG                  },
-//     {OP_LOAD, ADDR_IMM,             ADDR_REG,           OP_LOAD_IMM_TO_REG                  },
-//     {OP_LOAD, ADDR_LABEL,           ADDR_REG,           OP_LOAD_IMM_TO_REG/*OP_LOAD_LABEL_TO_REG*/                },
-//     {OP_LOAD, ADDR_REG_INDIRECT,    ADDR_REG,           OP_LOAD_REG_ADDR_TO_REG             },
-//     {OP_LOAD, ADDR_REG_OFFSET,      ADDR_REG,           OP_LOAD_OFFSET_REG_ADDR_TO_REG      },
-//     {OP_LOAD, ADDR_REG,             ADDR_REG_INDIRECT,  OP_LOAD_REG_TO_REG_ADDR             },
-//     {OP_LOAD, ADDR_REG,             ADDR_REG_OFFSET,    OP_LOAD_REG_TO_OFFSET_REG_ADDR      },
-//     {OP_LOAD, ADDR_REG_INDIRECT,    ADDR_REG_INDIRECT,  OP_LOAD_DATA_ADDR_TO_ADDR     },
-//     {OP_LOAD, ADDR_REG_OFFSET,      ADDR_REG_INDIRECT,  OP_LOAD_OFFSET_REG_ADDR_TO_REG_ADDR },
-//     {OP_LOAD, ADDR_REG_INDIRECT,    ADDR_REG_OFFSET,    OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR },
+inline void parseRET(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
+    parseAdvance(parser, scanner);
+    int bytes[3] = {};
+    const char* end = NULL;
+    EMIT_INSTRUCTION();
+}
 
-// };
 
-void emit_instruction_bytes(VM* vm, vm_instruction* inst) {
+inline void parsePRT(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
 
-    int byteCount = vm->byteCount;
+    parseAdvance(parser, scanner);
+
+    int bytes[3] = {};
+    const char* end = NULL;
+
+    switch (parser->current.type) {
+        case TOK_REGISTER: {
+            parseAdvance(parser, scanner);
+            if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return;
+            int reg1 = string_to_int(parser->previous.start, &end);
+            bytes[0] = reg1;
+            code = OP_PRT_REG;
+        }break;
+
+        case TOK_LEFT_BRACKET: {
+            parseAdvance(parser, scanner);
+
+            const char* end = NULL;
+            if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand"))return;
+            if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return;
+            int reg1 = string_to_int(parser->previous.start, &end);
+            if (reg1 < 0 || reg1 >= MAX_REGISTERS) {
+                error(parser, "REGISTER 1 TOO HIGH!\n");
+                return;
+            }
+            bytes[0] = reg1;
+            code = OP_PRT_ADDRESS;
+            if (!parser_consume(parser, scanner, TOK_RIGHT_BRACKET, "Expected closing bracket"))return;
+        }break;
+
+        case TOK_INSTRUCTION_VALUE: {
+            errorAtCurrent(parser, "PRT takes a register or [register]");
+            return;
+        }break;
+
+        default:{}break;
+    }
+
+    EMIT_INSTRUCTION();
+}
+
+
+inline void parseReg(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
+    parseAdvance(parser, scanner);
+
+    int regs[1] = {};
+    int result = parseRegister(vm, parser, scanner, regs);
+
+    if (result < 0)return;
+
+    // printf("%x %x\n", hex1, hex2);
+    u32 offset = vm->byteCount;
+    vm->bytecode[offset + 0] = code;
+    vm->bytecode[offset + 1] = regs[0];
     vm->byteCount += 4;
+}
 
-    vm->bytecode[byteCount++] = inst->final_opcode;
-    switch (inst->dst.mode) {
-    case ADDR_REG: {
-        vm->bytecode[byteCount++] = inst->dst.reg;
-    }break;
-    case ADDR_IMM: {
-        vm->bytecode[byteCount++] = (inst->dst.immediate >> 8) & 0xFF;
-        vm->bytecode[byteCount++] = inst->dst.immediate & 0XFF;
-    }break;
-    case ADDR_REG_INDIRECT: {
-        vm->bytecode[byteCount++] = inst->dst.indirect.reg;
-    }break;
-    case ADDR_REG_OFFSET: {
-        vm->bytecode[byteCount++] = inst->dst.indirect.reg;
-        vm->bytecode[byteCount++] = inst->dst.indirect.offset;
-    }break;
-    default: {}break;
+
+
+inline void parseLabelDec(Program* vm, Parser* parser, Scanner* scanner) {
+    if (parser->previous.type != TOK_IDENTIFIER) {
+        error(parser, "expected identifier before colon for label declaration!");
+        return;
     }
-    switch (inst->src.mode) {
-    case ADDR_REG: {
-        vm->bytecode[byteCount++] = inst->src.reg;
-    }break;
-    case ADDR_IMM: {
-        vm->bytecode[byteCount++] = (inst->src.immediate >> 8) & 0xFF;
-        vm->bytecode[byteCount++] = inst->src.immediate & 0XFF;
+    Assert(!"add label to symbol table!\n");
+    parseAdvance(parser, scanner);
+}
 
-    }break;
-    case ADDR_LABEL: {
-        vm->bytecode[byteCount++] = (inst->src.label.value >> 8) & 0xFF;
-        vm->bytecode[byteCount++] = inst->src.label.value & 0XFF;
-    }break;
-    case ADDR_REG_INDIRECT: {
-        vm->bytecode[byteCount++] = inst->src.indirect.reg;
-    }break;
-    case ADDR_REG_OFFSET: {
-        vm->bytecode[byteCount++] = inst->src.indirect.reg;
-        vm->bytecode[byteCount++] = inst->src.indirect.offset;
-    }break;
-    default: {}break;
+inline void parseLabelCode(Program* vm, Parser* parser, Scanner* scanner) {
+    char* labelStart = scanner->start;
+    char* labelEnd = scanner->current;
+    parseAdvance(parser, scanner);
+    if (!parser_consume(parser, scanner, TOK_COLON, "Expected colon after label definition at start of line"))return;
+
+
+    u32 len = labelEnd - labelStart;
+
+    if (len > 32) {
+        errorAtCurrent(parser, "Label is too long! must be under 32 characters long!");
+        return;
     }
-    switch (inst->res.mode) {
-    case ADDR_REG: {
-        vm->bytecode[byteCount++] = inst->res.reg;
+
+    //the table owns name and the chain, an earlier forward use may have put it there already
+    symbol_table_entry* tableEntry = pushAssemblerSymbolTable(&vm->table, labelStart, len);
+    if (tableEntry) {
+        tableEntry->type = label_types::label_code;
+        tableEntry->byteOffset = vm->byteCount;
+        tableEntry->defined = true;
+    }
+    else {
+        error(parser, "Couldn't assign label to the table?");
+        return;
+    }
+    // Assert(!"figure out label use here!\n");
+    //so this is a function that we jump to
+
+}
+
+
+
+
+inline void parseLabelData(Program* vm, Parser* parser, Scanner* scanner) {
+
+    parseAdvance(parser, scanner);
+    char* labelStart = scanner->start;
+    char* labelEnd = scanner->current;
+
+    if (!parser_consume(parser, scanner, TOK_IDENTIFIER, "Expected identifier name after '.' definition at start of line"))return;
+
+
+
+    u32 len = labelEnd - labelStart;
+
+
+    if (len > 32) {
+        errorAtCurrent(parser, "Label is too long! must be under 32 characters long!");
+        return;
+    }
+
+
+    u32 dataLocation = 0;
+
+    switch (parser->current.type) {
+    case TOK_STRING: {//create stretch of static memory for a string
+
+        if (parser->current.length - 2 > 256) {
+            errorAtCurrent(parser, "String is too long! must be under 256 characters long!");
+            return;
+        }
+        if (vm->dataSize + parser->current.length - 1 > MAX_MEM) {
+            errorAtCurrent(parser, "Out of data memory!");
+            return;
+        }
+
+        dataLocation = vm->dataSize;
+        memcpy(vm->data + vm->dataSize, parser->current.start + 1, parser->current.length - 2);
+        *(vm->data + vm->dataSize + parser->current.length - 1) = 0;
+        vm->dataSize += parser->current.length - 1;
+        parseAdvance(parser, scanner);
+        int fuckTheDebugger = 0;
+
     }break;
-    case ADDR_REG_INDIRECT: {
-        vm->bytecode[byteCount++] = inst->res.indirect.reg;
+
+    case TOK_RESB: {//allocates data in const data segment (should we instead use a different variable data block and do a runtime check?)
+        const char* end = NULL;
+        parseAdvance(parser, scanner);
+        if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected numeric value after RESB"))return;
+        int val = string_to_int(parser->previous.start, &end);
+        if (val < 0 || vm->dataSize + val > MAX_MEM) {
+            error(parser, "Out of data memory!");
+            return;
+        }
+        dataLocation = vm->dataSize;
+        memset(vm->data + vm->dataSize, 0, val);
+        vm->dataSize += val;
+        int fuckTheDebugger = 0;
+
     }break;
-    case ADDR_IMM: {
-        vm->bytecode[byteCount++] = inst->res.immediate;
+
+    default: {
+        errorAtCurrent(parser, "Expected a string or RESB after the label name");
+        return;
     }break;
-    default: {}break;
     }
 
+    symbol_table_entry* tableEntry = pushAssemblerSymbolTable(&vm->table, labelStart, len);
+    if (tableEntry) {
+        tableEntry->type = label_types::label_data;
+        tableEntry->byteOffset = dataLocation;
+        tableEntry->defined = true;
+    }
+    else {
+        error(parser, "Couldn't assign label to the table?");
+        return;
+    }
+
+
+
+
+    // Assert(!"figure out label use here!\n");
+    //so this is a function that we jump to
+
+}
+
+
+inline void parseSingleInstruction(Program* vm, Parser* parser, Scanner* scanner, Opcode code) {
+    TokenTypes instructionType = parser->previous.type;
+    parseAdvance(parser, scanner);
+
+    // printf("%x %x\n", hex1, hex2);
+    u32 offset = vm->byteCount;
+    vm->bytecode[offset + 0] = code;
+    vm->byteCount += 4;
 }
 
-operand parse_operand(Parser* parser, Scanner* scanner, VM* vm) {
-    operand operand = {};
-    const char* end = NULL;
-
-    s32 bytes[3] = {};
 
-    switch (parser->current.type) {
-    case TOK_REGISTER: {
-        operand.mode = ADDR_REG;
-        parseAdvance(parser, scanner);
-        parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
-        u32 reg = string_to_int(parser->previous.start, &end);
-        if (((reg) < 0) || ((reg) >= MAX_REGISTERS)) { error(parser, "REGISTER NUMBER TOO HIGH!\n");return operand; }
-        operand.reg = reg;
-    }break;
+//the REPL stands in for the game loop, its spell's effects get drained and printed after every run
+static void repl_print_effects(const VMEffect* records, u32 count, void* user) {
+    for (u32 i = 0; i < count; i++) {
+        const VMEffect& effect = records[i];
+        printf("EFFECT %s from instance %u:", vmHost.functions[effect.effect].name, effect.instance);
+        for (u32 a = 0; a < effect.argCount; a++) printf(" %d", effect.args[a]);
+        printf("\n");
+    }
+}
 
+void repl_run(REPL* repl, bool resume) {
+    VMEffectQueue* outer = vm_effect_queue_bind(&repl->effects);
+    if (resume) vm_resume(repl->vm);
+    else vm_run(repl->vm, &repl->scanner);
+    vm_effect_queue_bind(outer);
+    vm_effect_drain(&repl->effects, repl_print_effects, NULL);
+}
 
+int repl_command(REPL* repl) {
+    Scanner* scanner = &repl->scanner;
+    VM& vm = repl->vm;
+    char c = scannerAdvance(scanner);
 
-    case TOK_LEFT_BRACKET: {
-        parseAdvance(parser, scanner);
+    TokenTypes type = {};
 
-        switch (parser->current.type) {
+    //assuming we've hit an identifier
+    while (isAlpha(charPeek(scanner)) || isNumeric(charPeek(scanner))) scannerAdvance(scanner);
 
-        case TOK_REGISTER: {
+    switch (c) {
+    case '/': {//repl command
 
-            parseAdvance(parser, scanner);
-            parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
-            u32 reg = string_to_int(parser->previous.start, &end);
-            if (((reg) < 0) || ((reg) >= MAX_REGISTERS)) { error(parser, "REGISTER NUMBER TOO HIGH!\n");return operand; }
-            operand.reg = reg;
+        scanner->start++;
 
+        TokenTypes command = vmKeywordLookup(vmReplCommandTable, vmReplCommands, scanner->start, (u32)(scanner->current - scanner->start), TOK_IDENTIFIER);
+        switch (command) {
+        case TOK_COMMAND_CLEAR: {
+            printf("clearing registers and bytecode!\n");
+            repl->vm.byteCount = 0;
+            repl->vm.pc = 0;
+            vm_invalidate_decode(repl->vm, 0);
+            for (u32 i = 0; i < 32; i++) {//exclude the last command which is just .history
+                vm.registers[i] = 0;
+            }
+            return 0;
+        }break;
+        case TOK_COMMAND_QUIT: {
+            printf("THANKS BYE\n");
+            return 1;
+        }break;
+        case TOK_COMMAND_HISTORY: {
+            for (int i = 0; i < repl->historyLines - 1; i++) {//exclude the last command which is just .history
+                printf("%u: %s", i, repl->history + (i * MAX_REPL_BUFFER));
+            }
+        }break;
+        case TOK_COMMAND_PROGRAM: {
+            for (u32 i = 0; i < vm.byteCount; i += 4) {//exclude the last command which is just .history
+                printf("%2x %2x %2x %2x\n", vm.bytecode[i + 0], vm.bytecode[i + 1], vm.bytecode[i + 2], vm.bytecode[i + 3]);
+            }
+        }break;
+        case TOK_COMMAND_REGISTERS: {
+            printf("REGISTERS:\n");
+            for (u32 i = 0; i < 16; i++) {//exclude the last command which is just .history
+                printf(" %5d   ", i);
+            }
+            printf("\n");
+            for (u32 i = 0; i < 16; i++) {//exclude the last command which is just .history
+                printf("[%6d] ", vm.registers[i]);
+            }
+            printf("\n");
 
-            if (parser->current.type == TOK_PLUS) {
-                operand.mode = ADDR_REG_OFFSET;
-                parseAdvance(parser, scanner);
-                switch (parser->current.type) {
-                case TOK_INSTRUCTION_VALUE:
-                    parseAdvance(parser, scanner);//fall through
-                case TOK_NUMBER: {
-                    parser_consume(parser, scanner, TOK_NUMBER, "Expected Number!");
-                    s32 instructionValue = string_to_int(parser->previous.start, &end);
-                    if ((instructionValue) > 0xff) { error(parser, "Offset too large! needs to be within 1 byte!"); return operand; }
-                    operand.indirect.offset = instructionValue & 0xff;
-                }break;
-                default:
-                    error(parser, "EXPECTED NUMBER AFTER + FOR ADDRESS OFFSET!");
-                    return operand;
+            for (u32 i = 16; i < 32; i++) {//exclude the last command which is just .history
+                if (i == 31) {
+                    printf(" %5d (STACK PTR)  ", i);
+                }
+                else {
+                    printf(" %5d   ", i);
                 }
             }
-            else {
-                operand.mode = ADDR_REG_INDIRECT;
+            printf("\n");
+            for (u32 i = 16; i < 32; i++) {//exclude the last command which is just .history
+                printf("[%6d] ", vm.registers[i]);
+            }
+            printf("\n");
+        }break;
+        case TOK_COMMAND_RESUME: {
+            if (vm.status != VM_YIELDED && vm.status != VM_WAITING && vm.status != VM_WAITING_EVENT) {
+                printf("nothing to resume\n");
+                return 0;
             }
+            repl_run(repl, true);
+            if (vm.status == VM_YIELDED) printf("yielded again at pc %u, /resume to keep going\n", vm.pc);
+            if (vm.status == VM_WAITING) printf("waiting %u ticks at pc %u, /resume to wake it now\n", vm.wakeTick, vm.pc);
+            if (vm.status == VM_WAITING_EVENT) printf("waiting for event %u at pc %u, /resume to wake it now\n", vm.waitEvent, vm.pc);
+        }break;
+        default: {}break;
+        }
 
+    }break;
+    }
+    return 0;
+}
 
-            if (!parser_consume(parser, scanner, TOK_RIGHT_BRACKET, "Expected right bracket register symbol")) { return operand; }
 
-        }break;
+void parseInstruction(Program* vm, Parser* parser, Scanner* scanner) {
+    switch (parser->current.type) {
+    case TOK_LOAD: { parseLOAD(vm, parser, scanner, Opcode::OP_LOAD); }break;
+    case TOK_ADD: { parseMATH(vm, parser, scanner, generic_opcode::GEN_ADD); }break;
+    case TOK_SUB: { parseMATH(vm, parser, scanner, generic_opcode::GEN_SUB); }break;
+    case TOK_MUL: { parseMATH(vm, parser, scanner, generic_opcode::GEN_MUL); }break;
+    case TOK_DIV: { parseMATH(vm, parser, scanner, generic_opcode::GEN_DIV); }break;
 
-        default: {
-            Assert(!"Unhandled LOAD case!");
-        }break;
+    case TOK_EQ: { parseGEN(vm, parser, scanner, generic_opcode::GEN_EQ); }break;
+    case TOK_NEQ: { parse2Regs(vm, parser, scanner, Opcode::OP_NEQ); }break;
+    case TOK_GT: { parse2Regs(vm, parser, scanner, Opcode::OP_GT); }break;
+    case TOK_LT: { parse2Regs(vm, parser, scanner, Opcode::OP_LT); }break;
+    case TOK_GTQ: { parse2Regs(vm, parser, scanner, Opcode::OP_GTQ); }break;
+    case TOK_LTQ: { parse2Regs(vm, parser, scanner, Opcode::OP_LTQ); }break;
 
-        }
-        int fuckTheDebugger = 0;
-    }break;//end brackets/indirect addressing
+    case TOK_JEQ: { parseGEN(vm, parser, scanner, generic_opcode::GEN_JEQ); }break;
+    case TOK_JNE: { parseGEN(vm, parser, scanner, generic_opcode::GEN_JNE); }break;
+    case TOK_JMP: { parseGEN(vm, parser, scanner, generic_opcode::GEN_JMP); }break;
+    case TOK_JMPF: { parseReg(vm, parser, scanner, Opcode::OP_JMPF); }break;
+    case TOK_JMPB: { parseReg(vm, parser, scanner, Opcode::OP_JMPB); }break;
 
-    case TOK_IDENTIFIER: {
+    case TOK_INC: { parseReg(vm, parser, scanner, Opcode::OP_INC); }break;
+    case TOK_ALOC: { parse2Regs(vm, parser, scanner, Opcode::OP_ALOC); }break;
+    case TOK_FREE: { parseReg(vm, parser, scanner, Opcode::OP_FREE); }break;
+    case TOK_DEC: { parseReg(vm, parser, scanner, Opcode::OP_DEC); }break;
 
-        operand.mode = ADDR_LABEL;
-        char* labelStart = scanner->start;
-        char* labelEnd = scanner->current;
-        u32 len = labelEnd - labelStart;
+    case TOK_PRT: { parsePRT(vm, parser, scanner, Opcode::OP_PRT); }break;
 
-        parser_consume(parser, scanner, TOK_IDENTIFIER, "Expected label as second operand");
-        //dont worry about backpatching yet
-        //TODO: HANDLE BACKPATCHING HERE!!
+    case TOK_PUSH: { parseRegisterList(vm, parser, scanner, Opcode::OP_PUSH_REG, Opcode::OP_PUSH_MASK); }break;
+    case TOK_POP: { parseRegisterList(vm, parser, scanner, Opcode::OP_POP_REG, Opcode::OP_POP_MASK); }break;
+    case TOK_ENTER: { parseENTER(vm, parser, scanner); }break;
+    case TOK_LEAVE: { parseSingleInstruction(vm, parser, scanner, Opcode::OP_LEAVE); }break;
+    case TOK_YIELD: { parseSingleInstruction(vm, parser, scanner, Opcode::OP_YIELD); }break;
+    case TOK_WAIT: { parseWAIT(vm, parser, scanner); }break;
+    case TOK_WAIT_EVENT: { parseWAIT_EVENT(vm, parser, scanner); }break;
+    case TOK_SYSCALL: { parseSYSCALL(vm, parser, scanner); }break;
 
-        u32 val = 0;
-        symbol_table_entry* entry = pushAssemblerSymbolTable(&vm->table, labelStart, len);
-        if (entry) {
+    case TOK_COLON: {
+        // parseLabelDec(vm, parser, scanner);
+        errorAtCurrent(parser, "Expected a label name before ':'");
+    }break;
 
-            if (entry->defined) {
-                operand.label.value = entry->byteOffset;
-            }
-            else {
-                printf("label is not yet defined\n");
-                AssemblerBackPatch patch = {};
-                patch.hashEntry = entry;
-                patch.byteCodeLocation = vm->byteCount + 1;//JMP location + vm->byteCount
-                vm->backPatchTable[vm->backPatchTableSize++] = patch;
-                operand.label.value = 0;
-            }
-        }
-        else {
-            Assert(!"Invalid symbol table entry??");
-        }
+    case TOK_HLT: { parseSingleInstruction(vm, parser, scanner, Opcode::OP_HLT); }break;
 
-    }break;
 
-    case TOK_INSTRUCTION_VALUE: {
-        parser_consume(parser, scanner, TOK_INSTRUCTION_VALUE, "Expected number following immediate symbol");
-        parser_consume(parser, scanner, TOK_NUMBER, "Expected number after register symbol");
+    case TOK_RAW: { parseRaw(vm, parser, scanner); }break;
 
-    }//drop into number parsing
-    case TOK_NUMBER: {
-        operand.mode = ADDR_IMM;
+    case TOK_SEMICOLON: {
+        if (!scanner->quiet) printf("parsed ';' begin comment!");
+        while (charPeek(scanner) != '\n' && !isAtEnd(scanner)) scannerAdvance(scanner); //consume all whitespace on the line
+        parseAdvance(parser, scanner);
+    }break;
 
-        s32 instructionValue = string_to_int(parser->previous.start, &end) & 0x0000FFFF;
-        operand.immediate = instructionValue;
+    case TOK_IDENTIFIER: {
+        if (!scanner->quiet) printf("parsed identifier at start of line! this is a location in code to jump to\n");
+        //this means the label is a function defining code that can be jumped to
+        parseLabelCode(vm, parser, scanner);
+    }break;
+
+    case TOK_DOT: {
+        if (!scanner->quiet) printf("parsed label variable declaration at start of line!\n");
+        // parseLabelDec(vm, parser, scanner);
+        parseLabelData(vm, parser, scanner);
     }break;
 
+    case TOK_EOF: { if (!scanner->quiet) printf("end of file!\n"); }break;
 
-    default: {
-        error(parser, "unhandled argument!");
-        return operand;
+    case TOK_CALL: {
+        parseCALL(vm, parser, scanner, Opcode::OP_CALL);
+    }break;
+    case TOK_RET: {
+        parseRET(vm, parser, scanner, Opcode::OP_RET);
     }break;
+
+    default:
+        error(parser, "unrecognized instruction type!");
     }
+}
 
-    return operand;
+//parses lines onto the end of vm's program until the text runs out or one fails, labels used before they're defined
+//go in the backpatch table for assemble_resolve. the scanner has to be pointing at the text already
+bool assemble_lines(Program* vm, Parser* parser, Scanner* scanner) {
+    parseAdvance(parser, scanner);
+    Token curTok = parser->current;
+    while ((curTok.type != TOK_EOF) && !parser->hadError) {
+        bool emits = curTok.type != TOK_IDENTIFIER && curTok.type != TOK_DOT && curTok.type != TOK_NEWLINE;
+        if (emits && !vm_code_reserve(vm, 4)) {
+            errorAtCurrent(parser, "Program is too long!");
+            break;
+        }
+        u32 firstByte = vm->byteCount;
+        if (curTok.type != TOK_NEWLINE) parseInstruction(vm, parser, scanner); //blank lines before the first instruction
+        for (u32 b = firstByte; b < vm->byteCount; b += 4) vm->sourceLines[b / 4] = scanner->line;
+
+
+        if (parser->current.type == TOK_NEWLINE) {
+            while (parser->current.type == TOK_NEWLINE) {
+                scanner->line++;
+                if (scanner->line < MAX_SCANNER_LINES) scanner->lines[scanner->line] = scanner->current;
+                printScannerLine(scanner, scanner->line);
+                parser_advance(parser, scanner);
+            }
+        }
+
+        else if (parser->current.type == TOK_EOF) {
+            if (!scanner->quiet) printf("END OF FILE REACHED!\n");
+        }
+        else {
+            errorAtCurrent(parser, "Expected next instruction on a new line!");
+        }
+        curTok = parser->current;
+
+    }
+    return !parser->hadError;
 }
 
+//patches every forward label use in the backpatch table, once everything they could name has been parsed
+bool assemble_resolve(Program* vm, Parser* parser) {
+    if (vm->backPatchTableSize && !parser->hadError) {
+        u32 size = vm->backPatchTableSize;
+        for (u32 i = 0; i < size; i++) {
+            AssemblerBackPatch* patch = vm->backPatchTable + i;
+            symbol_table_entry* entry = patch->hashEntry;
+
+            Assert(entry);
+            if (!entry->defined) {
+                if (!parser->quiet) printf("label %.*s was never defined!\n", (int)entry->nameLen, entry->name);
+                error(parser, "label was never defined");
+                break;
+            }
+            switch (entry->type) {
+            case label_types::label_data: {
+                error(parser, "data labels have to be defined before they're used");
+            }break;
+            case label_types::label_code: {
+                // Assert(!"handle code labels!");
+                //for now we'll treat code addresses as very large
+                vm->bytecode[patch->byteCodeLocation + 0] = entry->byteOffset >> 16;
+                vm->bytecode[patch->byteCodeLocation + 1] = entry->byteOffset >> 8;
+                vm->bytecode[patch->byteCodeLocation + 2] = entry->byteOffset & 0xff;
+                vm->backPatchTableSize--;
+                // Assert(!"Implement more OP Codes depending on the context of what was patched, can probably handle that when we initially parse the OPcode");
+            }break;
+            default:{}break;
+            }
+
 
-u8 lookup_opcode(VM* vm, u8 operation, addressing_mode arg1, addressing_mode arg2, addressing_mode arg3) {
-#if 0
-    //arg1 is src, arg2 is dst, so LOAD would look like LOAD arg2(dst) arg1(src), needed to change it for the 4d table 
-    for (int i = 0; opcode_table[i].operation != 0; i++) {
-        if (opcode_table[i].operation == operation &&
-            opcode_table[i].srcMode == arg1 &&
-            opcode_table[i].dstMode == arg2) {
-            return opcode_table[i].opcode;
         }
     }
-    return 255;
-#else //this is in a function in case we later want to use a hash map instead of a stupid large 4D table
-    return vm->opLookupTable[operation][arg1][arg2][arg3];
-#endif
+
+    if (vm->backPatchTableSize && !parser->hadError) { //an undefined label already failed the entry
+        error(parser, "back patch table not fully resolved after parsing!");
+    }
+    return !parser->hadError;
 }
 
+//parses one entry onto the end of vm's program and resolves its labels, false on a parse error. the scanner has to be
+//pointing at the text already, label names point into it so it has to live as long as the program does
+bool assemble_entry(Program* vm, Parser* parser, Scanner* scanner) {
+    assemble_lines(vm, parser, scanner);
+    return assemble_resolve(vm, parser);
+}
 
+//caller owned memory assemble() takes everything it needs from, nothing else gets allocated
+struct VMArena {
+    u8* base;
+    size_t size;
+    size_t used;
+};
 
+inline void* vm_arena_push(VMArena* arena, size_t size, size_t align = 16) {
+    size_t start = (arena->used + align - 1) & ~(align - 1);
+    if (start > arena->size || size > arena->size - start) return NULL;
+    arena->used = start + size;
+    return arena->base + start;
+}
 
-// };
+struct AssembleError {
+    const char* message; //a string literal, NULL when it assembled
+    int line;
+};
 
-inline void parseLOAD(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    Token instructionToken = parser->current;
-    parseAdvance(parser, scanner);
+//assembles NUL terminated text into a Program that's zeroed or been through program_reset, without printing anything.
+//label names point into text. no REPL, VM or global state is written, so any number of threads can run it at once
+bool assemble_program(Program* program, char* text, AssembleError* error = NULL) {
+    static bool lookupBuilt = (init_opcode_lookup(), true); //once, before any thread reads it
+    (void)lookupBuilt;
+    if (!program->bytecode) program_reset(program); //zeroed, point it at its inline arrays
+    Scanner scanner = {};
+    scanner.quiet = true;
+    scanner.line = 1;
+    scanner.start = text;
+    scanner.current = text;
+    Token tokens[VM_LEX_BATCH];
+    scanner_batch(&scanner, tokens, VM_LEX_BATCH);
+    Parser parser = {};
+    parser.quiet = true;
+    bool ok = assemble_entry(program, &parser, &scanner);
+    if (error) {
+        error->message = ok ? NULL : parser.errorMessage;
+        error->line = ok ? 0 : parser.errorLine;
+    }
+    return ok;
+}
 
-    vm_instruction inst = { 0 };
-    inst.operation = GEN_LOAD;
-    // Parse destination operand
-    inst.dst = parse_operand(parser, scanner, vm);
-    if (parser->hadError) return;
+#define VM_STREAM_WINDOW 65536
+
+//assemble_program for sources too big to hold: in is read through a windowSize buffer (assemble_stream's only use of
+//the stack or heap besides the Program) and only whole lines get parsed, the part line at the end of a window moves
+//to the front of the next one. label names are copied into the table since the text doesn't stay around, and the
+//backpatch table is resolved once the whole stream is in. the Program grows up to VM_MAX_CODE, so like for any
+//Program that assembled, reset it before freeing it. no line may be longer than the window
+bool assemble_stream(Program* program, FILE* in, AssembleError* error = NULL, u32 windowSize = VM_STREAM_WINDOW) {
+    static bool lookupBuilt = (init_opcode_lookup(), true);
+    (void)lookupBuilt;
+    if (!program->bytecode) program_reset(program);
+    program->table.copyNames = true;
+    char* window = (char*)malloc(windowSize + 1);
+    Scanner scanner = {};
+    scanner.quiet = true;
+    scanner.line = 1;
+    Token tokens[VM_LEX_BATCH];
+    Parser parser = {};
+    parser.quiet = true;
+    if (!window) {
+        Token at = {};
+        at.type = TOK_ERROR;
+        errorAt(&parser, &at, "no memory for the stream window");
+    }
 
-    // Parse source operand  
-    inst.src = parse_operand(parser, scanner, vm);
-    if (parser->hadError) return;
+    u32 used = 0;
+    bool atEnd = false;
+    while (window && !atEnd && !parser.hadError) {
+        used += (u32)fread(window + used, 1, windowSize - used, in);
+        atEnd = used < windowSize;
+
+        //the last whole line, everything after it waits for the next read
+        u32 parsed = used;
+        if (!atEnd) {
+            while (parsed && window[parsed - 1] != '\n') parsed--;
+            if (!parsed) {
+                Token at = {};
+                at.type = TOK_ERROR;
+                at.line = scanner.line;
+                errorAt(&parser, &at, "Line is longer than the stream window!");
+                break;
+            }
+        }
+        char next = window[parsed];
+        window[parsed] = 0;
+        scanner.start = window;
+        scanner.current = window;
+        scanner_batch(&scanner, tokens, VM_LEX_BATCH);
+        assemble_lines(program, &parser, &scanner);
+        window[parsed] = next;
+
+        memmove(window, window + parsed, used - parsed);
+        used -= parsed;
+    }
+    free(window);
+    if (!parser.hadError && ferror(in)) {
+        Token at = {};
+        at.type = TOK_ERROR;
+        at.line = scanner.line;
+        errorAt(&parser, &at, "couldn't read the stream");
+    }
 
-    inst.final_opcode = lookup_opcode(vm, inst.operation, inst.dst.mode, inst.src.mode, ADDR_NONE);
+    bool ok = assemble_resolve(program, &parser);
+    if (error) {
+        error->message = ok ? NULL : parser.errorMessage;
+        error->line = ok ? 0 : parser.errorLine;
+    }
+    return ok;
+}
 
-    //if we want to reorder operands to reduce symmetric instructions from taking up the instruction count
-#if 0
-    if (inst.final_opcode == OP_LOAD_REG_ADDR_TO_OFFSET_REG_ADDR) {
-        //swap dst and src
-        operand temp = inst.dst;
-        inst.dst = inst.src;
-        inst.src = temp;
+//the assembler as a service: the Program and a copy of the source (its label names point into it) come out of arena,
+//decoded and verified, ready for context_acquire. NULL with error filled in when it doesn't assemble or the arena is
+//too small (about sizeof(Program) + length), the arena is left as it was then
+Program* assemble(const char* source, u32 length, VMArena* arena, AssembleError* error = NULL) {
+    size_t mark = arena->used;
+    Program* program = (Program*)vm_arena_push(arena, sizeof(Program), alignof(Program));
+    char* text = (char*)vm_arena_push(arena, length + 1, 1);
+    if (!program || !text) {
+        arena->used = mark;
+        if (error) *error = { "arena too small", 0 };
+        return NULL;
     }
-#endif
+    memcpy(text, source, length);
+    text[length] = 0;
+    memset(program, 0, sizeof(Program));
+    program_reset(program);
+    program->fixedSize = true; //all of it is in the arena, nothing to free
+    program->table.fixedSize = true;
+    if (!assemble_program(program, text, error)) {
+        arena->used = mark;
+        return NULL;
+    }
+    vm_decode(*program);
+    return program;
+}
+
+int eval_repl_entry(REPL* repl, char* buffer) {
+    Scanner* scanner = &repl->scanner;
+    Parser* parser = &repl->parser;
+    scanner->lines[1] = buffer;
+    repl->vm.backPatchTableSize = 0;
+    printScannerLine(scanner, scanner->line);//print line 1
+
+    skipWhitespace(scanner);
+    if (*scanner->current == '/') {
+        int result = repl_command(repl);
+        return result;
+    }
+    else {
+
+        u32 byteCount = repl->vm.byteCount;
+        u32 dataSize = repl->vm.dataSize;
+        assemble_entry(&repl->vm, parser, scanner);
+        //new label data goes in the program's image for every future instance, and into the REPL's running one right away
+        memcpy(repl->vm.memBase + dataSize, repl->vm.data + dataSize, repl->vm.dataSize - dataSize);
+
+        //the new entry was appended at byteCount, only it needs decoding before we run
+        vm_invalidate_decode(repl->vm, byteCount);
+
+        if (byteCount != repl->vm.byteCount && !parser->hadError) {
+            //assume there is always an instruction to execute after we parse, depends on how we want the REPL to work
+            // executeInstruction(repl->vm);
+            vm_refuel(repl->vm);
+            repl_run(repl, false);
+            if (repl->vm.status == VM_YIELDED) printf("yielded (out of fuel or YIELD) at pc %u, /resume to keep going\n", repl->vm.pc);
+            if (repl->vm.status == VM_WAITING) printf("waiting %u ticks at pc %u, /resume to wake it now\n", repl->vm.wakeTick, repl->vm.pc);
+            if (repl->vm.status == VM_WAITING_EVENT) printf("waiting for event %u at pc %u, /resume to wake it now\n", repl->vm.waitEvent, repl->vm.pc);
+        }
+        else if (parser->hadError) {
+            printf("Error in parser! instructions discarded!\n");
+        }
 
-    if (inst.final_opcode == 255) {
-        errorAt(parser, &instructionToken, "PARSE LOAD invalid addressing mode combination");
-        return;
     }
-    emit_instruction_bytes(vm, &inst);
-    return;
-}
 
+    return 0;
 
-inline void parseMATH(VM* vm, Parser* parser, Scanner* scanner, generic_opcode code) {
-    Token instructionToken = parser->current;
-    parseAdvance(parser, scanner);
+}
 
-    vm_instruction inst = { 0 };
-    inst.operation = code;
-    // Parse destination operand
-    inst.dst = parse_operand(parser, scanner, vm);
-    if (parser->hadError) return;
 
-    // Parse source operand  
-    inst.src = parse_operand(parser, scanner, vm);
-    if (parser->hadError) return;
+//one assembled spell in a VMProgramCache, the Program comes first so vm_cache_release can get back here from it
+struct VMCachedProgram {
+    Program program;
+    u64 hash; //of the normalized source
+    char* source; //normalized, NUL terminated, the program's label names point into it
+    u32 sourceLength;
+    u32 sourceCapacity;
+    u32 refs; //vm_cache_acquire without a vm_cache_release yet, an entry with any isn't evicted
+    u32 prev; //LRU list, index + 1, 0 ends it
+    u32 next;
+    u32 nextInBucket; //index + 1, the free list links through it too
+};
 
+//assembled programs keyed by a hash of their normalized source, so everyone casting the same spell text shares one
+//Program (and one decode, verify and JIT). least recently used goes first when it's full. with a directory set a miss
+//tries <directory>/<hash>.lie before assembling, and whatever gets assembled is saved there for the next process.
+//not thread safe, the thread that takes submissions owns it, workers only run the programs it hands out
+struct VMProgramCache {
+    VMCachedProgram* entries;
+    u32 capacity;
+    u32* buckets; //head of each chain, index + 1
+    u32 bucketMask;
+    u32 head; //most recently used, index + 1
+    u32 tail; //least
+    u32 used; //entries handed out at least once
+    u32 freeList; //entries that didn't assemble, index + 1
+    const char* directory;
+    u32 hits;
+    u32 diskHits;
+    u32 misses;
+    u32 evictions;
+};
 
-    switch (parser->current.type) {
-    case TOK_REGISTER:
-    case TOK_LEFT_BRACKET://fall through, so that we can omit the result operand in certain cases
-        inst.res = parse_operand(parser, scanner, vm);
-        if (parser->hadError) return;
-        break;
-    default: {
-        inst.res = inst.dst;
+//the spell with comments, indentation, repeated spaces and blank lines taken out, strings are left alone.
+//out needs length + 2 bytes, returns the length without the NUL
+u32 vm_normalize_source(const char* source, u32 length, char* out) {
+    u32 count = 0;
+    u32 lineStart = 0;
+    bool space = false;
+    for (u32 i = 0; i < length && source[i]; i++) {
+        char c = source[i];
+        if (c == '"') {
+            if (space && count > lineStart) out[count++] = ' ';
+            space = false;
+            out[count++] = c;
+            for (i++; i < length && source[i]; i++) {
+                out[count++] = source[i];
+                if (source[i] == '"') break;
+            }
+            continue;
+        }
+        if (c == ';' || (c == '/' && i + 1 < length && source[i + 1] == '/')) {
+            while (i + 1 < length && source[i + 1] && source[i + 1] != '\n') i++;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r') {
+            space = true;
+            continue;
+        }
+        if (c == '\n') {
+            if (count > lineStart) out[count++] = '\n';
+            lineStart = count;
+            space = false;
+            continue;
+        }
+        if (space && count > lineStart) out[count++] = ' ';
+        space = false;
+        out[count++] = c;
     }
+    if (count > lineStart) out[count++] = '\n';
+    out[count] = 0;
+    return count;
+}
+
+//FNV-1a, the same as vm_program_hash
+u64 vm_source_hash(const char* source, u32 length) {
+    u64 hash = 14695981039346656037ull;
+    for (u32 i = 0; i < length; i++) {
+        hash ^= (u8)source[i];
+        hash *= 1099511628211ull;
     }
+    return hash;
+}
 
-    //LOAD doesnt have a third operand, just use the  ADDR_REG as a null value 
-    inst.final_opcode = lookup_opcode(vm, inst.operation, inst.dst.mode, inst.src.mode, inst.res.mode);
-    if (inst.final_opcode == 255) {
-        errorAt(parser, &instructionToken, "PARSE MATH invalid addressing mode combination");
-        return;
+VMProgramCache* vm_cache_create(u32 capacity, const char* directory = NULL) {
+    VMProgramCache* cache = (VMProgramCache*)calloc(1, sizeof(VMProgramCache));
+    cache->entries = (VMCachedProgram*)calloc(capacity, sizeof(VMCachedProgram)); //zeroed once, like program_reset wants
+    cache->capacity = capacity;
+    u32 buckets = 16;
+    while (buckets < capacity * 2) buckets *= 2;
+    cache->buckets = (u32*)calloc(buckets, sizeof(u32));
+    cache->bucketMask = buckets - 1;
+    cache->directory = directory;
+    return cache;
+}
+
+void vm_cache_destroy(VMProgramCache* cache) {
+    for (u32 i = 0; i < cache->used; i++) {
+        program_reset(&cache->entries[i].program);
+        free(cache->entries[i].source);
     }
-    emit_instruction_bytes(vm, &inst);
-    return;
+    free(cache->buckets);
+    free(cache->entries);
+    free(cache);
 }
 
-//can either accept a single operand, or 3
-inline void parseGEN(VM* vm, Parser* parser, Scanner* scanner, generic_opcode code) {
-    Token instructionToken = parser->current;
-    parseAdvance(parser, scanner);
+inline void vm_cache_unlink(VMProgramCache* cache, u32 index) {
+    VMCachedProgram& entry = cache->entries[index];
+    if (entry.prev) cache->entries[entry.prev - 1].next = entry.next;
+    else cache->head = entry.next;
+    if (entry.next) cache->entries[entry.next - 1].prev = entry.prev;
+    else cache->tail = entry.prev;
+    entry.prev = entry.next = 0;
+}
 
-    vm_instruction inst = { 0 };
-    inst.operation = code;
-    // Parse destination operand
-    inst.dst = parse_operand(parser, scanner, vm);
-    if (parser->hadError) return;
+inline void vm_cache_push_front(VMProgramCache* cache, u32 index) {
+    VMCachedProgram& entry = cache->entries[index];
+    entry.prev = 0;
+    entry.next = cache->head;
+    if (cache->head) cache->entries[cache->head - 1].prev = index + 1;
+    else cache->tail = index + 1;
+    cache->head = index + 1;
+}
 
-    switch (parser->current.type) {
-    case TOK_REGISTER:
-    case TOK_INSTRUCTION_VALUE:
-    case TOK_NUMBER:
-    case TOK_LEFT_BRACKET://fall through, so that we can omit the result operand in certain cases
-        inst.src = parse_operand(parser, scanner, vm);
-        if (parser->hadError) return;
-        break;
-    default: {
-        inst.src.mode = ADDR_NONE;
-    }
+//takes the entry out of the table and the LRU list, its program goes with it
+void vm_cache_evict(VMProgramCache* cache, u32 index) {
+    VMCachedProgram& entry = cache->entries[index];
+    u32* link = &cache->buckets[entry.hash & cache->bucketMask];
+    while (*link != index + 1) link = &cache->entries[*link - 1].nextInBucket;
+    *link = entry.nextInBucket;
+    entry.nextInBucket = 0;
+    vm_cache_unlink(cache, index);
+    program_reset(&entry.program);
+    cache->evictions++;
+}
+
+//a slot for a new program: a free one, or the least recently used one nobody holds. -1 when they're all held
+s32 vm_cache_slot(VMProgramCache* cache) {
+    if (cache->freeList) {
+        u32 index = cache->freeList - 1;
+        cache->freeList = cache->entries[index].nextInBucket;
+        cache->entries[index].nextInBucket = 0;
+        return (s32)index;
     }
-    switch (parser->current.type) {
-    case TOK_REGISTER:
-    case TOK_INSTRUCTION_VALUE://fall through, so that we can omit the result operand in certain cases
-    case TOK_NUMBER:
-    case TOK_LEFT_BRACKET:
-        inst.res = parse_operand(parser, scanner, vm);
-        if (parser->hadError) return;
-        break;
-    default: {
-        inst.res.mode = ADDR_NONE;
+    if (cache->used < cache->capacity) return (s32)cache->used++;
+    for (u32 link = cache->tail; link; link = cache->entries[link - 1].prev) {
+        if (!cache->entries[link - 1].refs) {
+            vm_cache_evict(cache, link - 1);
+            return (s32)(link - 1);
+        }
     }
+    return -1;
+}
+
+//the shared, decoded and verified program for source, assembling it only if neither the cache nor its directory has
+//it. NULL when it doesn't assemble or every entry is held. hand it back with vm_cache_release once nothing runs it
+Program* vm_cache_acquire(VMProgramCache* cache, const char* source, u32 length) {
+    char stackBuffer[MAX_REPL_BUFFER + 2];
+    char* normalized = length + 2 <= sizeof(stackBuffer) ? stackBuffer : (char*)malloc(length + 2);
+    u32 normalizedLength = vm_normalize_source(source, length, normalized);
+    u64 hash = vm_source_hash(normalized, normalizedLength);
+
+    for (u32 link = cache->buckets[hash & cache->bucketMask]; link; link = cache->entries[link - 1].nextInBucket) {
+        VMCachedProgram& entry = cache->entries[link - 1];
+        if (entry.hash != hash || entry.sourceLength != normalizedLength || memcmp(entry.source, normalized, normalizedLength)) continue;
+        vm_cache_unlink(cache, link - 1);
+        vm_cache_push_front(cache, link - 1);
+        entry.refs++;
+        cache->hits++;
+        if (normalized != stackBuffer) free(normalized);
+        return &entry.program;
     }
 
-    inst.final_opcode = lookup_opcode(vm, inst.operation, inst.dst.mode, inst.src.mode, inst.res.mode);
-    if (inst.final_opcode == 255) {
-        errorAt(parser, &instructionToken, "PARSE GEN invalid addressing mode combination");
-        return;
+    s32 index = vm_cache_slot(cache);
+    if (index < 0) {
+        printf("program cache: all %u programs are in use\n", cache->capacity);
+        if (normalized != stackBuffer) free(normalized);
+        return NULL;
     }
-    emit_instruction_bytes(vm, &inst);
-    return;
+    VMCachedProgram& entry = cache->entries[index];
+    if (entry.sourceCapacity < normalizedLength + 1) {
+        free(entry.source);
+        entry.sourceCapacity = normalizedLength + 1;
+        entry.source = (char*)malloc(entry.sourceCapacity);
+    }
+    memcpy(entry.source, normalized, normalizedLength + 1);
+    entry.sourceLength = normalizedLength;
+    entry.hash = hash;
+    if (normalized != stackBuffer) free(normalized);
+
+    char path[512] = {};
+    FILE* image = NULL;
+    if (cache->directory) {
+        snprintf(path, sizeof(path), "%s/%016llx.lie", cache->directory, hash);
+        image = fopen(path, "rb"); //a miss is the common case, lie_load would complain about every one
+        if (image) fclose(image);
+    }
+    if (image && lie_load(&entry.program, path)) {
+        cache->diskHits++;
+    }
+    else if (assemble_program(&entry.program, entry.source)) {
+        cache->misses++;
+        if (cache->directory) lie_save(entry.program, path);
+    }
+    else {
+        program_reset(&entry.program);
+        entry.nextInBucket = cache->freeList;
+        cache->freeList = (u32)index + 1;
+        return NULL;
+    }
+
+    vm_decode(entry.program);
+    entry.refs = 1;
+    entry.nextInBucket = cache->buckets[hash & cache->bucketMask];
+    cache->buckets[hash & cache->bucketMask] = (u32)index + 1;
+    vm_cache_push_front(cache, (u32)index);
+    return &entry.program;
 }
 
-inline void parseRegAndVal(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    parseAdvance(parser, scanner);
+void vm_cache_release(VMProgramCache* cache, Program* program) {
+    VMCachedProgram* entry = (VMCachedProgram*)program;
+    Assert(entry >= cache->entries && entry < cache->entries + cache->used && entry->refs);
+    entry->refs--;
+}
 
-    int bytes[3] = {};
-    int result = parseRegisterAndValue(vm, parser, scanner, bytes);
 
-    if (result < 0)return;
+void test_label_code(REPL* repl) {
+    reset_vm(&repl->vm);
 
-    EMIT_INSTRUCTION();
-}
+    const char* command = "jmp label\n label:\n LOAD $0 #1\n jmp label";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
 
-inline void parse3Regs(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    parseAdvance(parser, scanner);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
-    int bytes[3] = {};
-    int result = parse3Registers(vm, parser, scanner, bytes);
+    eval_repl_entry(repl, buffer);
 
-    if (result < 0)return;
-    EMIT_INSTRUCTION();
+    //we will continuously load 1 into register 0, until the instance runs out of fuel and yields
+    //the final result will be 1 no matter how many times it looped
+    Assert(repl->vm.registers[0] == 1);
+    Assert(repl->vm.status == VM_YIELDED);
 }
 
-inline void parse2Regs(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    parseAdvance(parser, scanner);
 
-    int regs[2] = {};
-    int result = parse2Registers(vm, parser, scanner, regs);
+void test_label_data(REPL* repl) {
+    reset_vm(&repl->vm);
+    const char* command = ".label1 \"hello\" \n .label2 \" world! \"\n .label3 resb 128\n \
+    LOAD $0 label1\n\
+    LOAD $1 label2\n\
+    LOAD $2 label3\n\
+    LOAD [$2] [$0]\n\
+    INC $2\n\
+    INC $0\n\
+    EQ [$0] $3\n\
+    JEQ #36\n\
+    JMP #12\n\
+    LOAD [$2] [$1]\n\
+    INC $2\n\
+    INC $1\n\
+    EQ [$1] $3\n\
+    JEQ #60\n\
+    JMP #36\n\
+    LOAD $2 label3\n\
+    PRT [$2]\n\
+    ";
 
-    if (result < 0)return;
+    // for(int i = 0; i < handmade_strlen(command); i++){
+    //     printf("%c\n", command[i]);
+    // }
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
 
-    // printf("%x %x\n", hex1, hex2);
-    u32 offset = vm->byteCount;
-    vm->bytecode[offset + 0] = code;
-    vm->bytecode[offset + 1] = regs[0];
-    vm->bytecode[offset + 2] = regs[1];
-    vm->byteCount += 4;
-}
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
+    eval_repl_entry(repl, buffer);
 
-inline void parsePUSH(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    parseAdvance(parser, scanner);
-    int bytes[3] = {};
-    const char* end = NULL;
+    //register 0 will be incremented 5 times as it iterates over all the characters in 'hello'
+    //so we expect 5 to be in register 0
+    Assert(repl->vm.registers[0] == 5);
+}
 
-    switch (parser->current.type) {
+void test_stack(REPL* repl) {
+    reset_vm(&repl->vm);
+    //factorial
+    const char* command = " \
+    LOAD $0 #12 ;0 \n\
+    LOAD $2 $0  ;4 \n\
+    PUSH $0     ;8 \n\
+    POP $0      ;12\n\
+    LOAD $1 #1  ;16\n\
+    EQ $0 $1    ;20\n\
+    JEQ #44     ;24\n\
+    PUSH $0     ;28\n\
+    DEC $0      ;32\n\
+    PUSH $0     ;36\n\
+    JMP #12     ;40\n\
+    POP $1      ;44\n\
+    MUL $0 $1 $0;48\n\
+    NEQ $1 $2   ;52\n\
+    JEQ #44     ;56\n\
+    PRT $0      ;60\n\
+    ";
 
-    case TOK_REGISTER: {
-        parseAdvance(parser, scanner);
-        int reg1 = string_to_int(parser->current.start, &end);
-        if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return;
-        bytes[0] = reg1;
+    // for(int i = 0; i < handmade_strlen(command); i++){
+    //     printf("%c\n", command[i]);
+    // }
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
 
-    }break;
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
-    default:
-        error(parser, "unhandled OP_PUSH CASE!");
-        Assert(!"unhandled OP_PUSH CASE!");
-    }
+    eval_repl_entry(repl, buffer);
 
-    EMIT_INSTRUCTION();
+    Assert(repl->vm.registers[0] == 479001600); //factorial of 12 is 479001600
 }
 
-inline void parseSYSCALL(VM* vm, Parser* parser, Scanner* scanner) {
-    parseAdvance(parser, scanner);
-    int bytes[3] = {};
-    Opcode code = OP_SYSCALL;
 
 
-    EMIT_INSTRUCTION();
-}
 
-inline void parsePOP(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    parseAdvance(parser, scanner);
-    int bytes[3] = {};
-    const char* end = NULL;
+void test_framePointer(REPL* repl) {
+    reset_vm(&repl->vm);
 
-    switch (parser->current.type) {
+    const char* command = "\
+    LOAD $0 #2          ;0  \n\
+    LOAD $1 #3          ;4  \n\
+    PUSH $0             ;8  stack is now at 4\n\
+    PUSH $1             ;12 stack is now at 8\n\
+    CALL addtest        ;16 pushes return address onto stack, stack is now at 12\n\
+    HLT                 ;20 \n\
+                            \n\
+    addtest:                \n\
+    PUSH $30            ;24 save old frame pointer to stack, now at 16  \n\
+    LOAD $30 $31        ;28 set frame pointer to current stack pointer  \n\
+    LOAD $0 [$30 + 16]  ;32                                             \n\
+    LOAD $1 [$30 + 12]  ;36                                             \n\
+    ADD $0 $1 $0        ;40                                             \n\
+    LOAD $31 $30        ;44 restore stack pointer (cleanup locals)      \n\
+    POP $30             ;48 restore to old frame pointer                \n\
+    RET                 ;52                                             \n\
+    ";
 
-    case TOK_REGISTER: {
-        parseAdvance(parser, scanner);
-        int reg1 = string_to_int(parser->current.start, &end);
-        if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return;
-        bytes[0] = reg1;
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
 
-    }break;
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
-    default:
-        error(parser, "unhandled OP_PUSH CASE!");
-        Assert(!"unhandled OP_PUSH CASE!");
-    }
+    eval_repl_entry(repl, buffer);
 
-    EMIT_INSTRUCTION();
+    Assert(repl->vm.registers[0] == 5); //adds 2 + 3
 }
 
-inline void parseCALL(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    parseAdvance(parser, scanner);
-    int bytes[3] = {};
-    const char* end = NULL;
-
-    switch (parser->current.type) {
 
-    case TOK_IDENTIFIER: {
-        char* labelStart = scanner->start;
-        char* labelEnd = scanner->current;
-        u32 len = labelEnd - labelStart;
+//effects only get recorded, in order, with their arguments and who cast them. a full queue yields the spell on the
+//SYSCALL and it casts again once it's resumed after a drain
+static void test_collect_effects(const VMEffect* records, u32 count, void* user) {
+    VMEffect** at = (VMEffect**)user;
+    memcpy(*at, records, count * sizeof(VMEffect));
+    *at += count;
+}
 
-        parseAdvance(parser, scanner);
+void test_effect_queue(REPL* repl) {
+    s32 hit = vm_host_lookup("test_hit", 8);
+    if (hit < 0) hit = vm_register_effect("test_hit", 2);
+    Assert(hit >= 0 && vmHost.functions[hit].effect);
+    Assert(vm_register_effect("test_too_many", VM_EFFECT_MAX_ARGS + 1) == -1);
 
-        u32 val = 0;
-        symbol_table_entry* entry = pushAssemblerSymbolTable(&vm->table, labelStart, len);
-        if (entry) {
-            if (entry->defined) {
-                val = entry->byteOffset;
-            }
-            else {
-                printf("label is not yet defined\n");
-                AssemblerBackPatch patch = {};
-                patch.hashEntry = entry;
-                patch.byteCodeLocation = vm->byteCount + 1;//JMP location + vm->byteCount
-                vm->backPatchTable[vm->backPatchTableSize++] = patch;
-            }
-        }
-        else {
-            Assert(!"Invalid symbol table entry??");
+    reset_vm(&repl->vm);
+    const char* command = "\
+    LOAD $1 #0          ;0  \n\
+    LOAD $2 #7          ;4  \n\
+    LOAD $3 #6          ;8  \n\
+    LOAD $4 #99         ;12 not an argument\n\
+    loop:                   \n\
+    SYSCALL test_hit    ;16 \n\
+    INC $1              ;20 \n\
+    LT $1 $3            ;24 \n\
+    JEQ #16             ;28 \n\
+    HLT                 ;32 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    u32 queued = repl->effects.tail;
+    eval_repl_entry(repl, buffer); //the REPL drains its own queue and prints them
+    Assert(repl->effects.head == repl->effects.tail && repl->effects.tail == queued + 6);
+    VM& vm = repl->vm;
+    vm.trace = false;
+
+    VMEffect records[4];
+    VMEffectQueue queue;
+    vm_dispatch_mode modes[3] = { DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_JIT };
+    for (int mode = 0; mode < 3; mode++) {
+        vm_effect_queue_init(&queue, records, 4);
+        VMEffectQueue* outer = vm_effect_queue_bind(&queue);
+        vm.dispatch = modes[mode];
+        vm.id = 77;
+        vm_restart(&vm);
+        vm_run(vm);
+        Assert(vm.status == VM_YIELDED);
+        Assert(vm.pc == 16 && vm.registers[1] == 4); //the fifth one didn't fit
+        Assert(queue.stalls == 1);
+
+        VMEffect drained[6];
+        VMEffect* at = drained;
+        Assert(vm_effect_drain(&queue, test_collect_effects, &at) == 4);
+        vm_resume(vm);
+        Assert(vm.status == VM_HALTED);
+        Assert(vm_effect_drain(&queue, test_collect_effects, &at) == 2); //wrapped around the ring, two runs
+        Assert(at == drained + 6);
+        for (int i = 0; i < 6; i++) {
+            Assert(drained[i].effect == hit && drained[i].instance == 77 && drained[i].argCount == 2);
+            Assert(drained[i].args[0] == i && drained[i].args[1] == 7);
         }
+        vm_effect_queue_bind(outer);
+    }
 
-        bytes[0] = (val) >> 16;
-        bytes[1] = (val) >> 8;
-        bytes[2] = val & 0xff;
+    //nowhere to put it is an error, not a silently dropped effect
+    vm.dispatch = DISPATCH_SWITCH;
+    vm_restart(&vm);
+    vm_run(vm);
+    Assert(vm.status == VM_ERROR);
+    Assert(vm.pc == 20);
 
-    }break;
+    reset_vm(&vm);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
+}
 
-    default:
-        error(parser, "unhandled OP_CALL CASE! Expected label name!");
-        Assert(!"unhandled OP_CALL CASE!");
+//YIELD and WAIT suspend with pc past them on every engine, resuming picks up right there
+void test_yield_wait(REPL* repl) {
+    reset_vm(&repl->vm);
+    const char* command = "\
+    LOAD $1 #1          ;0  \n\
+    YIELD               ;4  \n\
+    LOAD $1 #2          ;8  \n\
+    WAIT #70000         ;12 \n\
+    LOAD $1 #3          ;16 \n\
+    WAIT_EVENT #9       ;20 \n\
+    HLT                 ;24 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
+
+    Assert(vm.bytecode[4] == OP_YIELD && vm.bytecode[12] == OP_WAIT);
+    Assert(vm.bytecode[13] == 1 && vm.bytecode[14] == 0x11 && vm.bytecode[15] == 0x70); //70000, 24 bits
+    Assert(vm.bytecode[20] == OP_WAIT_EVENT && vm.bytecode[21] == 0 && vm.bytecode[22] == 9);
+    vm_decode(vm);
+    Assert(vm.verified);
+
+    vm_dispatch_mode modes[4] = { DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_JIT, DISPATCH_AOT };
+    int modeCount = 3;
+#if VM_AOT
+    if (vm_aot_build(vm, "yield_test", "/tmp/vm_yield_test.so") && vm_aot_load(vm, "/tmp/vm_yield_test.so", "yield_test")) modeCount = 4;
+#endif
+    for (int mode = 0; mode < modeCount; mode++) {
+        vm.dispatch = modes[mode];
+        vm_restart(&vm);
+        vm_run(vm);
+        Assert(vm.status == VM_YIELDED && vm.pc == 8 && vm.registers[1] == 1);
+        vm_resume(vm);
+        Assert(vm.status == VM_WAITING && vm.pc == 16 && vm.registers[1] == 2);
+        Assert(vm.wakeTick == 70000);
+        vm_resume(vm); //the host can always wake it early
+        Assert(vm.status == VM_WAITING_EVENT && vm.pc == 24 && vm.registers[1] == 3);
+        Assert(vm.waitEvent == 9);
+        vm_resume(vm);
+        Assert(vm.status == VM_HALTED);
     }
 
-    EMIT_INSTRUCTION();
+    reset_vm(&vm);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
 }
 
-inline void parseRET(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    parseAdvance(parser, scanner);
-    int bytes[3] = {};
-    const char* end = NULL;
-    EMIT_INSTRUCTION();
+static void test_scheduler_stopped(Context* ctx, void* user) {
+    Assert(ctx->status == VM_HALTED);
+    (*(u32*)user)++;
 }
 
+//instances wake exactly on the tick they asked for, whichever level of the wheel the wait started on
+void test_scheduler(REPL* repl) {
+    reset_vm(&repl->vm);
+    const char* command = "\
+    WAIT #0             ;0  next tick\n\
+    INC $1              ;4  \n\
+    WAIT #63            ;8  \n\
+    INC $1              ;12 \n\
+    WAIT #64            ;16 \n\
+    INC $1              ;20 \n\
+    WAIT #4095          ;24 \n\
+    INC $1              ;28 \n\
+    WAIT #4097          ;32 \n\
+    INC $1              ;36 \n\
+    WAIT #300000        ;40 \n\
+    INC $1              ;44 \n\
+    HLT                 ;48 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
+    vm_decode(vm);
+    Assert(vm.verified);
+
+    //wake ticks after the instance starts, the nth one makes $1 == n
+    const u32 wakes[6] = { 1, 1 + 63, 1 + 63 + 64, 1 + 63 + 64 + 4095, 1 + 63 + 64 + 4095 + 4097, 1 + 63 + 64 + 4095 + 4097 + 300000 };
+
+    //three instances started on different ticks, so they sit in different slots and cascade at different times
+    const u32 starts[3] = { 0, 5, 4000 };
+    Context slots[3];
+    ContextPool pool;
+    context_pool_init(&pool, slots, 3);
+    VMScheduler scheduler;
+    vm_scheduler_init(&scheduler, &pool);
+    u32 halted = 0;
+    u32 started = 0;
+    while (halted < 3) {
+        while (started < 3 && starts[started] == scheduler.now) {
+            Context* ctx = context_acquire(&pool, &vm);
+            context_run(*ctx);
+            Assert(ctx->status == VM_WAITING);
+            vm_scheduler_sleep(&scheduler, ctx);
+            started++;
+        }
+        vm_scheduler_tick(&scheduler, VM_DEFAULT_FUEL, test_scheduler_stopped, &halted);
+        for (u32 i = 0; i < started; i++) {
+            u32 age = scheduler.now - starts[i];
+            s32 expected = 0;
+            while (expected < 6 && wakes[expected] <= age) expected++;
+            Assert(slots[i].registers[1] == expected);
+        }
+        Assert(scheduler.sleeping == started - halted);
+        Assert(scheduler.now <= starts[2] + wakes[5]);
+    }
+    Assert(scheduler.now == starts[2] + wakes[5]);
+    for (int level = 0; level < VM_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < VM_WHEEL_SLOTS; i++) Assert(!scheduler.wheel[level][i]);
+    }
+    for (int i = 0; i < 3; i++) context_release(&pool, slots + i);
 
-inline void parsePRT(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-
-    parseAdvance(parser, scanner);
-
-    int bytes[3] = {};
-    const char* end = NULL;
-
-    switch (parser->current.type) {
-        case TOK_REGISTER: {
-            parseAdvance(parser, scanner);
-            if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return;
-            int reg1 = string_to_int(parser->previous.start, &end);
-            bytes[0] = reg1;
-            code = OP_PRT_REG;
-        }break;
+    reset_vm(&vm);
+}
 
-        case TOK_LEFT_BRACKET: {
-            parseAdvance(parser, scanner);
+//only the instances waiting on a published event wake, in the order they started waiting, and only when the host runs them
+void test_event_waits(REPL* repl) {
+    reset_vm(&repl->vm);
+    const char* command = "\
+    WAIT_EVENT #3       ;0  \n\
+    INC $1              ;4  \n\
+    WAIT_EVENT #5       ;8  \n\
+    INC $1              ;12 \n\
+    WAIT #2             ;16 \n\
+    INC $1              ;20 \n\
+    HLT                 ;24 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
+    vm_decode(vm);
+    Assert(vm.verified);
+
+    Context slots[4];
+    ContextPool pool;
+    context_pool_init(&pool, slots, 4);
+    VMScheduler* scheduler = (VMScheduler*)malloc(sizeof(VMScheduler));
+    vm_scheduler_init(scheduler, &pool);
+    for (int i = 0; i < 4; i++) {
+        Context* ctx = context_acquire(&pool, &vm, i & 1 ? DISPATCH_JIT : DISPATCH_SWITCH);
+        context_run(*ctx);
+        Assert(ctx->status == VM_WAITING_EVENT && ctx->waitEvent == 3);
+        vm_scheduler_subscribe(scheduler, ctx);
+    }
+    Assert(scheduler->subscribed == 4 && scheduler->events[3].count == 4);
+
+    u32 nobody[2] = { 5, 7 };
+    Assert(vm_scheduler_publish(scheduler, nobody, 2) == 0);
+    Assert(vm_scheduler_run_ready(scheduler) == 0);
+
+    u32 hit[2] = { 3, 3 }; //the second one finds the list empty
+    Assert(vm_scheduler_publish(scheduler, hit, 2) == 4);
+    Assert(scheduler->subscribed == 0 && scheduler->ready.count == 4 && !scheduler->events[3].head);
+    u32 link = scheduler->ready.head;
+    for (u32 i = 0; i < 4; i++) { //first come first served
+        Assert(link == i + 1);
+        link = slots[i].nextWaiting;
+    }
+    Assert(!link);
+    for (int i = 0; i < 4; i++) Assert(slots[i].registers[1] == 0); //publishing doesn't run anything
+
+    Assert(vm_scheduler_run_ready(scheduler) == 4);
+    Assert(scheduler->subscribed == 4 && scheduler->events[5].count == 4 && !scheduler->ready.head);
+    for (int i = 0; i < 4; i++) Assert(slots[i].registers[1] == 1 && slots[i].status == VM_WAITING_EVENT);
+
+    u32 next[1] = { 5 };
+    Assert(vm_scheduler_publish(scheduler, next, 1) == 4);
+    Assert(vm_scheduler_run_ready(scheduler) == 4);
+    Assert(scheduler->subscribed == 0 && scheduler->sleeping == 4); //on to the timer wheel
+
+    u32 halted = 0;
+    Assert(vm_scheduler_tick(scheduler, VM_DEFAULT_FUEL, test_scheduler_stopped, &halted) == 0);
+    Assert(vm_scheduler_tick(scheduler, VM_DEFAULT_FUEL, test_scheduler_stopped, &halted) == 4);
+    Assert(halted == 4 && scheduler->sleeping == 0);
+    for (int i = 0; i < 4; i++) Assert(slots[i].registers[1] == 3);
+
+    for (int i = 0; i < 4; i++) context_release(&pool, slots + i);
+    free(scheduler);
+    reset_vm(&vm);
+}
 
-            const char* end = NULL;
-            if (!parser_consume(parser, scanner, TOK_REGISTER, "Expected register as first operand"))return;
-            if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected number after first register symbol"))return;
-            int reg1 = string_to_int(parser->previous.start, &end);
-            if (reg1 < 0 || reg1 >= MAX_REGISTERS) {
-                error(parser, "REGISTER 1 TOO HIGH!\n");
-                return;
-            }
-            bytes[0] = reg1;
-            code = OP_PRT_ADDRESS;
-            if (!parser_consume(parser, scanner, TOK_RIGHT_BRACKET, "Expected closing bracket"))return;
-        }break;
+//every submitted instance runs exactly once a frame whichever worker gets it, and each worker's effects go to its own queue
+void test_worker_pool(REPL* repl) {
+    s32 hit = vm_host_lookup("test_hit", 8);
+    if (hit < 0) hit = vm_register_effect("test_hit", 2);
+    reset_vm(&repl->vm);
+    const char* command = "\
+    LOAD $1 #0          ;0  $4 is how many times it loops, the host sets it\n\
+    INC $1              ;4  \n\
+    LT $1 $4            ;8  \n\
+    JEQ #4              ;12 \n\
+    SYSCALL test_hit    ;16 \n\
+    HLT                 ;20 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
+    vm_decode(vm);
+    Assert(vm.verified);
+
+    const u32 count = 64;
+    Context* slots = (Context*)malloc(sizeof(Context) * count);
+    ContextPool contexts;
+    context_pool_init(&contexts, slots, count);
+    VMWorkerPool* pool = vm_workers_create(4, 64, 64);
+
+    //a thief takes the oldest of someone else's
+    Context* a = context_acquire(&contexts, &vm);
+    Context* b = context_acquire(&contexts, &vm);
+    Assert(vm_workers_push(pool, 2, a) && vm_workers_push(pool, 2, b));
+    VMTask task;
+    Assert(vm_worker_steal(pool, 1, &task) && task.ctx == a);
+    Assert(vm_worker_steal(pool, 3, &task) && task.ctx == b);
+    Assert(!vm_worker_steal(pool, 0, &task));
+    context_release(&contexts, b);
+    context_release(&contexts, a);
+
+    //a deadline that's already gone starts nothing and keeps everything for the next frame
+    for (u32 i = 0; i < count; i++) {
+        Context* ctx = context_acquire(&contexts, &vm, i & 1 ? DISPATCH_JIT : DISPATCH_THREADED);
+        ctx->registers[2] = (s32)ctx->id;
+        ctx->registers[4] = 50;
+        Assert(vm_workers_push(pool, 0, ctx)); //all on one worker, the rest have to steal to get any
+    }
+    VMFrameStats stats = vm_workers_run_frame(pool, 0);
+    Assert(stats.ran == 0 && stats.rounds == 0 && stats.deferred == count);
+    Assert(vm_workers_pending(pool) == count);
+
+    stats = vm_workers_run_frame(pool, ~0ull);
+    Assert(stats.ran == count && stats.deferred == 0 && stats.rounds == 1 && stats.quanta == count);
+    Assert(stats.fuelCharged == count * (3 * 50 - 2)); //the first block is 4 instructions, every pass after it 3, the one HLT ends isn't charged
+    Assert(vm_workers_pending(pool) == 0);
+    u32 stolen = 0;
+    for (u32 i = 0; i < 4; i++) stolen += pool->workers[i].stolen;
+    Assert(stolen == count - pool->workers[0].ran + pool->workers[0].stolen);
+    for (u32 i = 0; i < count; i++) Assert(slots[i].status == VM_HALTED && slots[i].registers[1] == 50);
+
+    VMEffect drained[count];
+    VMEffect* at = drained;
+    Assert(vm_workers_drain_effects(pool, test_collect_effects, &at) == count);
+    bool seen[count] = {};
+    for (u32 i = 0; i < count; i++) {
+        Assert(drained[i].effect == hit && drained[i].args[0] == 50 && drained[i].args[1] == (s32)drained[i].instance);
+        Assert(!seen[drained[i].instance]);
+        seen[drained[i].instance] = true;
+    }
 
-        case TOK_INSTRUCTION_VALUE: {
-            Assert(!"unhandled case!");
-        }break;
+#if VM_JIT
+    //code a later push wrapped the arena over gets compiled again when the frame starts, never on a worker
+    Program& program = *slots[1].program;
+    context_reset(slots + 1, &vm, DISPATCH_JIT);
+    slots[1].registers[4] = 50;
+    Assert(vm_workers_push(pool, 1, slots + 1));
+    jitArena.generation++; //what the wrap does
+    Assert(!vm_jit_valid(program));
+    Assert(vm_workers_run_frame(pool, ~0ull).ran == 1 && vm_jit_valid(program));
+    Assert(slots[1].status == VM_HALTED && slots[1].registers[1] == 50);
+
+    //and a worker that finds it stale anyway runs it threaded and leaves it stale
+    context_reset(slots + 1, &vm, DISPATCH_JIT);
+    slots[1].registers[4] = 50;
+    jitArena.generation++;
+    VMEffectQueue* outer = vm_effect_queue_bind(&pool->workers[1].effects);
+    vmOnWorker = true;
+    context_run(slots[1]);
+    vmOnWorker = false;
+    vm_effect_queue_bind(outer);
+    Assert(slots[1].status == VM_HALTED && slots[1].registers[1] == 50 && !vm_jit_valid(program));
+    Assert(vm_workers_drain_effects(pool, test_collect_effects, &(at = drained)) == 2);
+    Assert(drained[0].args[0] == 50 && drained[1].args[0] == 50);
+#endif
 
-        default:{}break;
+    //round robin, and a second frame runs them all again
+    for (u32 i = 0; i < count; i++) {
+        context_reset(slots + i, &vm, slots[i].dispatch);
+        slots[i].registers[4] = 50;
+        Assert(vm_workers_submit(pool, slots + i));
+    }
+    for (u32 i = 0; i < 4; i++) Assert(pool->workers[i].tail - pool->workers[i].head == count / 4);
+    Assert(vm_workers_run_frame(pool, ~0ull).ran == count);
+    Assert(vm_workers_drain_effects(pool, test_collect_effects, &(at = drained)) == count);
+    for (u32 i = 0; i < count; i++) Assert(slots[i].status == VM_HALTED && slots[i].registers[1] == 50);
+
+    //a frame budget of 1000 in quanta of 100, everyone gets their ten quanta in turn and then yields like running out of fuel
+    for (u32 i = 0; i < count; i++) {
+        context_reset(slots + i, &vm, slots[i].dispatch);
+        slots[i].registers[4] = 200000;
+        Assert(vm_workers_submit(pool, slots + i));
+    }
+    stats = vm_workers_run_frame(pool, ~0ull, 1000, 100);
+    Assert(stats.ran == count && stats.deferred == 0 && stats.rounds == 10 && stats.quanta == count * 10);
+    for (u32 i = 0; i < count; i++) {
+        Assert(slots[i].status == VM_YIELDED);
+        Assert(slots[i].registers[1] >= 330 && slots[i].registers[1] <= 345); //1000 and maybe a bit, 3 instructions a pass
     }
 
-    EMIT_INSTRUCTION();
+    //a deadline that comes first leaves them queued in the order they'd have run, the next frame finishes them
+    for (u32 i = 0; i < count; i++) Assert(vm_workers_submit(pool, slots + i));
+    stats = vm_workers_run_frame(pool, vm_time_ns() + 1000000, 1 << 30);
+    Assert(stats.deferred && stats.deferred == vm_workers_pending(pool));
+    u32 finished = 0;
+    for (u32 i = 0; i < count; i++) finished += slots[i].status == VM_HALTED;
+    Assert(finished + stats.deferred == count);
+    stats = vm_workers_run_frame(pool, ~0ull, 1 << 30);
+    Assert(stats.ran == count - finished && stats.deferred == 0);
+    for (u32 i = 0; i < count; i++) Assert(slots[i].status == VM_HALTED && slots[i].registers[1] == 200000);
+    Assert(vm_workers_drain_effects(pool, test_collect_effects, &(at = drained)) == count);
+
+    vm_workers_destroy(pool);
+    for (u32 i = 0; i < count; i++) context_release(&contexts, slots + i);
+    free(slots);
+    reset_vm(&vm);
 }
 
+void test_lie_image(REPL* repl) {
+    reset_vm(&repl->vm);
+    const char* command = "\
+    .greeting \"hello\"      \n\
+    LOAD $0 greeting        ;0  \n\
+    LOAD $1 #5              ;4  \n\
+    CALL double             ;8  \n\
+    SYSCALL meaning_of_life ;12 \n\
+    HLT                     ;16 \n\
+    double:                     \n\
+    ADD $1 $1 $1            ;20 \n\
+    RET                     ;24 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    Assert(vm.registers[1] == 10);
+    Assert(vm.sourceLines[0] == 2 && vm.sourceLines[5] == 8);
+
+    const char* path = "/tmp/vm_lie_test.lie";
+    Assert(lie_save(vm, path));
+    Assert(vm.lie.magic == LIE_MAGIC && vm.lie.symbolCount == 2 && vm.lie.importCount == 1);
+
+    Program* loaded = (Program*)calloc(1, sizeof(Program));
+    Assert(lie_load(loaded, path));
+    Assert(loaded->byteCount == vm.byteCount && !memcmp(loaded->bytecode, vm.bytecode, vm.byteCount));
+    Assert(loaded->dataSize == vm.dataSize && !memcmp(loaded->data, vm.data, vm.dataSize));
+    Assert(!memcmp(loaded->sourceLines, vm.sourceLines, vm.byteCount / 4 * sizeof(u32)));
+    //used where they're mapped, only the data is copied
+    Assert(loaded->bytecode == loaded->image + loaded->lie.sections[LIE_CODE].offset);
+    Assert((u8*)loaded->sourceLines == loaded->image + loaded->lie.sections[LIE_DEBUG].offset);
+    symbol_table_entry* entry = getAssemblerSymbolTableEntry(&loaded->table, (char*)"double", 6);
+    Assert(entry && entry->type == label_code && entry->byteOffset == 20);
+    Assert(entry->name >= (char*)loaded->image && entry->name < (char*)loaded->image + loaded->imageSize);
+    entry = getAssemblerSymbolTableEntry(&loaded->table, (char*)"greeting", 8);
+    Assert(entry && entry->type == label_data && !strcmp((char*)loaded->data + entry->byteOffset, "hello"));
+
+    //runs without the assembler ever seeing it
+    Context* ctx = (Context*)calloc(1, sizeof(Context));
+    context_init(ctx, loaded);
+    Assert(loaded->verified);
+    context_run(*ctx);
+    Assert(ctx->status == VM_HALTED && ctx->registers[1] == 10 && ctx->registers[0] == vm.registers[0]);
+    context_free_memory(ctx);
+
+    //nothing is fixed up on load, so anything that doesn't match is turned away rather than repaired
+    FILE* file = fopen(path, "r+b");
+    Assert(file);
+    u8 image[512];
+    u32 size = (u32)fread(image, 1, sizeof(image), file);
+    Assert(size == vm.lie.size);
+    LIE* header = (LIE*)image;
+    LIEImport* import = (LIEImport*)(image + header->sections[LIE_IMPORTS].offset);
+    import->index = 0; //meaning_of_life built against the wrong slot
+    fseek(file, 0, SEEK_SET);
+    fwrite(image, 1, size, file);
+    fflush(file);
+    Assert(!lie_load(loaded, path) && !loaded->image && !loaded->byteCount);
+    header->magic = 0;
+    fseek(file, 0, SEEK_SET);
+    fwrite(image, 1, size, file);
+    fclose(file);
+    Assert(!lie_load(loaded, path));
+
+    lie_unmap(loaded);
+    free(ctx);
+    free(loaded);
+    remove(path);
+}
 
-inline void parseReg(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    parseAdvance(parser, scanner);
-
-    int regs[1] = {};
-    int result = parseRegister(vm, parser, scanner, regs);
+//runs a cached program on a fresh instance, $1 after it halts
+s32 cacheTestRun(Program* program) {
+    Context* ctx = (Context*)calloc(1, sizeof(Context));
+    context_init(ctx, program);
+    context_run(*ctx);
+    Assert(ctx->status == VM_HALTED);
+    s32 result = ctx->registers[1];
+    context_free_memory(ctx);
+    free(ctx);
+    return result;
+}
 
-    if (result < 0)return;
+void test_program_cache(REPL* repl) {
+    char normalized[256];
+    const char* messy = "  LOAD $0   #1 ;x\n\n\t.s \"a  ;b\" // y\n";
+    u32 length = vm_normalize_source(messy, handmade_strlen(messy), normalized);
+    Assert(length == 22 && !strcmp(normalized, "LOAD $0 #1\n.s \"a  ;b\"\n"));
+
+    const char* spell = "LOAD $1 #3\nJMP loop\nHLT\nloop:\nINC $1\nLOAD $2 #10\nLT $1 $2\nJEQ #12\nHLT\n";
+    const char* sameSpell = "\n    LOAD $1 #3   ;start at 3\n    JMP loop\n    HLT\n    loop:\n    INC  $1 ;12\n\n    LOAD $2 #10\n    LT $1 $2\n    JEQ #12 ;until 10\n    HLT\n";
+    const char* other = "LOAD $1 #7\nHLT\n";
+    const char* third = "LOAD $1 #8\nHLT\n";
+
+    VMProgramCache* cache = vm_cache_create(2);
+    Program* a = vm_cache_acquire(cache, spell, handmade_strlen(spell));
+    Assert(a && a->verified && cacheTestRun(a) == 10);
+    //the same spell typed differently is the same program
+    Assert(vm_cache_acquire(cache, sameSpell, handmade_strlen(sameSpell)) == a);
+    Assert(cache->hits == 1 && cache->misses == 1);
+    vm_cache_release(cache, a);
+    vm_cache_release(cache, a);
+
+    //least recently used goes first
+    Program* b = vm_cache_acquire(cache, other, handmade_strlen(other));
+    Assert(b && b != a && cacheTestRun(b) == 7);
+    vm_cache_release(cache, b);
+    Assert(vm_cache_acquire(cache, spell, handmade_strlen(spell)) == a);
+    vm_cache_release(cache, a);
+    Program* c = vm_cache_acquire(cache, third, handmade_strlen(third));
+    Assert(c == b && cache->evictions == 1 && cacheTestRun(c) == 8);
+    Assert(vm_cache_acquire(cache, spell, handmade_strlen(spell)) == a && cache->hits == 3);
+
+    //nothing held is evicted, and a spell that doesn't assemble doesn't take a slot
+    Assert(!vm_cache_acquire(cache, other, handmade_strlen(other)));
+    vm_cache_release(cache, c);
+    Assert(!vm_cache_acquire(cache, "LOAD $1 nowhere\nJMP nowhere\n", 28));
+    Assert(cache->evictions == 2);
+    Program* d = vm_cache_acquire(cache, other, handmade_strlen(other));
+    Assert(d == c && cacheTestRun(d) == 7);
+    vm_cache_release(cache, d);
+    vm_cache_release(cache, a);
+    vm_cache_destroy(cache);
+
+    //with a directory the next process maps what this one assembled
+    char path[64];
+    length = vm_normalize_source(spell, handmade_strlen(spell), normalized);
+    snprintf(path, sizeof(path), "/tmp/%016llx.lie", vm_source_hash(normalized, length));
+    remove(path);
+    cache = vm_cache_create(4, "/tmp");
+    a = vm_cache_acquire(cache, spell, handmade_strlen(spell));
+    Assert(a && cache->misses == 1);
+    vm_cache_release(cache, a);
+    vm_cache_destroy(cache);
+    cache = vm_cache_create(4, "/tmp");
+    a = vm_cache_acquire(cache, sameSpell, handmade_strlen(sameSpell));
+    Assert(a && cache->diskHits == 1 && !cache->misses && a->image && a->verified && cacheTestRun(a) == 10);
+    vm_cache_release(cache, a);
+    vm_cache_destroy(cache);
+    remove(path);
+}
 
-    // printf("%x %x\n", hex1, hex2);
-    u32 offset = vm->byteCount;
-    vm->bytecode[offset + 0] = code;
-    vm->bytecode[offset + 1] = regs[0];
-    vm->byteCount += 4;
+//every thread assembles the same spells into its own arena
+static void assembleTestThread(const char** spells, u32 count, u8* memory, size_t size, Program** out) {
+    VMArena arena = { memory, size, 0 };
+    for (u32 i = 0; i < count; i++) out[i] = assemble(spells[i], handmade_strlen(spells[i]), &arena);
 }
 
+void test_assemble(REPL* repl) {
+    const char* spells[4] = {
+        "LOAD $1 #3\nJMP loop\nHLT\nloop:\nINC $1\nLOAD $2 #10\nLT $1 $2\nJEQ #12\nHLT\n",
+        ".greeting \"hello\"\nLOAD $0 greeting\nLOAD $1 [$0 + 1]\nHLT\n",
+        "LOAD $1 #5\nCALL double\nHLT\ndouble:\nADD $1 $1 $1\nRET\n",
+        "LOAD $1 #7 ;a comment\nPUSH $1\nPOP $2\nADD $1 $2 $1\n",
+    };
+    s32 results[4] = { 10, 'e', 10, 14 };
 
+    size_t size = 5 * (sizeof(Program) + 256);
+    VMArena arena = { (u8*)malloc(size), size, 0 };
+    Program* programs[4];
+    for (u32 i = 0; i < 4; i++) {
+        AssembleError error;
+        programs[i] = assemble(spells[i], handmade_strlen(spells[i]), &arena, &error);
+        Assert(programs[i] && !error.message && programs[i]->verified);
+        Context* ctx = (Context*)calloc(1, sizeof(Context));
+        context_init(ctx, programs[i]);
+        context_run(*ctx);
+        Assert(ctx->status == VM_HALTED && ctx->registers[1] == results[i]);
+        context_free_memory(ctx);
+        free(ctx);
+    }
 
-inline void parseLabelDec(VM* vm, Parser* parser, Scanner* scanner) {
-    if (parser->previous.type != TOK_IDENTIFIER) {
-        error(parser, "expected identifier before colon for label declaration!");
-        return;
+    //errors come back instead of being printed, and leave the arena alone
+    size_t used = arena.used;
+    AssembleError error;
+    Assert(!assemble("LOAD $1 #1\nLOAD $99 #1\n", 23, &arena, &error) && error.message && error.line == 2 && arena.used == used);
+    Assert(!assemble("JMP nowhere\n", 12, &arena, &error) && error.message && arena.used == used);
+    Assert(!assemble("PRT #1\n", 7, &arena, &error) && error.message);
+    Assert(!assemble(".x 12\n", 6, &arena, &error) && error.message);
+    VMArena tiny = { arena.base, 1024, 0 };
+    Assert(!assemble(spells[0], handmade_strlen(spells[0]), &tiny, &error) && !strcmp(error.message, "arena too small") && !tiny.used);
+
+    //what used to overflow a fixed table now fails the spell
+    u32 lines = MAX_BYTECODE / 4 + 8;
+    char* big = (char*)malloc(lines * 16);
+    u32 length = 0;
+    for (u32 i = 0; i < lines; i++) length += sprintf(big + length, "INC $1\n");
+    arena.used = 0;
+    Assert(!assemble(big, length, &arena, &error) && !strcmp(error.message, "Program is too long!"));
+    length = 0;
+    for (u32 i = 0; i < MAX_BACKPATCHES + 1; i++) length += sprintf(big + length, "JMP later\n");
+    length += sprintf(big + length, "later:\nHLT\n");
+    Assert(!assemble(big, length, &arena, &error) && !strcmp(error.message, "Too many forward label references!"));
+    length = 0;
+    for (u32 i = 0; i < 3; i++) length += sprintf(big + length, ".buffer%u resb 100\n", i);
+    Assert(!assemble(big, length, &arena, &error) && !strcmp(error.message, "Out of data memory!"));
+    free(big);
+
+    //threads share nothing but the host table, so they all get what one thread got
+    arena.used = 0;
+    for (u32 i = 0; i < 4; i++) programs[i] = assemble(spells[i], handmade_strlen(spells[i]), &arena);
+    const u32 threadCount = 4;
+    u8* memory[threadCount];
+    Program* out[threadCount][4];
+    std::thread threads[threadCount];
+    for (u32 t = 0; t < threadCount; t++) {
+        memory[t] = (u8*)malloc(size);
+        threads[t] = std::thread(assembleTestThread, spells, 4, memory[t], size, out[t]);
     }
-    Assert(!"add label to symbol table!\n");
-    parseAdvance(parser, scanner);
+    for (u32 t = 0; t < threadCount; t++) {
+        threads[t].join();
+        for (u32 i = 0; i < 4; i++) {
+            Assert(out[t][i] && out[t][i]->byteCount == programs[i]->byteCount);
+            Assert(!memcmp(out[t][i]->bytecode, programs[i]->bytecode, programs[i]->byteCount));
+            Assert(out[t][i]->dataSize == programs[i]->dataSize && !memcmp(out[t][i]->data, programs[i]->data, programs[i]->dataSize));
+        }
+        free(memory[t]);
+    }
+    free(arena.base);
 }
 
-inline void parseLabelCode(VM* vm, Parser* parser, Scanner* scanner) {
-    char* labelStart = scanner->start;
-    char* labelEnd = scanner->current;
-    parseAdvance(parser, scanner);
-    if (!parser_consume(parser, scanner, TOK_COLON, "Expected colon after label definition at start of line"))return;
-
-
-    u32 len = labelEnd - labelStart;
-
-    symbol_table_entry entry = {};
-    // entry.name          = scanner->start;
-    entry.name = labelStart;
-    entry.nameLen = len;
-    entry.type = label_types::label_code;
-    entry.byteOffset = vm->byteCount;
-    entry.defined = true;
-
+//writes text to path and streams it back in through a window of windowSize bytes
+bool streamTestFile(Program* program, const char* path, const char* text, u32 length, u32 windowSize, AssembleError* error) {
+    FILE* out = fopen(path, "wb");
+    Assert(out && fwrite(text, 1, length, out) == length);
+    fclose(out);
+    FILE* in = fopen(path, "rb");
+    Assert(in);
+    program_reset(program);
+    bool ok = assemble_stream(program, in, error, windowSize);
+    fclose(in);
+    return ok;
+}
 
-    if (len > 32) {
-        errorAtCurrent(parser, "Label is too long! must be under 32 characters long!");
-        return;
+//what the REPL's parser gets from scanToken, one token at a time, counting lines the way assemble_lines does
+u32 lexTestScan(char* text, Token* tokens, u32 capacity) {
+    Scanner scanner = {};
+    scanner.quiet = true;
+    scanner.line = 1;
+    scanner.start = text;
+    scanner.current = text;
+    u32 count = 0;
+    while (count < capacity) {
+        Token token = scanToken(&scanner);
+        tokens[count++] = token;
+        if (token.type == TOK_EOF) break;
+        if (token.type == TOK_NEWLINE) scanner.line++;
     }
+    return count;
+}
 
-    symbol_table_entry* tableEntry = pushAssemblerSymbolTable(&vm->table, labelStart, len);
-    if (tableEntry) {
-        *tableEntry = entry;
+void test_lexer(REPL* repl) {
+    //every mnemonic in any case, and only whole words
+    for (u32 i = 0; i < sizeof(vmMnemonics) / sizeof(vmMnemonics[0]); i++) {
+        char name[16];
+        u32 length = handmade_strlen(vmMnemonics[i].name);
+        for (u32 c = 0; c < length; c++) { //every other letter upper case, WaIt_EvEnT
+            char letter = vmMnemonics[i].name[c];
+            name[c] = (c & 1) == 0 && letter >= 'a' && letter <= 'z' ? letter - ('a' - 'A') : letter;
+        }
+        Assert(vmKeywordLookup(vmMnemonicTable, vmMnemonics, vmMnemonics[i].name, length, TOK_IDENTIFIER) == vmMnemonics[i].type);
+        Assert(vmKeywordLookup(vmMnemonicTable, vmMnemonics, name, length, TOK_IDENTIFIER) == vmMnemonics[i].type);
+        Assert(vmKeywordLookup(vmMnemonicTable, vmMnemonics, vmMnemonics[i].name, length - 1, TOK_IDENTIFIER) != vmMnemonics[i].type);
     }
-    // Assert(!"figure out label use here!\n");
-    //so this is a function that we jump to
-
+    const char* names[] = { "loads", "lo", "block_1", "wait_even", "wait_events", "jmpx", "x" };
+    for (u32 i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        Assert(vmKeywordLookup(vmMnemonicTable, vmMnemonics, names[i], handmade_strlen(names[i]), TOK_IDENTIFIER) == TOK_IDENTIFIER);
+    }
+    Assert(vmKeywordLookup(vmReplCommandTable, vmReplCommands, "QUIT", 4, TOK_IDENTIFIER) == TOK_COMMAND_QUIT);
+    Assert(vmKeywordLookup(vmReplCommandTable, vmReplCommands, "resume", 6, TOK_IDENTIFIER) == TOK_COMMAND_RESUME);
+    Assert(vmKeywordLookup(vmReplCommandTable, vmReplCommands, "res", 3, TOK_IDENTIFIER) == TOK_IDENTIFIER);
+    Assert(vmKeywordLookup(vmLanguageKeywordTable, vmLanguageKeywords, "while", 5, TOK_IDENTIFIER) == TOK_WHILE);
+
+    //vm_lex makes exactly what scanToken does, at every alignment so the 16 byte blocks start all over the text
+    const char* source = "\
+    load $1 #5                          ; a comment long enough to take a few blocks to skip\n\
+\t\t  Jmp loop_1 // the other kind of comment\n\
+.greeting \"hello\nthere\"\n\
+loop_1: ADD $1 $1 $1\n\
+RAW 0x01020304 12.5 0x 7\n\
+LT $1 $2 != == <= >= ! = < > ( ) { } [ ] @ , . - + / * ` ~ _x\n\
+                                                                WAIT_EVENT #3\n\
+;\n\
+\"unterminated";
+    u32 length = handmade_strlen(source);
+    char* buffer = (char*)malloc(length + 32);
+    Token expected[256];
+    Token lexed[256];
+    for (u32 offset = 0; offset < 16; offset++) {
+        char* text = buffer + offset;
+        memcpy(text, source, length + 1);
+        u32 count = lexTestScan(text, expected, 256);
+        Assert(count < 256 && expected[count - 1].type == TOK_EOF);
+
+        //a small batch size, so some tokens are cut off between calls
+        const char* at = text;
+        int line = 1;
+        u32 lexedCount = 0;
+        while (!lexedCount || lexed[lexedCount - 1].type != TOK_EOF) lexedCount += vm_lex(&at, &line, lexed + lexedCount, 5);
+        Assert(lexedCount == count);
+        for (u32 i = 0; i < count; i++) {
+            Assert(lexed[i].type == expected[i].type && lexed[i].length == expected[i].length && lexed[i].line == expected[i].line);
+            Assert(lexed[i].type == TOK_ERROR ? !strcmp(lexed[i].start, expected[i].start) : lexed[i].start == expected[i].start);
+        }
+        Assert(expected[0].type == TOK_LOAD && expected[5].type == TOK_NEWLINE && expected[6].type == TOK_JMP);
+    }
+    free(buffer);
 }
 
+void test_assemble_stream(REPL* repl) {
+    const char* path = "/tmp/vm_stream_test.s";
+    Program* program = (Program*)calloc(1, sizeof(Program));
+    AssembleError error;
+
+    //a few bytes at a time cuts the text everywhere, it still comes out the same as assembling it in one go
+    const char* spell = "LOAD $1 #5\nCALL double\nHLT\n\ndouble: ;labels, comments and blank lines\nADD $1 $1 $1\nRET\n";
+    u32 spellLength = handmade_strlen(spell);
+    char* text = (char*)malloc(spellLength + 1);
+    memcpy(text, spell, spellLength + 1);
+    Program* whole = (Program*)calloc(1, sizeof(Program));
+    Assert(assemble_program(whole, text));
+    Assert(streamTestFile(program, path, spell, spellLength, 48, &error) && !error.message);
+    Assert(program->byteCount == whole->byteCount && !memcmp(program->bytecode, whole->bytecode, whole->byteCount));
+    Assert(!memcmp(program->sourceLines, whole->sourceLines, whole->byteCount / 4 * sizeof(u32)));
+
+    //the table keeps its own copy of every name, the window they were read from is long gone
+    symbol_table_entry* entry = getAssemblerSymbolTableEntry(&program->table, (char*)"double", 6);
+    Assert(entry && entry->type == label_code && entry->byteOffset == 12);
+    Assert(entry->name < text || entry->name >= text + spellLength);
+    program_reset(whole);
+    free(whole);
+    free(text);
+
+    //a generated library: far past the inline code, forward jumps the whole way, and labels that are prefixes of
+    //each other, so block_1 can't be mistaken for block_12
+    const u32 blocks = 20000;
+    char* library = (char*)malloc(blocks * 40 + 64);
+    u32 length = sprintf(library, "; generated, %u blocks\n\n", blocks);
+    for (u32 i = 0; i < blocks; i++) length += sprintf(library + length, "block_%u:\nINC $1\nJMP block_%u\n", i, i + 1);
+    length += sprintf(library + length, "block_%u:\nHLT\n", blocks);
+    Assert(streamTestFile(program, path, library, length, 4096, &error));
+    Assert(program->byteCount == (blocks * 2 + 1) * 4 && program->byteCount > MAX_BYTECODE);
+    Assert(program->table.total_entry_count == blocks + 1 && !program->backPatchTableSize);
+    Assert(program->sourceLines[program->byteCount / 4 - 1] == 3 + blocks * 3 + 1);
+    vm_decode(*program);
+    Assert(program->verified);
+    Context* ctx = (Context*)calloc(1, sizeof(Context));
+    context_init(ctx, program);
+    vm_refuel(*ctx, 1 << 20);
+    context_run(*ctx);
+    Assert(ctx->status == VM_HALTED && ctx->registers[1] == (s32)blocks);
+    context_free_memory(ctx);
+    free(ctx);
+
+    //the same thing streamed again reuses the Program, reset frees what it grew
+    Assert(streamTestFile(program, path, library, length, 4096, &error) && program->byteCount == (blocks * 2 + 1) * 4);
+
+    //its image loads as mapped too, the decoded instructions are the one part that has to outgrow the inline array
+    const char* imagePath = "/tmp/vm_stream_test.lie";
+    Assert(lie_save(*program, imagePath));
+    Program* loaded = (Program*)calloc(1, sizeof(Program));
+    Assert(lie_load(loaded, imagePath) && loaded->byteCount == program->byteCount && loaded->decoded != loaded->inlineDecoded);
+    ctx = (Context*)calloc(1, sizeof(Context));
+    context_init(ctx, loaded);
+    vm_refuel(*ctx, 1 << 20);
+    context_run(*ctx);
+    Assert(ctx->status == VM_HALTED && ctx->registers[1] == (s32)blocks);
+    context_free_memory(ctx);
+    free(ctx);
+    program_reset(loaded);
+    Assert(loaded->bytecode == loaded->inlineCode && !loaded->image);
+    free(loaded);
+    remove(imagePath);
+
+    //errors carry the line they're on, however far into the stream that is
+    length = sprintf(library, "LOAD $1 #1\n; ");
+    memset(library + length, 'x', 5000);
+    length += 5000;
+    length += sprintf(library + length, "\nHLT\n");
+    Assert(!streamTestFile(program, path, library, length, 4096, &error) && !strcmp(error.message, "Line is longer than the stream window!") && error.line == 2);
+    length = 0;
+    for (u32 i = 0; i < 1000; i++) length += sprintf(library + length, "INC $1\n");
+    length += sprintf(library + length, "JMP nowhere\n");
+    Assert(!streamTestFile(program, path, library, length, 256, &error) && error.message);
+    length = 0;
+    for (u32 i = 0; i < 1000; i++) length += sprintf(library + length, "INC $1\n");
+    length += sprintf(library + length, "LOAD $99 #1\n");
+    Assert(!streamTestFile(program, path, library, length, 256, &error) && error.line == 1001);
+
+    free(library);
+    program_reset(program);
+    free(program);
+    remove(path);
+}
 
+void test_syscall(REPL* repl) {
+    reset_vm(&repl->vm);
 
+    const char* command = "\
+    LOAD $0 #0          ;0  \n\
+    LOAD $1 #13         ;4  \n\
+    SYSCALL             ;8  \n\
+    ";
 
-inline void parseLabelData(VM* vm, Parser* parser, Scanner* scanner) {
-
-    parseAdvance(parser, scanner);
-    char* labelStart = scanner->start;
-    char* labelEnd = scanner->current;
-
-    if (!parser_consume(parser, scanner, TOK_IDENTIFIER, "Expected identifier name after '.' definition at start of line"))return;
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
 
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
+    eval_repl_entry(repl, buffer);
+    Assert(repl->vm.registers[0] == 0);
+}
 
-    u32 len = labelEnd - labelStart;
 
+//host functions for the tests and the benchmark, registered the first time they're needed
+static void test_host_add(Context& vm, void* user) {
+    vm.registers[0] = vm.registers[1] + vm.registers[2];
+    (*(u32*)user)++;
+}
+static void test_host_yield(Context& vm, void* user) { vm.status = VM_YIELDED; }
+static void test_host_fail(Context& vm, void* user) { vmError(vm, "HOST FUNCTION FAILED", vm.pc - 4); }
+static u32 testHostCalls;
+
+s32 test_host_register(const char* name, vm_host_fn fn, void* user = NULL) {
+    s32 index = vm_host_lookup(name, handmade_strlen(name));
+    if (index < 0) index = vm_register_host(name, fn, user);
+    Assert(index >= 0 && vmHost.functions[index].fn == fn);
+    return index;
+}
 
-    if (len > 32) {
-        errorAtCurrent(parser, "Label is too long! must be under 32 characters long!");
-        return;
+//named SYSCALLs compile to the registered index and run the same on every engine, a host function can yield or fail the run
+void test_host_functions(REPL* repl) {
+    s32 add = test_host_register("test_add", test_host_add, &testHostCalls);
+    test_host_register("test_yield", test_host_yield);
+    s32 fail = test_host_register("test_fail", test_host_fail);
+    Assert(vm_register_host("test_add", test_host_add) == -1); //names are unique
+    Assert(vm_host_lookup("cast_projectile", 15) == 2);
+    Assert(vm_host_lookup("cast", 4) == -1);
+
+    reset_vm(&repl->vm);
+    const char* command = "\
+    LOAD $1 #20         ;0  \n\
+    LOAD $2 #22         ;4  \n\
+    SYSCALL test_add    ;8  \n\
+    SYSCALL test_yield  ;12 \n\
+    LOAD $3 #1          ;16 \n\
+    HLT                 ;20 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
+    Assert(vm.bytecode[8] == OP_SYSCALL && ((vm.bytecode[9] << 8) | vm.bytecode[10]) == add);
+    vm_decode(vm);
+    Assert(vm.verified);
+
+    vm_dispatch_mode modes[4] = { DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_JIT, DISPATCH_AOT };
+    int modeCount = 3;
+#if VM_AOT
+    if (vm_aot_build(vm, "host_test", "/tmp/vm_host_test.so") && vm_aot_load(vm, "/tmp/vm_host_test.so", "host_test")) modeCount = 4;
+#endif
+    for (int mode = 0; mode < modeCount; mode++) {
+        vm.dispatch = modes[mode];
+        vm_restart(&vm);
+        u32 calls = testHostCalls;
+        vm_run(vm);
+        Assert(vm.status == VM_YIELDED);
+        Assert(vm.pc == 16); //picks up after the SYSCALL
+        Assert(vm.registers[0] == 42 && testHostCalls == calls + 1);
+        vm_resume(vm);
+        Assert(vm.status == VM_HALTED);
+        Assert(vm.registers[3] == 1);
     }
 
+    //an index nothing was registered at doesn't verify, and is an error on the checked engine
+    vm.bytecode[13] = 0xFF;
+    vm_invalidate_decode(vm, 12);
+    vm_decode(vm);
+    Assert(!vm.verified);
+    vm.dispatch = DISPATCH_SWITCH;
+    vm_restart(&vm);
+    vm_run(vm);
+    Assert(vm.status == VM_ERROR);
+    Assert(vm.pc == 16);
+
+    //and a host function can fail the run
+    vm.bytecode[13] = fail >> 8;
+    vm.bytecode[14] = fail & 0xFF;
+    vm_invalidate_decode(vm, 12);
+    vm_restart(&vm);
+    vm_run(vm);
+    Assert(vm.status == VM_ERROR);
+    Assert(vm.registers[0] == 42 && vm.registers[3] == 0);
 
-    u32 dataLocation = 0;
+    reset_vm(&vm);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
+}
 
-    switch (parser->current.type) {
-    case TOK_STRING: {//create stretch of static memory for a string
+void test_fib(REPL* repl) {
+    reset_vm(&repl->vm);
+    //fib, the count (starting at 0) is loaded to register 2
+    // const char* command = "\
+    // LOAD $2 #8      ;0 \n\
+    // LOAD $0 #0      ;4 \n\
+    // LOAD $1 #1      ;8 \n\
+    // LOAD $3 #1      ;12\n\
+    // JEQ $2 $0 #52   ;16 check if given count is 0\n\
+    // JEQ $2 $1 #52   ;20 check if given count is 1\n\
+    // ADD  $0 $1 $0   ;24\n\
+    // INC $3          ;28\n\
+    // JEQ $3 $2 #52   ;32\n\
+    // ADD  $1 $0 $1   ;36\n\
+    // INC $3          ;40\n\
+    // JEQ $3 $2 #52   ;44\n\
+    // JMP #24         ;48\n\
+    // PRT $0          ;52\n\
+    // PRT $1          ;56\n\
+    // LOAD $4 #2      ;60\n\
+    // LOAD $5 #0      ;64\n\
+    // DIV $3 $4 $3    ;68 remainder is sent to register 29\n\
+    // JEQ $29 $5 #80  ;72 if given count is even, the final term is already in register 0\n\
+    // LOAD $0 $1      ;76\n\
+    // ";
 
-        if (parser->current.length - 2 > 256) {
-            errorAtCurrent(parser, "String is too long! must be under 256 characters long!");
-            return;
-        }
+    const char* command = "\
+    LOAD $2 #8      ;0 \n\
+    LOAD $0 #0      ;4 \n\
+    LOAD $1 #1      ;8 \n\
+    LOAD $3 #0      ;12\n\
+    JEQ $0 $2 #48   ;16\n\
+    JEQ $1 $2 #48   ;20\n\
+    PUSH $0         ;24\n\
+    ADD $0 $1 $0    ;28\n\
+    POP $1          ;32\n\
+    INC $3          ;36\n\
+    JEQ $3 $2 #48   ;40\n\
+    JMP #24         ;44\n\
+    PRT $0          ;48\n\
+    ";
 
-        dataLocation = vm->memSize;
-        memcpy(vm->mem + vm->memSize, parser->current.start + 1, parser->current.length - 2);
-        *(vm->mem + vm->memSize + parser->current.length - 1) = 0;
-        vm->memSize += parser->current.length - 1;
-        parseAdvance(parser, scanner);
-        int fuckTheDebugger = 0;
 
-    }break;
+    // for(int i = 0; i < handmade_strlen(command); i++){
+    //     printf("%c\n", command[i]);
+    // }
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
 
-    case TOK_RESB: {//allocates data in const data segment (should we instead use a different variable data block and do a runtime check?)
-        const char* end = NULL;
-        parseAdvance(parser, scanner);
-        if (!parser_consume(parser, scanner, TOK_NUMBER, "Expected numeric value after RESB"))return;
-        int val = string_to_int(parser->previous.start, &end);
-        dataLocation = vm->memSize;
-        memset(vm->mem + vm->memSize, 0, val);
-        vm->memSize += val;
-        int fuckTheDebugger = 0;
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
-    }break;
+    eval_repl_entry(repl, buffer);
 
-    default: {
-        Assert(!"unhandled label case!");
-    }break;
-    }
+    Assert(repl->vm.registers[0] == 21); //fib
+}
 
-    symbol_table_entry entry = {};
-    entry.name = labelStart;
-    entry.nameLen = len;
-    entry.type = label_types::label_data;
-    entry.byteOffset = dataLocation;
-    entry.defined = true;
 
 
+void test_repl_reg_val(const char* command, u32 reg, int val) {
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
 
-    symbol_table_entry* tableEntry = pushAssemblerSymbolTable(&vm->table, labelStart, len);
-    if (tableEntry) {
-        *tableEntry = entry;
-    }
-    else {
-        Assert(!"Is this something we should be worried about?");
-        error(parser, "Couldn't assign label to the table?");
-        return;
-    }
+    static REPL* repl = repl_create(); //one for all of them, reset_vm is all it takes between programs
 
+    reset_vm(&repl->vm);
 
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
+    eval_repl_entry(repl, buffer);
 
-    // Assert(!"figure out label use here!\n");
-    //so this is a function that we jump to
+    Assert(repl->vm.registers[reg] == val);
 
 }
 
+void test_compiler(REPL* repl) {
+    reset_vm(&repl->vm);
 
-inline void parseSingleInstruction(VM* vm, Parser* parser, Scanner* scanner, Opcode code) {
-    TokenTypes instructionType = parser->previous.type;
-    parseAdvance(parser, scanner);
-
-    // printf("%x %x\n", hex1, hex2);
-    u32 offset = vm->byteCount;
-    vm->bytecode[offset + 0] = code;
-    vm->byteCount += 4;
-}
+    const char* command = "\
+        LOAD $0  #12        ;0\n\
+        SUB $31 $0          ;4\n\
+        LOAD $30 $31        ;8\n\
+        LOAD  $0 #1         ;12\n\
+        LOAD  [$30 + 4] $0  ;16\n\
+        LOAD  $0 #2         ;20\n\
+        LOAD  [$30 + 8] $0  ;24\n\
+        LOAD  $0 #0         ;28\n\
+        LOAD  [$30 + 12] $0 ;32\n\
+        LOAD  $0 [$30 + 4]  ;36\n\
+        LOAD  $1 [$30 + 8]  ;40\n\
+        ADD $0 $1           ;44\n\
+        LOAD  [$30 + 12] $0 ;48\n\
+    ";
 
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
 
-int repl_command(REPL* repl) {
+    buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
-    VM& vm = repl->vm;
-    char c = scannerAdvance(scanner);
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
-    TokenTypes type = {};
+    eval_repl_entry(repl, buffer);
+    Assert(repl->vm.registers[0] == 3);
+}
 
-    //assuming we've hit an identifier
-    while (isAlpha(charPeek(scanner)) || isNumeric(charPeek(scanner))) scannerAdvance(scanner);
 
-    switch (c) {
-    case '/': {//repl command
 
-        scanner->start++;
+void test_forloop(REPL* repl) {
+    reset_vm(&repl->vm);
 
-        if (scanner->current - scanner->start > 1) {
-            switch (scanner->start[0]) {
-            case 'c': {
-                if (checkReplKeyword(scanner, 1, 4, "lear")) {
-                    printf("clearing registers and bytecode!\n");
-                    repl->vm.byteCount = 0;
-                    repl->vm.pc = 0;
-                    for (u32 i = 0; i < 32; i++) {//exclude the last command which is just .history
-                        vm.registers[i] = 0;
-                    }
-                    return 0;
-                }
-            }break;
-            case 'q': {
-                if (checkReplKeyword(scanner, 1, 3, "uit")) {
-                    printf("THANKS BYE\n");
-                    return 1;
-                }
-            }break;
-            case 'h': {
-                if (checkReplKeyword(scanner, 1, 6, "istory")) {
-                    for (int i = 0; i < repl->historyLines - 1; i++) {//exclude the last command which is just .history
-                        printf("%u: %s", i, repl->history + (i * MAX_REPL_BUFFER));
-                    }
-                }
-            }break;
-            case 'p': {
-                if (checkReplKeyword(scanner, 1, 6, "rogram")) {
-                    for (u32 i = 0; i < vm.byteCount; i += 4) {//exclude the last command which is just .history
-                        printf("%2x %2x %2x %2x\n", vm.bytecode[i + 0], vm.bytecode[i + 1], vm.bytecode[i + 2], vm.bytecode[i + 3]);
-                    }
-                }
-            }break;
-            case 'r': {
-                if (checkReplKeyword(scanner, 1, 8, "egisters")) {
-                    printf("REGISTERS:\n");
-                    for (u32 i = 0; i < 16; i++) {//exclude the last command which is just .history
-                        printf(" %5ld   ", i);
-                    }
-                    printf("\n");
-                    for (u32 i = 0; i < 16; i++) {//exclude the last command which is just .history
-                        printf("[%6ld] ", vm.registers[i]);
-                    }
-                    printf("\n");
-
-                    for (u32 i = 16; i < 32; i++) {//exclude the last command which is just .history
-                        if (i == 31) {
-                            printf(" %5ld (STACK PTR)  ", i);
-                        }
-                        else {
-                            printf(" %5ld   ", i);
-                        }
-                    }
-                    printf("\n");
-                    for (u32 i = 16; i < 32; i++) {//exclude the last command which is just .history
-                        printf("[%6ld] ", vm.registers[i]);
-                    }
-                    printf("\n");
+    //locals are x and i 
+    #if 0
+    const char* command = "\
+        LOAD $0  #8         ;0 \n\
+        SUB $31 $0          ;4 \n\
+        LOAD $30 $31        ;8 \n\
+        LOAD  $0 #0         ;12\n\
+        LOAD  [$30 + 4] $0  ;16\n\
+        LOAD  $0 #0         ;20\n\
+        LOAD  [$30 + 8] $0  ;24\n\
+        LOAD $1 [$30 + 8]   ;28\n\
+        ;ONLY HANDLES exact comparison, no greater than or less then \n\
+        LOAD $2 #6          ;32\n\
+        JEQ $1 $2 #72       ;36\n\
+        LOAD $0 [$30 + 4]   ;40\n\
+        LOAD $3 #1          ;44\n\
+        ADD  $0 $3          ;48\n\
+        LOAD [$30 + 4] $0   ;52\n\
+        ;for loops can ONLY handle prefix ++ for now and generate an INC operator\n\
+        INC $1              ;56\n\
+        LOAD [$30 + 8] $1   ;60\n\
+        LOAD $4 #36         ;64\n\
+        JMPB $4             ;68\n\
+        HLT                 ;72\n\
+    ";
+    #else
+    const char* command = "\
+        LOAD     $0          #16        ;0  \n\
+        SUB      $31         $0         ;4  \n\
+        LOAD     $30         $31        ;8  \n\
+        LOAD     $0          #0         ;12 \n\
+        LOAD    [$30 + 4 ]   $0         ;16 \n\
+        LOAD     $0          #1         ;20 \n\
+        LOAD    [$30 + 8 ]   $0         ;24 \n\
+        LOAD     $0          #0         ;28 \n\
+        LOAD    [$30 + 12]   $0         ;32 \n\
+        LOAD     $0         [$30 + 12]  ;36 \n\
+        LOAD     $1          #7         ;40 \n\
+        LT       $0          $1         ;44 \n\
+        JNE      #100                 ;48 \n\
+        LOAD     $2         [$30 + 8 ]  ;52 \n\
+        LOAD    [$30 + 16]   $2         ;56 \n\
+        LOAD     $2         [$30 + 8 ]  ;60 \n\
+        LOAD     $3         [$30 + 4 ]  ;64 \n\
+        ADD      $2          $3         ;68 \n\
+        LOAD    [$30 + 8 ]   $2         ;72 \n\
+        LOAD     $4         [$30 + 16]  ;76 \n\
+        LOAD    [$30 + 4 ]   $4         ;80 \n\
+        INC      $0                     ;84 \n\
+        LOAD    [$30 + 16]   $0         ;88 \n\
+        LOAD     $5          #56        ;92 \n\
+        JMPB     $5                     ;96 \n\
+";
+    #endif
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
 
-                }
-            }break;
-            }
-        }
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
 
-    }break;
-    }
-    return 0;
+    eval_repl_entry(repl, buffer);
+    Assert(repl->vm.registers[2] == 21);
 }
 
 
-void parseInstruction(VM* vm, Parser* parser, Scanner* scanner) {
-    switch (parser->current.type) {
-    case TOK_LOAD: { parseLOAD(vm, parser, scanner, Opcode::OP_LOAD); }break;
-    case TOK_ADD: { parseMATH(vm, parser, scanner, generic_opcode::GEN_ADD); }break;
-    case TOK_SUB: { parseMATH(vm, parser, scanner, generic_opcode::GEN_SUB); }break;
-    case TOK_MUL: { parseMATH(vm, parser, scanner, generic_opcode::GEN_MUL); }break;
-    case TOK_DIV: { parseMATH(vm, parser, scanner, generic_opcode::GEN_DIV); }break;
+//runs the already assembled program again on both trace free engines, they should land in the same state as the traced run
+void test_trace_free(REPL* repl) {
+    test_fib(repl);
 
-    case TOK_EQ: { parseGEN(vm, parser, scanner, generic_opcode::GEN_EQ); }break;
-    case TOK_NEQ: { parse2Regs(vm, parser, scanner, Opcode::OP_NEQ); }break;
-    case TOK_GT: { parse2Regs(vm, parser, scanner, Opcode::OP_GT); }break;
-    case TOK_LT: { parse2Regs(vm, parser, scanner, Opcode::OP_LT); }break;
-    case TOK_GTQ: { parse2Regs(vm, parser, scanner, Opcode::OP_GTQ); }break;
-    case TOK_LTQ: { parse2Regs(vm, parser, scanner, Opcode::OP_LTQ); }break;
+    VM& vm = repl->vm;
+    s32 tracedRegisters[MAX_REGISTERS];
+    memcpy(tracedRegisters, vm.registers, sizeof(tracedRegisters));
+    int tracedInstructions = vm.instructionsExecuted;
 
-    case TOK_JEQ: { parseGEN(vm, parser, scanner, generic_opcode::GEN_JEQ); }break;
-    case TOK_JNE: { parseGEN(vm, parser, scanner, generic_opcode::GEN_JNE); }break;
-    case TOK_JMP: { parseGEN(vm, parser, scanner, generic_opcode::GEN_JMP); }break;
-    case TOK_JMPF: { parseReg(vm, parser, scanner, Opcode::OP_JMPF); }break;
-    case TOK_JMPB: { parseReg(vm, parser, scanner, Opcode::OP_JMPB); }break;
+    vm_dispatch_mode modes[2] = { DISPATCH_SWITCH, DISPATCH_THREADED };
+    for (int mode = 0; mode < 2; mode++) {
+        vm_restart(&vm);
+        vm.trace = false;
+        vm.dispatch = modes[mode];
 
-    case TOK_INC: { parseReg(vm, parser, scanner, Opcode::OP_INC); }break;
-    case TOK_DEC: { parseReg(vm, parser, scanner, Opcode::OP_DEC); }break;
+        vm_run(vm);
 
-    case TOK_PRT: { parsePRT(vm, parser, scanner, Opcode::OP_PRT); }break;
+        for (int i = 0; i < MAX_REGISTERS; i++) Assert(vm.registers[i] == tracedRegisters[i]);
+        Assert(vm.instructionsExecuted == tracedInstructions);
+        Assert(vm.registers[0] == 21);
+    }
+}
 
-    case TOK_PUSH: { parsePUSH(vm, parser, scanner, Opcode::OP_PUSH_REG); }break;
-    case TOK_POP: { parsePOP(vm, parser, scanner, Opcode::OP_POP_REG); }break;
-    case TOK_SYSCALL: { parseSYSCALL(vm, parser, scanner); }break;
 
-    case TOK_COLON: {
-        // parseLabelDec(vm, parser, scanner);
-        Assert(!"parse label function declaration here!");
+//each REPL entry appends to the bytecode, only the new instructions should get decoded before running
+void test_incremental_decode(REPL* repl) {
+    reset_vm(&repl->vm);
 
-    }break;
+    const char* entries[3] = { "LOAD $0 #5\n", "LOAD $1 #6\n", "ADD $0 $1 $2\n" };
+    for (int i = 0; i < 3; i++) {
+        char buffer[MAX_REPL_BUFFER];
+        size_t len = handmade_strlen(entries[i]);
+        memcpy(buffer, entries[i], len);
+        buffer[len] = 0;
+
+        Scanner* scanner = &repl->scanner;
+        repl->parser = {}; //clear 
+        repl->scanner = {}; //clear 
+        scanner->line = 1;
+        scanner->current = buffer;
+        scanner->start = buffer;
 
-    case TOK_HLT: { parseSingleInstruction(vm, parser, scanner, Opcode::OP_HLT); }break;
+        eval_repl_entry(repl, buffer);
+        Assert(repl->vm.decodedCount == (u32)(i + 1));
+    }
 
+    Assert(repl->vm.registers[2] == 11);
+}
 
-    case TOK_RAW: { parseRaw(vm, parser, scanner); }break;
 
-    case TOK_SEMICOLON: {
-        printf("parsed ';' begin comment!");
-        while (charPeek(scanner) != '\n' && !isAtEnd(scanner)) scannerAdvance(scanner); //consume all whitespace on the line
-        parseAdvance(parser, scanner);
-    }break;
+//the verifier has to turn down anything the check free engine can't survive, and accept a jump to exactly the end
+void test_verifier(REPL* repl) {
+    test_forloop(repl); //ends with JNE #100 on a 100 byte program
+    Assert(repl->vm.verified);
 
-    case TOK_IDENTIFIER: {
-        printf("parsed identifier at start of line! this is a location in code to jump to\n");
-        //this means the label is a function defining code that can be jumped to
-        parseLabelCode(vm, parser, scanner);
-    }break;
+    VM& vm = repl->vm;
+    reset_vm(&vm);
+    vm.trace = false;
+    u8 badRegister[4] = { OP_LOAD_IMM_TO_REG, 40, 0, 1 };
+    memcpy(vm.bytecode, badRegister, 4);
+    vm.byteCount = 4;
+    vm_decode(vm);
+    Assert(!vm.verified);
+    Assert(vm.verifyErrorByte == 0);
 
-    case TOK_DOT: {
-        printf("parsed label variable declaration at start of line!\n");
-        // parseLabelDec(vm, parser, scanner);
-        parseLabelData(vm, parser, scanner);
-    }break;
+    reset_vm(&vm);
+    vm.trace = false;
+    u8 misaligned[8] = { OP_JMP_CONSTANT, 0, 6, 0,   OP_HLT, 0, 0, 0 };
+    memcpy(vm.bytecode, misaligned, 8);
+    vm.byteCount = 8;
+    vm_run(vm);
+    Assert(!vm.verified);
+    Assert(vm.status == VM_ERROR); //the checked engine still catches it
 
-    case TOK_EOF: { printf("end of file!\n"); }break;
+    reset_vm(&vm);
+    vm.trace = false;
+    u8 noHandler[4] = { OP_LOAD_LABEL_TO_REG, 0, 0, 0 };
+    memcpy(vm.bytecode, noHandler, 4);
+    vm.byteCount = 4;
+    vm_decode(vm);
+    Assert(!vm.verified);
+}
 
-    case TOK_CALL: {
-        parseCALL(vm, parser, scanner, Opcode::OP_CALL);
-    }break;
-    case TOK_RET: {
-        parseRET(vm, parser, scanner, Opcode::OP_RET);
-    }break;
+//native code has to end up in exactly the state the interpreter does, including where it yields
+void test_jit(REPL* repl) {
+#if VM_JIT
+    void (*programs[3])(REPL*) = { test_fib, test_stack, test_forloop };
+    for (int p = 0; p < 3; p++) {
+        programs[p](repl);
+        VM& vm = repl->vm;
+        s32 expected[MAX_REGISTERS];
+        memcpy(expected, vm.registers, sizeof(expected));
+
+        vm.trace = false;
+        vm.dispatch = DISPATCH_JIT;
+        vm_restart(&vm);
+        vm_run(vm);
+        Assert(vm.jit.valid);
+        for (int i = 0; i < MAX_REGISTERS; i++) Assert(vm.registers[i] == expected[i]);
+        vm.dispatch = VM_DEFAULT_DISPATCH;
+    }
 
-    default:
-        error(parser, "unrecognized instruction type!");
+    //DIV has no template so every pass goes back through the interpreter, and small frames make it yield over and over
+    reset_vm(&repl->vm);
+    const char* command = "\
+        LOAD $0 #0     ;0  \n\
+        LOAD $2 #100   ;4  \n\
+        LOAD $5 #2     ;8  \n\
+        INC  $0        ;12 \n\
+        ADD  $1 $0     ;16 \n\
+        DIV  $0 $5 $6  ;20 \n\
+        LT   $0 $2     ;24 \n\
+        JEQ  #12       ;28 \n\
+        HLT            ;32 \n\
+";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    Assert(vm.registers[1] == 5050);
+    vm.trace = false;
+
+    u32 yieldPcs[2][64];
+    int frames[2] = {};
+    vm_dispatch_mode modes[2] = { DISPATCH_THREADED, DISPATCH_JIT };
+    for (int mode = 0; mode < 2; mode++) {
+        vm.dispatch = modes[mode];
+        vm_restart(&vm);
+        vm_refuel(vm, 30);
+        vm_run(vm);
+        while (vm.status == VM_YIELDED) {
+            Assert(frames[mode] < 64);
+            yieldPcs[mode][frames[mode]++] = vm.pc;
+            vm_resume(vm, 30);
+        }
+        Assert(vm.status == VM_HALTED);
+        Assert(vm.registers[1] == 5050);
+        Assert(vm.registers[6] == 50);
     }
+    Assert(frames[0] == frames[1] && frames[0] > 1);
+    for (int i = 0; i < frames[0]; i++) Assert(yieldPcs[0][i] == yieldPcs[1][i]);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
+#endif
 }
 
-int eval_repl_entry(REPL* repl, char* buffer) {
+//builds a spell with a call, a frame, a loop and a DIV into a .so and checks it against the interpreter, frame by frame
+//skipped when there's no C compiler around
+void test_aot(REPL* repl) {
+#if VM_AOT
+    reset_vm(&repl->vm);
+    const char* command = "\
+    LOAD $0 #0          ;0  \n\
+    LOAD $2 #40         ;4  \n\
+    LOAD $5 #3          ;8  \n\
+    loop:                   \n\
+    PUSH $0             ;12 \n\
+    CALL addone         ;16 \n\
+    POP $0              ;20 \n\
+    DIV $0 $5 $6        ;24 \n\
+    LT $0 $2            ;28 \n\
+    JEQ #12             ;32 \n\
+    HLT                 ;36 \n\
+                            \n\
+    addone:                 \n\
+    PUSH $30            ;40 \n\
+    LOAD $30 $31        ;44 \n\
+    LOAD $3 [$30 + 12]  ;48 \n\
+    INC $3              ;52 \n\
+    LOAD [$30 + 12] $3  ;56 \n\
+    ADD $1 $3 $1        ;60 \n\
+    POP $30             ;64 \n\
+    RET                 ;68 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
-    Parser* parser = &repl->parser;
-    scanner->lines[1] = buffer;
-    repl->vm.backPatchTableSize = 0;
-    printScannerLine(scanner, scanner->line);//print line 1
-
-    skipWhitespace(scanner);
-    if (*scanner->current == '/') {
-        int result = repl_command(repl);
-        return result;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    printf("AOT program: $0=%d $1=%d $6=%d\n", vm.registers[0], vm.registers[1], vm.registers[6]);
+    Assert(vm.registers[0] == 40);
+    Assert(vm.registers[1] == 820);
+    Assert(vm.registers[6] == 13);
+    vm.trace = false;
+
+    if (!vm_aot_build(vm, "aot_test", "/tmp/vm_aot_test.so") || !vm_aot_load(vm, "/tmp/vm_aot_test.so", "aot_test")) {
+        printf("AOT test skipped, couldn't build the spell\n");
+        return;
     }
-    else {
-
-        u32 byteCount = repl->vm.byteCount;
-        parseAdvance(parser, scanner);
-        Token curTok = parser->current;
-        while ((curTok.type != TOK_EOF) && !parser->hadError) {
-            parseInstruction(&repl->vm, &repl->parser, &repl->scanner);
-
-
-            if (parser->current.type == TOK_NEWLINE) {
-                while (parser->current.type == TOK_NEWLINE) {
-                    scanner->line++;
-                    Assert(scanner->line < 256);//max line count for now
-                    scanner->lines[scanner->line] = scanner->current;
-                    printScannerLine(scanner, scanner->line);
-                    parser_advance(parser, scanner);
-                }
-            }
-
-            else if (parser->current.type == TOK_EOF) {
-                printf("END OF FILE REACHED!\n");
-            }
-            else {
-                errorAtCurrent(parser, "Expected next instruction on a new line!");
-            }
-            curTok = parser->current;
 
+    s32 registers[2][MAX_REGISTERS];
+    u32 yieldPcs[2][64];
+    int frames[2] = {};
+    vm_dispatch_mode modes[2] = { DISPATCH_THREADED, DISPATCH_AOT };
+    for (int mode = 0; mode < 2; mode++) {
+        vm.dispatch = modes[mode];
+        vm_restart(&vm);
+        vm_refuel(vm, 25);
+        vm_run(vm);
+        while (vm.status == VM_YIELDED) {
+            Assert(frames[mode] < 64);
+            yieldPcs[mode][frames[mode]++] = vm.pc;
+            vm_resume(vm, 25);
         }
+        Assert(vm.status == VM_HALTED);
+        memcpy(registers[mode], vm.registers, sizeof(vm.registers));
+    }
+    Assert(frames[0] == frames[1] && frames[0] > 1);
+    for (int i = 0; i < frames[0]; i++) Assert(yieldPcs[0][i] == yieldPcs[1][i]);
+    for (int i = 0; i < MAX_REGISTERS; i++) Assert(registers[0][i] == registers[1][i]);
+
+    //a program that changed since the build doesn't get to run the stale .so, and it's told once rather than hashed every run
+    vm.bytecode[7] ^= 1;
+    vm_invalidate_decode(vm, 4);
+    Assert(!vm_aot_ready(vm));
+    vm.dispatch = VM_DEFAULT_DISPATCH;
+#endif
+}
 
-        //resolve backpatching
-        VM* vm = &repl->vm;
-        if (vm->backPatchTableSize && !parser->hadError) {
-            u32 size = vm->backPatchTableSize;
-            for (u32 i = 0; i < size; i++) {
-
-                char* labelStart = scanner->start;
-                char* labelEnd = scanner->current;
-                u32 len = labelEnd - labelStart;
-
-
-
-                AssemblerBackPatch* patch = vm->backPatchTable + i;
-                symbol_table_entry* entry = patch->hashEntry;
-
-                Assert(entry);
-                if (!entry->defined) {
-                    char temp[32];
-                    handmade_len_strcpy(temp, entry->name, entry->nameLen);
-                    printf("label %s was never defined!\n", temp);
-                    error(parser, "label was never defined");
-                    break;
-                }
-                switch (entry->type) {
-                case label_types::label_data: {
-                    Assert(!"handle data labels!");
-                    vm->backPatchTableSize--;
-                }break;
-                case label_types::label_code: {
-                    // Assert(!"handle code labels!");
-                    //for now we'll treat code addresses as very large
-                    vm->bytecode[patch->byteCodeLocation + 0] = entry->byteOffset >> 16;
-                    vm->bytecode[patch->byteCodeLocation + 1] = entry->byteOffset >> 8;
-                    vm->bytecode[patch->byteCodeLocation + 2] = entry->byteOffset & 0xff;
-                    vm->backPatchTableSize--;
-                    // Assert(!"Implement more OP Codes depending on the context of what was patched, can probably handle that when we initially parse the OPcode");
-                }break;
-                default:{}break;
-                }
-
+//INT32_MIN / -1 is the one division the hardware traps on, every engine has to give the wrapped result instead
+void test_div_overflow(REPL* repl) {
+    reset_vm(&repl->vm);
+    const char* command = "\
+    LOAD $1 #32768      ;0  \n\
+    MUL $1 $1 $2        ;4  $2 is 2^30\n\
+    LOAD $4 #0          ;8  \n\
+    SUB $4 $2 $3        ;12 -2^30\n\
+    ADD $3 $3 $2        ;16 and now INT32_MIN, without overflowing on the way\n\
+    LOAD $5 #1          ;20 \n\
+    SUB $4 $5 $4        ;24 -1\n\
+    DIV $1 $4 $7        ;28 \n\
+    DIV $2 $4 $6        ;32 \n\
+    HLT                 ;36 \n\
+    ";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
+    vm_decode(vm);
+    Assert(vm.verified);
+
+    vm_dispatch_mode modes[4] = { DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_JIT, DISPATCH_AOT };
+    int modeCount = 3;
+#if VM_AOT
+    if (vm_aot_build(vm, "div_test", "/tmp/vm_div_test.so") && vm_aot_load(vm, "/tmp/vm_div_test.so", "div_test")) modeCount = 4;
+#endif
+    for (int mode = 0; mode < modeCount; mode++) {
+        vm.dispatch = modes[mode];
+        vm_restart(&vm);
+        vm_run(vm);
+        Assert(vm.status == VM_HALTED);
+        Assert(vm.registers[2] == INT32_MIN && vm.registers[4] == -1);
+        Assert(vm.registers[7] == -32768);
+        Assert(vm.registers[6] == INT32_MIN && vm.registers[29] == 0 && vm.remainder == 0);
+    }
 
-            }
-        }
+    reset_vm(&vm);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
+}
 
-        if (vm->backPatchTableSize) {
-            error(parser, "back patch table not fully resolved after parsing!");
-            Assert(!"Need to handle this case, backpatching hasn't been fully implemented in all cases yet");
+//a bunch of instances of one program all mid run at once, each one has to end up where the REPL's own run did
+void test_contexts(REPL* repl) {
+    Assert(sizeof(Context) < 512);
+    void (*programs[2])(REPL*) = { test_framePointer, test_forloop };
+    for (int p = 0; p < 2; p++) {
+        programs[p](repl);
+        VM& vm = repl->vm;
+
+        Context contexts[64];
+        for (int i = 0; i < 64; i++) {
+            context_init(&contexts[i], &vm, i & 1 ? DISPATCH_SWITCH : VM_DEFAULT_DISPATCH);
+            vm_refuel(contexts[i], 8);
+            context_run(contexts[i]);
         }
 
-
-        if (byteCount != repl->vm.byteCount && !parser->hadError) {
-            //assume there is always an instruction to execute after we parse, depends on how we want the REPL to work
-            // executeInstruction(repl->vm);
-            vm_run(repl->vm, scanner);
+        //round robin with tiny frames so they're all in flight together
+        bool running = true;
+        while (running) {
+            running = false;
+            for (int i = 0; i < 64; i++) {
+                if (contexts[i].status != VM_YIELDED) continue;
+                vm_resume(contexts[i], 8);
+                running = true;
+            }
         }
-        else if (parser->hadError) {
-            printf("Error in parser! instructions discarded!\n");
+        for (int i = 0; i < 64; i++) {
+            Assert(contexts[i].status == VM_HALTED);
+            for (int r = 0; r < MAX_REGISTERS; r++) Assert(contexts[i].registers[r] == vm.registers[r]);
+            context_free_memory(&contexts[i]); //their stack pages
         }
-
     }
+}
 
-    return 0;
+//slots come back in O(1) and a reused one can't see anything the last spell left in it
+void test_context_pool(REPL* repl) {
+    test_framePointer(repl); //leaves its frame on the stack
+    VM& vm = repl->vm;
 
+    Context slots[3];
+    ContextPool pool;
+    context_pool_init(&pool, slots, 3);
+    Context* a = context_acquire(&pool, &vm);
+    Context* b = context_acquire(&pool, &vm);
+    Context* c = context_acquire(&pool, &vm);
+    Assert(a && b && c && pool.live == 3);
+    Assert(!context_acquire(&pool, &vm));
+
+    context_run(*b);
+    Assert(b->status == VM_HALTED);
+    for (int r = 0; r < MAX_REGISTERS; r++) Assert(b->registers[r] == vm.registers[r]);
+
+    context_release(&pool, a);
+    context_release(&pool, b);
+    Assert(pool.live == 1);
+    Context* reused = context_acquire(&pool, &vm);
+    Assert(reused == b); //last one in is the first one out
+    Assert(reused->pc == 0 && reused->status == VM_HALTED && !reused->equalFlag);
+    Assert(reused->registers[0] == 0 && reused->registers[REGSP] == STACK_START);
+    for (u32 i = vm.dataSize; i < MAX_MEM; i++) Assert(reused->mem[i] == 0);
+
+    context_run(*reused);
+    for (int r = 0; r < MAX_REGISTERS; r++) Assert(reused->registers[r] == vm.registers[r]);
+    Assert(context_acquire(&pool, &vm) == a);
+    Assert(!context_acquire(&pool, &vm));
+    for (int i = 0; i < 3; i++) context_release(&pool, slots + i);
 }
 
-
-void test_label_code(REPL* repl) {
+//ALOC hands out heap above the low memory, pages only get allocated where the program touches them
+void test_paged_memory(REPL* repl) {
     reset_vm(&repl->vm);
-
-    const char* command = "jmp label\n label:\n LOAD $0 #1\n jmp label";
+    const char* command = "\
+    LOAD $0 #6000       ;0  \n\
+    ALOC $0 $1          ;4  \n\
+    ALOC $0 $2          ;8  \n\
+    LOAD $3 #77         ;12 \n\
+    LOAD [$2 + 4] $3    ;16 \n\
+    LOAD $4 [$2 + 4]    ;20 \n\
+    LOAD $5 [$1 + 0]    ;24 \n\
+    LOAD $6 #0          ;28 \n\
+    LOAD $7 #100        ;32 \n\
+    loop:                   \n\
+    LOAD [$1 + 0] $6    ;36 \n\
+    LOAD $8 [$1 + 0]    ;40 \n\
+    ADD $9 $8 $9        ;44 \n\
+    INC $1              ;48 \n\
+    INC $6              ;52 \n\
+    LT $6 $7            ;56 \n\
+    JEQ #36             ;60 \n\
+    HLT                 ;64 \n\
+    ";
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
-
     buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
@@ -3493,45 +8881,64 @@ void test_label_code(REPL* repl) {
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
+    u32 pagesBefore = vmPages.live;
     eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
+
+    vm_dispatch_mode modes[3] = { DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_JIT };
+    for (int mode = 0; mode < 3; mode++) {
+        if (mode) {
+            vm.dispatch = modes[mode];
+            vm_restart(&vm);
+            vm_run(vm);
+        }
+        Assert(vm.status == VM_HALTED);
+        //past the allocator's header, 6000 + the size word rounds up to 6016 byte blocks
+        Assert(vm.registers[1] == MAX_MEM + VM_HEAP_HEADER_SIZE + 4 + 100);
+        Assert(vm.registers[2] == MAX_MEM + VM_HEAP_HEADER_SIZE + 6016 + 4);
+        Assert(vm.registers[4] == 77);
+        Assert(vm.registers[5] == 0);
+        Assert(vm.registers[9] == 100 * 99 / 2);
+        Assert(vm.heapTop == VM_HEAP_HEADER_SIZE + 2 * 6016);
+        Assert(vmPages.live == pagesBefore + 3); //the page table, the page the loop writes and the one $2 + 4 lands in
+    }
 
-    //we will continuously load 1 into register 0, until we hit the jump max count, and exit
-    //1 will be loaded into register 0 32 times, so the final result will be 1
-    Assert(repl->vm.registers[0] == 1);
-}
+    //past the cap is an error, not a bigger instance
+    vm_restart(&vm);
+    vm.memCap = 8000;
+    vm_run(vm);
+    Assert(vm.status == VM_ERROR);
+    Assert(vm.pc == 12); //stopped at the second ALOC
 
+    //a cap lowered below what's already in use stops allocation instead of wrapping around
+    u32 heapTop = vm.heapTop;
+    vm.memCap = heapTop / 2;
+    Assert(vm_heap_alloc(vm, 16) == 0 && vm.heapTop == heapTop);
 
-void test_label_data(REPL* repl) {
+    reset_vm(&vm);
+    Assert(vmPages.live == pagesBefore);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
+}
+
+//guard page backend runs the same programs to the same results, and a load/store outside the instance's memory is a VM error
+//at the same pc the checked engines stop at, not a crash
+void test_guard_pages(REPL* repl) {
     reset_vm(&repl->vm);
-    const char* command = ".label1 \"hello\" \n .label2 \" world! \"\n .label3 resb 256\n \
-    LOAD $0 label1\n\
-    LOAD $1 label2\n\
-    LOAD $2 label3\n\
-    LOAD [$2] [$0]\n\
-    INC $2\n\
-    INC $0\n\
-    EQ [$0] $3\n\
-    JEQ #36\n\
-    JMP #12\n\
-    LOAD [$2] [$1]\n\
-    INC $2\n\
-    INC $1\n\
-    EQ [$1] $3\n\
-    JEQ #60\n\
-    JMP #36\n\
-    LOAD $2 label3\n\
-    PRT [$2]\n\
+    const char* command = "\
+    LOAD $0 #6000       ;0  \n\
+    ALOC $0 $1          ;4  \n\
+    LOAD $3 #77         ;8  \n\
+    LOAD [$1 + 4] $3    ;12 \n\
+    LOAD $4 [$1 + 4]    ;16 \n\
+    LOAD $5 [$1 + 0]    ;20 \n\
+    LOAD $6 [$8 + 0]    ;24 \n\
+    HLT                 ;28 \n\
     ";
-
-    // for(int i = 0; i < handmade_strlen(command); i++){
-    //     printf("%c\n", command[i]);
-    // }
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
-
     buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
@@ -3539,44 +8946,87 @@ void test_label_data(REPL* repl) {
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
     eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
 
-    //register 0 will be incremented 5 times as it iterates over all the characters in 'hello'
-    //so we expect 5 to be in register 0
-    Assert(repl->vm.registers[0] == 5);
+    if (!context_guard_memory(&vm)) {
+        printf("guard pages aren't available here, skipping\n");
+        return;
+    }
+    Assert(vm.memBase == vm.guardMem);
+
+    //a page past the heap, a negative address that wraps to the top of the reservation, and the ones that are mapped
+    //but not the program's: the rest of the last heap page and the stack segment below stackLimit
+    context_set_stack_size(&vm, 64);
+    s32 badAddresses[4] = { MAX_MEM + (1 << 20), -4, MAX_MEM + 7000, VM_STACK_BASE + 16 };
+    vm_dispatch_mode modes[2] = { DISPATCH_SWITCH, DISPATCH_THREADED };
+    for (int mode = 0; mode < 2; mode++) {
+        vm.dispatch = modes[mode];
+        for (int bad = 0; bad < 4; bad++) {
+            vm_restart(&vm);
+            vm.registers[8] = badAddresses[bad];
+            vm_run(vm);
+            Assert(vm.status == VM_ERROR);
+            Assert(vm.pc == 28);
+            Assert(vm.registers[4] == 77);
+        }
+
+        //and the instance still runs fine after a fault
+        vm_restart(&vm);
+        Assert(vm.guardCommitted < MAX_MEM + 6000);
+        vm_run(vm);
+        Assert(vm.status == VM_HALTED);
+        Assert(vm.registers[1] == MAX_MEM + VM_HEAP_HEADER_SIZE + 4);
+        Assert(vm.registers[4] == 77);
+        Assert(vm.registers[5] == 0);
+        Assert(vm.guardCommitted >= MAX_MEM + vm.heapTop);
+        Assert(MAX_MEM + vm.heapTop < MAX_MEM + 7000 && MAX_MEM + 7000 < vm.guardCommitted); //really in the slack
+    }
+
+    //the checked engine stops in the same places
+    context_unguard_memory(&vm);
+    Assert(vm.memBase == vm.mem && !vm.guardMem);
+    for (int bad = 0; bad < 4; bad++) {
+        vm_restart(&vm);
+        vm.registers[8] = badAddresses[bad];
+        vm_run(vm);
+        Assert(vm.status == VM_ERROR);
+        Assert(vm.pc == 28);
+    }
+
+    reset_vm(&vm);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
 }
 
-void test_stack(REPL* repl) {
+//ENTER/LEAVE and multi register PUSH/POP do what the long forms did in every engine, the stack has its own size limit
+//and the top of low memory belongs to the program again
+void test_stack_frames(REPL* repl) {
     reset_vm(&repl->vm);
-    //factorial
-    const char* command = " \
-    LOAD $0 #12 ;0 \n\
-    LOAD $2 $0  ;4 \n\
-    PUSH $0     ;8 \n\
-    POP $0      ;12\n\
-    LOAD $1 #1  ;16\n\
-    EQ $0 $1    ;20\n\
-    JEQ #44     ;24\n\
-    PUSH $0     ;28\n\
-    DEC $0      ;32\n\
-    PUSH $0     ;36\n\
-    JMP #12     ;40\n\
-    POP $1      ;44\n\
-    MUL $0 $1 $0;48\n\
-    NEQ $1 $2   ;52\n\
-    JEQ #44     ;56\n\
-    PRT $0      ;60\n\
+    const char* command = "\
+    LOAD $0 #2          ;0  \n\
+    LOAD $1 #3          ;4  \n\
+    LOAD $5 #9          ;8  \n\
+    LOAD $6 #11         ;12 \n\
+    PUSH $0 $1          ;16 one instruction, two slots\n\
+    CALL addtest        ;20 \n\
+    POP $2 $3           ;24 \n\
+    HLT                 ;28 \n\
+                            \n\
+    addtest:                \n\
+    ENTER 8             ;32 PUSH $30, LOAD $30 $31, 8 bytes of locals\n\
+    PUSH $5 $6          ;36 callee saved\n\
+    LOAD $5 [$30 + 12]  ;40 \n\
+    LOAD $6 [$30 + 16]  ;44 \n\
+    ADD $5 $6 $7        ;48 \n\
+    POP $5 $6           ;52 \n\
+    LEAVE               ;56 \n\
+    RET                 ;60 \n\
     ";
-
-    // for(int i = 0; i < handmade_strlen(command); i++){
-    //     printf("%c\n", command[i]);
-    // }
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
-
     buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
@@ -3584,42 +9034,94 @@ void test_stack(REPL* repl) {
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
     eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
 
-    Assert(repl->vm.registers[0] == 479001600); //factorial of 12 is 479001600
-}
+    Assert(vm.bytecode[16] == OP_PUSH_MASK && vm.bytecode[24] == OP_POP_MASK && vm.bytecode[36] == OP_PUSH_MASK);
+    Assert(vm.bytecode[32] == OP_ENTER && vm.bytecode[33] == 0 && vm.bytecode[34] == 8 && vm.bytecode[56] == OP_LEAVE);
+    vm_decode(vm);
+    Assert(vm.verified);
+
+    //the stack used to grow down from here
+    memset(vm.mem + MAX_MEM - 16, 0xAB, 16);
+
+    vm_dispatch_mode modes[4] = { DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_JIT, DISPATCH_AOT };
+    int modeCount = 3;
+#if VM_AOT
+    if (vm_aot_build(vm, "stack_test", "/tmp/vm_stack_test.so") && vm_aot_load(vm, "/tmp/vm_stack_test.so", "stack_test")) modeCount = 4;
+#endif
+    for (int mode = 0; mode < modeCount; mode++) {
+        vm.dispatch = modes[mode];
+        vm_restart(&vm);
+        vm.registers[REGFP] = 1234;
+        vm_run(vm);
+        Assert(vm.status == VM_HALTED);
+        Assert(vm.registers[7] == 5); //adds 2 + 3
+        Assert(vm.registers[5] == 9 && vm.registers[6] == 11);
+        Assert(vm.registers[2] == 2 && vm.registers[3] == 3);
+        Assert(vm.registers[REGSP] == STACK_START);
+        Assert(vm.registers[REGFP] == 1234);
+        for (int i = 0; i < 16; i++) Assert(vm.mem[MAX_MEM - 16 + i] == 0xAB);
+    }
 
+    //8 bytes holds the two arguments but not the return address
+    context_set_stack_size(&vm, 8);
+    for (int mode = 0; mode < modeCount; mode++) {
+        vm.dispatch = modes[mode];
+        vm_restart(&vm);
+        vm_run(vm);
+        Assert(vm.status == VM_ERROR);
+        Assert(vm.pc == 24); //stops past the CALL like every other runtime error
+    }
 
+    //past VM_STACK_SMALL it's a whole page instead of a small block, same addresses either way
+    context_set_stack_size(&vm, VM_STACK_MAX);
+    vm_restart(&vm);
+    vm_run(vm);
+    Assert(vm.status == VM_HALTED && vm.registers[7] == 5 && vm.registers[REGSP] == STACK_START);
+
+    //a POP with nothing pushed is an underflow instead of a read past the top
+    context_set_stack_size(&vm, VM_DEFAULT_STACK_SIZE);
+    vm.dispatch = DISPATCH_SWITCH;
+    vm_restart(&vm);
+    vm.pc = 24;
+    vm_run(vm);
+    Assert(vm.status == VM_ERROR);
+    Assert(vm.pc == 28);
 
+    reset_vm(&vm);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
+}
 
-void test_framePointer(REPL* repl) {
+//freed blocks get reused by the next ALOC of their class, a long running ALOC/FREE loop doesn't grow the heap,
+//and the same program always gets the same addresses
+void test_heap_allocator(REPL* repl) {
     reset_vm(&repl->vm);
-
     const char* command = "\
-    LOAD $0 #2          ;0  \n\
-    LOAD $1 #3          ;4  \n\
-    PUSH $0             ;8  stack is now at 4\n\
-    PUSH $1             ;12 stack is now at 8\n\
-    CALL addtest        ;16 pushes return address onto stack, stack is now at 12\n\
-    HLT                 ;20 \n\
-                            \n\
-    addtest:                \n\
-    PUSH $30            ;24 save old frame pointer to stack, now at 16  \n\
-    LOAD $30 $31        ;28 set frame pointer to current stack pointer  \n\
-    LOAD $0 [$30 + 16]  ;32                                             \n\
-    LOAD $1 [$30 + 12]  ;36                                             \n\
-    ADD $0 $1 $0        ;40                                             \n\
-    LOAD $31 $30        ;44 restore stack pointer (cleanup locals)      \n\
-    POP $30             ;48 restore to old frame pointer                \n\
-    RET                 ;52                                             \n\
+    LOAD $0 #20         ;0  \n\
+    ALOC $0 $1          ;4  \n\
+    ALOC $0 $2          ;8  \n\
+    FREE $1             ;12 \n\
+    ALOC $0 $3          ;16 \n\
+    LOAD $4 #100        ;20 \n\
+    ALOC $4 $5          ;24 \n\
+    LOAD $6 #0          ;28 \n\
+    LOAD $7 #120        ;32 \n\
+    loop:                   \n\
+    ALOC $4 $8          ;36 \n\
+    FREE $8             ;40 \n\
+    INC $6              ;44 \n\
+    LT $6 $7            ;48 \n\
+    JEQ #36             ;52 \n\
+    FREE $5             ;56 \n\
+    FREE $2             ;60 \n\
+    HLT                 ;64 \n\
     ";
-
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
-
     buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
@@ -3627,27 +9129,64 @@ void test_framePointer(REPL* repl) {
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
     eval_repl_entry(repl, buffer);
+    VM& vm = repl->vm;
+    vm.trace = false;
+
+    s32 first[MAX_REGISTERS];
+    vm_dispatch_mode modes[3] = { DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_JIT };
+    for (int mode = 0; mode < 3; mode++) {
+        if (mode) {
+            vm.dispatch = modes[mode];
+            vm_restart(&vm);
+            vm_run(vm);
+        }
+        Assert(vm.status == VM_HALTED);
+        Assert(vm.registers[3] == vm.registers[1]); //the 32 byte block FREE $1 gave back
+        Assert(vm.registers[8] != vm.registers[5]);
+        Assert(vm.heapTop == VM_HEAP_HEADER_SIZE + 32 + 32 + 128 + 128); //the loop keeps reusing one block
+
+        VMHeapStats stats = vm_heap_stats(vm);
+        Assert(stats.live == 32); //$3 is still out
+        Assert(stats.peak == 32 + 32 + 128 + 128);
+        Assert(stats.free == 32 + 128 + 128);
+        Assert(stats.fragmentation > 0.89f && stats.fragmentation < 0.91f);
+
+        if (!mode) memcpy(first, vm.registers, sizeof(first));
+        for (int r = 0; r < MAX_REGISTERS; r++) Assert(vm.registers[r] == first[r]);
+    }
 
-    Assert(repl->vm.registers[0] == 5); //adds 2 + 3
+    //freeing something twice, or something that was never allocated, stops the spell
+    vm_restart(&vm);
+    u8 doubleFree[4] = { OP_FREE, 1, 0, 0 };
+    memcpy(vm.bytecode + 16, doubleFree, 4); //right after FREE $1
+    vm.byteCount = 20;
+    vm_invalidate_decode(vm, 16);
+    vm_run(vm);
+    Assert(vm.status == VM_ERROR);
+    Assert(vm_heap_stats(vm).live == 32);
+    vm.dispatch = VM_DEFAULT_DISPATCH;
 }
 
-
-void test_syscall(REPL* repl) {
+//a loop longer than one frame's fuel yields and picks up where it left off instead of getting killed
+void test_fuel(REPL* repl) {
     reset_vm(&repl->vm);
+    VM& vm = repl->vm;
 
+    //sum 1..100 in $1, 100 taken jumps, way past what one frame gets below
     const char* command = "\
-    LOAD $0 #0          ;0  \n\
-    LOAD $1 #13         ;4  \n\
-    SYSCALL             ;8  \n\
-    ";
-
+        LOAD $0 #0    ;0  \n\
+        LOAD $2 #100  ;4  \n\
+        INC  $0       ;8  \n\
+        ADD  $1 $0    ;12 \n\
+        LT   $0 $2    ;16 \n\
+        JEQ  #8       ;20 \n\
+        HLT           ;24 \n\
+";
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
-
     buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
@@ -3655,64 +9194,124 @@ void test_syscall(REPL* repl) {
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
     eval_repl_entry(repl, buffer);
-    Assert(repl->vm.registers[0] == 0);
+    Assert(vm.status == VM_HALTED);
+    Assert(vm.registers[1] == 5050);
+
+    //same program in 40 instruction frames, each frame stops at the top of the loop with the state intact
+    vm_restart(&vm);
+    vm.trace = false;
+    vm_refuel(vm, 40);
+    vm_run(vm);
+    int frames = 1;
+    while (vm.status == VM_YIELDED) {
+        Assert(vm.pc == 8);
+        Assert(vm.registers[1] == vm.registers[0] * (vm.registers[0] + 1) / 2);
+        vm_resume(vm, 40);
+        frames++;
+    }
+    Assert(vm.status == VM_HALTED);
+    Assert(vm.registers[1] == 5050);
+    Assert(frames > 1);
 }
 
+//fusion has to leave the program's behavior alone, including jumps that land in the middle of a fused pair
+void test_superinstructions(REPL* repl) {
+    test_forloop(repl); //LOAD + LOAD + ADD on the frame, LT + JNE
+    VM& vm = repl->vm;
+    Assert(vm.dispatchesSaved > 0);
+    s32 expected[MAX_REGISTERS];
+    memcpy(expected, vm.registers, sizeof(expected));
+    int fusedDispatches = vm.instructionsExecuted;
+
+    vm.fuse = false;
+    vm_invalidate_decode(vm, 0);
+    vm_restart(&vm);
+    vm.trace = false;
+    vm_run(vm);
+    Assert(vm.dispatchesSaved == 0);
+    Assert(vm.instructionsExecuted > fusedDispatches);
+    for (int i = 0; i < MAX_REGISTERS; i++) Assert(vm.registers[i] == expected[i]);
+    vm.fuse = true;
+
+    //JMP #16 lands on the JEQ half of the fused EQ + JEQ, the flag is clear so it falls through
+    test_repl_reg_val("LOAD $1 #3\n LOAD $2 #0\n JMP #16\n EQ $1 $2\n JEQ #24\n LOAD $0 #7\n ", 0, 7);
+    //the fused LT + JNE has to branch exactly like the pair
+    test_repl_reg_val("LOAD $1 #3\n LOAD $2 #5\n LT $2 $1\n JNE #20\n LOAD $0 #7\n LOAD $4 #1\n ", 0, 0);
+}
 
 
-void test_fib(REPL* repl) {
-    reset_vm(&repl->vm);
-    //fib, the count (starting at 0) is loaded to register 2
-    // const char* command = "\
-    // LOAD $2 #8      ;0 \n\
-    // LOAD $0 #0      ;4 \n\
-    // LOAD $1 #1      ;8 \n\
-    // LOAD $3 #1      ;12\n\
-    // JEQ $2 $0 #52   ;16 check if given count is 0\n\
-    // JEQ $2 $1 #52   ;20 check if given count is 1\n\
-    // ADD  $0 $1 $0   ;24\n\
-    // INC $3          ;28\n\
-    // JEQ $3 $2 #52   ;32\n\
-    // ADD  $1 $0 $1   ;36\n\
-    // INC $3          ;40\n\
-    // JEQ $3 $2 #52   ;44\n\
-    // JMP #24         ;48\n\
-    // PRT $0          ;52\n\
-    // PRT $1          ;56\n\
-    // LOAD $4 #2      ;60\n\
-    // LOAD $5 #0      ;64\n\
-    // DIV $3 $4 $3    ;68 remainder is sent to register 29\n\
-    // JEQ $29 $5 #80  ;72 if given count is even, the final term is already in register 0\n\
-    // LOAD $0 $1      ;76\n\
-    // ";
+//BENCHMARKS
+//run with './vmtest bench'
 
-    const char* command = "\
-    LOAD $2 #8      ;0 \n\
-    LOAD $0 #0      ;4 \n\
-    LOAD $1 #1      ;8 \n\
-    LOAD $3 #0      ;12\n\
-    JEQ $0 $2 #48   ;16\n\
-    JEQ $1 $2 #48   ;20\n\
-    PUSH $0         ;24\n\
-    ADD $0 $1 $0    ;28\n\
-    POP $1          ;32\n\
-    INC $3          ;36\n\
-    JEQ $3 $2 #48   ;40\n\
-    JMP #24         ;44\n\
-    PRT $0          ;48\n\
-    ";
+void bench_dispatch_program(REPL* repl, const char* name, void (*assembleTest)(REPL*), u32 runs) {
+    assembleTest(repl); //assembles the test program and runs it once with tracing
+    VM& vm = repl->vm;
 
+    //drop a trailing PRT so the timing isn't just stdout
+    u8 lastOp = vm.bytecode[vm.byteCount - 4];
+    if (lastOp == OP_PRT_REG || lastOp == OP_PRT_ADDRESS) vm.byteCount -= 4;
+
+    //ns/instruction is per instruction of the unfused program (what switch dispatches), so every engine is measured on the same work
+    //the JIT only dispatches the instructions it hands back to the interpreter
+    //guarded is fused on the guard page backend, loads/stores without the address checks
+    vm_dispatch_mode modes[5] = { DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_THREADED, DISPATCH_THREADED, DISPATCH_JIT };
+    bool fuse[5] = { false, false, true, true, true };
+    bool guard[5] = { false, false, false, true, false };
+    const char* modeNames[5] = { "switch", "threaded", "fused", "guarded", "jit" };
+    u64 work = 0;
+    u64 switchElapsed = 0;
+    for (int mode = 0; mode < 5; mode++) {
+        if (modes[mode] == DISPATCH_JIT && !VM_JIT) continue;
+        if (guard[mode] && !context_guard_memory(&vm)) continue;
+        vm.trace = false;
+        vm.dispatch = modes[mode];
+        vm.fuse = fuse[mode];
+        vm_invalidate_decode(vm, 0);
+        vm_decode(vm);
+        u64 instructions = 0;
+
+        u64 start = vm_time_ns();
+        for (u32 run = 0; run < runs; run++) {
+            vm_restart(&vm);
+            vm.fuel = INT_MAX; //no frame budget, time the whole program
+            vm_run(vm);
+            instructions += vm.instructionsExecuted;
+        }
+        u64 elapsed = vm_time_ns() - start;
+        if (guard[mode]) context_unguard_memory(&vm);
+        if (mode == 0) {
+            work = instructions;
+            switchElapsed = elapsed;
+        }
 
-    // for(int i = 0; i < handmade_strlen(command); i++){
-    //     printf("%c\n", command[i]);
-    // }
+        printf("[BENCH] %-12s %-9s %10llu dispatches %8.3f ns/instruction %10.1f ns/run %6.1fx\n", name, modeNames[mode], instructions,
+            (double)elapsed / (double)work, (double)elapsed / (double)runs, (double)switchElapsed / (double)elapsed);
+    }
+    vm.dispatch = VM_DEFAULT_DISPATCH;
+    vm.fuse = true;
+}
+
+//test_stack style PUSH/POP loop that runs long enough for the per run overhead to disappear
+//only gets a frame of fuel on the traced run that assembles it, the benchmark runs it to the end
+void bench_loop(REPL* repl) {
+    reset_vm(&repl->vm);
+    const char* command = "\
+        LOAD $2 #50000 ;0  \n\
+        LOAD $0 #0     ;4  \n\
+        LOAD $1 #0     ;8  \n\
+        LOAD $3 #3     ;12 \n\
+        PUSH $0        ;16 \n\
+        ADD  $1 $3 $1  ;20 \n\
+        POP  $4        ;24 \n\
+        INC  $0        ;28 \n\
+        LT   $0 $2     ;32 \n\
+        JEQ  #16       ;36 \n\
+";
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
-
     buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
@@ -3720,64 +9319,136 @@ void test_fib(REPL* repl) {
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
     eval_repl_entry(repl, buffer);
-
-    Assert(repl->vm.registers[0] == 21); //fib
 }
 
-
-
-void test_repl_reg_val(const char* command, u32 reg, int val) {
+//a loop that's mostly host calls, what a SYSCALL costs on each engine
+void bench_host(REPL* repl) {
+    test_host_register("test_add", test_host_add, &testHostCalls);
+    reset_vm(&repl->vm);
+    const char* command = "\
+        LOAD $5 #50000   ;0  \n\
+        LOAD $6 #0       ;4  \n\
+        LOAD $1 #1       ;8  \n\
+        LOAD $2 #2       ;12 \n\
+        SYSCALL test_add ;16 \n\
+        INC  $6          ;20 \n\
+        LT   $6 $5       ;24 \n\
+        JEQ  #16         ;28 \n\
+";
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
     buffer[len] = 0;
+    Scanner* scanner = &repl->scanner;
+    repl->parser = {}; //clear 
+    repl->scanner = {}; //clear 
+    scanner->line = 1;
+    scanner->current = buffer;
+    scanner->start = buffer;
+    eval_repl_entry(repl, buffer);
+}
 
-    REPL* repl = (REPL*)malloc(sizeof(REPL));
+//lots of live instances of one program, what each one costs to keep around and to spin up and run
+void bench_contexts(REPL* repl, u32 count) {
+    test_forloop(repl);
+    Context* contexts = (Context*)malloc(sizeof(Context) * count);
 
-    reset_vm(&repl->vm);
+    u64 start = vm_time_ns();
+    for (u32 i = 0; i < count; i++) {
+        context_init(contexts + i, &repl->vm);
+        context_run(contexts[i]);
+    }
+    u64 elapsed = vm_time_ns() - start;
+    for (u32 i = 0; i < count; i++) {
+        Assert(contexts[i].status == VM_HALTED);
+        context_free_memory(contexts + i);
+    }
+
+    printf("[BENCH] %u contexts of test_forloop, %u bytes each (program shared, %u bytes), %.1f ns per instance\n",
+        count, (u32)sizeof(Context), (u32)sizeof(Program), (double)elapsed / count);
+
+    //the same number of short lived spells out of a small pool, acquire/release instead of a slot each
+    ContextPool pool;
+    context_pool_init(&pool, contexts, 64);
+    start = vm_time_ns();
+    for (u32 i = 0; i < count; i++) {
+        Context* ctx = context_acquire(&pool, &repl->vm);
+        context_run(*ctx);
+        context_release(&pool, ctx);
+    }
+    elapsed = vm_time_ns() - start;
+    printf("[BENCH] %u pooled spawns of test_forloop from 64 slots, %.1f ns per acquire/run/release\n", count, (double)elapsed / count);
+    free(contexts);
+}
 
+//count spells that wake every 1000 ticks, spread so about count / 1000 of them wake on each tick. what a tick costs
+//with all of them asleep on the wheel, and what each one it wakes costs on top
+void bench_scheduler(REPL* repl, u32 count) {
+    reset_vm(&repl->vm);
+    const char* command = "\
+        INC  $1        ;0  \n\
+        WAIT #1000     ;4  \n\
+        JMP  #0        ;8  \n\
+";
+    size_t len = handmade_strlen(command);
+    Assert(len < MAX_REPL_BUFFER);
+    char buffer[MAX_REPL_BUFFER];
+    memcpy(buffer, command, len);
+    buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
     repl->scanner = {}; //clear 
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
     eval_repl_entry(repl, buffer);
 
-    Assert(repl->vm.registers[reg] == val);
-
-    free(repl);//, sizeof(REPL)
+    Context* contexts = (Context*)malloc(sizeof(Context) * count);
+    ContextPool pool;
+    context_pool_init(&pool, contexts, count);
+    VMScheduler scheduler;
+    vm_scheduler_init(&scheduler, &pool);
+    for (u32 i = 0; i < count; i++) {
+        if (i && i % (count / 1000) == 0) vm_scheduler_tick(&scheduler);
+        Context* ctx = context_acquire(&pool, &repl->vm);
+        context_run(*ctx);
+        vm_scheduler_sleep(&scheduler, ctx);
+    }
 
+    u32 ticks = 10000;
+    u64 woken = 0;
+    u64 start = vm_time_ns();
+    for (u32 i = 0; i < ticks; i++) woken += vm_scheduler_tick(&scheduler);
+    u64 elapsed = vm_time_ns() - start;
+    Assert(scheduler.sleeping == count);
+
+    //the same number of ticks with nothing due, the wheel only looks at empty slots
+    VMScheduler idle;
+    vm_scheduler_init(&idle, &pool);
+    u64 idleStart = vm_time_ns();
+    for (u32 i = 0; i < ticks; i++) vm_scheduler_tick(&idle);
+    u64 idleElapsed = vm_time_ns() - idleStart;
+
+    printf("[BENCH] %u sleeping spells on the timer wheel, %.1f ns per tick waking %.1f of them (%.1f ns each), %.1f ns per tick with none due\n",
+        count, (double)elapsed / ticks, (double)woken / ticks, (double)elapsed / (woken ? woken : 1), (double)idleElapsed / ticks);
+    for (u32 i = 0; i < count; i++) context_free_memory(contexts + i);
+    free(contexts);
 }
 
-void test_compiler(REPL* repl) {
+//count spells waiting on event 0, what publishing costs when nobody is waiting and what waking one costs when they are
+void bench_events(REPL* repl, u32 count) {
     reset_vm(&repl->vm);
-
     const char* command = "\
-        LOAD $0  #12        ;0\n\
-        SUB $31 $0          ;4\n\
-        LOAD $30 $31        ;8\n\
-        LOAD  $0 #1         ;12\n\
-        LOAD  [$30 + 4] $0  ;16\n\
-        LOAD  $0 #2         ;20\n\
-        LOAD  [$30 + 8] $0  ;24\n\
-        LOAD  $0 #0         ;28\n\
-        LOAD  [$30 + 12] $0 ;32\n\
-        LOAD  $0 [$30 + 4]  ;36\n\
-        LOAD  $1 [$30 + 8]  ;40\n\
-        ADD $0 $1           ;44\n\
-        LOAD  [$30 + 12] $0 ;48\n\
-    ";
-
+        INC  $1        ;0  \n\
+        WAIT_EVENT #0  ;4  \n\
+        JMP  #0        ;8  \n\
+";
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
-
     buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
@@ -3785,75 +9456,146 @@ void test_compiler(REPL* repl) {
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
     eval_repl_entry(repl, buffer);
-    Assert(repl->vm.registers[0] == 3);
+
+    Context* contexts = (Context*)malloc(sizeof(Context) * count);
+    ContextPool pool;
+    context_pool_init(&pool, contexts, count);
+    VMScheduler* scheduler = (VMScheduler*)malloc(sizeof(VMScheduler));
+    vm_scheduler_init(scheduler, &pool);
+    for (u32 i = 0; i < count; i++) {
+        Context* ctx = context_acquire(&pool, &repl->vm);
+        context_run(*ctx);
+        vm_scheduler_subscribe(scheduler, ctx);
+    }
+
+    u32 others[VM_MAX_EVENTS - 1];
+    for (u32 i = 0; i < VM_MAX_EVENTS - 1; i++) others[i] = i + 1;
+    u64 start = vm_time_ns();
+    for (u32 i = 0; i < 100; i++) Assert(vm_scheduler_publish(scheduler, others, VM_MAX_EVENTS - 1) == 0);
+    u64 idleElapsed = vm_time_ns() - start;
+
+    u32 rounds = 10;
+    u32 event = 0;
+    start = vm_time_ns();
+    for (u32 i = 0; i < rounds; i++) {
+        Assert(vm_scheduler_publish(scheduler, &event, 1) == count);
+        Assert(vm_scheduler_run_ready(scheduler) == count);
+    }
+    u64 elapsed = vm_time_ns() - start;
+    Assert(scheduler->subscribed == count);
+
+    printf("[BENCH] %u spells waiting on an event, %.1f ns to publish an event nobody waits on, %.1f ns per spell it wakes and runs\n",
+        count, (double)idleElapsed / (100 * (VM_MAX_EVENTS - 1)), (double)elapsed / ((u64)rounds * count));
+    for (u32 i = 0; i < count; i++) context_free_memory(contexts + i);
+    free(scheduler);
+    free(contexts);
 }
 
+//what a cache hit costs next to assembling the spell, the spell bench_loop runs
+void bench_cache(u32 count) {
+    const char* spell = "\
+        LOAD $2 #2000  ;0  \n\
+        LOAD $0 #0     ;4  \n\
+        LOAD $3 #3     ;8  \n\
+        loop:              \n\
+        INC $0         ;12 \n\
+        DIV $0 $3 $4   ;16 \n\
+        LT $0 $2       ;20 \n\
+        JEQ #12        ;24 \n\
+        HLT            ;28 \n\
+";
+    u32 length = handmade_strlen(spell);
+    VMProgramCache* cache = vm_cache_create(64);
+
+    u32 misses = 16;
+    char variant[MAX_REPL_BUFFER];
+    u64 start = vm_time_ns();
+    for (u32 i = 0; i < misses; i++) {
+        snprintf(variant, sizeof(variant), "LOAD $5 #%u\n%s", i, spell); //a different spell every time
+        Program* program = vm_cache_acquire(cache, variant, handmade_strlen(variant));
+        Assert(program);
+        vm_cache_release(cache, program);
+    }
+    u64 missElapsed = vm_time_ns() - start;
 
+    start = vm_time_ns();
+    for (u32 i = 0; i < count; i++) {
+        Program* program = vm_cache_acquire(cache, variant, handmade_strlen(variant));
+        vm_cache_release(cache, program);
+    }
+    u64 hitElapsed = vm_time_ns() - start;
+    Assert(cache->hits == count && cache->misses == misses);
 
-void test_forloop(REPL* repl) {
-    reset_vm(&repl->vm);
+    printf("[BENCH] program cache, %u byte spell: %.0f ns to assemble on a miss, %.0f ns per hit\n",
+        length, (double)missElapsed / misses, (double)hitElapsed / count);
+    vm_cache_destroy(cache);
+}
 
-    //locals are x and i 
-    #if 0
-    const char* command = "\
-        LOAD $0  #8         ;0 \n\
-        SUB $31 $0          ;4 \n\
-        LOAD $30 $31        ;8 \n\
-        LOAD  $0 #0         ;12\n\
-        LOAD  [$30 + 4] $0  ;16\n\
-        LOAD  $0 #0         ;20\n\
-        LOAD  [$30 + 8] $0  ;24\n\
-        LOAD $1 [$30 + 8]   ;28\n\
-        ;ONLY HANDLES exact comparison, no greater than or less then \n\
-        LOAD $2 #6          ;32\n\
-        JEQ $1 $2 #72       ;36\n\
-        LOAD $0 [$30 + 4]   ;40\n\
-        LOAD $3 #1          ;44\n\
-        ADD  $0 $3          ;48\n\
-        LOAD [$30 + 4] $0   ;52\n\
-        ;for loops can ONLY handle prefix ++ for now and generate an INC operator\n\
-        INC $1              ;56\n\
-        LOAD [$30 + 8] $1   ;60\n\
-        LOAD $4 #36         ;64\n\
-        JMPB $4             ;68\n\
-        HLT                 ;72\n\
-    ";
-    #else
+//a generated library of lines lines, lexed passes times by scanToken a token at a time and by vm_lex into one array
+void bench_lexer(u32 lines, u32 passes) {
+    const char* block[] = {
+        "spell_%u:                       ; generated\n",
+        "    LOAD $2 #2000               ; how many\n",
+        "    load $0 #0\n",
+        "    INC $0                      // one more\n",
+        "    DIV $0 $3 $4\n",
+        "    LT $0 $2\n",
+        "    JMP spell_%u\n",
+        "\n",
+    };
+    u32 blockLines = sizeof(block) / sizeof(block[0]);
+    char* text = (char*)malloc(lines * 48 + 1);
+    u32 length = 0;
+    for (u32 i = 0; i < lines; i++) length += sprintf(text + length, block[i % blockLines], i / blockLines);
+
+    Scanner scanner = {};
+    scanner.quiet = true;
+    u32 scanned = 0;
+    u64 start = vm_time_ns();
+    for (u32 pass = 0; pass < passes; pass++) {
+        scanner.start = scanner.current = text;
+        while (scanToken(&scanner).type != TOK_EOF) scanned++;
+    }
+    u64 scanElapsed = vm_time_ns() - start;
+
+    Token* tokens = (Token*)malloc((scanned / passes + 1) * sizeof(Token));
+    u32 lexed = 0;
+    start = vm_time_ns();
+    for (u32 pass = 0; pass < passes; pass++) {
+        const char* at = text;
+        int line = 1;
+        lexed += vm_lex(&at, &line, tokens, scanned / passes + 1) - 1; //not the EOF
+    }
+    u64 lexElapsed = vm_time_ns() - start;
+    Assert(lexed == scanned);
+
+    double megabytes = (double)length * passes / (1024 * 1024);
+    double scanSeconds = scanElapsed / 1e9;
+    double lexSeconds = lexElapsed / 1e9;
+    printf("[BENCH] lexer, %u lines (%.1f MB) x %u: scanToken %.0f MB/s %.1fM lines/s, vm_lex %.0f MB/s %.1fM lines/s (%.1fx)\n",
+        lines, (double)length / (1024 * 1024), passes, megabytes / scanSeconds, (double)lines * passes / scanSeconds / 1e6,
+        megabytes / lexSeconds, (double)lines * passes / lexSeconds / 1e6, (double)scanElapsed / lexElapsed);
+    free(tokens);
+    free(text);
+}
+
+//count spells of bench_loop's kind of work on 1, 2, 4 ... workers up to the core count, one frame each
+void bench_workers(REPL* repl, u32 count) {
+    reset_vm(&repl->vm);
     const char* command = "\
-        LOAD     $0          #16        ;0  \n\
-        SUB      $31         $0         ;4  \n\
-        LOAD     $30         $31        ;8  \n\
-        LOAD     $0          #0         ;12 \n\
-        LOAD    [$30 + 4 ]   $0         ;16 \n\
-        LOAD     $0          #1         ;20 \n\
-        LOAD    [$30 + 8 ]   $0         ;24 \n\
-        LOAD     $0          #0         ;28 \n\
-        LOAD    [$30 + 12]   $0         ;32 \n\
-        LOAD     $0         [$30 + 12]  ;36 \n\
-        LOAD     $1          #7         ;40 \n\
-        LT       $0          $1         ;44 \n\
-        JNE      #100                 ;48 \n\
-        LOAD     $2         [$30 + 8 ]  ;52 \n\
-        LOAD    [$30 + 16]   $2         ;56 \n\
-        LOAD     $2         [$30 + 8 ]  ;60 \n\
-        LOAD     $3         [$30 + 4 ]  ;64 \n\
-        ADD      $2          $3         ;68 \n\
-        LOAD    [$30 + 8 ]   $2         ;72 \n\
-        LOAD     $4         [$30 + 16]  ;76 \n\
-        LOAD    [$30 + 4 ]   $4         ;80 \n\
-        INC      $0                     ;84 \n\
-        LOAD    [$30 + 16]   $0         ;88 \n\
-        LOAD     $5          #56        ;92 \n\
-        JMPB     $5                     ;96 \n\
+        LOAD $2 #2000  ;0  \n\
+        LOAD $0 #0     ;4  \n\
+        LOAD $3 #3     ;8  \n\
+        ADD  $1 $3 $1  ;12 \n\
+        INC  $0        ;16 \n\
+        LT   $0 $2     ;20 \n\
+        JEQ  #12       ;24 \n\
 ";
-    #endif
     size_t len = handmade_strlen(command);
     Assert(len < MAX_REPL_BUFFER);
     char buffer[MAX_REPL_BUFFER];
     memcpy(buffer, command, len);
-
     buffer[len] = 0;
     Scanner* scanner = &repl->scanner;
     repl->parser = {}; //clear 
@@ -3861,16 +9603,78 @@ void test_forloop(REPL* repl) {
     scanner->line = 1;
     scanner->current = buffer;
     scanner->start = buffer;
-
     eval_repl_entry(repl, buffer);
-    Assert(repl->vm.registers[2] == 21);
+
+    Context* contexts = (Context*)malloc(sizeof(Context) * count);
+    for (u32 i = 0; i < count; i++) context_init(contexts + i, &repl->vm);
+    u32 cores = std::thread::hardware_concurrency();
+    if (!cores) cores = 1;
+    if (cores > VM_MAX_WORKERS) cores = VM_MAX_WORKERS;
+    u64 single = 0;
+    for (u32 workers = 1; ; workers *= 2) {
+        if (workers > cores) workers = cores;
+        VMWorkerPool* pool = vm_workers_create(workers, 8192, 64);
+        u64 best = ~0ull;
+        for (u32 frame = 0; frame < 5; frame++) {
+            for (u32 i = 0; i < count; i++) {
+                context_reset(contexts + i, &repl->vm);
+                Assert(vm_workers_submit(pool, contexts + i));
+            }
+            u64 start = vm_time_ns();
+            Assert(vm_workers_run_frame(pool, ~0ull, 1 << 30).ran == count);
+            u64 elapsed = vm_time_ns() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        for (u32 i = 0; i < count; i++) Assert(contexts[i].status == VM_HALTED && contexts[i].registers[1] == 6000);
+        if (workers == 1) single = best;
+        printf("[BENCH] %u spells of 8000 instructions on %2u workers, %.3f ms per frame, %.2fx\n",
+            count, workers, best / 1e6, (double)single / best);
+        vm_workers_destroy(pool);
+        if (workers == cores) break;
+    }
+
+    //the same spells under a 2 ms frame budget, carried over until they're all done
+    VMWorkerPool* pool = vm_workers_create(cores, 8192, 64);
+    for (u32 i = 0; i < count; i++) {
+        context_reset(contexts + i, &repl->vm);
+        Assert(vm_workers_submit(pool, contexts + i));
+    }
+    u32 frames = 0;
+    u64 worstOver = 0;
+    u64 fuelCharged = 0;
+    while (vm_workers_pending(pool)) {
+        VMFrameStats stats = vm_workers_run_frame(pool, vm_time_ns() + 2000000, 1 << 30);
+        if (stats.elapsed > 2000000 && stats.elapsed - 2000000 > worstOver) worstOver = stats.elapsed - 2000000;
+        if (!frames) printf("[BENCH] 2 ms budget, first frame: %u ran, %u deferred, %llu fuel charged in %u quanta over %u rounds, %.3f ms\n",
+            stats.ran, stats.deferred, stats.fuelCharged, stats.quanta, stats.rounds, stats.elapsed / 1e6);
+        fuelCharged += stats.fuelCharged;
+        frames++;
+    }
+    printf("[BENCH] 2 ms budget, %u frames to finish %llu fuel charged, worst frame went %.1f us over\n", frames, fuelCharged, worstOver / 1e3);
+    vm_workers_destroy(pool);
+    for (u32 i = 0; i < count; i++) context_free_memory(contexts + i);
+    free(contexts);
 }
 
+void vm_bench() {
+    REPL* repl = repl_create();
+    bench_dispatch_program(repl, "test_fib", test_fib, 200000);
+    bench_dispatch_program(repl, "test_stack", test_stack, 200000);
+    bench_dispatch_program(repl, "test_forloop", test_forloop, 200000);
+    bench_dispatch_program(repl, "bench_loop", bench_loop, 200);
+    bench_dispatch_program(repl, "bench_host", bench_host, 200);
+    bench_contexts(repl, 100000);
+    bench_scheduler(repl, 100000);
+    bench_events(repl, 100000);
+    bench_workers(repl, 4096);
+    bench_cache(100000);
+    bench_lexer(100000, 10);
+    free(repl);
+}
 
 void vm_repl() {
     char buffer[MAX_REPL_BUFFER];
-    REPL* repl = (REPL*)malloc(sizeof(REPL));
-    reset_vm(&repl->vm);
+    REPL* repl = repl_create();
 
     Scanner* scanner = &repl->scanner;
     Parser* parser = &repl->parser;
@@ -3945,7 +9749,7 @@ void vm_repl() {
 void vm_test() {
     printf("vm test!\n");
     size_t mem_size = sizeof(VM);
-    VM* vm = (VM*)malloc(mem_size);
+    VM* vm = (VM*)calloc(1, mem_size);
     reset_vm(vm);
     #if 1
     //TESTING
@@ -3962,8 +9766,8 @@ void vm_test() {
     //jump to instruction 4 if equal, add again, reg1 = 2
     test_repl_reg_val(" LOAD $2 #4\n LOAD $0 #1\n ADD $0 $1 $1\n  EQ $0 $1\n   JEQ $2\n  ", 1, 2);
 
-    //jump back until max jumps reached, which is 16, reg1 should have been added enough times to be 16
-    test_repl_reg_val(" LOAD $2 #8\n LOAD $0 #1\n ADD $0 $1 $1\n  EQ $0 $1\n   JMPB $2\n  ", 1, MAX_JUMPS);
+    //jump back until the fuel runs out, the first block is 5 instructions and every pass after that is 3 (ADD, EQ, JMPB)
+    test_repl_reg_val(" LOAD $2 #8\n LOAD $0 #1\n ADD $0 $1 $1\n  EQ $0 $1\n   JMPB $2\n  ", 1, 1 + (VM_DEFAULT_FUEL - 5 + 2) / 3);
 
     //jump past add instruction, reg1 should be 0
     test_repl_reg_val(" LOAD $2 #8\n LOAD $0 #1\n JMPF $2\n ADD $0 $1 $1\n  ", 1, 0);
@@ -3991,7 +9795,7 @@ void vm_test() {
     printf("current OPcode count: %d\n", Opcode::OP_COUNT);
     Assert(Opcode::OP_COUNT < 254); //make sure we are within 1 byte of opcode size
     #endif
-    REPL* repl = (REPL*)malloc(sizeof(REPL));
+    REPL* repl = repl_create();
     test_label_code(repl);
     test_label_data(repl);
     test_stack(repl);
@@ -4000,6 +9804,31 @@ void vm_test() {
     test_syscall(repl);
     test_compiler(repl);
     test_forloop(repl);
+    test_trace_free(repl);
+    test_incremental_decode(repl);
+    test_superinstructions(repl);
+    test_fuel(repl);
+    test_verifier(repl);
+    test_jit(repl);
+    test_aot(repl);
+    test_div_overflow(repl);
+    test_contexts(repl);
+    test_context_pool(repl);
+    test_paged_memory(repl);
+    test_heap_allocator(repl);
+    test_guard_pages(repl);
+    test_stack_frames(repl);
+    test_host_functions(repl);
+    test_effect_queue(repl);
+    test_yield_wait(repl);
+    test_scheduler(repl);
+    test_event_waits(repl);
+    test_worker_pool(repl);
+    test_lie_image(repl);
+    test_program_cache(repl);
+    test_assemble(repl);
+    test_assemble_stream(repl);
+    test_lexer(repl);
     free(repl);//, sizeof(REPL)
 
     // vm_run(*vm);
@@ -4015,7 +9844,11 @@ void vm_test() {
 
 
 
-int main(){
+int main(int argc, char** argv){
+    if (argc > 1 && handmade_strcmp(argv[1], "bench")) {
+        vm_bench();
+        return 0;
+    }
     vm_test();
 }
 